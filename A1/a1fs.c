@@ -17,10 +17,12 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 // Using 2.9.x FUSE API
 #define FUSE_USE_VERSION 29
@@ -31,6 +33,9 @@
 #include "options.h"
 #include "map.h"
 #include "helpers.h"
+#include "htree.h"
+#include "dirblk.h"
+#include "extent.h"
 
 //NOTE: All path arguments are absolute paths within the a1fs file system and
 // start with a '/' that corresponds to the a1fs root directory.
@@ -61,11 +66,25 @@ static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
 		return true;
 
 	size_t size;
-	void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
+	// the block size is read from the superblock, and checked, by fs_ctx_init()
+	void *image = map_file(opts->img_path, A1FS_MIN_BLOCK_SIZE, &size);
 	if (!image)
 		return false;
 
-	return fs_ctx_init(fs, image, size);
+	// file data and journal commits go through the file; write_buf() splices
+	// the requests into it
+	int fd = open(opts->img_path, O_RDWR);
+	if (fd < 0) {
+		perror(opts->img_path);
+		munmap(image, size);
+		return false;
+	}
+	if (!fs_ctx_init(fs, image, size, fd, opts)) {
+		close(fd);
+		munmap(image, size);
+		return false;
+	}
+	return true;
 }
 
 /**
@@ -79,8 +98,8 @@ static void a1fs_destroy(void *ctx)
 	fs_ctx *fs = (fs_ctx *)ctx;
 	if (fs->image)
 	{
-		munmap(fs->image, fs->size);
 		fs_ctx_destroy(fs);
+		munmap(fs->image, fs->size);
 	}
 }
 
@@ -90,6 +109,52 @@ static fs_ctx *get_fs(void)
 	return (fs_ctx *)fuse_get_context()->private_data;
 }
 
+/**
+ * Finish mounting the file system.
+ *
+ * Called by FUSE once it has daemonized, so that the metadata faulted in and
+ * locked here stays resident in the process that serves the requests (see
+ * fs_ctx_advise()).
+ *
+ * @param conn  connection parameters; unused.
+ * @return      the file system context, kept as the private data.
+ */
+static void *a1fs_fuse_init(struct fuse_conn_info *conn)
+{
+	(void)conn;
+	fs_ctx *fs = get_fs();
+	if (!fs_ctx_advise(fs)) {
+		fprintf(stderr, "Failed to lock the image metadata in memory\n");
+		fuse_exit(fuse_get_context()->fuse);
+	}
+	return fs;
+}
+
+/**
+ * Get the inode of a file or directory, from the handle that open(), create()
+ * or opendir() left in fi if there is one, and by walking the path otherwise.
+ * The path is NULL when there is a handle (see flag_nopath).
+ *
+ * @param path  path to the file or directory.
+ * @param fi    file info of the open file; may be NULL.
+ * @param ino   pointer to the inode index that receives the result.
+ * @return      0 on success; -errno on error (see path_lookup()).
+ */
+static int get_ino(const char *path, struct fuse_file_info *fi, a1fs_ino_t *ino)
+{
+	if (fi && fi->fh) {
+		*ino = ((file_handle *)(uintptr_t)fi->fh)->ino;
+		return 0;
+	}
+	return path_lookup(path, get_fs(), ino);
+}
+
+/** Get the handle of an open file; NULL if there is none. */
+static file_handle *get_handle(struct fuse_file_info *fi)
+{
+	return fi ? (file_handle *)(uintptr_t)fi->fh : NULL;
+}
+
 /**
  * Get file system statistics.
  *
@@ -109,19 +174,9 @@ static int a1fs_statfs(const char *path, struct statvfs *st)
 {
 	(void)path; // unused
 	fs_ctx *fs = get_fs();
-	memset(st, 0, sizeof(*st));
-	st->f_bsize = A1FS_BLOCK_SIZE;
-	st->f_frsize = A1FS_BLOCK_SIZE;
 	//TODO: fill in the rest of required fields based on the information stored
 	// in the superblock
-	a1fs_superblock *sb = (a1fs_superblock *)(fs->image + A1FS_BLOCK_SIZE);
-	st->f_blocks = sb->size / A1FS_BLOCK_SIZE;
-	st->f_bfree = sb->s_free_blocks_count;
-	st->f_bavail = sb->s_free_blocks_count;
-	st->f_files = sb->s_inodes_count;
-	st->f_ffree = sb->s_free_inodes_count;
-	st->f_favail = sb->s_free_inodes_count;
-	st->f_namemax = A1FS_NAME_MAX;
+	stat_fs(fs, st);
 
 	return 0;
 }
@@ -168,15 +223,106 @@ static int a1fs_getattr(const char *path, struct stat *st)
 	{
 		return error;
 	}
-	a1fs_inode *inode = &(fs->root_ino[inode_i]);
-	st->st_mode = inode->mode;
-	st->st_nlink = inode->links;
-	st->st_size = inode->size;
-	st->st_blocks = divide_ceil(A1FS_BLOCK_SIZE, 512);
-	st->st_mtim = inode->mtime;
+	inode_rdlock(fs, inode_i);
+	stat_inode(inode_i, fs, st);
+	inode_unlock(fs, inode_i);
+	return 0;
+}
+
+/**
+ * Get attributes of an open file.
+ *
+ * Implements the fstat() system call. Same as getattr(), but the inode comes
+ * from the file handle.
+ *
+ * Errors: none
+ *
+ * @param path  unused (NULL).
+ * @param st    pointer to the struct stat that receives the result.
+ * @param fi    file info of the open file.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_fgetattr(const char *path, struct stat *st,
+                         struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
+	a1fs_ino_t ino_i;
+	int ret = get_ino(path, fi, &ino_i);
+	if (ret != 0)
+		return ret;
+
+	memset(st, 0, sizeof(*st));
+	inode_rdlock(fs, ino_i);
+	stat_inode(ino_i, fs, st);
+	inode_unlock(fs, ino_i);
+	return 0;
+}
+
+/**
+ * Open a file or directory.
+ *
+ * Implements the open() and opendir() system calls. The inode is looked up
+ * once here and kept in a handle in fi->fh, so that the operations on the
+ * open file don't walk the path again, and sequential reads and writes resume
+ * from the extent where the previous one ended.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param path  path to the file or directory.
+ * @param fi    file info that receives the handle.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_open(const char *path, struct fuse_file_info *fi)
+{
+	a1fs_ino_t ino_i;
+	int ret = path_lookup(path, get_fs(), &ino_i);
+	if (ret != 0)
+		return ret;
+
+	file_handle *fh = create_handle(ino_i);
+	if (!fh)
+		return -ENOMEM;
+	fi->fh = (uintptr_t)fh;
 	return 0;
 }
 
+/**
+ * Close a file or directory.
+ *
+ * Implements the last close() of an open file. Frees the handle created by
+ * open(), create() or opendir().
+ *
+ * @param path  unused (NULL).
+ * @param fi    file info of the open file.
+ * @return      0.
+ */
+static int a1fs_release(const char *path, struct fuse_file_info *fi)
+{
+	(void)path; // unused
+	free_handle(get_handle(fi));
+	return 0;
+}
+
+/** filler() call arguments for iterating over a directory. */
+typedef struct readdir_ctx {
+	void *buf;
+	fuse_fill_dir_t filler;
+} readdir_ctx;
+
+static int readdir_fill(const dirblk_entry *entry, void *arg)
+{
+	readdir_ctx *ctx = (readdir_ctx *)arg;
+	char name[A1FS_NAME_MAX];
+	memcpy(name, entry->name, entry->len);
+	name[entry->len] = '\0';
+	// compact dentries know the file type, which lets readdir report it without a getattr()
+	struct stat st = {0};
+	st.st_mode = (entry->type == A1FS_FT_DIR) ? S_IFDIR : S_IFREG;
+	const struct stat *stp = (entry->type == A1FS_FT_UNKNOWN) ? NULL : &st;
+	return ctx->filler(ctx->buf, name, stp, 0) != 0 ? -ENOMEM : 0;
+}
+
 /**
  * Read a directory.
  *
@@ -194,7 +340,7 @@ static int a1fs_getattr(const char *path, struct stat *st)
  * @param filler  function that needs to be called for each directory entry.
  *                Pass 0 as offset (4th argument). 3rd argument can be NULL.
  * @param offset  unused.
- * @param fi      unused.
+ * @param fi      file info of the open directory.
  * @return        0 on success; -errno on error.
  */
 static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
@@ -202,46 +348,19 @@ static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 {
 	fs_ctx *fs = get_fs();
 	(void) offset;
-	(void) fi;
 	//TODO: lookup the directory inode for given path and iterate through its
 	// directory entries
 	if (filler(buf, "..", NULL, 0) != 0){return -ENOMEM;}
 	if (filler(buf, ".", NULL, 0) != 0){return -ENOMEM;}
 	a1fs_ino_t inode_i;
-	path_lookup(path, fs, &inode_i); // get the inode for the path
-	a1fs_inode *inode = &(fs->root_ino[inode_i]);
-	if (inode->size == 0)
-	{
-		return 0;
-	}
-
-	a1fs_extent *s_extent = (a1fs_extent *)(fs->data_blk + inode->s_extent_block * A1FS_BLOCK_SIZE);
-	int num_dentry = inode->size / sizeof(a1fs_dentry);
-	for (a1fs_blk_t i = 0; i < inode->i_extents_count; i++)
-	{ // go through each extent
-		a1fs_blk_t extent_start = s_extent[i].start;
-		int blk_count = s_extent[i].count;
-
-		for (int j = 0; j < blk_count; j++)
-		{ //go through each block
-			a1fs_dentry *start_dentry = (a1fs_dentry *)(fs->data_blk + (extent_start + j) * A1FS_BLOCK_SIZE);
-			for (int dentry_i = 0; dentry_i < A1FS_BLOCK_SIZE / 256; dentry_i++)
-			{ //go through each dentry
-				if (num_dentry == 0)
-				{ //check if gone through all dentries
-					return 0;
-				}
-
-				if (filler(buf, start_dentry[dentry_i].name, NULL, 0) != 0)
-				{
-					return -ENOMEM;
-				}
-
-				num_dentry -= 1;
-			}
-		}
-	}
-	return 0;
+	int ret = get_ino(path, fi, &inode_i); // get the inode from the handle or the path
+	if (ret != 0)
+		return ret;
+	readdir_ctx ctx = { buf, filler };
+	inode_rdlock(fs, inode_i);
+	ret = iterate_dir(inode_i, fs, readdir_fill, &ctx);
+	inode_unlock(fs, inode_i);
+	return ret;
 }
 
 /**
@@ -268,43 +387,23 @@ static int a1fs_mkdir(const char *path, mode_t mode)
 	fs_ctx *fs = get_fs();
 
 	//TODO: create a directory at given path with given mode
-	char *parent_path;
-	char *new_dir;
-	if (get_parent_child_str_from_path(&parent_path, &new_dir, path) == -1)
-	{
-		return -ENOMEM;
-	}
-
 	a1fs_ino_t parent_ino_i;
-
-	path_lookup(parent_path, fs, &parent_ino_i);
-	a1fs_inode *parent_ino = &(fs->root_ino[parent_ino_i]);
-	uint32_t extra_blk;
-	if (parent_ino->size % A1FS_BLOCK_SIZE == 0) //data blocks are full
+	const char *new_dir;
+	size_t len;
+	int ret = path_lookup_parent(path, fs, &parent_ino_i, &new_dir, &len);
+	if (ret != 0)
 	{
-		extra_blk = 1;
+		return ret;
 	}
-	else
-	{
-		extra_blk = 0;
-	}
-	// all inodes occupied or all blocks occupied
-	// all inodes occupied or all blocks occupied
-	if ((fs->sb->s_free_inodes_count == 0) | (fs->sb->s_free_blocks_count < 2 + extra_blk) | (parent_ino->i_extents_count == 512))
-	{
-		return -ENOSPC;
-	}
-	a1fs_ino_t child_ino_i = create_inode(fs, mode);
-	a1fs_inode *child_inode = &(fs->root_ino[child_ino_i]);
-	child_inode->links = 2;
-	// add a dentry in the parent inode
-	a1fs_dentry dentry = create_dentry(child_ino_i, new_dir);
-	add_dentry(parent_ino_i, dentry, fs);
-	fs->sb->s_dir_count += 1;
-	free(parent_path);
-	free(new_dir);
-
-	return 0;
+	a1fs_ino_t child_ino_i;
+	journal_start(&fs->journal);
+	inode_wrlock(fs, parent_ino_i);
+	alloc_lock(fs);
+	ret = make_file(parent_ino_i, new_dir, len, mode, fs, &child_ino_i);
+	alloc_unlock(fs);
+	inode_unlock(fs, parent_ino_i);
+	journal_stop(&fs->journal);
+	return ret;
 }
 
 /**
@@ -326,27 +425,41 @@ static int a1fs_rmdir(const char *path)
 	fs_ctx *fs = get_fs();
 
 	//TODO: remove the directory at given path (only if it's empty)
-	//a1fs_inode child_inode;
-	//path_lookup(path, fs, child_inode);
-	char *parent_path;
-	char *new_dir;
-	get_parent_child_str_from_path(&parent_path, &new_dir, path);
-
-	a1fs_ino_t child_ino_i;
-	path_lookup(path, fs, &child_ino_i);
 	a1fs_ino_t parent_ino_i;
-	path_lookup(parent_path, fs, &parent_ino_i);
+	const char *dir;
+	size_t len;
+	int ret = path_lookup_parent(path, fs, &parent_ino_i, &dir, &len);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	journal_start(&fs->journal);
+	inode_wrlock(fs, parent_ino_i);
+	a1fs_ino_t child_ino_i = parent_ino_i;
+	if ((ret = lookup_dentry(&child_ino_i, dir, len, fs)) != 0)
+	{
+		inode_unlock(fs, parent_ino_i);
+		journal_stop(&fs->journal);
+		return ret;
+	}
+	inode_wrlock(fs, child_ino_i);
 	a1fs_inode *child_ino = &(fs->root_ino[child_ino_i]);
 	if (child_ino->size > 0)
 	{ 
-		return -ENOTEMPTY;
+		ret = -ENOTEMPTY;
 	}
-	a1fs_dentry child_dentry = create_dentry(child_ino_i, new_dir);
-	rm_dentry(parent_ino_i, child_dentry, fs);
-	unset_bitmap('i', child_ino_i, 1, fs);             //delete the inode
-	free(parent_path);
-	free(new_dir);
-	return 0;
+	else
+	{
+		a1fs_dentry child_dentry = create_dentry(child_ino_i, dir, len);
+		alloc_lock(fs);
+		rm_dentry(parent_ino_i, child_dentry, fs);
+		free_inode(child_ino_i, fs);             //delete the inode
+		alloc_unlock(fs);
+	}
+	inode_unlock(fs, child_ino_i);
+	inode_unlock(fs, parent_ino_i);
+	journal_stop(&fs->journal);
+	return ret;
 }
 
 /**
@@ -365,47 +478,39 @@ static int a1fs_rmdir(const char *path)
  *
  * @param path  path to the file to create.
  * @param mode  file mode bits.
- * @param fi    unused.
+ * @param fi    file info that receives the handle of the new file.
  * @return      0 on success; -errno on error.
  */
 static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	(void)fi; // unused
 	assert(S_ISREG(mode));
 	fs_ctx *fs = get_fs();
 
 	//TODO: create a file at given path with given mode
-	char *parent_path;
-	char *new_file;
-	if (get_parent_child_str_from_path(&parent_path, &new_file, path) == -1)
-	{
-		return -ENOMEM;
-	}
 	a1fs_ino_t parent_ino_i;
-	path_lookup(parent_path, fs, &parent_ino_i);
-	a1fs_inode *parent_ino = &(fs->root_ino[parent_ino_i]);
-	uint32_t extra_blk;
-	if (parent_ino->size % A1FS_BLOCK_SIZE == 0) //data blocks are full
+	const char *new_file;
+	size_t len;
+	int ret = path_lookup_parent(path, fs, &parent_ino_i, &new_file, &len);
+	if (ret != 0)
 	{
-		extra_blk = 1;
+		return ret;
 	}
-	else
-	{
-		extra_blk = 0;
-	}
-	// all inodes occupied or all blocks occupied
-	if ((fs->sb->s_free_inodes_count == 0) | (fs->sb->s_free_blocks_count < extra_blk) | (parent_ino->i_extents_count == 512))
-	{
-		return -ENOSPC;
+	// allocated first, so that running out of memory leaves no file behind
+	file_handle *fh = create_handle(0);
+	if (!fh)
+		return -ENOMEM;
+	journal_start(&fs->journal);
+	inode_wrlock(fs, parent_ino_i);
+	alloc_lock(fs);
+	ret = make_file(parent_ino_i, new_file, len, mode, fs, &fh->ino);
+	alloc_unlock(fs);
+	inode_unlock(fs, parent_ino_i);
+	journal_stop(&fs->journal);
+	if (ret != 0) {
+		free_handle(fh);
+		return ret;
 	}
-	a1fs_ino_t child_ino_i = create_inode(fs, mode);
-	a1fs_inode *child_ino = &(fs->root_ino[child_ino_i]);
-	child_ino->links = 1;
-	a1fs_dentry child_dentry = create_dentry(child_ino_i, new_file);
-	add_dentry(parent_ino_i, child_dentry, fs);
-	free(parent_path);
-	free(new_file);
-
+	fi->fh = (uintptr_t)fh;
 	return 0;
 }
 
@@ -428,28 +533,33 @@ static int a1fs_unlink(const char *path)
 
 	//TODO: remove the file at given path
 
-	char *parent_path;
-	char *file;
-	get_parent_child_str_from_path(&parent_path, &file, path);
-	
-	a1fs_ino_t child_ino_i;
-	path_lookup(path, fs, &child_ino_i);
-    a1fs_inode *inode = &(fs->root_ino[child_ino_i]);
-    if(inode->size != 0){
-        delete_file_data(child_ino_i, fs); //delete file content
-    }
-	unset_bitmap('i', child_ino_i, 1, fs); //delete inode
 	a1fs_ino_t parent_ino_i;
-	path_lookup(parent_path, fs, &parent_ino_i);
-
-	a1fs_dentry child_dentry = create_dentry(child_ino_i, file);
+	const char *file;
+	size_t len;
+	int ret = path_lookup_parent(path, fs, &parent_ino_i, &file, &len);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	journal_start(&fs->journal);
+	inode_wrlock(fs, parent_ino_i);
+	a1fs_ino_t child_ino_i = parent_ino_i;
+	if ((ret = lookup_dentry(&child_ino_i, file, len, fs)) != 0)
+	{
+		inode_unlock(fs, parent_ino_i);
+		journal_stop(&fs->journal);
+		return ret;
+	}
+	inode_wrlock(fs, child_ino_i);
+	alloc_lock(fs);
+	a1fs_dentry child_dentry = create_dentry(child_ino_i, file, len);
 	rm_dentry(parent_ino_i, child_dentry, fs); //rm child dentry
-	free(file);
-	free(parent_path);
+	free_inode(child_ino_i, fs); //delete file content and inode
+	alloc_unlock(fs);
+	inode_unlock(fs, child_ino_i);
+	inode_unlock(fs, parent_ino_i);
+	journal_stop(&fs->journal);
 	return 0;
-
-
-	
 }
 
 /**
@@ -478,7 +588,11 @@ static int a1fs_utimens(const char *path, const struct timespec times[2])
 	// according to the utimensat man page
 
 	a1fs_ino_t ino_i;
-	path_lookup(path, fs, &ino_i);
+	int ret = path_lookup(path, fs, &ino_i);
+	if (ret != 0)
+		return ret;
+	journal_start(&fs->journal);
+	inode_wrlock(fs, ino_i);
 	a1fs_inode *inode = &(fs->root_ino[ino_i]);
 	if (times == NULL)
 	{
@@ -496,10 +610,49 @@ static int a1fs_utimens(const char *path, const struct timespec times[2])
 	{
 		inode->mtime = times[1];
 	}
+	inode_unlock(fs, ino_i);
+	journal_stop(&fs->journal);
 
 	return 0;
 }
 
+/**
+ * Change the size of an open file.
+ *
+ * Implements the ftruncate() system call. Same as truncate(), but the inode
+ * comes from the file handle if there is one.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *   ENOSPC  not enough free space in the file system.
+ *   EFBIG   the file would grow past the maximum file size.
+ *
+ * @param path  path to the file (NULL if fi holds a handle).
+ * @param size  new file size in bytes.
+ * @param fi    file info of the open file; NULL for truncate().
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_ftruncate(const char *path, off_t size,
+                          struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
+
+	//TODO: set new file size, possibly "zeroing out" the uninitialized range
+
+	a1fs_ino_t ino_i;
+	int ret = get_ino(path, fi, &ino_i); // get the inode from the handle or the path
+	if (ret != 0)
+		return ret;
+	journal_start(&fs->journal);
+	inode_wrlock(fs, ino_i);
+	alloc_lock(fs);
+	ret = resize_file(ino_i, fs, size);
+	alloc_unlock(fs);
+	inode_unlock(fs, ino_i);
+	journal_stop(&fs->journal);
+	return ret;
+}
+
 /**
  * Change the size of a file.
  *
@@ -520,57 +673,7 @@ static int a1fs_utimens(const char *path, const struct timespec times[2])
  */
 static int a1fs_truncate(const char *path, off_t size)
 {
-	fs_ctx *fs = get_fs();
-
-	//TODO: set new file size, possibly "zeroing out" the uninitialized range
-
-	a1fs_ino_t ino_i;
-	path_lookup(path, fs, &ino_i); // get the inode for the path
-	a1fs_inode *inode = &(fs->root_ino[ino_i]);
-	uint32_t orig_ino_size = inode ->size;
-
-	// if the input size is larger than the original size of the file, extend the file
-	if ((uint32_t)size > inode->size)
-	{   
-		int offset = size - inode->size;
-        int last_fill = (inode->size)%A1FS_BLOCK_SIZE;
-        int vacant = A1FS_BLOCK_SIZE - last_fill;
-        int deduct = 0;
-        int add_ex_blk = 0;
-        if(last_fill != 0){
-            deduct = vacant;
-        }
-        if(inode->size == 0){
-            add_ex_blk = 1;
-        }
-        if (((offset>deduct)&&(fs->sb->s_free_blocks_count < divide_ceil(offset - deduct, A1FS_BLOCK_SIZE) + add_ex_blk))|(inode->i_extents_count == 512)){
-            return -ENOSPC;
-        }
-
-		int error = extend_file(offset, ino_i, fs);
-		if (error != 0) {
-            // revert back to original via truncate
-            truncate_file(ino_i, fs, inode->size - orig_ino_size);
-            return error;
-		} else {
-            clock_gettime(CLOCK_REALTIME, &(inode->mtime));
-		    return 0;
-		}
-	}
-
-	// if the input size is smaller than the original size of the file, truncate the file
-	if ((uint32_t)size < inode->size)
-	{
-		if (size == 0){
-		    delete_file_data(ino_i, fs);
-		}
-		else {
-            truncate_file(ino_i, fs, inode->size - size);
-		}
-	}
-
-    clock_gettime(CLOCK_REALTIME, &(inode->mtime));
-	return 0;
+	return a1fs_ftruncate(path, size, NULL);
 }
 
 /**
@@ -578,66 +681,55 @@ static int a1fs_truncate(const char *path, off_t size)
  *
  * Implements the pread() system call. Must return exactly the number of bytes
  * requested except on EOF (end of file). Reads from file ranges that have not
- * been written to must return ranges filled with zeros. You can assume that the
- * byte range from offset to offset + size is contained within a single block.
+ * been written to must return ranges filled with zeros. The byte range from
+ * offset to offset + size may span several blocks and extents.
+ *
+ * There is no read_buf(): FUSE only sends its reply after it returns, when
+ * the inode is no longer locked and the blocks of the file may already be
+ * freed and reused, so the data has to be copied under the lock anyway. Only
+ * the low-level driver splices reads from the image file (see ll_read()).
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
  *
- * Errors: none
+ * Errors:
+ *   EIO     the image file could not be read.
  *
  * @param path    path to the file to read from.
  * @param buf     pointer to the buffer that receives the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to read from.
- * @param fi      unused.
+ * @param fi      file info of the open file.
  * @return        number of bytes read on success; 0 if offset is beyond EOF;
  *                -errno on error.
  */
 static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
 					 struct fuse_file_info *fi)
 {
-	(void)fi; // unused
 	fs_ctx *fs = get_fs();
 
 	//TODO: read data from the file at given offset into the buffer
 
 	// get the inode
     a1fs_ino_t ino_i;
-    path_lookup(path, fs, &ino_i); // get the inode from the path
-    a1fs_inode *inode = &(fs->root_ino[ino_i]);
-    if(inode->size == 0){// if the file is empty
-        buf[0] = '\0';
-        return 0;
+    int ret = get_ino(path, fi, &ino_i); // get the inode from the handle or the path
+    if (ret != 0)
+    {
+        return ret;
     }
-
-	// "from somewhere after EOF to somewhere after EOF,
-	// you should zero-fill the buffer and return 0"
-	if ((uint32_t)offset > inode->size) {
-        memset(buf, 0, size);
-        buf[size] = '\0';
-        return 0;
-	}
-
-	// find the start position to read
-	unsigned char *start_pos = find_offset(ino_i, fs, offset);
-
-    // "from somewhere before EOF to somewhere before EOF,
-    // you should fill the buffer and return the argument size"
-    if (offset + size <= inode->size) {
-        memcpy(buf, start_pos, size);
-        buf[size] = '\0';
-        return size;
-    } else {    // "from somewhere before EOF to somewhere after EOF,
-        // you should fill the buffer with the data before EOF, zero-fill the rest,
-        // and return the number of bytes read before EOF"
-        unsigned char *end_pos = find_last_blk(ino_i, fs);
-        int difference = end_pos - start_pos;
-        memcpy(buf, start_pos, difference);
-        memset(buf + difference, 0, size - difference); // zero-fill the rest
-        buf[size] = '\0';
-        return difference;
+    inode_rdlock(fs, ino_i);
+    ssize_t done = read_file(ino_i, fs, buf, size, offset, get_handle(fi));
+    inode_unlock(fs, ino_i);
+    if (done < 0)
+    {
+        return done;
     }
+
+    // "from somewhere before EOF to somewhere after EOF,
+    // you should fill the buffer with the data before EOF, zero-fill the rest,
+    // and return the number of bytes read before EOF"
+    memset(buf + done, 0, size - done);
+    return done;
 }
 
 /**
@@ -646,8 +738,8 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
  * Implements the pwrite() system call. Must return exactly the number of bytes
  * requested except on error. If the offset is beyond EOF (end of file), the
  * file must be extended. If the write creates a "hole" of uninitialized data,
- * the new uninitialized range must filled with zeros. You can assume that the
- * byte range from offset to offset + size is contained within a single block.
+ * the new uninitialized range must filled with zeros. The byte range from
+ * offset to offset + size may span several blocks and extents.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
@@ -655,44 +747,108 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
  * Errors:
  *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *   ENOSPC  not enough free space in the file system.
- *   ENOSPC  too many extents (a1fs only needs to support 512 extents per file)
+ *   EFBIG   the file would grow past the maximum file size.
+ *   EIO     the image file could not be written.
  *
  * @param path    path to the file to write to.
  * @param buf     pointer to the buffer containing the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to write to.
- * @param fi      unused.
+ * @param fi      file info of the open file.
  * @return        number of bytes written on success; -errno on error.
  */
 static int a1fs_write(const char *path, const char *buf, size_t size,
 					  off_t offset, struct fuse_file_info *fi)
 {
-	(void)fi; // unused
 	fs_ctx *fs = get_fs();
 
     // get the inode
     a1fs_ino_t ino_i;
-    path_lookup(path, fs, &ino_i); // get the inode from the path
-    a1fs_inode *inode = &(fs->root_ino[ino_i]);
-
-    // write to after EOF == need to extend the file first
-    // if extension gives an error then returns error
-    int error = extend_file(size + offset - inode->size,ino_i, fs);
-	
-    if ((offset + size > inode->size) && (error != 0)){return error;}
-
-    // find the start position to write
-    unsigned char *start_pos = find_offset(ino_i, fs, offset);
-    // start_pos will be in the same blk as the end of writing
-    memcpy(start_pos, buf, size);
-    clock_gettime(CLOCK_REALTIME, &(inode->mtime));
-    return size;
+    int ret = get_ino(path, fi, &ino_i); // get the inode from the handle or the path
+    if (ret != 0)
+    {
+        return ret;
+    }
+    journal_start(&fs->journal);
+    inode_wrlock(fs, ino_i);
+    int error = write_file(ino_i, fs, buf, size, offset, get_handle(fi));
+    inode_unlock(fs, ino_i);
+    journal_stop(&fs->journal);
+    return error != 0 ? error : (int)size;
+}
+
+/**
+ * Write data to a file without an intermediate copy.
+ *
+ * Used by FUSE instead of write(). The data is copied from the request buffer,
+ * or spliced from the pipe FUSE spliced the request into, straight into the
+ * extents of the file in the image file.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *   ENOSPC  not enough free space in the file system.
+ *   EFBIG   the file would grow past the maximum file size.
+ *   EIO     the image file could not be written.
+ *
+ * @param path    path to the file to write to (NULL if fi holds a handle).
+ * @param buf     the data.
+ * @param offset  offset from the beginning of the file to write to.
+ * @param fi      file info of the open file.
+ * @return        number of bytes written on success; -errno on error.
+ */
+static int a1fs_write_buf(const char *path, struct fuse_bufvec *buf,
+                          off_t offset, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
+	a1fs_ino_t ino_i;
+	int error = get_ino(path, fi, &ino_i);
+	if (error != 0)
+		return error;
+	journal_start(&fs->journal);
+	inode_wrlock(fs, ino_i);
+	ssize_t ret = write_file_buf(ino_i, fs, buf, offset, get_handle(fi));
+	inode_unlock(fs, ino_i);
+	journal_stop(&fs->journal);
+	return (int)ret;
+}
+
+/**
+ * Synchronize the contents of a file or directory.
+ *
+ * Implements the fsync(), fdatasync() and fsync() on a directory system
+ * calls. Only the data the file wrote since its last fsync() is written back,
+ * plus the metadata changed since then (with a journal, by committing the
+ * running transaction). fdatasync() skips the metadata if only timestamps
+ * changed.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *   EIO     the image file could not be written.
+ *
+ * @param path      path to the file or directory (NULL if fi holds a handle).
+ * @param datasync  non-zero for fdatasync().
+ * @param fi        file info of the open file or directory.
+ * @return          0 on success; -errno on error.
+ */
+static int a1fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	a1fs_ino_t ino_i;
+	int ret = get_ino(path, fi, &ino_i);
+	if (ret != 0)
+		return ret;
+	return sync_file(ino_i, get_fs(), datasync != 0);
 }
 
 static struct fuse_operations a1fs_ops = {
+	.init = a1fs_fuse_init,
 	.destroy = a1fs_destroy,
 	.statfs = a1fs_statfs,
 	.getattr = a1fs_getattr,
+	.fgetattr = a1fs_fgetattr,
+	.open = a1fs_open,
+	.release = a1fs_release,
+	.opendir = a1fs_open,
+	.releasedir = a1fs_release,
 	.readdir = a1fs_readdir,
 	.mkdir = a1fs_mkdir,
 	.rmdir = a1fs_rmdir,
@@ -700,8 +856,17 @@ static struct fuse_operations a1fs_ops = {
 	.unlink = a1fs_unlink,
 	.utimens = a1fs_utimens,
 	.truncate = a1fs_truncate,
+	.ftruncate = a1fs_ftruncate,
 	.read = a1fs_read,
 	.write = a1fs_write,
+	.write_buf = a1fs_write_buf,
+	.fsync = a1fs_fsync,
+	.fsyncdir = a1fs_fsync,
+
+	// Operations on open files get their inode from the handle, so FUSE
+	// needn't build their paths
+	.flag_nullpath_ok = 1,
+	.flag_nopath = 1,
 };
 
 int main(int argc, char *argv[])
@@ -21,20 +21,46 @@
 #include <assert.h>
 #include <stdint.h>
 #include <limits.h>
+#include <stddef.h>
 #include <sys/stat.h>
 
 /**
- * a1fs block size in bytes. You are not allowed to change this value.
+ * a1fs block size in bytes.
  *
  * The block size is the unit of space allocation. Each file (and directory)
  * must occupy an integral number of blocks. Each of the file systems metadata
  * partitions, e.g. superblock, inode/block bitmaps, inode table (but not an
  * individual inode) must also occupy an integral number of blocks.
+ *
+ * mkfs.a1fs -b chooses the block size of an image and records it in
+ * s_block_size; the file system and fsck.a1fs open images of any supported
+ * size. The macros below that depend on it take it as their bs argument.
+ */
+#define A1FS_MIN_BLOCK_SIZE 4096
+#define A1FS_MAX_BLOCK_SIZE 65536
+#define A1FS_DEFAULT_BLOCK_SIZE 4096
+
+/**
+ * Expand X(bs) for every supported block size, e.g. to build a helper once
+ * per block size with bs a constant.
+ */
+#define A1FS_FOR_EACH_BLOCK_SIZE(X) X(4096) X(8192) X(16384) X(32768) X(65536)
+
+/** Whether bs is a supported block size. */
+#define A1FS_VALID_BLOCK_SIZE(bs) \
+	(((bs) & ((bs) - 1)) == 0 && (bs) >= A1FS_MIN_BLOCK_SIZE && (bs) <= A1FS_MAX_BLOCK_SIZE)
+
+/**
+ * Byte offset of the superblock: block 1 with 4 KiB blocks, and the same
+ * offset whatever the block size, so that any image can be identified.
  */
-#define A1FS_BLOCK_SIZE 4096
+#define A1FS_SB_OFFSET 4096
 
 /** Block number (block pointer) type. */
-typedef uint32_t a1fs_blk_t;
+typedef uint64_t a1fs_blk_t;
+
+/** Logical block number (block index within a file) type. */
+typedef uint64_t a1fs_lblk_t;
 
 /** Inode number type. */
 typedef uint32_t a1fs_ino_t;
@@ -42,6 +68,28 @@ typedef uint32_t a1fs_ino_t;
 /** Magic value that can be used to identify an a1fs image. */
 #define A1FS_MAGIC 0xC5C369A1C5C369A1ul
 
+/**
+ * On-disk format revision, bumped whenever the layout changes. Images of
+ * another revision are not mounted.
+ *
+ * 0: original format.
+ * 1: 128-byte inodes holding the first A1FS_INLINE_EXTENTS extents.
+ * 2: tiny regular files stored in the inode (A1FS_INLINE_DATA_FL).
+ * 3: s_features, optional compact directory entries.
+ * 4: name hash tags at the start of every directory block.
+ * 5: metadata journal (A1FS_FEATURE_JOURNAL).
+ * 6: lazily zeroed inode table (s_itable_zeroed).
+ * 7: 64-bit block numbers, block counts and logical blocks.
+ * 8: block size chosen at mkfs time (s_block_size).
+ * 9: small directories stored in the inode (A1FS_INLINE_DIR_FL).
+ */
+#define A1FS_REVISION 9
+
+/** Directories hold a1fs_dirent records instead of a1fs_dentry (mkfs -c). */
+#define A1FS_FEATURE_COMPACT_DIRENT 0x1
+/** Metadata changes go through the journal at s_journal_block (mkfs -J). */
+#define A1FS_FEATURE_JOURNAL 0x2
+
 /** a1fs superblock. */
 typedef struct a1fs_superblock
 { //set values
@@ -53,7 +101,7 @@ typedef struct a1fs_superblock
 	/** Number of total possible inodes in the file system. */
 	uint32_t s_inodes_count;
 	/** Number of total blocks in the file system. */
-	uint32_t s_blocks_count;
+	uint64_t s_blocks_count;
 
 	/** Blk num of the first inode_bitmap. */
 	a1fs_blk_t s_inode_bitmap;
@@ -70,14 +118,35 @@ typedef struct a1fs_superblock
 	uint32_t s_dir_count; //when mkdir or rmdir
 
 	/** Number of free data blocks in the file system. */
-	uint32_t s_free_blocks_count; //when getting a blk
+	uint64_t s_free_blocks_count; //when getting a blk
 	/** Number of free inodes in the file system. */
 	uint32_t s_free_inodes_count; //when getting an inode
 
+	/** On-disk format revision (A1FS_REVISION). */
+	uint32_t s_revision;
+
+	/** Optional format features chosen at mkfs time (A1FS_FEATURE_*). */
+	uint32_t s_features;
+
+	/** Blk num of the journal superblock, followed by the journal log. */
+	a1fs_blk_t s_journal_block;
+	/** Number of journal blocks, the journal superblock included. */
+	uint32_t s_journal_blocks;
+
+	/**
+	 * Number of inode table blocks that are zeroed or hold inodes. mkfs leaves
+	 * the rest as they were; the file system zeroes the next blocks when it
+	 * first allocates an inode in them.
+	 */
+	uint32_t s_itable_zeroed;
+
+	/** Block size in bytes, a power of 2 from A1FS_MIN_BLOCK_SIZE to A1FS_MAX_BLOCK_SIZE. */
+	uint32_t s_block_size;
+
 } a1fs_superblock;
 
 // Superblock must fit into a single block
-static_assert(sizeof(a1fs_superblock) <= A1FS_BLOCK_SIZE,
+static_assert(sizeof(a1fs_superblock) <= A1FS_MIN_BLOCK_SIZE,
 			  "superblock is too large");
 
 /** Extent - a contiguous range of blocks. */
@@ -87,9 +156,17 @@ typedef struct a1fs_extent
 	a1fs_blk_t start;
 	/** Number of blocks in the extent. */
 	uint32_t count;
+	uint32_t padding;
 
 } a1fs_extent;
 
+static_assert(sizeof(a1fs_extent) == 16, "invalid extent size");
+
+/** Number of extents stored in the inode itself. */
+#define A1FS_INLINE_EXTENTS 4
+/** Largest regular file whose data is stored in the inode itself. */
+#define A1FS_INLINE_DATA_MAX (A1FS_INLINE_EXTENTS * sizeof(a1fs_extent))
+
 /** a1fs inode. */
 typedef struct a1fs_inode
 {
@@ -98,7 +175,10 @@ typedef struct a1fs_inode
 	mode_t mode;
 	/** index in the inode table **/
 	uint32_t ino_idx;
-	/** Blk num of the extent block. */
+	/**
+	 * Blk num of the extent block (or extent tree root) holding the extents
+	 * after the first A1FS_INLINE_EXTENTS; only allocated when there are any.
+	 */
 	a1fs_blk_t s_extent_block;
 	// need to be updated sometimes
 	/**
@@ -126,16 +206,44 @@ typedef struct a1fs_inode
 	/** Number of extents in this file. */
 	uint32_t i_extents_count; //when adding an extent
 
+	/** Inode flags (A1FS_*_FL). */
+	uint32_t i_flags;
+
+	union {
+		/** The first extents of the file. */
+		a1fs_extent i_extents[A1FS_INLINE_EXTENTS];
+		/** The data of the file, with A1FS_INLINE_DATA_FL or A1FS_INLINE_DIR_FL set. */
+		unsigned char i_data[A1FS_INLINE_DATA_MAX];
+	};
+
 	// NOTE: You might have to add padding (e.g. a dummy char array field)
 	// at the end of the struct in order to satisfy the assertion below.
 	// Try to keep the size of this struct minimal, but don't worry about
 	// the "wasted space" introduced by the required padding.
-	char padding[16];
+	char padding[8];
 
 } a1fs_inode;
 
 //// A single block must fit an integral number of inodes
-static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
+static_assert(A1FS_MIN_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
+static_assert(sizeof(a1fs_inode) == 128, "invalid inode size");
+
+/** Directory uses the hashed index format (see a1fs_dx_header). */
+#define A1FS_INDEX_FL 0x1
+/** Extents are kept in an extent tree (see a1fs_extent_header). */
+#define A1FS_EXTTREE_FL 0x2
+/**
+ * The data of a regular file of at most A1FS_INLINE_DATA_MAX bytes is stored
+ * in i_data instead of data blocks; the file then has no extents. Never set
+ * on an empty file.
+ */
+#define A1FS_INLINE_DATA_FL 0x4
+/**
+ * With A1FS_FEATURE_COMPACT_DIRENT, the a1fs_dirent records of a directory
+ * that fits in A1FS_INLINE_DATA_MAX bytes fill i_data, with no tag header;
+ * the directory then has no extents. Never set on an empty directory.
+ */
+#define A1FS_INLINE_DIR_FL 0x8
 
 /** Maximum file name (path component) length. Includes the null terminator. */
 #define A1FS_NAME_MAX 252
@@ -154,3 +262,264 @@ typedef struct a1fs_dentry
 } a1fs_dentry;
 
 static_assert(sizeof(a1fs_dentry) == 256, "invalid dentry size");
+
+/** File types stored in a1fs_dirent. */
+#define A1FS_FT_UNKNOWN 0
+#define A1FS_FT_REG 1
+#define A1FS_FT_DIR 2
+
+/**
+ * Variable length directory entry, used instead of a1fs_dentry when the file
+ * system has A1FS_FEATURE_COMPACT_DIRENT.
+ *
+ * The records of a directory block are laid out back to back and together
+ * always cover the whole block after its tag header (see A1FS_DIRENT_START).
+ * rec_len may exceed the space the name needs, and that slack is where new
+ * entries go. A record with name_len 0 is unused. A removed entry is merged
+ * into the record before it, or marked unused if it is the first one in the
+ * block.
+ */
+typedef struct a1fs_dirent
+{
+	/** Inode number. */
+	a1fs_ino_t ino;
+	/** Length of this record in bytes, a multiple of 4. */
+	uint16_t rec_len;
+	/** Length of the name; 0 if the record is unused. */
+	uint8_t name_len;
+	/** Type of the file (A1FS_FT_*). */
+	uint8_t file_type;
+	/** File name. Not null-terminated. */
+	char name[];
+
+} a1fs_dirent;
+
+static_assert(sizeof(a1fs_dirent) == 8, "invalid dirent size");
+static_assert(A1FS_NAME_MAX - 1 <= UINT8_MAX, "name length must fit in name_len");
+
+/** Bytes needed by an a1fs_dirent with a name of name_len bytes. */
+#define A1FS_DIRENT_LEN(name_len) ((sizeof(a1fs_dirent) + (name_len) + 3) & ~(size_t)3)
+
+/**
+ * Directory block tags.
+ *
+ * Every directory block (linear or hashed index leaf) starts with a header
+ * holding, for each entry slot, an 8-bit tag taken from the hash of the name
+ * and the length of the name (0 for a free slot). A lookup compares the tags
+ * and lengths of many slots at once and only compares the names of the slots
+ * that match both.
+ *
+ * The header of a block with nslots slots holds the tags in bytes
+ * [0, nslots) and the lengths in bytes [nslots, 2 * nslots). With fixed
+ * dentries the header takes the place of the first A1FS_DENTRY_HDR_SLOTS
+ * a1fs_dentry of the block (one, unless the blocks are larger than 32 KiB),
+ * and slot i describes dentry i; the slots of the header itself are never
+ * used and have length UINT8_MAX so that they are neither free nor match a
+ * name. With compact dentries the header also holds, in bytes
+ * [2 * nslots, 4 * nslots), the 16-bit offset within the block of the record
+ * in each slot, and the records start right after it, at A1FS_DIRENT_START.
+ */
+#define A1FS_DENTRY_SLOTS(bs) ((bs) / sizeof(a1fs_dentry))
+#define A1FS_DIRENT_SLOTS(bs) ((bs) / 32)
+
+/** Number of dentry slots taken by the tag header of a block with fixed dentries. */
+#define A1FS_DENTRY_HDR_SLOTS(bs) ((2 * A1FS_DENTRY_SLOTS(bs) + sizeof(a1fs_dentry) - 1) / sizeof(a1fs_dentry))
+
+/** Offset of the first record in a block with compact dentries (the size of its tag header). */
+#define A1FS_DIRENT_START(bs) (4 * A1FS_DIRENT_SLOTS(bs))
+
+static_assert(A1FS_MAX_BLOCK_SIZE - A1FS_DIRENT_START(A1FS_MAX_BLOCK_SIZE) <= UINT16_MAX,
+			  "a record must fit in rec_len and off");
+
+/**
+ * Hashed directory index.
+ *
+ * A directory that outgrows its first block is converted to the indexed
+ * format. Logical block 0 of the directory then holds the index root, which
+ * maps ranges of name hashes to leaf blocks (or, when the root has filled up,
+ * to one level of interior index blocks). Leaf blocks are ordinary directory
+ * blocks: a tag header followed by fixed a1fs_dentry slots or compact
+ * a1fs_dirent records, in any order, with a free entry marked by a zero name
+ * length in the header (see A1FS_DENTRY_SLOTS). All entries whose names
+ * hash to the same value always live in the same leaf, so a lookup reads
+ * exactly one leaf.
+ */
+typedef struct a1fs_dx_header
+{
+	/** Number of entries in use. */
+	uint16_t count;
+	/** Number of entries that fit in the block. */
+	uint16_t limit;
+	/** Number of interior index levels below the root (root only). */
+	uint8_t levels;
+	uint8_t padding[3];
+
+} a1fs_dx_header;
+
+/** Hashed directory index entry. */
+typedef struct a1fs_dx_entry
+{
+	/** Lowest hash covered by the child block (ignored for the first entry). */
+	uint32_t hash;
+	/** Logical block number of the child block within the directory. */
+	uint32_t block;
+
+} a1fs_dx_entry;
+
+/** Maximum number of entries in a directory index block of bs bytes. */
+#define A1FS_DX_LIMIT(bs) (((bs) - sizeof(a1fs_dx_header)) / sizeof(a1fs_dx_entry))
+
+static_assert(A1FS_DX_LIMIT(A1FS_MAX_BLOCK_SIZE) <= UINT16_MAX, "index entries must fit in limit");
+
+/** Maximum number of interior index levels below the root. */
+#define A1FS_DX_MAX_LEVELS 1
+
+/**
+ * Hash of a file name (32-bit FNV-1a), which places it in the hashed index;
+ * its low 8 bits are the tag of the name in a directory block. Part of the
+ * format, so both the file system and fsck.a1fs compute it.
+ */
+static inline uint32_t dx_hash(const char *name, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * Extent tree.
+ *
+ * The first A1FS_INLINE_EXTENTS extents of a file live in the inode. The
+ * rest go to a flat extent block in s_extent_block: an array of up to
+ * A1FS_EXTENT_MAX extents. When it overflows, the file is switched to an
+ * extent tree (A1FS_EXTTREE_FL) rooted at s_extent_block. Every tree node
+ * starts with an a1fs_extent_header; leaves (depth 0) hold a1fs_extent_leaf
+ * entries and interior nodes hold a1fs_extent_idx entries pointing one level
+ * down. Extents are only added and removed at the end of a file, so every node
+ * except the rightmost one on each level is full. i_extents_count counts all
+ * the extents of the file, inline ones included, and the logical blocks in the
+ * tree are relative to the start of the file.
+ */
+typedef struct a1fs_extent_header
+{
+	/** Number of entries in use. */
+	uint16_t count;
+	/** Height of the node above the leaves; 0 for a leaf. */
+	uint16_t depth;
+	uint32_t padding;
+
+} a1fs_extent_header;
+
+/** Extent tree leaf entry. */
+typedef struct a1fs_extent_leaf
+{
+	/** First logical block of the file covered by the extent. */
+	a1fs_lblk_t lblk;
+	/** The extent. */
+	a1fs_extent extent;
+
+} a1fs_extent_leaf;
+
+/** Extent tree interior entry. */
+typedef struct a1fs_extent_idx
+{
+	/** First logical block of the file covered by the child. */
+	a1fs_lblk_t lblk;
+	/** Block number of the child node. */
+	a1fs_blk_t child;
+
+} a1fs_extent_idx;
+
+/** Maximum number of extents in a flat extent block of bs bytes. */
+#define A1FS_EXTENT_MAX(bs) ((bs) / sizeof(a1fs_extent))
+
+/** Maximum number of entries in an extent tree leaf of bs bytes. */
+#define A1FS_EXTENT_LEAF_MAX(bs) (((bs) - sizeof(a1fs_extent_header)) / sizeof(a1fs_extent_leaf))
+
+/** Maximum number of entries in an extent tree interior node of bs bytes. */
+#define A1FS_EXTENT_IDX_MAX(bs) (((bs) - sizeof(a1fs_extent_header)) / sizeof(a1fs_extent_idx))
+
+static_assert(A1FS_EXTENT_LEAF_MAX(A1FS_MAX_BLOCK_SIZE) <= UINT16_MAX &&
+			  A1FS_EXTENT_IDX_MAX(A1FS_MAX_BLOCK_SIZE) <= UINT16_MAX, "node entries must fit in count");
+
+/**
+ * Metadata journal.
+ *
+ * With A1FS_FEATURE_JOURNAL, s_journal_blocks blocks between the inode table
+ * and the first data block hold a circular redo log of metadata blocks
+ * (superblock, bitmaps, inode table, directory and extent blocks). File data
+ * is not journaled. The first block is the journal superblock; the rest is
+ * the log, where each transaction takes consecutive blocks:
+ *
+ *   descriptor blocks | images of the metadata blocks | commit block
+ *
+ * The descriptor blocks list the home block numbers of the images, and the
+ * commit block holds a checksum of the descriptors and the images, so a
+ * transaction that was only partly written when the system crashed is
+ * ignored. A transaction that does not fit before the end of the log starts
+ * over at the first log block.
+ *
+ * Mounting replays the transactions that follow each other from start with
+ * consecutive sequence numbers, beginning with seq, and stops at the first
+ * block that is not the next valid one. Every transaction older than the last
+ * committed one has already been written home, so replaying it again is
+ * harmless.
+ */
+#define A1FS_JOURNAL_MAGIC 0xC369A1u
+
+/** Types of journal blocks. */
+#define A1FS_JOURNAL_SUPER 1
+#define A1FS_JOURNAL_DESC 2
+#define A1FS_JOURNAL_COMMIT 3
+
+/** Header at the start of every journal block that is not an image. */
+typedef struct a1fs_journal_header
+{
+	/** Must match A1FS_JOURNAL_MAGIC. */
+	uint32_t magic;
+	/** Type of the block (A1FS_JOURNAL_*). */
+	uint32_t type;
+	/** Sequence number of the transaction (of the first one to replay in the journal superblock). */
+	uint64_t seq;
+
+} a1fs_journal_header;
+
+/** Journal superblock. */
+typedef struct a1fs_journal_super
+{
+	a1fs_journal_header h;
+	/** Log block (relative to s_journal_block) of the first transaction to replay. */
+	uint32_t start;
+	uint32_t padding;
+
+} a1fs_journal_super;
+
+/** Journal descriptor block. */
+typedef struct a1fs_journal_desc
+{
+	a1fs_journal_header h;
+	/** Number of metadata blocks in the transaction, across all its descriptor blocks. */
+	uint32_t count;
+	uint32_t padding;
+	/** Home block numbers of the images, in the order they follow the descriptor blocks. */
+	a1fs_blk_t blocks[];
+
+} a1fs_journal_desc;
+
+/** Number of home block numbers in a journal descriptor block of bs bytes. */
+#define A1FS_JOURNAL_TAGS(bs) (((bs) - sizeof(a1fs_journal_desc)) / sizeof(a1fs_blk_t))
+
+/** Journal commit block. */
+typedef struct a1fs_journal_commit
+{
+	a1fs_journal_header h;
+	/** Number of metadata blocks in the transaction. */
+	uint32_t count;
+	uint32_t padding;
+	/** Checksum of the descriptor blocks and the images. */
+	uint64_t checksum;
+
+} a1fs_journal_commit;
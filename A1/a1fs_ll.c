@@ -0,0 +1,800 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - a1fs driver on the FUSE low-level (inode based) API.
+ *
+ * Implements the same operations as a1fs.c with the same helpers, but the
+ * kernel names files by node id instead of by path, so no operation walks a
+ * path: lookup() resolves one name in one dir and every other operation goes
+ * straight to the inode.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Using 2.9.x FUSE API
+#define FUSE_USE_VERSION 29
+
+#include <fuse_lowlevel.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+#include "helpers.h"
+#include "map.h"
+#include "options.h"
+
+/** How long the kernel may cache names and attributes, in seconds. */
+#define A1FS_LL_TIMEOUT 1.0
+
+/**
+ * Mounted file system state of the low-level driver.
+ */
+typedef struct ll_ctx {
+	/**
+	 * The file system. The kernel holds one lookup of an inode per entry
+	 * returned by lookup(), mkdir() and create(), dropped by forget(), and
+	 * counted in the nlookup of the state of the inode, which is kept while
+	 * the count is not zero. An unlinked inode is freed once its count drops
+	 * to zero.
+	 */
+	fs_ctx fs;
+	/** The session, to end it if init() fails. */
+	struct fuse_session *se;
+
+} ll_ctx;
+
+/** A directory listing built by readdir(), kept in fi->fh between calls. */
+typedef struct ll_dirbuf {
+	char *p;
+	size_t size;
+
+} ll_dirbuf;
+
+// FUSE reserves node id 0 and gives the root dir node id 1 (FUSE_ROOT_ID),
+// while the a1fs root dir is inode 0: node ids are inode indices plus one.
+
+/** Get the inode index of the node id nodeid. */
+static inline a1fs_ino_t to_ino(fuse_ino_t nodeid)
+{
+	return (a1fs_ino_t)(nodeid - 1);
+}
+
+/** Get the node id of the inode at index ino. */
+static inline fuse_ino_t to_nodeid(a1fs_ino_t ino)
+{
+	return (fuse_ino_t)ino + 1;
+}
+
+/** Get the low-level mount state. */
+static ll_ctx *get_ctx(fuse_req_t req)
+{
+	return (ll_ctx *)fuse_req_userdata(req);
+}
+
+/**
+ * Initialize the file system.
+ *
+ * Called before the session is created, like a1fs_init() in a1fs.c.
+ *
+ * @param ctx   low-level mount state to initialize.
+ * @param opts  command line options.
+ * @return      true on success; false on failure.
+ */
+static bool ll_init(ll_ctx *ctx, a1fs_opts *opts)
+{
+	// Nothing to initialize if only printing help
+	if (opts->help)
+		return true;
+
+	size_t size;
+	// the block size is read from the superblock, and checked, by fs_ctx_init()
+	void *image = map_file(opts->img_path, A1FS_MIN_BLOCK_SIZE, &size);
+	if (!image)
+		return false;
+	// file data and journal commits go through the file; read() replies
+	// with ranges of it for FUSE to splice
+	int fd = open(opts->img_path, O_RDWR);
+	if (fd < 0) {
+		perror(opts->img_path);
+		munmap(image, size);
+		return false;
+	}
+	if (!fs_ctx_init(&ctx->fs, image, size, fd, opts)) {
+		close(fd);
+		munmap(image, size);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Finish mounting the file system.
+ *
+ * Called with the first request, once the process has daemonized, like
+ * a1fs_fuse_init() in a1fs.c (see fs_ctx_advise()).
+ */
+static void ll_fuse_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void)conn;
+	ll_ctx *ctx = (ll_ctx *)userdata;
+	if (!fs_ctx_advise(&ctx->fs)) {
+		fprintf(stderr, "Failed to lock the image metadata in memory\n");
+		fuse_session_exit(ctx->se);
+	}
+}
+
+/** Free the inode of the state s if it was unlinked while it was looked up. */
+static void free_unlinked(istate *s, void *arg)
+{
+	fs_ctx *fs = (fs_ctx *)arg;
+	if (s->nlookup > 0 && fs->root_ino[s->ino].links == 0) {
+		journal_dirty(&fs->journal, &fs->root_ino[s->ino], sizeof(a1fs_inode));
+		free_inode(s->ino, fs);
+	}
+}
+
+/**
+ * Cleanup the file system.
+ *
+ * Called when the session is destroyed. No more requests can arrive, so the
+ * unlinked inodes that are still waiting for a forget() are freed here,
+ * rather than left allocated with no links.
+ */
+static void ll_destroy(void *userdata)
+{
+	ll_ctx *ctx = (ll_ctx *)userdata;
+	if (ctx->fs.image) {
+		journal_start(&ctx->fs.journal);
+		alloc_lock(&ctx->fs);
+		istate_iterate(&ctx->fs.istate, free_unlinked, &ctx->fs);
+		alloc_unlock(&ctx->fs);
+		journal_stop(&ctx->fs.journal);
+		fs_ctx_destroy(&ctx->fs);
+		munmap(ctx->fs.image, ctx->fs.size);
+	}
+}
+
+/**
+ * Fill the entry e for the inode at index ino and count the lookup it stands
+ * for. The inode must be locked.
+ */
+static void fill_entry(ll_ctx *ctx, a1fs_ino_t ino, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(*e));
+	e->ino = to_nodeid(ino);
+	e->attr_timeout = A1FS_LL_TIMEOUT;
+	e->entry_timeout = A1FS_LL_TIMEOUT;
+	stat_inode(ino, &ctx->fs, &e->attr);
+	e->attr.st_ino = e->ino;
+	__atomic_add_fetch(&inode_state(&ctx->fs, ino)->nlookup, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Look up a directory entry by name.
+ *
+ * Errors:
+ *   ENAMETOOLONG  the name is too long.
+ *   ENOENT        the name does not exist.
+ *   ENOTDIR       parent is not a directory.
+ */
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	ll_ctx *ctx = get_ctx(req);
+	fs_ctx *fs = &ctx->fs;
+	a1fs_ino_t dir_i = to_ino(parent);
+
+	inode_rdlock(fs, dir_i);
+	a1fs_ino_t ino_i = dir_i;
+	int ret = lookup_dentry(&ino_i, name, strlen(name), fs);
+	if (ret != 0) {
+		inode_unlock(fs, dir_i);
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	// the dir stays locked until the lookup is counted so that unlink() sees it
+	inode_rdlock(fs, ino_i);
+	inode_unlock(fs, dir_i);
+	struct fuse_entry_param e;
+	fill_entry(ctx, ino_i, &e);
+	inode_unlock(fs, ino_i);
+	fuse_reply_entry(req, &e);
+}
+
+/** Drop nlookup lookups of the inode at index ino; free it if it was the last. */
+static void forget_one(ll_ctx *ctx, a1fs_ino_t ino, uint64_t nlookup)
+{
+	fs_ctx *fs = &ctx->fs;
+	journal_start(&fs->journal);
+	inode_wrlock(fs, ino);
+	istate *s = inode_state(fs, ino);
+	s->nlookup -= nlookup;
+	if (s->nlookup == 0 && fs->root_ino[ino].links == 0) {
+		alloc_lock(fs);
+		free_inode(ino, fs);
+		alloc_unlock(fs);
+	}
+	inode_unlock(fs, ino);
+	journal_stop(&fs->journal);
+}
+
+/**
+ * Forget about an inode.
+ *
+ * The kernel drops nlookup of the lookups it holds on the inode.
+ */
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	forget_one(get_ctx(req), to_ino(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+/** Forget about multiple inodes at once. */
+static void ll_forget_multi(fuse_req_t req, size_t count,
+                            struct fuse_forget_data *forgets)
+{
+	ll_ctx *ctx = get_ctx(req);
+	for (size_t i = 0; i < count; i++)
+		forget_one(ctx, to_ino(forgets[i].ino), forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+/**
+ * Get file or directory attributes.
+ *
+ * Errors: none
+ */
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)fi; // unused
+	fs_ctx *fs = &get_ctx(req)->fs;
+	a1fs_ino_t ino_i = to_ino(ino);
+
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	inode_rdlock(fs, ino_i);
+	stat_inode(ino_i, fs, &st);
+	inode_unlock(fs, ino_i);
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, A1FS_LL_TIMEOUT);
+}
+
+/**
+ * Set file attributes.
+ *
+ * Only the size (truncate()) and the modification time (utimensat()) are
+ * stored by a1fs; the other attributes are ignored.
+ *
+ * Errors:
+ *   EISDIR  changing the size of a directory.
+ *   ENOSPC  not enough free space in the file system.
+ *   EFBIG   the file would grow past the maximum file size.
+ */
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                       int to_set, struct fuse_file_info *fi)
+{
+	(void)fi; // unused
+	fs_ctx *fs = &get_ctx(req)->fs;
+	a1fs_ino_t ino_i = to_ino(ino);
+	a1fs_inode *inode = &(fs->root_ino[ino_i]);
+
+	int ret = 0;
+	journal_start(&fs->journal);
+	inode_wrlock(fs, ino_i);
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		if (S_ISDIR(inode->mode)) {
+			ret = -EISDIR;
+		} else {
+			alloc_lock(fs);
+			ret = resize_file(ino_i, fs, attr->st_size);
+			alloc_unlock(fs);
+		}
+	}
+	if (ret == 0) {
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+			clock_gettime(CLOCK_REALTIME, &(inode->mtime));
+		else if (to_set & FUSE_SET_ATTR_MTIME)
+			inode->mtime = attr->st_mtim;
+	}
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	stat_inode(ino_i, fs, &st);
+	inode_unlock(fs, ino_i);
+	journal_stop(&fs->journal);
+
+	if (ret != 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, A1FS_LL_TIMEOUT);
+}
+
+/**
+ * Create a file or directory named name in the directory parent and reply
+ * with its entry; fi is NULL for mkdir() and receives the handle of the new
+ * file for create().
+ */
+static void make_node(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      mode_t mode, struct fuse_file_info *fi)
+{
+	ll_ctx *ctx = get_ctx(req);
+	fs_ctx *fs = &ctx->fs;
+	a1fs_ino_t dir_i = to_ino(parent);
+	size_t len = strlen(name);
+	if (len >= A1FS_NAME_MAX) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+
+	// allocated first, so that running out of memory leaves no file behind
+	file_handle *fh = NULL;
+	if (fi && !(fh = create_handle(0))) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	a1fs_ino_t ino_i;
+	struct fuse_entry_param e;
+	journal_start(&fs->journal);
+	inode_wrlock(fs, dir_i);
+	alloc_lock(fs);
+	int ret = make_file(dir_i, name, len, mode, fs, &ino_i);
+	alloc_unlock(fs);
+	if (ret == 0) {
+		// nobody can reach the new inode before the dir is unlocked
+		inode_rdlock(fs, ino_i);
+		fill_entry(ctx, ino_i, &e);
+		inode_unlock(fs, ino_i);
+	}
+	inode_unlock(fs, dir_i);
+	journal_stop(&fs->journal);
+
+	if (ret != 0) {
+		if (fh)
+			free_handle(fh);
+		fuse_reply_err(req, -ret);
+	} else if (fi) {
+		fh->ino = ino_i;
+		fi->fh = (uintptr_t)fh;
+		if (fuse_reply_create(req, &e, fi) != 0)
+			free_handle(fh); // interrupted, no release() will follow
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+/**
+ * Create a directory.
+ *
+ * Errors:
+ *   ENAMETOOLONG  the name is too long.
+ *   ENOSPC        not enough free space in the file system.
+ */
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode)
+{
+	make_node(req, parent, name, mode | S_IFDIR, NULL);
+}
+
+/**
+ * Create and open a file.
+ *
+ * Errors:
+ *   ENAMETOOLONG  the name is too long.
+ *   ENOSPC        not enough free space in the file system.
+ */
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      mode_t mode, struct fuse_file_info *fi)
+{
+	assert(S_ISREG(mode));
+	make_node(req, parent, name, mode, fi);
+}
+
+/**
+ * Remove the file (dir is false) or the empty directory (dir is true) named
+ * name from the directory parent. The inode is freed right away if the kernel
+ * holds no lookups of it, and by the last forget() otherwise.
+ */
+static void remove_node(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        bool dir)
+{
+	ll_ctx *ctx = get_ctx(req);
+	fs_ctx *fs = &ctx->fs;
+	a1fs_ino_t dir_i = to_ino(parent);
+	size_t len = strlen(name);
+
+	journal_start(&fs->journal);
+	inode_wrlock(fs, dir_i);
+	a1fs_ino_t ino_i = dir_i;
+	int ret = lookup_dentry(&ino_i, name, len, fs);
+	if (ret != 0) {
+		inode_unlock(fs, dir_i);
+		journal_stop(&fs->journal);
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	inode_wrlock(fs, ino_i);
+	a1fs_inode *inode = &(fs->root_ino[ino_i]);
+	if (dir && !S_ISDIR(inode->mode)) {
+		ret = -ENOTDIR;
+	} else if (!dir && S_ISDIR(inode->mode)) {
+		ret = -EISDIR;
+	} else if (dir && inode->size > 0) {
+		ret = -ENOTEMPTY;
+	} else {
+		alloc_lock(fs);
+		rm_dentry(dir_i, create_dentry(ino_i, name, len), fs);
+		inode->links = 0;
+		if (inode_state(fs, ino_i)->nlookup == 0)
+			free_inode(ino_i, fs);
+		alloc_unlock(fs);
+	}
+	inode_unlock(fs, ino_i);
+	inode_unlock(fs, dir_i);
+	journal_stop(&fs->journal);
+	fuse_reply_err(req, -ret);
+}
+
+/**
+ * Remove a directory.
+ *
+ * Errors:
+ *   ENOENT     the name does not exist.
+ *   ENOTDIR    the name is not a directory.
+ *   ENOTEMPTY  the directory is not empty.
+ */
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	remove_node(req, parent, name, true);
+}
+
+/**
+ * Remove a file.
+ *
+ * Errors:
+ *   ENOENT  the name does not exist.
+ *   EISDIR  the name is a directory.
+ */
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	remove_node(req, parent, name, false);
+}
+
+/**
+ * Open a file.
+ *
+ * Sequential reads and writes through the handle left in fi->fh resume from
+ * the extent where the previous one ended.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory.
+ */
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	file_handle *fh = create_handle(to_ino(ino));
+	if (!fh) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fi->fh = (uintptr_t)fh;
+	if (fuse_reply_open(req, fi) != 0)
+		free_handle(fh); // interrupted, no release() will follow
+}
+
+/** Close a file. */
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)ino; // unused
+	free_handle((file_handle *)(uintptr_t)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+/**
+ * Open a directory.
+ *
+ * The listing is built by the first readdir() call and kept in fi->fh.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory.
+ */
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)ino; // unused
+	ll_dirbuf *b = calloc(1, sizeof(ll_dirbuf));
+	if (!b) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fi->fh = (uintptr_t)b;
+	fuse_reply_open(req, fi);
+}
+
+/** dirblk_iterate() arguments for building a listing. */
+typedef struct ll_readdir_ctx {
+	fuse_req_t req;
+	fs_ctx *fs;
+	ll_dirbuf *b;
+
+} ll_readdir_ctx;
+
+/** Append the entry for the inode at index ino named name to the listing b. */
+static int dirbuf_add(fuse_req_t req, ll_dirbuf *b, const char *name,
+                      a1fs_ino_t ino, mode_t mode)
+{
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_ino = to_nodeid(ino);
+	st.st_mode = mode;
+	size_t old = b->size;
+	size_t len = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+	char *p = realloc(b->p, old + len);
+	if (!p)
+		return -ENOMEM;
+	b->p = p;
+	b->size = old + len;
+	// the offset of an entry is where the next one starts
+	fuse_add_direntry(req, b->p + old, len, name, &st, b->size);
+	return 0;
+}
+
+static int ll_readdir_fill(const dirblk_entry *entry, void *arg)
+{
+	ll_readdir_ctx *ctx = (ll_readdir_ctx *)arg;
+	char name[A1FS_NAME_MAX];
+	memcpy(name, entry->name, entry->len);
+	name[entry->len] = '\0';
+	// the dir is locked, so its files stay put while we look at their modes
+	mode_t mode = ctx->fs->root_ino[entry->ino].mode & S_IFMT;
+	return dirbuf_add(ctx->req, ctx->b, name, entry->ino, mode);
+}
+
+/**
+ * Read a directory.
+ *
+ * A read from offset 0 (a new listing or rewinddir()) rebuilds the listing;
+ * later reads return the rest of it.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory.
+ */
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       struct fuse_file_info *fi)
+{
+	fs_ctx *fs = &get_ctx(req)->fs;
+	ll_dirbuf *b = (ll_dirbuf *)(uintptr_t)fi->fh;
+	a1fs_ino_t dir_i = to_ino(ino);
+
+	if (off == 0) {
+		b->size = 0;
+		// a1fs keeps no parent pointers, so ".." gets the node id of the dir itself
+		int ret = dirbuf_add(req, b, ".", dir_i, S_IFDIR);
+		if (ret == 0)
+			ret = dirbuf_add(req, b, "..", dir_i, S_IFDIR);
+		if (ret == 0) {
+			ll_readdir_ctx ctx = { req, fs, b };
+			inode_rdlock(fs, dir_i);
+			ret = iterate_dir(dir_i, fs, ll_readdir_fill, &ctx);
+			inode_unlock(fs, dir_i);
+		}
+		if (ret != 0) {
+			fuse_reply_err(req, -ret);
+			return;
+		}
+	}
+	if ((size_t)off >= b->size) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	size_t rest = b->size - off;
+	fuse_reply_buf(req, b->p + off, rest < size ? rest : size);
+}
+
+/** Close a directory. */
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi)
+{
+	(void)ino; // unused
+	ll_dirbuf *b = (ll_dirbuf *)(uintptr_t)fi->fh;
+	free(b->p);
+	free(b);
+	fuse_reply_err(req, 0);
+}
+
+/**
+ * Read data from a file.
+ *
+ * Replies with ranges of the image file, one per extent, which FUSE splices
+ * to the kernel; the inode stays locked until the reply is sent. Replies with
+ * less than size bytes only at EOF.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory.
+ */
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info *fi)
+{
+	fs_ctx *fs = &get_ctx(req)->fs;
+	a1fs_ino_t ino_i = to_ino(ino);
+
+	struct fuse_bufvec *bufv;
+	inode_rdlock(fs, ino_i);
+	int ret = read_file_buf(ino_i, fs, size, off,
+	                        (file_handle *)(uintptr_t)fi->fh, &bufv);
+	if (ret == 0)
+		fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	inode_unlock(fs, ino_i);
+	if (ret != 0)
+		fuse_reply_err(req, -ret);
+	else
+		free_file_buf(bufv);
+}
+
+/**
+ * Write data to a file.
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *   EFBIG   the file would grow past the maximum file size.
+ *   EIO     the image file could not be written.
+ */
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                     size_t size, off_t off, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = &get_ctx(req)->fs;
+	a1fs_ino_t ino_i = to_ino(ino);
+
+	journal_start(&fs->journal);
+	inode_wrlock(fs, ino_i);
+	int ret = write_file(ino_i, fs, buf, size, off,
+	                     (file_handle *)(uintptr_t)fi->fh);
+	inode_unlock(fs, ino_i);
+	journal_stop(&fs->journal);
+	if (ret != 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, size);
+}
+
+/**
+ * Write data to a file without an intermediate copy.
+ *
+ * The data is copied from the request buffer, or read from the pipe FUSE
+ * spliced the request into, straight into the extents of the file.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory.
+ *   ENOSPC  not enough free space in the file system.
+ *   EFBIG   the file would grow past the maximum file size.
+ *   EIO     the image file could not be written.
+ */
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                         off_t off, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = &get_ctx(req)->fs;
+	a1fs_ino_t ino_i = to_ino(ino);
+
+	journal_start(&fs->journal);
+	inode_wrlock(fs, ino_i);
+	ssize_t ret = write_file_buf(ino_i, fs, bufv, off,
+	                             (file_handle *)(uintptr_t)fi->fh);
+	inode_unlock(fs, ino_i);
+	journal_stop(&fs->journal);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+/**
+ * Synchronize the contents of a file or directory.
+ *
+ * Only the data the file wrote since its last fsync() is written back, plus
+ * the metadata changed since then. fdatasync() skips the metadata if only
+ * timestamps changed.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory.
+ *   EIO     the image file could not be written.
+ */
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                     struct fuse_file_info *fi)
+{
+	(void)fi; // unused
+	fuse_reply_err(req, -sync_file(to_ino(ino), &get_ctx(req)->fs, datasync != 0));
+}
+
+/**
+ * Get file system statistics.
+ *
+ * Errors: none
+ */
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	(void)ino; // unused
+	struct statvfs st;
+	stat_fs(&get_ctx(req)->fs, &st);
+	fuse_reply_statfs(req, &st);
+}
+
+static struct fuse_lowlevel_ops a1fs_ll_ops = {
+	.init = ll_fuse_init,
+	.destroy = ll_destroy,
+	.lookup = ll_lookup,
+	.forget = ll_forget,
+	.forget_multi = ll_forget_multi,
+	.getattr = ll_getattr,
+	.setattr = ll_setattr,
+	.mkdir = ll_mkdir,
+	.rmdir = ll_rmdir,
+	.create = ll_create,
+	.unlink = ll_unlink,
+	.open = ll_open,
+	.release = ll_release,
+	.opendir = ll_opendir,
+	.readdir = ll_readdir,
+	.releasedir = ll_releasedir,
+	.read = ll_read,
+	.write = ll_write,
+	.write_buf = ll_write_buf,
+	.fsync = ll_fsync,
+	.fsyncdir = ll_fsync,
+	.statfs = ll_statfs,
+};
+
+int main(int argc, char *argv[])
+{
+	a1fs_opts opts = {0}; // defaults are all 0
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (!a1fs_opt_parse(&args, &opts))
+		return 1;
+
+	ll_ctx ctx = {0};
+	if (!ll_init(&ctx, &opts)) {
+		fprintf(stderr, "Failed to mount the file system\n");
+		return 1;
+	}
+
+	char *mountpoint;
+	int multithreaded, foreground;
+	int err = -1;
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1) {
+		struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+		if (ch) {
+			struct fuse_session *se = fuse_lowlevel_new(&args, &a1fs_ll_ops,
+			                                            sizeof(a1fs_ll_ops), &ctx);
+			if (se) {
+				ctx.se = se;
+				if (fuse_set_signal_handlers(se) != -1) {
+					fuse_session_add_chan(se, ch);
+					fuse_daemonize(foreground);
+					err = multithreaded ? fuse_session_loop_mt(se)
+					                    : fuse_session_loop(se);
+					fuse_remove_signal_handlers(se);
+					fuse_session_remove_chan(ch);
+				}
+				fuse_session_destroy(se);
+			}
+			fuse_unmount(mountpoint, ch);
+		}
+		free(mountpoint);
+	}
+	fuse_opt_free_args(&args);
+	return err ? 1 : 0;
+}
@@ -0,0 +1,177 @@
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "bitmap.h"
+
+/**
+ * load up to 8 bytes starting at p as a little-endian word, padding missing bytes with zeroes
+ *
+ * @param p         first byte
+ * @param avail     number of bytes that may be read at p
+ * @return          the word; bit i is bit (i % 8) of p[i / 8]
+ */
+static inline uint64_t load_word(const unsigned char *p, uint64_t avail)
+{
+    uint64_t word = 0;
+    memcpy(&word, p, avail < 8 ? avail : 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/**
+ * skip the bytes starting at byte that all equal fill, a vector at a time
+ *
+ * @param bm        the bitmap
+ * @param nbytes    number of bytes in the bitmap
+ * @param byte      first byte to look at
+ * @param fill      the byte value to skip, 0x00 or 0xff
+ * @return          first byte of the first vector that is not entirely fill (or of the unscanned tail)
+ */
+static inline uint64_t skip_fill(const unsigned char *bm, uint64_t nbytes, uint64_t byte, unsigned char fill)
+{
+#if defined(__AVX2__)
+    const __m256i fill32 = _mm256_set1_epi8((char)fill);
+    while (byte + 32 <= nbytes)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bm + byte));
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, fill32)) != 0xffffffffu)
+        {
+            return byte;
+        }
+        byte += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i fill16 = _mm_set1_epi8((char)fill);
+    while (byte + 16 <= nbytes)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(bm + byte));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, fill16)) != 0xffff)
+        {
+            return byte;
+        }
+        byte += 16;
+    }
+#endif
+    (void)bm;
+    (void)nbytes;
+    (void)fill;
+    return byte;
+}
+
+/**
+ * find the first bit at or after from whose value differs from the bits of flip
+ *
+ * @param bm        the bitmap
+ * @param nbits     number of bits in the bitmap
+ * @param from      first bit to look at
+ * @param flip      0 to look for a set bit; all ones to look for a clear bit
+ * @return          index of the bit; nbits if there is none
+ */
+static uint64_t bitmap_scan(const unsigned char *bm, uint64_t nbits, uint64_t from, uint64_t flip)
+{
+    if (from >= nbits)
+    {
+        return nbits;
+    }
+    uint64_t nbytes = (nbits + 7) / 8;
+    uint64_t byte = from / 8;
+    // bytes past the end load as zeroes; a hit there is clamped to nbits below
+    uint64_t word = (load_word(bm + byte, nbytes - byte) ^ flip) & (~0ULL << (from % 8));
+    while (word == 0)
+    {
+        byte += 8;
+        if (byte >= nbytes)
+        {
+            return nbits;
+        }
+        byte = skip_fill(bm, nbytes, byte, (unsigned char)flip);
+        word = load_word(bm + byte, nbytes - byte) ^ flip;
+    }
+    uint64_t bit = byte * 8 + __builtin_ctzll(word);
+    return bit < nbits ? bit : nbits;
+}
+
+/**
+ * set or clear the bits [start, start + count) of the bitmap bm
+ *
+ * @param bm        the bitmap
+ * @param start     first bit
+ * @param count     number of bits
+ * @param set       true to set the bits; false to clear them
+ */
+static void bitmap_fill(unsigned char *bm, uint64_t start, uint64_t count, bool set)
+{
+    uint64_t end = start + count;
+    uint64_t i = start;
+    for (; i < end && i % 8 != 0; i++)
+    { // leading partial byte
+        if (set)
+        {
+            bm[i / 8] |= (1 << (i % 8));
+        }
+        else
+        {
+            bm[i / 8] &= ~(1 << (i % 8));
+        }
+    }
+    uint64_t whole = (end - i) / 8;
+    memset(bm + i / 8, set ? 0xff : 0x00, whole);
+    for (i += whole * 8; i < end; i++)
+    { // trailing partial byte
+        if (set)
+        {
+            bm[i / 8] |= (1 << (i % 8));
+        }
+        else
+        {
+            bm[i / 8] &= ~(1 << (i % 8));
+        }
+    }
+}
+
+void bitmap_set(unsigned char *bm, uint64_t start, uint64_t count)
+{
+    bitmap_fill(bm, start, count, true);
+}
+
+void bitmap_clear(unsigned char *bm, uint64_t start, uint64_t count)
+{
+    bitmap_fill(bm, start, count, false);
+}
+
+uint64_t bitmap_next_zero(const unsigned char *bm, uint64_t nbits, uint64_t from)
+{
+    return bitmap_scan(bm, nbits, from, ~0ULL);
+}
+
+uint64_t bitmap_next_one(const unsigned char *bm, uint64_t nbits, uint64_t from)
+{
+    return bitmap_scan(bm, nbits, from, 0);
+}
+
+bool bitmap_is_clear(const unsigned char *bm, uint64_t start, uint64_t count)
+{
+    return bitmap_next_one(bm, start + count, start) == start + count;
+}
+
+uint64_t bitmap_weight(const unsigned char *bm, uint64_t nbits)
+{
+    uint64_t nbytes = (nbits + 7) / 8;
+    uint64_t weight = 0;
+    for (uint64_t byte = 0; byte < nbytes; byte += 8)
+    {
+        uint64_t word = load_word(bm + byte, nbytes - byte);
+        if (byte * 8 + 64 > nbits)
+        { // ignore the bits past the end
+            word &= ~0ULL >> (byte * 8 + 64 - nbits);
+        }
+        weight += __builtin_popcountll(word);
+    }
+    return weight;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Bitmap primitives shared by the inode and blk bitmaps.
+ *
+ * Bit i of a bitmap is bit (i % 8) of byte (i / 8). The scans load 64 bits at
+ * a time and use ctz to locate the first interesting bit; long runs of all-set
+ * or all-clear bytes are skipped with SSE2/AVX2 compares when available.
+ */
+
+/**
+ * set the bits [start, start + count) of the bitmap bm
+ *
+ * @param bm        the bitmap
+ * @param start     first bit
+ * @param count     number of bits
+ */
+void bitmap_set(unsigned char *bm, uint64_t start, uint64_t count);
+
+/**
+ * clear the bits [start, start + count) of the bitmap bm
+ *
+ * @param bm        the bitmap
+ * @param start     first bit
+ * @param count     number of bits
+ */
+void bitmap_clear(unsigned char *bm, uint64_t start, uint64_t count);
+
+/**
+ * find the first clear bit at or after from in the bitmap bm of nbits bits
+ *
+ * @param bm        the bitmap
+ * @param nbits     number of bits in the bitmap
+ * @param from      first bit to look at
+ * @return          index of the bit; nbits if there is none
+ */
+uint64_t bitmap_next_zero(const unsigned char *bm, uint64_t nbits, uint64_t from);
+
+/**
+ * find the first set bit at or after from in the bitmap bm of nbits bits
+ *
+ * @param bm        the bitmap
+ * @param nbits     number of bits in the bitmap
+ * @param from      first bit to look at
+ * @return          index of the bit; nbits if there is none
+ */
+uint64_t bitmap_next_one(const unsigned char *bm, uint64_t nbits, uint64_t from);
+
+/**
+ * check if the bits [start, start + count) of the bitmap bm are all clear
+ *
+ * @param bm        the bitmap
+ * @param start     first bit
+ * @param count     number of bits
+ * @return          true if all the bits are clear
+ */
+bool bitmap_is_clear(const unsigned char *bm, uint64_t start, uint64_t count);
+
+/**
+ * count the set bits of the bitmap bm of nbits bits
+ *
+ * @param bm        the bitmap
+ * @param nbits     number of bits in the bitmap
+ * @return          number of set bits
+ */
+uint64_t bitmap_weight(const unsigned char *bm, uint64_t nbits);
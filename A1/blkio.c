@@ -0,0 +1,600 @@
+#define _GNU_SOURCE // O_DIRECT, readahead()
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blkio.h"
+
+/** End of a hash chain. */
+#define BLKCACHE_NONE UINT32_MAX
+/** Most blks read or written with one system call through the bounce buffer: one 128K FUSE request. */
+#define BLKIO_MAX_RUN 32
+
+/**
+ * read the size bytes at offset pos of the file fd into buf
+ *
+ * @param fd        the file
+ * @param buf       the buffer that receives the data
+ * @param size      number of bytes
+ * @param pos       offset in the file
+ * @return          0 on success; -EIO on error
+ */
+static int file_read(int fd, void *buf, size_t size, uint64_t pos)
+{
+    while (size > 0)
+    {
+        ssize_t n = pread(fd, buf, size, pos);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            perror("pread");
+            return -EIO;
+        }
+        buf = (unsigned char *)buf + n;
+        pos += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ * write the size bytes of buf to the file fd at offset pos
+ *
+ * @param fd        the file
+ * @param buf       the data; NULL to write zeros
+ * @param size      number of bytes
+ * @param pos       offset in the file
+ * @return          0 on success; -EIO on error
+ */
+static int file_write(int fd, const void *buf, size_t size, uint64_t pos)
+{
+    static const unsigned char zeros[A1FS_MAX_BLOCK_SIZE];
+    while (size > 0)
+    {
+        size_t len = size;
+        const void *src = buf;
+        if (buf == NULL)
+        {
+            len = (size < sizeof(zeros)) ? size : sizeof(zeros);
+            src = zeros;
+        }
+        ssize_t n = pwrite(fd, src, len, pos);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            perror("pwrite");
+            return -EIO;
+        }
+        if (buf != NULL)
+        {
+            buf = (const unsigned char *)buf + n;
+        }
+        pos += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ * get the bounce buffer of the calling thread, BLKIO_MAX_RUN blks aligned for O_DIRECT
+ *
+ * @param b         pointer to the blk I/O
+ * @return          the buffer; NULL if out of memory
+ */
+static unsigned char *get_bounce(blkio *b)
+{
+    void *buf = pthread_getspecific(b->bounce_key);
+    if (buf == NULL)
+    {
+        if (posix_memalign(&buf, b->block_size, BLKIO_MAX_RUN * b->block_size) != 0)
+        {
+            return NULL;
+        }
+        pthread_setspecific(b->bounce_key, buf);
+    }
+    return buf;
+}
+
+/**
+ * get the shard of the cache of b that holds the blk blk
+ *
+ * @param b         pointer to the blk I/O
+ * @param blk       image blk num
+ * @return          the shard
+ */
+static inline blkcache_shard *shard_of(blkio *b, a1fs_blk_t blk)
+{
+    return &(b->shards[blk & (BLKCACHE_SHARDS - 1)]);
+}
+
+/**
+ * get the hash bucket of the shard sh for the blk blk; consecutive blks of a shard get consecutive buckets
+ *
+ * @param sh        the shard
+ * @param blk       image blk num
+ * @return          pointer to the head of the chain
+ */
+static inline uint32_t *bucket_of(blkcache_shard *sh, a1fs_blk_t blk)
+{
+    return &(sh->buckets[(blk / BLKCACHE_SHARDS) & (sh->nbuckets - 1)]);
+}
+
+/**
+ * find the slot of the shard sh that holds the blk blk; the shard is locked
+ *
+ * @param sh        the shard
+ * @param blk       image blk num
+ * @return          index of the slot; BLKCACHE_NONE if blk is not cached
+ */
+static uint32_t shard_lookup(blkcache_shard *sh, a1fs_blk_t blk)
+{
+    uint32_t i = *bucket_of(sh, blk);
+    while (i != BLKCACHE_NONE && sh->slots[i].blk != blk)
+    {
+        i = sh->slots[i].next;
+    }
+    return i;
+}
+
+/**
+ * take the slot i of the shard sh out of its hash chain and mark it unused; the shard is locked
+ *
+ * @param sh        the shard
+ * @param i         index of a valid slot
+ */
+static void shard_remove(blkcache_shard *sh, uint32_t i)
+{
+    uint32_t *link = bucket_of(sh, sh->slots[i].blk);
+    while (*link != i)
+    {
+        link = &(sh->slots[*link].next);
+    }
+    *link = sh->slots[i].next;
+    sh->slots[i].valid = false;
+}
+
+/**
+ * pick a slot of the shard sh for a new blk: one never used, or the first one the clock hand finds unused or
+ * unreferenced, clearing the referenced bits it passes; the shard is locked
+ *
+ * @param sh        the shard
+ * @return          index of the slot, out of its hash chain
+ */
+static uint32_t shard_victim(blkcache_shard *sh)
+{
+    if (sh->nused < sh->nslots)
+    {
+        return sh->nused++;
+    }
+    while (sh->slots[sh->hand].valid && sh->slots[sh->hand].ref)
+    {
+        sh->slots[sh->hand].ref = false;
+        sh->hand = (sh->hand + 1) % sh->nslots;
+    }
+    uint32_t i = sh->hand;
+    sh->hand = (sh->hand + 1) % sh->nslots;
+    if (sh->slots[i].valid)
+    {
+        shard_remove(sh, i);
+    }
+    return i;
+}
+
+/**
+ * copy the n bytes at offset off of the blk blk from the cache of b into dst, if it is cached
+ *
+ * @param b         pointer to the blk I/O
+ * @param blk       image blk num
+ * @param off       offset within the blk
+ * @param dst       the buffer that receives the bytes
+ * @param n         number of bytes
+ * @return          true if blk was cached
+ */
+static bool cache_get(blkio *b, a1fs_blk_t blk, size_t off, void *dst, size_t n)
+{
+    blkcache_shard *sh = shard_of(b, blk);
+    pthread_mutex_lock(&(sh->lock));
+    uint32_t i = shard_lookup(sh, blk);
+    if (i != BLKCACHE_NONE)
+    {
+        sh->slots[i].ref = true;
+        memcpy(dst, sh->data + (size_t)i * b->block_size + off, n);
+    }
+    pthread_mutex_unlock(&(sh->lock));
+    return i != BLKCACHE_NONE;
+}
+
+/**
+ * check whether the blk blk is in the cache of b, without counting it as a reference
+ *
+ * @param b         pointer to the blk I/O
+ * @param blk       image blk num
+ * @return          true if blk is cached
+ */
+static bool cache_has(blkio *b, a1fs_blk_t blk)
+{
+    blkcache_shard *sh = shard_of(b, blk);
+    pthread_mutex_lock(&(sh->lock));
+    bool found = shard_lookup(sh, blk) != BLKCACHE_NONE;
+    pthread_mutex_unlock(&(sh->lock));
+    return found;
+}
+
+/**
+ * add the blk blk, just read into src, to the cache of b unreferenced, unless another thread added it first
+ *
+ * @param b         pointer to the blk I/O
+ * @param blk       image blk num
+ * @param src       contents of the blk
+ */
+static void cache_put(blkio *b, a1fs_blk_t blk, const void *src)
+{
+    blkcache_shard *sh = shard_of(b, blk);
+    pthread_mutex_lock(&(sh->lock));
+    if (shard_lookup(sh, blk) == BLKCACHE_NONE)
+    {
+        uint32_t i = shard_victim(sh);
+        uint32_t *head = bucket_of(sh, blk);
+        sh->slots[i] = (blkcache_slot){ blk, *head, true, false };
+        *head = i;
+        memcpy(sh->data + (size_t)i * b->block_size, src, b->block_size);
+    }
+    pthread_mutex_unlock(&(sh->lock));
+}
+
+/**
+ * copy the n bytes of src over offset off of the blk blk in the cache of b, if it is cached
+ *
+ * @param b         pointer to the blk I/O
+ * @param blk       image blk num
+ * @param off       offset within the blk
+ * @param src       the bytes; NULL for zeros
+ * @param n         number of bytes
+ */
+static void cache_update(blkio *b, a1fs_blk_t blk, size_t off, const void *src, size_t n)
+{
+    blkcache_shard *sh = shard_of(b, blk);
+    pthread_mutex_lock(&(sh->lock));
+    uint32_t i = shard_lookup(sh, blk);
+    if (i != BLKCACHE_NONE)
+    {
+        unsigned char *dst = sh->data + (size_t)i * b->block_size + off;
+        if (src != NULL)
+        {
+            memcpy(dst, src, n);
+        }
+        else
+        {
+            memset(dst, 0, n);
+        }
+    }
+    pthread_mutex_unlock(&(sh->lock));
+}
+
+/**
+ * read the whole blk blk into dst, from the cache of b if it is there
+ *
+ * @param b         pointer to the blk I/O
+ * @param blk       image blk num
+ * @param dst       aligned buffer for one blk
+ * @return          0 on success; -EIO on error
+ */
+static int fill_blk(blkio *b, a1fs_blk_t blk, void *dst)
+{
+    if (cache_get(b, blk, 0, dst, b->block_size))
+    {
+        return 0;
+    }
+    return file_read(b->fd, dst, b->block_size, blk * b->block_size);
+}
+
+/**
+ * initialize the shard sh with nslots empty slots of block_size bytes
+ *
+ * @param sh            the shard
+ * @param nslots        number of slots
+ * @param block_size    blk size of the image
+ * @return              true on success; false if out of memory
+ */
+static bool shard_init(blkcache_shard *sh, uint32_t nslots, uint32_t block_size)
+{
+    uint32_t nbuckets = 1;
+    while (nbuckets < nslots)
+    {
+        nbuckets *= 2;
+    }
+    void *data;
+    if (posix_memalign(&data, block_size, (size_t)nslots * block_size) != 0)
+    {
+        return false;
+    }
+    sh->data = data;
+    sh->slots = calloc(nslots, sizeof(blkcache_slot));
+    sh->buckets = malloc(nbuckets * sizeof(uint32_t));
+    if (sh->slots == NULL || sh->buckets == NULL)
+    {
+        free(sh->buckets);
+        free(sh->slots);
+        free(sh->data);
+        return false;
+    }
+    memset(sh->buckets, 0xff, nbuckets * sizeof(uint32_t)); // BLKCACHE_NONE
+    sh->nslots = nslots;
+    sh->nbuckets = nbuckets;
+    sh->nused = 0;
+    sh->hand = 0;
+    pthread_mutex_init(&(sh->lock), NULL);
+    return true;
+}
+
+/**
+ * free the memory of the shard sh
+ *
+ * @param sh        the shard
+ */
+static void shard_destroy(blkcache_shard *sh)
+{
+    pthread_mutex_destroy(&(sh->lock));
+    free(sh->buckets);
+    free(sh->slots);
+    free(sh->data);
+}
+
+bool blkio_init(blkio *b, const char *path, int fd, uint32_t block_size, size_t cache_size, bool direct)
+{
+    memset(b, 0, sizeof(blkio));
+    b->fd = fd;
+    b->block_size = block_size;
+    if (cache_size == 0)
+    {
+        assert(!direct);
+        return true;
+    }
+    size_t nslots = cache_size / b->block_size / BLKCACHE_SHARDS;
+    if (nslots == 0)
+    {
+        nslots = 1;
+    }
+    if (nslots >= BLKCACHE_NONE)
+    {
+        nslots = BLKCACHE_NONE - 1;
+    }
+    b->shards = calloc(BLKCACHE_SHARDS, sizeof(blkcache_shard));
+    if (b->shards == NULL)
+    {
+        return false;
+    }
+    size_t n = 0;
+    while (n < BLKCACHE_SHARDS && shard_init(&(b->shards[n]), nslots, b->block_size))
+    {
+        n++;
+    }
+    if (n < BLKCACHE_SHARDS)
+    {
+        fprintf(stderr, "Not enough memory for a %zu MB blk cache\n", cache_size >> 20);
+        goto err;
+    }
+    if (direct)
+    {
+        b->fd = open(path, O_RDWR | O_DIRECT);
+        if (b->fd < 0)
+        {
+            perror("open(O_DIRECT)");
+            goto err;
+        }
+        b->direct = true;
+    }
+    pthread_key_create(&(b->bounce_key), free);
+    return true;
+
+err:
+    while (n > 0)
+    {
+        shard_destroy(&(b->shards[--n]));
+    }
+    free(b->shards);
+    b->shards = NULL;
+    return false;
+}
+
+void blkio_destroy(blkio *b)
+{
+    if (!blkio_cached(b))
+    {
+        return;
+    }
+    // the other threads free theirs when they exit
+    free(pthread_getspecific(b->bounce_key));
+    pthread_key_delete(b->bounce_key);
+    for (size_t i = 0; i < BLKCACHE_SHARDS; i++)
+    {
+        shard_destroy(&(b->shards[i]));
+    }
+    free(b->shards);
+    b->shards = NULL;
+    if (b->direct)
+    {
+        close(b->fd);
+    }
+}
+
+int blkio_read(blkio *b, uint64_t pos, void *buf, size_t size)
+{
+    if (!blkio_cached(b))
+    {
+        return file_read(b->fd, buf, size, pos);
+    }
+    unsigned char *dst = buf;
+    a1fs_blk_t blk = pos / b->block_size;
+    size_t off = pos % b->block_size;
+    while (size > 0)
+    {
+        size_t n = (size < b->block_size - off) ? size : b->block_size - off;
+        if (!cache_get(b, blk, off, dst, n))
+        { // read the run of blks missing from the cache with one call
+            unsigned char *bounce = get_bounce(b);
+            if (bounce == NULL)
+            {
+                return -ENOMEM;
+            }
+            uint32_t count = 1;
+            while (count < BLKIO_MAX_RUN && (size_t)count * b->block_size < off + size &&
+                   !cache_has(b, blk + count))
+            {
+                count++;
+            }
+            int error = file_read(b->fd, bounce, (size_t)count * b->block_size, blk * b->block_size);
+            if (error != 0)
+            {
+                return error;
+            }
+            if (!b->direct)
+            { // the cache holds the blks now; don't keep a second copy in the page cache
+                posix_fadvise(b->fd, blk * b->block_size, (size_t)count * b->block_size, POSIX_FADV_DONTNEED);
+            }
+            for (uint32_t i = 0; i < count; i++)
+            {
+                cache_put(b, blk + i, bounce + (size_t)i * b->block_size);
+            }
+            n = (size < (size_t)count * b->block_size - off) ? size : (size_t)count * b->block_size - off;
+            memcpy(dst, bounce + off, n);
+            blk += count - 1;
+        }
+        dst += n;
+        size -= n;
+        blk++;
+        off = 0;
+    }
+    return 0;
+}
+
+int blkio_write(blkio *b, uint64_t pos, const void *buf, size_t size)
+{
+    const unsigned char *src = buf;
+    a1fs_blk_t blk = pos / b->block_size;
+    size_t off = pos % b->block_size;
+    if (!b->direct)
+    { // the file takes any range; then bring the cached blks up to date
+        int error = file_write(b->fd, buf, size, pos);
+        while (error == 0 && blkio_cached(b) && size > 0)
+        {
+            size_t n = (size < b->block_size - off) ? size : b->block_size - off;
+            cache_update(b, blk, off, src, n);
+            if (src != NULL)
+            {
+                src += n;
+            }
+            size -= n;
+            blk++;
+            off = 0;
+        }
+        return error;
+    }
+    unsigned char *bounce = get_bounce(b);
+    if (bounce == NULL)
+    {
+        return -ENOMEM;
+    }
+    while (size > 0)
+    {
+        size_t count = (off + size + b->block_size - 1) / b->block_size;
+        if (count > BLKIO_MAX_RUN)
+        {
+            count = BLKIO_MAX_RUN;
+        }
+        size_t n = (size < count * b->block_size - off) ? size : count * b->block_size - off;
+        // blks written only in part keep the rest of their contents
+        int error = 0;
+        if (off != 0)
+        {
+            error = fill_blk(b, blk, bounce);
+        }
+        if (error == 0 && (off + n) % b->block_size != 0 && (count > 1 || off == 0))
+        {
+            error = fill_blk(b, blk + count - 1, bounce + (count - 1) * b->block_size);
+        }
+        if (error != 0)
+        {
+            return error;
+        }
+        if (src != NULL)
+        {
+            memcpy(bounce + off, src, n);
+            src += n;
+        }
+        else
+        {
+            memset(bounce + off, 0, n);
+        }
+        error = file_write(b->fd, bounce, count * b->block_size, blk * b->block_size);
+        if (error != 0)
+        {
+            return error;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            cache_update(b, blk + i, 0, bounce + i * b->block_size, b->block_size);
+        }
+        size -= n;
+        blk += count;
+        off = 0;
+    }
+    return 0;
+}
+
+void blkio_readahead(blkio *b, uint64_t pos, size_t size)
+{
+    if (!b->direct)
+    {
+        readahead(b->fd, pos, size);
+    }
+}
+
+void blkio_forget(blkio *b, a1fs_blk_t blk, uint64_t count)
+{
+    if (!blkio_cached(b))
+    {
+        return;
+    }
+    uint64_t nslots = (uint64_t)b->shards[0].nslots * BLKCACHE_SHARDS;
+    if (count <= nslots)
+    { // look each blk up
+        for (uint64_t i = 0; i < count; i++)
+        {
+            blkcache_shard *sh = shard_of(b, blk + i);
+            pthread_mutex_lock(&(sh->lock));
+            uint32_t slot = shard_lookup(sh, blk + i);
+            if (slot != BLKCACHE_NONE)
+            {
+                shard_remove(sh, slot);
+            }
+            pthread_mutex_unlock(&(sh->lock));
+        }
+        return;
+    }
+    // more blks than the cache holds: check every slot instead
+    for (size_t s = 0; s < BLKCACHE_SHARDS; s++)
+    {
+        blkcache_shard *sh = &(b->shards[s]);
+        pthread_mutex_lock(&(sh->lock));
+        for (uint32_t i = 0; i < sh->nused; i++)
+        {
+            if (sh->slots[i].valid && sh->slots[i].blk - blk < count)
+            {
+                shard_remove(sh, i);
+            }
+        }
+        pthread_mutex_unlock(&(sh->lock));
+    }
+}
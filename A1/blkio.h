@@ -0,0 +1,150 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+/** Number of blk cache shards; a power of 2. */
+#define BLKCACHE_SHARDS 16
+
+/** A cached data blk. */
+typedef struct blkcache_slot
+{
+    /** Image blk num; meaningful only if valid. */
+    a1fs_blk_t blk;
+    /** Next slot in the hash chain; BLKCACHE_NONE at the end. */
+    uint32_t next;
+    /** The slot holds blk. */
+    bool valid;
+    /** Referenced since the clock hand last passed. */
+    bool ref;
+
+} blkcache_slot;
+
+/** One shard of the blk cache, holding the blks whose number is its index modulo the number of shards. */
+typedef struct blkcache_shard
+{
+    blkcache_slot *slots;
+    /** Contents of the slots, one blk each, aligned for O_DIRECT. */
+    unsigned char *data;
+    /** Number of slots. */
+    uint32_t nslots;
+    /** Slots filled so far; the rest have never been used. */
+    uint32_t nused;
+    /** Next slot the clock hand looks at for a victim. */
+    uint32_t hand;
+    /** Hash buckets, heads of chains of slots; the number of buckets is a power of 2. */
+    uint32_t *buckets;
+    uint32_t nbuckets;
+    /** Protects all of the above. */
+    pthread_mutex_t lock;
+
+} blkcache_shard;
+
+/**
+ * Blk I/O of file data, which never goes through the image mapping.
+ *
+ * Only file data goes through here: the metadata (superblock, bitmaps, inode table, directory and extent blks)
+ * stays in the image mapping, so the image must still fit in the address space, an I/O error on metadata still
+ * raises SIGBUS, and what keeps the metadata in memory is the page cache (and -o mlock), not this cache.
+ *
+ * Without a cache, data is read and written with pread() and pwrite() on the image file through the kernel page
+ * cache, and the reads of a1fs_ll and write_buf() splice it to and from FUSE. With a cache (-o cache=N), data blks
+ * are kept in a sharded CLOCK cache in front of pread() and pwrite(). The blks read into it are dropped from the
+ * page cache so that they are not cached twice, or the file is opened with O_DIRECT if asked to (-o direct), so that
+ * streaming data leaves the page cache to the metadata. A blk enters the cache unreferenced when it is read and is
+ * only kept past one sweep of the clock hand if it is read again, so a stream of blks read once does not evict the
+ * ones read repeatedly. Writes go through to the file before they return, and only update blks that are already
+ * cached, so fsync() works the same with or without a cache.
+ */
+typedef struct blkio
+{
+    /** File the data is read and written through; the image file unless direct. */
+    int fd;
+    /** fd was opened with O_DIRECT, so it is only read and written in whole aligned blks. */
+    bool direct;
+    /** Blk size of the image. */
+    uint32_t block_size;
+    /** BLKCACHE_SHARDS cache shards; NULL without a cache. */
+    blkcache_shard *shards;
+    /** Per-thread aligned buffer that whole blks are read into and written from. */
+    pthread_key_t bounce_key;
+
+} blkio;
+
+/**
+ * initialize the blk I/O of the image file
+ *
+ * @param b             pointer to the blk I/O
+ * @param path          image file path, opened again if direct
+ * @param fd            image file, open for reading and writing
+ * @param block_size    blk size of the image
+ * @param cache_size    size of the cache in bytes; 0 for no cache
+ * @param direct        bypass the page cache with O_DIRECT; needs a cache
+ * @return              true on success; false on error
+ */
+bool blkio_init(blkio *b, const char *path, int fd, uint32_t block_size, size_t cache_size, bool direct);
+
+/**
+ * free the cache of the blk I/O b and close the file it opened
+ *
+ * @param b             pointer to the blk I/O
+ */
+void blkio_destroy(blkio *b);
+
+/**
+ * check whether the blk I/O b caches data, in which case it must be read and written through blkio_read() and
+ * blkio_write() rather than spliced to and from the image file
+ *
+ * @param b             pointer to the blk I/O
+ * @return              true if there is a cache
+ */
+static inline bool blkio_cached(const blkio *b)
+{
+    return b->shards != NULL;
+}
+
+/**
+ * read the size bytes at byte offset pos of the image file into buf
+ *
+ * @param b             pointer to the blk I/O
+ * @param pos           offset in the image file
+ * @param buf           the buffer that receives the data
+ * @param size          number of bytes
+ * @return              0 on success; -ENOMEM or -EIO on error
+ */
+int blkio_read(blkio *b, uint64_t pos, void *buf, size_t size);
+
+/**
+ * write the size bytes of buf at byte offset pos of the image file
+ *
+ * @param b             pointer to the blk I/O
+ * @param pos           offset in the image file
+ * @param buf           the data; NULL to write zeros
+ * @param size          number of bytes
+ * @return              0 on success; -ENOMEM or -EIO on error
+ */
+int blkio_write(blkio *b, uint64_t pos, const void *buf, size_t size);
+
+/**
+ * start reading the size bytes at byte offset pos of the image file into the page cache without waiting for them;
+ * does nothing with O_DIRECT, which bypasses the page cache
+ *
+ * @param b             pointer to the blk I/O
+ * @param pos           offset in the image file
+ * @param size          number of bytes
+ */
+void blkio_readahead(blkio *b, uint64_t pos, size_t size);
+
+/**
+ * drop the count image blks starting at blk from the cache after they were freed, since they may be written
+ * through the mapping next
+ *
+ * @param b             pointer to the blk I/O
+ * @param blk           first image blk num
+ * @param count         number of blks
+ */
+void blkio_forget(blkio *b, a1fs_blk_t blk, uint64_t count);
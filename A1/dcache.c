@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "htree.h"
+#include "util.h"
+
+/**
+ * compute the hash of (parent, name)
+ *
+ * @param parent    inode index of the parent dir
+ * @param name      name of the file/dir
+ * @param len       length of the name
+ * @return          the hash
+ */
+static uint32_t dcache_hash(a1fs_ino_t parent, const char *name, size_t len)
+{
+    return dx_hash(name, len) ^ (parent * 2654435761u);
+}
+
+/**
+ * unlink the entry e from the LRU list of the cache dc
+ *
+ * @param dc        pointer to the cache
+ * @param e         the entry
+ */
+static void lru_unlink(dcache *dc, dcache_entry *e)
+{
+    if (e->prev != NULL)
+    {
+        e->prev->next = e->next;
+    }
+    else
+    {
+        dc->head = e->next;
+    }
+    if (e->next != NULL)
+    {
+        e->next->prev = e->prev;
+    }
+    else
+    {
+        dc->tail = e->prev;
+    }
+}
+
+/**
+ * move the entry e to the head (most recently used end) of the LRU list of the cache dc
+ *
+ * @param dc        pointer to the cache
+ * @param e         the entry
+ */
+static void lru_touch(dcache *dc, dcache_entry *e)
+{
+    if (dc->head == e)
+    {
+        return;
+    }
+    lru_unlink(dc, e);
+    e->prev = NULL;
+    e->next = dc->head;
+    dc->head->prev = e;
+    dc->head = e;
+}
+
+/**
+ * move the entry e to the tail of the LRU list of the cache dc so that it gets reused first
+ *
+ * @param dc        pointer to the cache
+ * @param e         the entry
+ */
+static void lru_retire(dcache *dc, dcache_entry *e)
+{
+    if (dc->tail == e)
+    {
+        return;
+    }
+    lru_unlink(dc, e);
+    e->next = NULL;
+    e->prev = dc->tail;
+    dc->tail->next = e;
+    dc->tail = e;
+}
+
+/**
+ * remove the entry e from its hash bucket in the cache dc and mark it unused
+ *
+ * @param dc        pointer to the cache
+ * @param e         the entry; must be in use
+ */
+static void dcache_unhash(dcache *dc, dcache_entry *e)
+{
+    dcache_entry **p = &(dc->buckets[e->hash & (dc->nbuckets - 1)]);
+    while (*p != e)
+    {
+        p = &((*p)->hnext);
+    }
+    *p = e->hnext;
+    e->hnext = NULL;
+    e->len = 0;
+}
+
+/**
+ * find the entry for (parent, name) in the cache dc
+ *
+ * @param dc        pointer to the cache
+ * @param hash      hash of (parent, name)
+ * @param parent    inode index of the parent dir
+ * @param name      name of the file/dir
+ * @param len       length of the name
+ * @return          the entry; NULL if not cached
+ */
+static dcache_entry *dcache_find(dcache *dc, uint32_t hash, a1fs_ino_t parent, const char *name, size_t len)
+{
+    for (dcache_entry *e = dc->buckets[hash & (dc->nbuckets - 1)]; e != NULL; e = e->hnext)
+    {
+        if (e->hash == hash && e->parent == parent && e->len == len && memcmp(e->name, name, len) == 0)
+        {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * set the entry for (parent, name) in the cache dc, reusing the least recently used entry if needed
+ *
+ * @param dc        pointer to the cache
+ * @param parent    inode index of the parent dir
+ * @param name      name of the file/dir
+ * @param len       length of the name
+ * @param ino       inode index of the file/dir
+ * @param negative  the name does not exist
+ */
+static void dcache_set(dcache *dc, a1fs_ino_t parent, const char *name, size_t len, a1fs_ino_t ino, bool negative)
+{
+    if (len == 0 || len >= A1FS_NAME_MAX)
+    {
+        return;
+    }
+    uint32_t hash = dcache_hash(parent, name, len);
+    dcache_entry *e = dcache_find(dc, hash, parent, name, len);
+    if (e == NULL)
+    {
+        e = dc->tail;
+        if (e->len != 0)
+        { //evict
+            dcache_unhash(dc, e);
+        }
+        e->hash = hash;
+        e->parent = parent;
+        e->len = len;
+        memcpy(e->name, name, len);
+        dcache_entry **bucket = &(dc->buckets[hash & (dc->nbuckets - 1)]);
+        e->hnext = *bucket;
+        *bucket = e;
+    }
+    e->ino = ino;
+    e->negative = negative;
+    lru_touch(dc, e);
+}
+
+bool dcache_init(dcache *dc, size_t capacity)
+{
+    assert(capacity > 0);
+    pthread_mutex_init(&dc->lock, NULL);
+    size_t nbuckets = 1;
+    while (nbuckets < capacity)
+    {
+        nbuckets *= 2;
+    }
+    dc->entries = calloc(capacity, sizeof(dcache_entry));
+    dc->buckets = calloc(nbuckets, sizeof(dcache_entry *));
+    if (dc->entries == NULL || dc->buckets == NULL)
+    {
+        dcache_destroy(dc);
+        return false;
+    }
+    dc->nbuckets = nbuckets;
+    for (size_t i = 0; i < capacity; i++)
+    {
+        dc->entries[i].prev = (i == 0) ? NULL : &(dc->entries[i - 1]);
+        dc->entries[i].next = (i == capacity - 1) ? NULL : &(dc->entries[i + 1]);
+    }
+    dc->head = &(dc->entries[0]);
+    dc->tail = &(dc->entries[capacity - 1]);
+    return true;
+}
+
+void dcache_destroy(dcache *dc)
+{
+    free(dc->entries);
+    free(dc->buckets);
+    dc->entries = NULL;
+    dc->buckets = NULL;
+    pthread_mutex_destroy(&dc->lock);
+}
+
+dcache_result dcache_lookup(dcache *dc, a1fs_ino_t parent, const char *name, size_t len, a1fs_ino_t *ino)
+{
+    uint32_t hash = dcache_hash(parent, name, len);
+    dcache_result ret = DCACHE_MISS;
+    pthread_mutex_lock(&dc->lock);
+    dcache_entry *e = dcache_find(dc, hash, parent, name, len);
+    if (e != NULL)
+    {
+        lru_touch(dc, e);
+        if (e->negative)
+        {
+            ret = DCACHE_NEGATIVE;
+        }
+        else
+        {
+            *ino = e->ino;
+            ret = DCACHE_HIT;
+        }
+    }
+    pthread_mutex_unlock(&dc->lock);
+    return ret;
+}
+
+void dcache_add(dcache *dc, a1fs_ino_t parent, const char *name, size_t len, a1fs_ino_t ino)
+{
+    pthread_mutex_lock(&dc->lock);
+    dcache_set(dc, parent, name, len, ino, false);
+    pthread_mutex_unlock(&dc->lock);
+}
+
+void dcache_add_negative(dcache *dc, a1fs_ino_t parent, const char *name, size_t len)
+{
+    pthread_mutex_lock(&dc->lock);
+    dcache_set(dc, parent, name, len, 0, true);
+    pthread_mutex_unlock(&dc->lock);
+}
+
+void dcache_remove(dcache *dc, a1fs_ino_t parent, const char *name, size_t len)
+{
+    uint32_t hash = dcache_hash(parent, name, len);
+    pthread_mutex_lock(&dc->lock);
+    dcache_entry *e = dcache_find(dc, hash, parent, name, len);
+    if (e != NULL)
+    {
+        dcache_unhash(dc, e);
+        lru_retire(dc, e);
+    }
+    pthread_mutex_unlock(&dc->lock);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+/** A cached (parent dir, name) -> inode mapping; negative entries record names that don't exist. */
+typedef struct dcache_entry
+{
+    /** Next entry in the same hash bucket. */
+    struct dcache_entry *hnext;
+    /** Neighbours in the LRU list, most recently used first. */
+    struct dcache_entry *prev, *next;
+    /** Hash of (parent, name). */
+    uint32_t hash;
+    /** Inode index of the parent dir. */
+    a1fs_ino_t parent;
+    /** Inode index of the file/dir; unused for negative entries. */
+    a1fs_ino_t ino;
+    /** The name does not exist in the parent dir. */
+    bool negative;
+    /** Length of the name. */
+    uint8_t len;
+    /** The name, not null-terminated. */
+    char name[A1FS_NAME_MAX];
+
+} dcache_entry;
+
+/** Dentry cache: a fixed number of entries in a hash table, evicted in LRU order. */
+typedef struct dcache
+{
+    /** Preallocated entries. */
+    dcache_entry *entries;
+    /** Hash buckets; the number of buckets is a power of 2. */
+    dcache_entry **buckets;
+    size_t nbuckets;
+    /** LRU list; unused entries sit at the tail. */
+    dcache_entry *head, *tail;
+    /** Protects all of the above; every lookup moves an entry in the LRU list. */
+    pthread_mutex_t lock;
+
+} dcache;
+
+/** Result of a dentry cache lookup. */
+typedef enum dcache_result
+{
+    DCACHE_MISS,
+    DCACHE_HIT,
+    DCACHE_NEGATIVE,
+
+} dcache_result;
+
+/**
+ * initialize the dentry cache dc with capacity entries
+ *
+ * @param dc        pointer to the cache
+ * @param capacity  max number of cached entries
+ * @return          true on success; false if out of memory
+ */
+bool dcache_init(dcache *dc, size_t capacity);
+
+/**
+ * free all the memory used by the dentry cache dc
+ *
+ * @param dc        pointer to the cache
+ */
+void dcache_destroy(dcache *dc);
+
+/**
+ * look up name in the dir at inode index parent in the dentry cache dc
+ *
+ * @param dc        pointer to the cache
+ * @param parent    inode index of the parent dir
+ * @param name      name of the file/dir (need not be null-terminated)
+ * @param len       length of the name
+ * @param ino       stores the inode index of the file/dir on DCACHE_HIT
+ * @return          DCACHE_HIT, DCACHE_NEGATIVE if the name is known not to exist, or DCACHE_MISS
+ */
+dcache_result dcache_lookup(dcache *dc, a1fs_ino_t parent, const char *name, size_t len, a1fs_ino_t *ino);
+
+/**
+ * record that name in the dir at inode index parent refers to inode index ino
+ *
+ * @param dc        pointer to the cache
+ * @param parent    inode index of the parent dir
+ * @param name      name of the file/dir (need not be null-terminated)
+ * @param len       length of the name
+ * @param ino       inode index of the file/dir
+ */
+void dcache_add(dcache *dc, a1fs_ino_t parent, const char *name, size_t len, a1fs_ino_t ino);
+
+/**
+ * record that name does not exist in the dir at inode index parent
+ *
+ * @param dc        pointer to the cache
+ * @param parent    inode index of the parent dir
+ * @param name      name of the file/dir (need not be null-terminated)
+ * @param len       length of the name
+ */
+void dcache_add_negative(dcache *dc, a1fs_ino_t parent, const char *name, size_t len);
+
+/**
+ * drop whatever the cache knows about name in the dir at inode index parent
+ *
+ * @param dc        pointer to the cache
+ * @param parent    inode index of the parent dir
+ * @param name      name of the file/dir (need not be null-terminated)
+ * @param len       length of the name
+ */
+void dcache_remove(dcache *dc, a1fs_ino_t parent, const char *name, size_t len);
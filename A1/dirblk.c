@@ -0,0 +1,473 @@
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "dirblk.h"
+#include "helpers.h"
+#include "htree.h"
+
+/** Number of tags compared at once. */
+#if defined(__AVX2__)
+#define TAG_STRIDE 32
+#else
+#define TAG_STRIDE 16
+#endif
+
+/**
+ * compute the tag of the name name
+ * the low bits of the hash are used since all the names in a leaf of the hashed index share the high bits
+ *
+ * @param name      the name (need not be null-terminated)
+ * @param len       length of the name
+ * @return          the tag
+ */
+static inline uint8_t name_tag(const char *name, size_t len)
+{
+    return (uint8_t)dx_hash(name, len);
+}
+
+/**
+ * compare TAG_STRIDE bytes starting at p with x
+ *
+ * @param p         first byte
+ * @param x         the value to compare with
+ * @return          mask with bit i set if p[i] == x
+ */
+static inline uint32_t bytes_eq(const uint8_t *p, uint8_t x)
+{
+#if defined(__AVX2__)
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)x)));
+#elif defined(__SSE2__)
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)x)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TAG_STRIDE; i++)
+    {
+        mask |= (uint32_t)(p[i] == x) << i;
+    }
+    return mask;
+#endif
+}
+
+/**
+ * get the mask of the slots [first, first + TAG_STRIDE) that exist in a blk of nslots slots
+ *
+ * @param first     first slot
+ * @param nslots    number of slots
+ * @return          mask with bit i set if slot first + i exists
+ */
+static inline uint32_t slots_mask(uint32_t first, uint32_t nslots)
+{
+    return (nslots - first >= 32) ? ~0u : ((1u << (nslots - first)) - 1);
+}
+
+/**
+ * get the number of tag slots of a dir blk of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @return          number of slots
+ */
+static inline uint32_t blk_nslots(const fs_ctx *fs)
+{
+    return fs->compact_dirents ? A1FS_DIRENT_SLOTS(fs->block_size) : A1FS_DENTRY_SLOTS(fs->block_size);
+}
+
+/**
+ * get the offset of the first record of a compact dir blk of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @return          the offset, right after the tag header
+ */
+static inline uint32_t dirent_start(const fs_ctx *fs)
+{
+    return A1FS_DIRENT_START(fs->block_size);
+}
+
+/**
+ * get the tags of the dir blk blk, which start the tag header
+ *
+ * @param blk       the dir blk
+ * @return          pointer to the first tag
+ */
+static inline uint8_t *blk_tags(void *blk)
+{
+    return blk;
+}
+
+/**
+ * get the name lengths of the dir blk blk of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param blk       the dir blk
+ * @return          pointer to the length of the first slot
+ */
+static inline uint8_t *blk_lens(const fs_ctx *fs, void *blk)
+{
+    return (uint8_t *)blk + blk_nslots(fs);
+}
+
+/**
+ * get the record offsets of the compact dir blk blk of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param blk       the dir blk
+ * @return          pointer to the offset of the first slot
+ */
+static inline uint16_t *blk_offs(const fs_ctx *fs, void *blk)
+{
+    return (uint16_t *)((uint8_t *)blk + 2 * A1FS_DIRENT_SLOTS(fs->block_size));
+}
+
+/**
+ * get the record at byte offset off of the compact dir blk blk
+ *
+ * @param blk       the dir blk
+ * @param off       offset of the record
+ * @return          pointer to the record
+ */
+static inline a1fs_dirent *dirent_at(void *blk, uint32_t off)
+{
+    return (a1fs_dirent *)((unsigned char *)blk + off);
+}
+
+/**
+ * get the record in the slot slot of the compact dir blk blk of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param blk       the dir blk
+ * @param slot      the slot; must be in use
+ * @return          pointer to the record
+ */
+static inline a1fs_dirent *dirent_in_slot(const fs_ctx *fs, void *blk, uint32_t slot)
+{
+    return dirent_at(blk, blk_offs(fs, blk)[slot]);
+}
+
+/**
+ * get the number of bytes the record d actually needs
+ *
+ * @param d         the record
+ * @return          0 if the record is unused; otherwise the length of its header and name
+ */
+static inline uint32_t dirent_used(const a1fs_dirent *d)
+{
+    return d->name_len == 0 ? 0 : A1FS_DIRENT_LEN(d->name_len);
+}
+
+/**
+ * find the slot of the dentry named name in the dir blk blk of file system fs
+ * only the slots whose tag and length both match get their name compared
+ *
+ * @param fs        a pointer to the file system
+ * @param blk       the dir blk
+ * @param name      the name to look for (need not be null-terminated)
+ * @param len       length of the name
+ * @return          the slot; the number of slots if not found
+ */
+static uint32_t find_slot(const fs_ctx *fs, void *blk, const char *name, size_t len)
+{
+    uint32_t nslots = blk_nslots(fs);
+    if (len == 0 || len >= A1FS_NAME_MAX)
+    {
+        return nslots;
+    }
+    const uint8_t *tags = blk_tags(blk);
+    const uint8_t *lens = blk_lens(fs, blk);
+    uint8_t tag = name_tag(name, len);
+    for (uint32_t i = 0; i < nslots; i += TAG_STRIDE)
+    {
+        uint32_t mask = bytes_eq(tags + i, tag) & bytes_eq(lens + i, (uint8_t)len) & slots_mask(i, nslots);
+        while (mask != 0)
+        {
+            uint32_t slot = i + __builtin_ctz(mask);
+            const char *candidate = fs->compact_dirents ? dirent_in_slot(fs, blk, slot)->name
+                                                        : ((a1fs_dentry *)blk)[slot].name;
+            if (memcmp(candidate, name, len) == 0)
+            {
+                return slot;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return nslots;
+}
+
+/**
+ * find a free slot in the dir blk blk of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param blk       the dir blk
+ * @return          the slot; the number of slots if there is none
+ */
+static uint32_t free_slot(const fs_ctx *fs, void *blk)
+{
+    uint32_t nslots = blk_nslots(fs);
+    const uint8_t *lens = blk_lens(fs, blk);
+    for (uint32_t i = 0; i < nslots; i += TAG_STRIDE)
+    {
+        uint32_t mask = bytes_eq(lens + i, 0) & slots_mask(i, nslots);
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return nslots;
+}
+
+/**
+ * put a record for the inode at index ino named name into the chain of records [start, end) of area
+ * the first record with enough slack at its end gives it up
+ *
+ * @param fs        a pointer to the file system
+ * @param area      the compact dir blk or the i_data of an inline dir
+ * @param start     offset of the first record
+ * @param end       offset right after the last record
+ * @param ino       inode index of the file/dir
+ * @param name      name of the file/dir (need not be null-terminated)
+ * @param len       length of the name
+ * @return          offset of the new record; end if there is no room for it
+ */
+static uint32_t dirent_insert(const fs_ctx *fs, void *area, uint32_t start, uint32_t end, a1fs_ino_t ino,
+                              const char *name, size_t len)
+{
+    uint32_t need = A1FS_DIRENT_LEN(len);
+    uint32_t off = start;
+    a1fs_dirent *d = dirent_at(area, off);
+    while (d->rec_len - dirent_used(d) < need)
+    {
+        off += d->rec_len;
+        if (off >= end)
+        {
+            return end;
+        }
+        d = dirent_at(area, off);
+    }
+    uint32_t used = dirent_used(d);
+    if (used > 0)
+    { // take over the slack at the end of the record
+        a1fs_dirent *next = dirent_at(area, off + used);
+        next->rec_len = d->rec_len - used;
+        d->rec_len = used;
+        d = next;
+        off += used;
+    }
+    d->ino = ino;
+    d->name_len = len;
+    d->file_type = S_ISDIR(fs->root_ino[ino].mode) ? A1FS_FT_DIR : A1FS_FT_REG;
+    memcpy(d->name, name, len);
+    return off;
+}
+
+/**
+ * remove the record at offset target from the chain of records starting at offset start of area
+ *
+ * @param area      the compact dir blk or the i_data of an inline dir
+ * @param start     offset of the first record
+ * @param target    offset of the record; must be in use
+ */
+static void dirent_unlink(void *area, uint32_t start, uint32_t target)
+{
+    a1fs_dirent *d = dirent_at(area, target);
+    if (target == start)
+    {
+        d->ino = 0;
+        d->name_len = 0;
+        d->file_type = A1FS_FT_UNKNOWN;
+        return;
+    }
+    // the previous record absorbs this one
+    uint32_t off = start;
+    while (off + dirent_at(area, off)->rec_len != target)
+    {
+        off += dirent_at(area, off)->rec_len;
+    }
+    dirent_at(area, off)->rec_len += d->rec_len;
+}
+
+/**
+ * find the record named name in the chain of records [0, end) of the inline dir data data
+ * an inline dir holds a couple of records, so they are compared one by one
+ *
+ * @param data      the i_data of the dir
+ * @param end       offset right after the last record
+ * @param name      the name to look for (need not be null-terminated)
+ * @param len       length of the name
+ * @return          offset of the record; end if not found
+ */
+static uint32_t dirent_find(void *data, uint32_t end, const char *name, size_t len)
+{
+    for (uint32_t off = 0; off < end; off += dirent_at(data, off)->rec_len)
+    {
+        a1fs_dirent *d = dirent_at(data, off);
+        if (d->name_len == len && len > 0 && memcmp(d->name, name, len) == 0)
+        {
+            return off;
+        }
+    }
+    return end;
+}
+
+/**
+ * call fn on every record in use in the chain of records [start, end) of area
+ *
+ * @param area      the compact dir blk or the i_data of an inline dir
+ * @param start     offset of the first record
+ * @param end       offset right after the last record
+ * @param fn        callback; a non-zero return value stops the iteration
+ * @param arg       argument passed to fn
+ * @return          0 if all records were visited; otherwise the value returned by fn
+ */
+static int dirent_iterate(void *area, uint32_t start, uint32_t end, dirblk_fn fn, void *arg)
+{
+    dirblk_entry entry;
+    int ret;
+    for (uint32_t off = start; off < end; off += dirent_at(area, off)->rec_len)
+    {
+        a1fs_dirent *d = dirent_at(area, off);
+        if (d->name_len == 0)
+        {
+            continue;
+        }
+        entry.ino = d->ino;
+        entry.name = d->name;
+        entry.len = d->name_len;
+        entry.type = d->file_type;
+        if ((ret = fn(&entry, arg)) != 0)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+void dirblk_init(const fs_ctx *fs, void *blk)
+{
+    if (!fs->compact_dirents)
+    {
+        memset(blk, 0, fs->block_size);
+        memset(blk_lens(fs, blk), UINT8_MAX, A1FS_DENTRY_HDR_SLOTS(fs->block_size)); // the header itself
+        return;
+    }
+    memset(blk, 0, dirent_start(fs) + sizeof(a1fs_dirent));
+    dirent_at(blk, dirent_start(fs))->rec_len = fs->block_size - dirent_start(fs); // one unused record
+}
+
+bool dirblk_add(const fs_ctx *fs, void *blk, a1fs_ino_t ino, const char *name, size_t len)
+{
+    uint32_t slot = free_slot(fs, blk);
+    if (slot == blk_nslots(fs))
+    {
+        return false;
+    }
+    if (!fs->compact_dirents)
+    {
+        ((a1fs_dentry *)blk)[slot] = create_dentry(ino, name, len);
+    }
+    else
+    {
+        uint32_t off = dirent_insert(fs, blk, dirent_start(fs), fs->block_size, ino, name, len);
+        if (off == fs->block_size)
+        {
+            return false;
+        }
+        blk_offs(fs, blk)[slot] = off;
+    }
+    blk_tags(blk)[slot] = name_tag(name, len);
+    blk_lens(fs, blk)[slot] = len;
+    return true;
+}
+
+a1fs_ino_t *dirblk_find(const fs_ctx *fs, void *blk, const char *name, size_t len)
+{
+    uint32_t slot = find_slot(fs, blk, name, len);
+    if (slot == blk_nslots(fs))
+    {
+        return NULL;
+    }
+    return fs->compact_dirents ? &(dirent_in_slot(fs, blk, slot)->ino) : &(((a1fs_dentry *)blk)[slot].ino);
+}
+
+bool dirblk_remove(const fs_ctx *fs, void *blk, const char *name, size_t len)
+{
+    uint32_t slot = find_slot(fs, blk, name, len);
+    if (slot == blk_nslots(fs))
+    {
+        return false;
+    }
+    if (!fs->compact_dirents)
+    {
+        memset(&(((a1fs_dentry *)blk)[slot]), 0, sizeof(a1fs_dentry));
+    }
+    else
+    {
+        dirent_unlink(blk, dirent_start(fs), blk_offs(fs, blk)[slot]);
+    }
+    blk_tags(blk)[slot] = 0;
+    blk_lens(fs, blk)[slot] = 0;
+    return true;
+}
+
+int dirblk_iterate(const fs_ctx *fs, void *blk, dirblk_fn fn, void *arg)
+{
+    dirblk_entry entry;
+    int ret;
+    if (!fs->compact_dirents)
+    {
+        a1fs_dentry *slots = blk;
+        const uint8_t *lens = blk_lens(fs, blk);
+        for (uint32_t i = A1FS_DENTRY_HDR_SLOTS(fs->block_size); i < blk_nslots(fs); i++)
+        {
+            if (lens[i] == 0)
+            {
+                continue;
+            }
+            entry.ino = slots[i].ino;
+            entry.name = slots[i].name;
+            entry.len = lens[i];
+            entry.type = A1FS_FT_UNKNOWN;
+            if ((ret = fn(&entry, arg)) != 0)
+            {
+                return ret;
+            }
+        }
+        return 0;
+    }
+    return dirent_iterate(blk, dirent_start(fs), fs->block_size, fn, arg);
+}
+
+void dirblk_inline_init(void *data)
+{
+    memset(data, 0, sizeof(a1fs_dirent));
+    dirent_at(data, 0)->rec_len = A1FS_INLINE_DATA_MAX; // one unused record
+}
+
+bool dirblk_inline_add(const fs_ctx *fs, void *data, a1fs_ino_t ino, const char *name, size_t len)
+{
+    return dirent_insert(fs, data, 0, A1FS_INLINE_DATA_MAX, ino, name, len) != A1FS_INLINE_DATA_MAX;
+}
+
+a1fs_ino_t *dirblk_inline_find(void *data, const char *name, size_t len)
+{
+    uint32_t off = dirent_find(data, A1FS_INLINE_DATA_MAX, name, len);
+    return (off == A1FS_INLINE_DATA_MAX) ? NULL : &(dirent_at(data, off)->ino);
+}
+
+bool dirblk_inline_remove(void *data, const char *name, size_t len)
+{
+    uint32_t off = dirent_find(data, A1FS_INLINE_DATA_MAX, name, len);
+    if (off == A1FS_INLINE_DATA_MAX)
+    {
+        return false;
+    }
+    dirent_unlink(data, 0, off);
+    return true;
+}
+
+int dirblk_inline_iterate(void *data, dirblk_fn fn, void *arg)
+{
+    return dirent_iterate(data, 0, A1FS_INLINE_DATA_MAX, fn, arg);
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+/*
+ * Directory blocks.
+ *
+ * A directory block holds either fixed a1fs_dentry slots or, on file systems
+ * with A1FS_FEATURE_COMPACT_DIRENT, a chain of a1fs_dirent records, after a
+ * header of name hash tags (see A1FS_DENTRY_SLOTS).
+ * Lookups compare 16 (SSE2) or 32 (AVX2) tags at a time and only compare the
+ * names whose tag and length match. Linear directories and the leaves of the
+ * hashed index both go through the functions below, so they work with either
+ * format.
+ *
+ * With compact records, a small directory keeps its records in the i_data of
+ * its inode instead (A1FS_INLINE_DIR_FL), with no tag header; the
+ * dirblk_inline_*() functions below work on those.
+ */
+
+/** A directory entry as seen by dirblk_iterate(). */
+typedef struct dirblk_entry
+{
+    /** Inode number. */
+    a1fs_ino_t ino;
+    /** File name. Not null-terminated. */
+    const char *name;
+    /** Length of the name. */
+    size_t len;
+    /** Type of the file (A1FS_FT_*); A1FS_FT_UNKNOWN with fixed dentries. */
+    uint8_t type;
+
+} dirblk_entry;
+
+/** Callback of dirblk_iterate(); a non-zero return value stops the iteration. */
+typedef int (*dirblk_fn)(const dirblk_entry *entry, void *arg);
+
+/**
+ * get the number of bytes a dentry with a name of len bytes adds to the size of its dir in file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param len       length of the name
+ * @return          size of the dentry in bytes
+ */
+static inline uint32_t dirblk_entry_size(const fs_ctx *fs, size_t len)
+{
+    return fs->compact_dirents ? A1FS_DIRENT_LEN(len) : sizeof(a1fs_dentry);
+}
+
+/**
+ * initialize the empty dir blk blk of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param blk       the dir blk
+ */
+void dirblk_init(const fs_ctx *fs, void *blk);
+
+/**
+ * add a dentry for the inode at index ino named name to the dir blk blk of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param blk       the dir blk
+ * @param ino       inode index of the file/dir
+ * @param name      name of the file/dir (need not be null-terminated)
+ * @param len       length of the name; must be < A1FS_NAME_MAX
+ * @return          true on success; false if the blk has no room for the dentry
+ */
+bool dirblk_add(const fs_ctx *fs, void *blk, a1fs_ino_t ino, const char *name, size_t len);
+
+/**
+ * find the dentry named name in the dir blk blk of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param blk       the dir blk
+ * @param name      name of the file/dir (need not be null-terminated)
+ * @param len       length of the name
+ * @return          pointer to the inode number of the dentry, which may be updated in place; NULL if not found
+ */
+a1fs_ino_t *dirblk_find(const fs_ctx *fs, void *blk, const char *name, size_t len);
+
+/**
+ * remove the dentry named name from the dir blk blk of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param blk       the dir blk
+ * @param name      name of the file/dir (need not be null-terminated)
+ * @param len       length of the name
+ * @return          true on success; false if not found
+ */
+bool dirblk_remove(const fs_ctx *fs, void *blk, const char *name, size_t len);
+
+/**
+ * call fn on every dentry of the dir blk blk of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param blk       the dir blk
+ * @param fn        callback; a non-zero return value stops the iteration
+ * @param arg       argument passed to fn
+ * @return          0 if all dentries were visited; otherwise the value returned by fn
+ */
+int dirblk_iterate(const fs_ctx *fs, void *blk, dirblk_fn fn, void *arg);
+
+/**
+ * initialize the i_data data of an empty inline dir
+ *
+ * @param data      the i_data of the dir
+ */
+void dirblk_inline_init(void *data);
+
+/**
+ * add a record for the inode at index ino named name to the i_data data of an inline dir of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param data      the i_data of the dir
+ * @param ino       inode index of the file/dir
+ * @param name      name of the file/dir (need not be null-terminated)
+ * @param len       length of the name; must be < A1FS_NAME_MAX
+ * @return          true on success; false if the inode has no room for the record
+ */
+bool dirblk_inline_add(const fs_ctx *fs, void *data, a1fs_ino_t ino, const char *name, size_t len);
+
+/**
+ * find the record named name in the i_data data of an inline dir
+ *
+ * @param data      the i_data of the dir
+ * @param name      name of the file/dir (need not be null-terminated)
+ * @param len       length of the name
+ * @return          pointer to the inode number of the record, which may be updated in place; NULL if not found
+ */
+a1fs_ino_t *dirblk_inline_find(void *data, const char *name, size_t len);
+
+/**
+ * remove the record named name from the i_data data of an inline dir
+ *
+ * @param data      the i_data of the dir
+ * @param name      name of the file/dir (need not be null-terminated)
+ * @param len       length of the name
+ * @return          true on success; false if not found
+ */
+bool dirblk_inline_remove(void *data, const char *name, size_t len);
+
+/**
+ * call fn on every record of the i_data data of an inline dir
+ *
+ * @param data      the i_data of the dir
+ * @param fn        callback; a non-zero return value stops the iteration
+ * @param arg       argument passed to fn
+ * @return          0 if all records were visited; otherwise the value returned by fn
+ */
+int dirblk_inline_iterate(void *data, dirblk_fn fn, void *arg);
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dirty.h"
+
+/**
+ * merge the two neighbouring ranges of the dirty set ds with the smallest gap between them
+ *
+ * @param ds        pointer to the dirty set; holds at least 2 ranges
+ */
+static void merge_closest(dirty_set *ds)
+{
+    uint32_t best = 0;
+    for (uint32_t i = 1; i + 1 < ds->count; i++)
+    {
+        if (ds->ranges[i + 1].start - ds->ranges[i].end < ds->ranges[best + 1].start - ds->ranges[best].end)
+        {
+            best = i;
+        }
+    }
+    ds->ranges[best].end = ds->ranges[best + 1].end;
+    memmove(&ds->ranges[best + 1], &ds->ranges[best + 2], (ds->count - best - 2) * sizeof(dirty_range));
+    ds->count--;
+}
+
+void dirty_add(dirty_set *ds, uint64_t start, uint64_t end)
+{
+    if (ds->overflow || start >= end)
+    {
+        return;
+    }
+    // first range that ends at or after start; the ranges before it are untouched
+    uint32_t lo = 0;
+    uint32_t hi = ds->count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ds->ranges[mid].end < start)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    // ranges [lo, last) overlap or touch the new one
+    uint32_t last = lo;
+    while (last < ds->count && ds->ranges[last].start <= end)
+    {
+        last++;
+    }
+    if (last > lo)
+    { // fold them into the first one
+        if (ds->ranges[lo].start < start)
+        {
+            start = ds->ranges[lo].start;
+        }
+        if (ds->ranges[last - 1].end > end)
+        {
+            end = ds->ranges[last - 1].end;
+        }
+        ds->ranges[lo] = (dirty_range){start, end};
+        memmove(&ds->ranges[lo + 1], &ds->ranges[last], (ds->count - last) * sizeof(dirty_range));
+        ds->count -= last - lo - 1;
+        return;
+    }
+    if (ds->count == ds->capacity)
+    { // one spare slot, so a new range can go in before the closest ones are merged
+        uint32_t capacity = (ds->capacity == 0) ? 4 : ds->capacity * 2;
+        if (capacity > DIRTY_MAX_RANGES + 1)
+        {
+            capacity = DIRTY_MAX_RANGES + 1;
+        }
+        dirty_range *ranges = realloc(ds->ranges, capacity * sizeof(dirty_range));
+        if (ranges == NULL)
+        {
+            ds->overflow = true;
+            return;
+        }
+        ds->ranges = ranges;
+        ds->capacity = capacity;
+    }
+    memmove(&ds->ranges[lo + 1], &ds->ranges[lo], (ds->count - lo) * sizeof(dirty_range));
+    ds->ranges[lo] = (dirty_range){start, end};
+    ds->count++;
+    if (ds->count > DIRTY_MAX_RANGES)
+    {
+        merge_closest(ds);
+    }
+}
+
+void dirty_take(dirty_set *ds, dirty_set *out)
+{
+    *out = *ds;
+    memset(ds, 0, sizeof(dirty_set));
+}
+
+void dirty_restore(dirty_set *ds, const dirty_set *from)
+{
+    for (uint32_t i = 0; i < from->count; i++)
+    {
+        dirty_add(ds, from->ranges[i].start, from->ranges[i].end);
+    }
+    ds->metadata = ds->metadata || from->metadata;
+    ds->overflow = ds->overflow || from->overflow;
+}
+
+void dirty_clear(dirty_set *ds)
+{
+    free(ds->ranges);
+    memset(ds, 0, sizeof(dirty_set));
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Most ranges a dirty set keeps; beyond that the closest ranges are merged. */
+#define DIRTY_MAX_RANGES 64
+
+/** Bytes [start, end) of the image file. */
+typedef struct dirty_range
+{
+    uint64_t start;
+    uint64_t end;
+
+} dirty_range;
+
+/**
+ * Data of one file written since its last fsync(), as sorted, disjoint byte
+ * ranges of the image file. Kept under the lock of the inode.
+ */
+typedef struct dirty_set
+{
+    dirty_range *ranges;
+    uint32_t count;
+    uint32_t capacity;
+    /** The size, the extents or the inline data of the file changed, so fdatasync() must flush metadata too. */
+    bool metadata;
+    /** A range could not be recorded (out of memory); everything must be flushed. */
+    bool overflow;
+
+} dirty_set;
+
+/**
+ * add the bytes [start, end) of the image file to the dirty set ds, merging them with the ranges they touch
+ * once the set holds DIRTY_MAX_RANGES ranges, the two closest ones are merged, so the set may grow to cover
+ * bytes that did not change
+ *
+ * @param ds        pointer to the dirty set
+ * @param start     first byte
+ * @param end       byte after the last one
+ */
+void dirty_add(dirty_set *ds, uint64_t start, uint64_t end);
+
+/**
+ * move the ranges and flags of the dirty set ds to out, leaving ds empty
+ *
+ * @param ds        pointer to the dirty set
+ * @param out       pointer to an uninitialized set; free it with dirty_clear()
+ */
+void dirty_take(dirty_set *ds, dirty_set *out);
+
+/**
+ * add the ranges and flags of the dirty set from back to the dirty set ds, after a failed flush
+ *
+ * @param ds        pointer to the dirty set
+ * @param from      pointer to the set taken with dirty_take()
+ */
+void dirty_restore(dirty_set *ds, const dirty_set *from);
+
+/**
+ * empty the dirty set ds and free its memory
+ *
+ * @param ds        pointer to the dirty set
+ */
+void dirty_clear(dirty_set *ds);
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+
+#include "extcache.h"
+#include "util.h"
+
+/**
+ * get the entry of the extent cache ec that the inode ino maps to
+ *
+ * @param ec        pointer to the cache
+ * @param ino       inode index
+ * @return          the entry
+ */
+static inline extcache_entry *extcache_slot(extcache *ec, a1fs_ino_t ino)
+{
+    return &(ec->entries[ino & (ec->nentries - 1)]);
+}
+
+/**
+ * build the prefix sums of the entry e from the extents extents
+ *
+ * @param e         the entry
+ * @param extents   the extents of the file
+ * @param count     number of extents
+ * @return          true on success; false if out of memory
+ */
+static bool extcache_build(extcache_entry *e, const a1fs_extent *extents, uint32_t count)
+{
+    if (count > e->capacity)
+    {
+        a1fs_lblk_t *prefix = realloc(e->prefix, count * sizeof(a1fs_lblk_t));
+        if (prefix == NULL)
+        {
+            return false;
+        }
+        e->prefix = prefix;
+        e->capacity = count;
+    }
+    a1fs_lblk_t sum = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        e->prefix[i] = sum;
+        sum += extents[i].count;
+    }
+    e->count = count;
+    return true;
+}
+
+bool extcache_init(extcache *ec, size_t nentries)
+{
+    assert(nentries > 0);
+    size_t n = 1;
+    while (n < nentries)
+    {
+        n *= 2;
+    }
+    ec->entries = calloc(n, sizeof(extcache_entry));
+    if (ec->entries == NULL)
+    {
+        return false;
+    }
+    ec->nentries = n;
+    for (size_t i = 0; i < n; i++)
+    {
+        pthread_mutex_init(&(ec->entries[i].lock), NULL);
+    }
+    return true;
+}
+
+void extcache_destroy(extcache *ec)
+{
+    if (ec->entries == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < ec->nentries; i++)
+    {
+        free(ec->entries[i].prefix);
+        pthread_mutex_destroy(&(ec->entries[i].lock));
+    }
+    free(ec->entries);
+    ec->entries = NULL;
+}
+
+/**
+ * find the extent holding the logical blk lblk of the inode ino through the locked entry e
+ *
+ * @param e         the entry the inode maps to
+ * @param ino       inode index of the file
+ * @param extents   the extents of the file
+ * @param count     number of extents
+ * @param lblk      logical blk within the file
+ * @param offset    stores the offset of lblk within the extent found
+ * @return          index of the extent; count if lblk is past the last extent
+ */
+static uint32_t extcache_lookup(extcache_entry *e, a1fs_ino_t ino, const a1fs_extent *extents, uint32_t count,
+                                a1fs_lblk_t lblk, a1fs_lblk_t *offset)
+{
+    if (!e->valid || e->ino != ino || e->count != count)
+    {
+        e->valid = false;
+        if (!extcache_build(e, extents, count))
+        { // out of memory, walk the extents instead
+            uint32_t i = 0;
+            for (; i < count && lblk >= extents[i].count; i++)
+            {
+                lblk -= extents[i].count;
+            }
+            *offset = lblk;
+            return i;
+        }
+        e->ino = ino;
+        e->valid = true;
+    }
+    if (count == 0 || lblk >= e->prefix[count - 1] + extents[count - 1].count)
+    {
+        *offset = 0;
+        return count;
+    }
+    // find the last extent that starts at or before lblk
+    uint32_t lo = 0;
+    uint32_t hi = count - 1;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+        if (e->prefix[mid] <= lblk)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    *offset = lblk - e->prefix[lo];
+    return lo;
+}
+
+uint32_t extcache_find(extcache *ec, a1fs_ino_t ino, const a1fs_extent *extents, uint32_t count,
+                       a1fs_lblk_t lblk, a1fs_lblk_t *offset)
+{
+    extcache_entry *e = extcache_slot(ec, ino);
+    pthread_mutex_lock(&(e->lock));
+    uint32_t i = extcache_lookup(e, ino, extents, count, lblk, offset);
+    pthread_mutex_unlock(&(e->lock));
+    return i;
+}
+
+void extcache_invalidate(extcache *ec, a1fs_ino_t ino)
+{
+    extcache_entry *e = extcache_slot(ec, ino);
+    pthread_mutex_lock(&(e->lock));
+    if (e->ino == ino)
+    {
+        e->valid = false;
+    }
+    pthread_mutex_unlock(&(e->lock));
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+/** Cumulative logical blk counts of the extents of one inode. */
+typedef struct extcache_entry
+{
+    /** Inode index of the file; meaningful only if valid. */
+    a1fs_ino_t ino;
+    /** The prefix sums match the extents of the inode. */
+    bool valid;
+    /** Number of extents covered by prefix. */
+    uint32_t count;
+    /** Capacity of prefix. */
+    uint32_t capacity;
+    /** prefix[i] is the first logical blk of extent i. */
+    a1fs_lblk_t *prefix;
+    /** Protects the entry; readers of different files may share it. */
+    pthread_mutex_t lock;
+
+} extcache_entry;
+
+/**
+ * Extent offset cache: direct-mapped by inode index, built lazily on the first
+ * lookup and dropped whenever the extents of the inode change.
+ */
+typedef struct extcache
+{
+    extcache_entry *entries;
+    /** Number of entries; a power of 2. */
+    size_t nentries;
+
+} extcache;
+
+/**
+ * initialize the extent cache ec with nentries entries
+ *
+ * @param ec        pointer to the cache
+ * @param nentries  number of entries; rounded up to a power of 2
+ * @return          true on success; false if out of memory
+ */
+bool extcache_init(extcache *ec, size_t nentries);
+
+/**
+ * free all the memory used by the extent cache ec
+ *
+ * @param ec        pointer to the cache
+ */
+void extcache_destroy(extcache *ec);
+
+/**
+ * find the extent holding the logical blk lblk of the inode ino, building its prefix sums if needed
+ *
+ * @param ec        pointer to the cache
+ * @param ino       inode index of the file
+ * @param extents   the extents of the file
+ * @param count     number of extents
+ * @param lblk      logical blk within the file
+ * @param offset    stores the offset of lblk within the extent found
+ * @return          index of the extent; count if lblk is past the last extent
+ */
+uint32_t extcache_find(extcache *ec, a1fs_ino_t ino, const a1fs_extent *extents, uint32_t count,
+                       a1fs_lblk_t lblk, a1fs_lblk_t *offset);
+
+/**
+ * drop the cached prefix sums of the inode ino after its extents changed
+ *
+ * @param ec        pointer to the cache
+ * @param ino       inode index of the file
+ */
+void extcache_invalidate(extcache *ec, a1fs_ino_t ino);
@@ -0,0 +1,513 @@
+#include <errno.h>
+#include <string.h>
+
+#include "extent.h"
+#include "helpers.h"
+
+// Extent tree, see a1fs_extent_header in a1fs.h for the layout
+
+/**
+ * get the extent tree node in the blk blk of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param blk       index of the data blk
+ * @return          header of the node
+ */
+static inline a1fs_extent_header *ext_node(fs_ctx *fs, a1fs_blk_t blk)
+{
+    return (a1fs_extent_header *)(fs->data_blk + (size_t)blk * fs->block_size);
+}
+
+/**
+ * get the entries of the leaf hdr
+ *
+ * @param hdr       header of the leaf
+ * @return          pointer to the first entry
+ */
+static inline a1fs_extent_leaf *ext_leaves(a1fs_extent_header *hdr)
+{
+    return (a1fs_extent_leaf *)(hdr + 1);
+}
+
+/**
+ * get the entries of the interior node hdr
+ *
+ * @param hdr       header of the interior node
+ * @return          pointer to the first entry
+ */
+static inline a1fs_extent_idx *ext_idxs(a1fs_extent_header *hdr)
+{
+    return (a1fs_extent_idx *)(hdr + 1);
+}
+
+/**
+ * get the flat extent blk of the file at inode index ino in file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param ino       inode index of the file
+ * @return          pointer to the first extent
+ */
+static inline a1fs_extent *ext_flat(fs_ctx *fs, a1fs_ino_t ino)
+{
+    return (a1fs_extent *)(fs->data_blk + (size_t)fs->root_ino[ino].s_extent_block * fs->block_size);
+}
+
+/**
+ * allocate an empty extent tree node of depth depth in file system fs
+ * precondition: there is a free blk
+ *
+ * @param fs        a pointer to the file system
+ * @param depth     depth of the node
+ * @return          index of the blk of the node
+ */
+static a1fs_blk_t ext_new_node(fs_ctx *fs, uint16_t depth)
+{
+    a1fs_extent extent;
+    search_blk_bitmap(1, fs, &extent);
+    a1fs_extent_header *hdr = ext_node(fs, extent.start);
+    journal_dirty(&fs->journal, hdr, fs->block_size);
+    memset(hdr, 0, sizeof(a1fs_extent_header));
+    hdr->depth = depth;
+    return extent.start;
+}
+
+/**
+ * switch the file at inode index ino in file system fs from its full flat extent blk to an extent tree
+ * the flat extent blk is reused as the first leaf
+ *
+ * @param fs        a pointer to the file system
+ * @param ino       inode index of the file
+ * @return          0 on success; -ENOSPC if out of blks
+ */
+static int ext_convert(fs_ctx *fs, a1fs_ino_t ino)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino]);
+    uint32_t count = inode->i_extents_count - A1FS_INLINE_EXTENTS;
+    uint32_t nleaves = divide_ceil(count, A1FS_EXTENT_LEAF_MAX(fs->block_size));
+    assert(nleaves <= A1FS_EXTENT_IDX_MAX(fs->block_size));
+    if (fs->sb->s_free_blocks_count < nleaves)
+    { // the other leaves and the root
+        return -ENOSPC;
+    }
+    a1fs_extent extents[A1FS_EXTENT_MAX(fs->block_size)];
+    memcpy(extents, ext_flat(fs, ino), count * sizeof(a1fs_extent));
+
+    a1fs_blk_t root_blk = ext_new_node(fs, 1);
+    a1fs_extent_header *root = ext_node(fs, root_blk);
+    a1fs_lblk_t lblk = 0; // the tree starts after the inline extents
+    for (uint32_t i = 0; i < A1FS_INLINE_EXTENTS; i++)
+    {
+        lblk += inode->i_extents[i].count;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        a1fs_extent_header *leaf;
+        if (i % A1FS_EXTENT_LEAF_MAX(fs->block_size) == 0)
+        {
+            a1fs_blk_t leaf_blk = (i == 0) ? inode->s_extent_block : ext_new_node(fs, 0);
+            leaf = ext_node(fs, leaf_blk);
+            journal_dirty(&fs->journal, leaf, fs->block_size);
+            memset(leaf, 0, sizeof(a1fs_extent_header));
+            ext_idxs(root)[root->count].lblk = lblk;
+            ext_idxs(root)[root->count].child = leaf_blk;
+            root->count += 1;
+        }
+        else
+        {
+            leaf = ext_node(fs, ext_idxs(root)[root->count - 1].child);
+        }
+        ext_leaves(leaf)[leaf->count].lblk = lblk;
+        ext_leaves(leaf)[leaf->count].extent = extents[i];
+        leaf->count += 1;
+        lblk += extents[i].count;
+    }
+    inode->s_extent_block = root_blk;
+    inode->i_flags |= A1FS_EXTTREE_FL;
+    return 0;
+}
+
+/**
+ * get the leaf entry of the extent number idx of the extent tree of the file with inode inode in file system fs
+ * all nodes but the rightmost ones on each level are full, so the path down the tree follows from idx
+ *
+ * @param fs        a pointer to the file system
+ * @param inode     the inode of the file; must use an extent tree
+ * @param idx       index of the extent within the tree (not counting the inline extents)
+ * @return          pointer to the leaf entry
+ */
+static a1fs_extent_leaf *ext_leaf_at(fs_ctx *fs, a1fs_inode *inode, uint32_t idx)
+{
+    uint64_t leaf = idx / A1FS_EXTENT_LEAF_MAX(fs->block_size);
+    a1fs_extent_header *hdr = ext_node(fs, inode->s_extent_block);
+    while (hdr->depth > 0)
+    {
+        uint64_t leaves_per_child = 1;
+        for (uint16_t d = 1; d < hdr->depth; d++)
+        {
+            leaves_per_child *= A1FS_EXTENT_IDX_MAX(fs->block_size);
+        }
+        hdr = ext_node(fs, ext_idxs(hdr)[leaf / leaves_per_child].child);
+        leaf %= leaves_per_child;
+    }
+    return &(ext_leaves(hdr)[idx % A1FS_EXTENT_LEAF_MAX(fs->block_size)]);
+}
+
+/**
+ * add the leaf entry entry at the end of the subtree rooted at hdr in file system fs
+ * precondition: there is a free blk for every level of the subtree
+ *
+ * @param fs        a pointer to the file system
+ * @param hdr       root of the subtree
+ * @param entry     the leaf entry
+ * @param sibling   stores the blk of a new node holding the entry if hdr was full
+ * @return          true if a new node was created (to be added right after hdr); false otherwise
+ */
+static bool ext_insert(fs_ctx *fs, a1fs_extent_header *hdr, a1fs_extent_leaf entry, a1fs_blk_t *sibling)
+{
+    if (hdr->depth == 0)
+    {
+        if (hdr->count < A1FS_EXTENT_LEAF_MAX(fs->block_size))
+        {
+            journal_dirty(&fs->journal, hdr, fs->block_size);
+            ext_leaves(hdr)[hdr->count] = entry;
+            hdr->count += 1;
+            return false;
+        }
+        *sibling = ext_new_node(fs, 0);
+        a1fs_extent_header *leaf = ext_node(fs, *sibling);
+        ext_leaves(leaf)[0] = entry;
+        leaf->count = 1;
+        return true;
+    }
+    a1fs_blk_t child;
+    if (!ext_insert(fs, ext_node(fs, ext_idxs(hdr)[hdr->count - 1].child), entry, &child))
+    {
+        return false;
+    }
+    a1fs_extent_idx idx = {entry.lblk, child};
+    if (hdr->count < A1FS_EXTENT_IDX_MAX(fs->block_size))
+    {
+        journal_dirty(&fs->journal, hdr, fs->block_size);
+        ext_idxs(hdr)[hdr->count] = idx;
+        hdr->count += 1;
+        return false;
+    }
+    *sibling = ext_new_node(fs, hdr->depth);
+    a1fs_extent_header *node = ext_node(fs, *sibling);
+    ext_idxs(node)[0] = idx;
+    node->count = 1;
+    return true;
+}
+
+/**
+ * remove the last leaf entry of the subtree rooted at hdr in file system fs, freeing the nodes that become empty
+ *
+ * @param fs        a pointer to the file system
+ * @param hdr       root of the subtree
+ */
+static void ext_remove_last(fs_ctx *fs, a1fs_extent_header *hdr)
+{
+    if (hdr->depth > 0)
+    {
+        a1fs_blk_t child = ext_idxs(hdr)[hdr->count - 1].child;
+        ext_remove_last(fs, ext_node(fs, child));
+        if (ext_node(fs, child)->count > 0)
+        {
+            return;
+        }
+        unset_bitmap('d', child, 1, fs);
+    }
+    journal_dirty(&fs->journal, hdr, fs->block_size);
+    hdr->count -= 1;
+}
+
+/**
+ * free all the nodes of the subtree rooted at the blk blk in file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param blk       blk of the root of the subtree
+ */
+static void ext_free_tree(fs_ctx *fs, a1fs_blk_t blk)
+{
+    a1fs_extent_header *hdr = ext_node(fs, blk);
+    for (uint32_t i = 0; hdr->depth > 0 && i < hdr->count; i++)
+    {
+        ext_free_tree(fs, ext_idxs(hdr)[i].child);
+    }
+    unset_bitmap('d', blk, 1, fs);
+}
+
+/**
+ * free the flat extent blk (or all the extent tree nodes) of the file with inode inode in file system fs
+ * the extents left are the inline ones
+ *
+ * @param fs        a pointer to the file system
+ * @param inode     the inode of the file; must have an extent blk
+ */
+static void free_extents_blk(fs_ctx *fs, a1fs_inode *inode)
+{
+    if (inode->i_flags & A1FS_EXTTREE_FL)
+    {
+        ext_free_tree(fs, inode->s_extent_block);
+    }
+    else
+    {
+        unset_bitmap('d', inode->s_extent_block, 1, fs);
+    }
+    inode->s_extent_block = 0;
+    inode->i_flags &= ~A1FS_EXTTREE_FL;
+}
+
+a1fs_extent *get_extent(fs_ctx *fs, a1fs_ino_t ino, uint32_t idx)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino]);
+    assert(idx < inode->i_extents_count);
+    if (idx < A1FS_INLINE_EXTENTS)
+    {
+        return &(inode->i_extents[idx]);
+    }
+    idx -= A1FS_INLINE_EXTENTS;
+    if (!(inode->i_flags & A1FS_EXTTREE_FL))
+    {
+        return &(ext_flat(fs, ino)[idx]);
+    }
+    return &(ext_leaf_at(fs, inode, idx)->extent);
+}
+
+uint32_t find_extent(fs_ctx *fs, a1fs_ino_t ino, a1fs_lblk_t lblk, a1fs_lblk_t *offset)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino]);
+    a1fs_lblk_t start = 0; // first logical blk of the current extent
+    for (uint32_t i = 0; i < inode->i_extents_count && i < A1FS_INLINE_EXTENTS; i++)
+    {
+        if (lblk - start < inode->i_extents[i].count)
+        {
+            *offset = lblk - start;
+            return i;
+        }
+        start += inode->i_extents[i].count;
+    }
+    if (inode->i_extents_count <= A1FS_INLINE_EXTENTS)
+    { // past the end of the file
+        *offset = 0;
+        return inode->i_extents_count;
+    }
+    if (!(inode->i_flags & A1FS_EXTTREE_FL))
+    {
+        return A1FS_INLINE_EXTENTS + extcache_find(&fs->extcache, ino, ext_flat(fs, ino),
+                                                   inode->i_extents_count - A1FS_INLINE_EXTENTS, lblk - start, offset);
+    }
+    uint64_t node = 0; // position of hdr among the nodes of its level
+    a1fs_extent_header *hdr = ext_node(fs, inode->s_extent_block);
+    while (hdr->depth > 0)
+    { // find the last child that starts at or before lblk
+        a1fs_extent_idx *idxs = ext_idxs(hdr);
+        uint32_t lo = 0;
+        uint32_t hi = hdr->count - 1;
+        while (lo < hi)
+        {
+            uint32_t mid = lo + (hi - lo + 1) / 2;
+            if (idxs[mid].lblk <= lblk)
+            {
+                lo = mid;
+            }
+            else
+            {
+                hi = mid - 1;
+            }
+        }
+        node = node * A1FS_EXTENT_IDX_MAX(fs->block_size) + lo;
+        hdr = ext_node(fs, idxs[lo].child);
+    }
+    a1fs_extent_leaf *leaves = ext_leaves(hdr);
+    uint32_t lo = 0;
+    uint32_t hi = hdr->count - 1;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+        if (leaves[mid].lblk <= lblk)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    if (lblk - leaves[lo].lblk >= leaves[lo].extent.count)
+    { // past the end of the file
+        *offset = 0;
+        return inode->i_extents_count;
+    }
+    *offset = lblk - leaves[lo].lblk;
+    return A1FS_INLINE_EXTENTS + node * A1FS_EXTENT_LEAF_MAX(fs->block_size) + lo;
+}
+
+uint32_t find_extent_at(fs_ctx *fs, a1fs_ino_t ino, a1fs_lblk_t lblk, a1fs_lblk_t *offset, extent_cursor *cur)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino]);
+    uint64_t gen = inode_state(fs, ino)->extent_gen;
+    if (cur->gen != gen)
+    { // the extents changed since the cursor was set, start over from the first one
+        cur->gen = gen;
+        cur->idx = 0;
+        cur->lblk = 0;
+    }
+    // a sequential access starts in the extent of the cursor or in the next one
+    for (int step = 0; step < 2 && cur->idx < inode->i_extents_count && lblk >= cur->lblk; step++)
+    {
+        uint32_t count = get_extent(fs, ino, cur->idx)->count;
+        if (lblk - cur->lblk < count)
+        {
+            *offset = lblk - cur->lblk;
+            return cur->idx;
+        }
+        cur->idx++;
+        cur->lblk += count;
+    }
+    uint32_t idx = find_extent(fs, ino, lblk, offset);
+    if (idx < inode->i_extents_count)
+    {
+        cur->idx = idx;
+        cur->lblk = lblk - *offset;
+    }
+    return idx;
+}
+
+int append_extent(fs_ctx *fs, a1fs_ino_t ino, a1fs_extent extent)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino]);
+    if (inode->i_extents_count < A1FS_INLINE_EXTENTS)
+    {
+        inode->i_extents[inode->i_extents_count] = extent;
+        inode->i_extents_count += 1;
+        return 0;
+    }
+    uint32_t count = inode->i_extents_count - A1FS_INLINE_EXTENTS; // extents outside the inode
+    if (count == 0)
+    { // the inode is full, start a flat extent blk
+        if (fs->sb->s_free_blocks_count == 0)
+        {
+            return -ENOSPC;
+        }
+        a1fs_extent blk;
+        search_blk_bitmap(1, fs, &blk);
+        inode->s_extent_block = blk.start;
+        inode->i_flags &= ~A1FS_EXTTREE_FL;
+    }
+    if (!(inode->i_flags & A1FS_EXTTREE_FL))
+    {
+        if (count < A1FS_EXTENT_MAX(fs->block_size))
+        {
+            journal_dirty(&fs->journal, &(ext_flat(fs, ino)[count]), sizeof(a1fs_extent));
+            ext_flat(fs, ino)[count] = extent;
+            inode->i_extents_count += 1;
+            return 0;
+        }
+        int res = ext_convert(fs, ino);
+        if (res != 0)
+        {
+            return res;
+        }
+    }
+    a1fs_extent_header *root = ext_node(fs, inode->s_extent_block);
+    if (fs->sb->s_free_blocks_count < (uint64_t)root->depth + 2)
+    { // a new node on every level plus a new root
+        return -ENOSPC;
+    }
+    // the tree is never empty, the new extent starts right after the last one
+    a1fs_extent_leaf *last = ext_leaf_at(fs, inode, count - 1);
+    a1fs_extent_leaf entry = {last->lblk + last->extent.count, extent};
+    a1fs_blk_t sibling;
+    if (ext_insert(fs, root, entry, &sibling))
+    { // the root was full, grow the tree by one level
+        a1fs_blk_t root_blk = ext_new_node(fs, root->depth + 1);
+        a1fs_extent_header *new_root = ext_node(fs, root_blk);
+        ext_idxs(new_root)[0].lblk = 0;
+        ext_idxs(new_root)[0].child = inode->s_extent_block;
+        ext_idxs(new_root)[1].lblk = entry.lblk;
+        ext_idxs(new_root)[1].child = sibling;
+        new_root->count = 2;
+        inode->s_extent_block = root_blk;
+    }
+    inode->i_extents_count += 1;
+    return 0;
+}
+
+void pop_extent(fs_ctx *fs, a1fs_ino_t ino)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino]);
+    assert(inode->i_extents_count > 0);
+    inode->i_extents_count -= 1;
+    if (inode->i_extents_count < A1FS_INLINE_EXTENTS)
+    {
+        return;
+    }
+    if (inode->i_extents_count == A1FS_INLINE_EXTENTS)
+    { // the rest fits in the inode again
+        free_extents_blk(fs, inode);
+        return;
+    }
+    if (!(inode->i_flags & A1FS_EXTTREE_FL))
+    {
+        return;
+    }
+    a1fs_extent_header *root = ext_node(fs, inode->s_extent_block);
+    ext_remove_last(fs, root);
+    while (root->depth > 0 && root->count == 1)
+    { // the root has a single child, drop a level
+        a1fs_blk_t old_root = inode->s_extent_block;
+        inode->s_extent_block = ext_idxs(root)[0].child;
+        unset_bitmap('d', old_root, 1, fs);
+        root = ext_node(fs, inode->s_extent_block);
+    }
+}
+
+void free_extents(fs_ctx *fs, a1fs_ino_t ino)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino]);
+    if (inode->i_extents_count > A1FS_INLINE_EXTENTS)
+    {
+        free_extents_blk(fs, inode);
+    }
+    inode->i_extents_count = 0;
+}
+
+a1fs_lblk_t extent_end(fs_ctx *fs, a1fs_ino_t ino)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino]);
+    if (inode->i_extents_count > A1FS_INLINE_EXTENTS && (inode->i_flags & A1FS_EXTTREE_FL))
+    { // tree leaves record where their extents start
+        a1fs_extent_leaf *last = ext_leaf_at(fs, inode, inode->i_extents_count - 1 - A1FS_INLINE_EXTENTS);
+        return last->lblk + last->extent.count;
+    }
+    a1fs_lblk_t end = 0;
+    for (uint32_t i = 0; i < inode->i_extents_count; i++)
+    {
+        end += get_extent(fs, ino, i)->count;
+    }
+    return end;
+}
+
+uint64_t extent_blk_count(fs_ctx *fs, a1fs_ino_t ino)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino]);
+    if (inode->i_extents_count <= A1FS_INLINE_EXTENTS)
+    {
+        return 0;
+    }
+    if (!(inode->i_flags & A1FS_EXTTREE_FL))
+    {
+        return 1;
+    }
+    // all nodes but the rightmost ones on each level are full, so the size of each level follows from the one below
+    uint64_t depth = ext_node(fs, inode->s_extent_block)->depth;
+    uint64_t nodes = divide_ceil(inode->i_extents_count - A1FS_INLINE_EXTENTS, A1FS_EXTENT_LEAF_MAX(fs->block_size));
+    uint64_t count = nodes;
+    for (uint64_t d = 0; d < depth; d++)
+    {
+        nodes = divide_ceil(nodes, A1FS_EXTENT_IDX_MAX(fs->block_size));
+        count += nodes;
+    }
+    return count;
+}
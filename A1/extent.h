@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+/**
+ * where the last access to a file through an open handle ended, so that the next sequential access finds its
+ * extent without a search; a zeroed cursor points at the first extent
+ */
+typedef struct extent_cursor
+{
+    /** extent_gen of the inode state when the cursor was set; the cursor is stale once it differs. */
+    uint64_t gen;
+    /** Index of the extent. */
+    uint32_t idx;
+    /** First logical blk of the extent. */
+    a1fs_lblk_t lblk;
+
+} extent_cursor;
+
+/**
+ * record that the extents of the file at inode index ino in file system fs are about to change
+ * drops the cached prefix sums of the file and makes all of its cursors stale
+ *
+ * @param fs        a pointer to the file system
+ * @param ino       inode index of the file
+ */
+static inline void extents_changed(fs_ctx *fs, a1fs_ino_t ino)
+{
+    extcache_invalidate(&fs->extcache, ino);
+    inode_state(fs, ino)->extent_gen = istate_next_gen(&fs->istate);
+}
+
+/**
+ * get the pointer to the extent number idx of the file at inode index ino in file system fs
+ * the extent can be modified in place as long as no other extent is added or removed meanwhile
+ * (after marking it with journal_dirty())
+ *
+ * @param fs        a pointer to the file system
+ * @param ino       inode index of the file
+ * @param idx       index of the extent; must be < i_extents_count
+ * @return          pointer to the extent
+ */
+a1fs_extent *get_extent(fs_ctx *fs, a1fs_ino_t ino, uint32_t idx);
+
+/**
+ * find the extent that holds the logical blk lblk of the file at inode index ino in file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param ino       inode index of the file
+ * @param lblk      logical blk number within the file
+ * @param offset    stores the offset of lblk within the extent
+ * @return          index of the extent; i_extents_count if lblk is past the end of the file
+ */
+uint32_t find_extent(fs_ctx *fs, a1fs_ino_t ino, a1fs_lblk_t lblk, a1fs_lblk_t *offset);
+
+/**
+ * find the extent that holds the logical blk lblk like find_extent(), starting from the cursor cur
+ * takes O(1) if lblk is in the extent of the cursor or the next one, and falls back to find_extent() otherwise;
+ * the cursor is moved to the extent found
+ *
+ * @param fs        a pointer to the file system
+ * @param ino       inode index of the file
+ * @param lblk      logical blk number within the file
+ * @param offset    stores the offset of lblk within the extent
+ * @param cur       the cursor
+ * @return          index of the extent; i_extents_count if lblk is past the end of the file
+ */
+uint32_t find_extent_at(fs_ctx *fs, a1fs_ino_t ino, a1fs_lblk_t lblk, a1fs_lblk_t *offset, extent_cursor *cur);
+
+/**
+ * add the extent extent at the end of the file at inode index ino in file system fs
+ * the first A1FS_INLINE_EXTENTS extents are kept in the inode, the next ones in a flat extent blk allocated
+ * on demand; switches the file to an extent tree when its flat extent blk is full
+ *
+ * @param fs        a pointer to the file system
+ * @param ino       inode index of the file
+ * @param extent    the extent
+ * @return          0 on success; -ENOSPC if out of blks for the extent blk or tree
+ */
+int append_extent(fs_ctx *fs, a1fs_ino_t ino, a1fs_extent extent);
+
+/**
+ * remove the last extent of the file at inode index ino in file system fs
+ * the data blks of the extent are not freed; the extent blk is freed once the extents fit in the inode again
+ *
+ * @param fs        a pointer to the file system
+ * @param ino       inode index of the file
+ */
+void pop_extent(fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * remove all the extents of the file at inode index ino in file system fs, freeing its extent blk (or all the
+ * extent tree nodes) if it has one; the data blks of the extents are not freed
+ *
+ * @param fs        a pointer to the file system
+ * @param ino       inode index of the file
+ */
+void free_extents(fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * get the logical blk right after the last extent of the file at inode index ino in file system fs, i.e. the number
+ * of data blks of the file
+ *
+ * @param fs        a pointer to the file system
+ * @param ino       inode index of the file
+ * @return          number of data blks
+ */
+a1fs_lblk_t extent_end(fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * get the number of blks holding the extents of the file at inode index ino in file system fs: its flat extent blk,
+ * or all the nodes of its extent tree
+ *
+ * @param fs        a pointer to the file system
+ * @param ino       inode index of the file
+ * @return          number of extent blks
+ */
+uint64_t extent_blk_count(fs_ctx *fs, a1fs_ino_t ino);
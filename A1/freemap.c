@@ -0,0 +1,362 @@
+#include <stdlib.h>
+
+#include "bitmap.h"
+#include "freemap.h"
+
+#define BY_OFFSET 0
+#define BY_SIZE 1
+
+/**
+ * compare the node node with the key (start, count) in tree t
+ *
+ * @param t         BY_OFFSET or BY_SIZE
+ * @param node      the node
+ * @param start     first blk of the key
+ * @param count     number of blks of the key
+ * @return          <0, 0, >0 if node is ordered before, at, after the key
+ */
+static int node_cmp(int t, const freemap_node *node, a1fs_blk_t start, uint64_t count)
+{
+    if (t == BY_SIZE && node->count != count)
+    {
+        return node->count < count ? -1 : 1;
+    }
+    return (node->start > start) - (node->start < start);
+}
+
+/**
+ * split the tree t rooted at root into the nodes ordered before the key (start, count) and the rest
+ *
+ * @param t         BY_OFFSET or BY_SIZE
+ * @param root      root of the tree
+ * @param start     first blk of the key
+ * @param count     number of blks of the key
+ * @param l         stores the tree of the nodes before the key
+ * @param r         stores the tree of the remaining nodes
+ */
+static void split(int t, freemap_node *root, a1fs_blk_t start, uint64_t count, freemap_node **l, freemap_node **r)
+{
+    if (root == NULL)
+    {
+        *l = NULL;
+        *r = NULL;
+    }
+    else if (node_cmp(t, root, start, count) < 0)
+    {
+        split(t, root->child[t][1], start, count, &(root->child[t][1]), r);
+        *l = root;
+    }
+    else
+    {
+        split(t, root->child[t][0], start, count, l, &(root->child[t][0]));
+        *r = root;
+    }
+}
+
+/**
+ * merge the trees l and r of tree t, assuming every node of l is ordered before every node of r
+ *
+ * @param t         BY_OFFSET or BY_SIZE
+ * @param l         the lower tree
+ * @param r         the upper tree
+ * @return          root of the merged tree
+ */
+static freemap_node *merge(int t, freemap_node *l, freemap_node *r)
+{
+    if (l == NULL)
+    {
+        return r;
+    }
+    if (r == NULL)
+    {
+        return l;
+    }
+    if (l->prio > r->prio)
+    {
+        l->child[t][1] = merge(t, l->child[t][1], r);
+        return l;
+    }
+    r->child[t][0] = merge(t, l, r->child[t][0]);
+    return r;
+}
+
+/**
+ * insert the node node into the tree t rooted at root
+ *
+ * @param t         BY_OFFSET or BY_SIZE
+ * @param root      root of the tree
+ * @param node      the node
+ * @return          new root of the tree
+ */
+static freemap_node *insert(int t, freemap_node *root, freemap_node *node)
+{
+    if (root == NULL)
+    {
+        node->child[t][0] = NULL;
+        node->child[t][1] = NULL;
+        return node;
+    }
+    if (node->prio > root->prio)
+    {
+        split(t, root, node->start, node->count, &(node->child[t][0]), &(node->child[t][1]));
+        return node;
+    }
+    int dir = node_cmp(t, root, node->start, node->count) < 0;
+    root->child[t][dir] = insert(t, root->child[t][dir], node);
+    return root;
+}
+
+/**
+ * remove the node node from the tree t rooted at root
+ *
+ * @param t         BY_OFFSET or BY_SIZE
+ * @param root      root of the tree
+ * @param node      the node; must be in the tree
+ * @return          new root of the tree
+ */
+static freemap_node *erase(int t, freemap_node *root, freemap_node *node)
+{
+    if (root == node)
+    {
+        return merge(t, root->child[t][0], root->child[t][1]);
+    }
+    int dir = node_cmp(t, root, node->start, node->count) < 0;
+    root->child[t][dir] = erase(t, root->child[t][dir], node);
+    return root;
+}
+
+/** Get the end (one past the last blk) of the free extent node. */
+static inline uint64_t node_end(const freemap_node *node)
+{
+    return node->start + node->count;
+}
+
+/**
+ * add a free extent to both trees of the free map fm
+ *
+ * @param fm        the free map
+ * @param node      the node to use, or NULL to allocate a new one
+ * @param start     first blk
+ * @param count     number of blks
+ * @return          true on success; false if out of memory
+ */
+static bool attach(freemap *fm, freemap_node *node, a1fs_blk_t start, uint64_t count)
+{
+    if (node == NULL && (node = malloc(sizeof(freemap_node))) == NULL)
+    {
+        return false;
+    }
+    // xorshift32
+    fm->seed ^= fm->seed << 13;
+    fm->seed ^= fm->seed >> 17;
+    fm->seed ^= fm->seed << 5;
+    node->prio = fm->seed;
+    node->start = start;
+    node->count = count;
+    fm->root[BY_OFFSET] = insert(BY_OFFSET, fm->root[BY_OFFSET], node);
+    fm->root[BY_SIZE] = insert(BY_SIZE, fm->root[BY_SIZE], node);
+    return true;
+}
+
+/**
+ * remove a free extent from both trees of the free map fm without freeing it
+ *
+ * @param fm        the free map
+ * @param node      the node
+ */
+static void detach(freemap *fm, freemap_node *node)
+{
+    fm->root[BY_OFFSET] = erase(BY_OFFSET, fm->root[BY_OFFSET], node);
+    fm->root[BY_SIZE] = erase(BY_SIZE, fm->root[BY_SIZE], node);
+}
+
+/**
+ * find the free extent with the largest start blk that is <= blk
+ *
+ * @param fm        the free map
+ * @param blk       the blk
+ * @return          the free extent; NULL if there is none
+ */
+static freemap_node *floor_by_offset(freemap *fm, uint64_t blk)
+{
+    freemap_node *best = NULL;
+    freemap_node *node = fm->root[BY_OFFSET];
+    while (node != NULL)
+    {
+        if (node->start <= blk)
+        {
+            best = node;
+            node = node->child[BY_OFFSET][1];
+        }
+        else
+        {
+            node = node->child[BY_OFFSET][0];
+        }
+    }
+    return best;
+}
+
+/**
+ * find the free extent with the smallest start blk that is >= blk
+ *
+ * @param fm        the free map
+ * @param blk       the blk
+ * @return          the free extent; NULL if there is none
+ */
+static freemap_node *ceil_by_offset(freemap *fm, uint64_t blk)
+{
+    freemap_node *best = NULL;
+    freemap_node *node = fm->root[BY_OFFSET];
+    while (node != NULL)
+    {
+        if (node->start >= blk)
+        {
+            best = node;
+            node = node->child[BY_OFFSET][0];
+        }
+        else
+        {
+            node = node->child[BY_OFFSET][1];
+        }
+    }
+    return best;
+}
+
+/**
+ * free all the nodes of the offset-ordered tree rooted at node
+ *
+ * @param node      root of the tree
+ */
+static void free_tree(freemap_node *node)
+{
+    while (node != NULL)
+    {
+        free_tree(node->child[BY_OFFSET][0]);
+        freemap_node *right = node->child[BY_OFFSET][1];
+        free(node);
+        node = right;
+    }
+}
+
+bool freemap_init(freemap *fm, const unsigned char *bitmap, uint64_t nbits)
+{
+    fm->root[BY_OFFSET] = NULL;
+    fm->root[BY_SIZE] = NULL;
+    fm->seed = 2463534242u;
+    fm->valid = true;
+    a1fs_blk_t start = 0;
+    while ((start = bitmap_next_zero(bitmap, nbits, start)) < nbits)
+    {
+        a1fs_blk_t end = bitmap_next_one(bitmap, nbits, start);
+        if (!attach(fm, NULL, start, end - start))
+        {
+            freemap_destroy(fm);
+            return false;
+        }
+        start = end;
+    }
+    return true;
+}
+
+void freemap_destroy(freemap *fm)
+{
+    free_tree(fm->root[BY_OFFSET]);
+    fm->root[BY_OFFSET] = NULL;
+    fm->root[BY_SIZE] = NULL;
+    fm->valid = false;
+}
+
+bool freemap_take(freemap *fm, a1fs_blk_t start, uint32_t count)
+{
+    uint64_t end = (uint64_t)start + count;
+    for (;;)
+    { // cut [start, end) out of every free extent that overlaps it
+        freemap_node *node = floor_by_offset(fm, start);
+        if (node == NULL || node_end(node) <= start)
+        {
+            node = ceil_by_offset(fm, start);
+            if (node == NULL || node->start >= end)
+            {
+                return true;
+            }
+        }
+        a1fs_blk_t node_start = node->start;
+        uint64_t node_e = node_end(node);
+        detach(fm, node);
+        if (node_start < start)
+        {
+            if (!attach(fm, node, node_start, start - node_start))
+            {
+                return false;
+            }
+            node = NULL;
+        }
+        if (node_e > end)
+        {
+            if (!attach(fm, node, end, node_e - end))
+            {
+                return false;
+            }
+            node = NULL;
+        }
+        free(node);
+    }
+}
+
+bool freemap_give(freemap *fm, a1fs_blk_t start, uint32_t count)
+{
+    uint64_t end = (uint64_t)start + count;
+    freemap_node *node;
+    // absorb the free extents that overlap or touch [start, end)
+    while ((node = floor_by_offset(fm, end)) != NULL && node_end(node) >= start)
+    {
+        if (node->start < start)
+        {
+            start = node->start;
+        }
+        if (node_end(node) > end)
+        {
+            end = node_end(node);
+        }
+        detach(fm, node);
+        free(node);
+    }
+    return attach(fm, NULL, start, end - start);
+}
+
+bool freemap_best_fit(freemap *fm, uint32_t count, a1fs_extent *extent)
+{
+    freemap_node *best = NULL;
+    freemap_node *largest = NULL;
+    freemap_node *node = fm->root[BY_SIZE];
+    while (node != NULL)
+    {
+        largest = node;
+        if (node->count >= count)
+        {
+            best = node;
+            node = node->child[BY_SIZE][0];
+        }
+        else
+        {
+            node = node->child[BY_SIZE][1];
+        }
+    }
+    if (best == NULL)
+    { // nothing big enough, the last node visited is the largest
+        best = largest;
+    }
+    if (best == NULL)
+    {
+        return false;
+    }
+    extent->start = best->start;
+    extent->count = best->count < count ? best->count : count;
+    return true;
+}
+
+bool freemap_is_free(freemap *fm, a1fs_blk_t start, uint32_t count)
+{
+    freemap_node *node = floor_by_offset(fm, start);
+    return node != NULL && node_end(node) >= (uint64_t)start + count;
+}
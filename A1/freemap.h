@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+/** A free extent, linked into both trees of the free map. */
+typedef struct freemap_node
+{
+    /** First free data blk. */
+    a1fs_blk_t start;
+    /** Number of free blks; may exceed what one extent holds. */
+    uint64_t count;
+    /** Treap priority. */
+    uint32_t prio;
+    /** Children in the offset-ordered tree ([0]) and the size-ordered tree ([1]). */
+    struct freemap_node *child[2][2];
+
+} freemap_node;
+
+/**
+ * In-memory index of the free data blks.
+ *
+ * Every maximal run of free blks is kept in two treaps: one ordered by start
+ * blk (to find the neighbours of a blk) and one ordered by size (for best-fit
+ * allocation). Both are built from the blk bitmap at mount time and kept in
+ * sync with it by set_bitmap() and unset_bitmap().
+ */
+typedef struct freemap
+{
+    /** Roots of the offset-ordered ([0]) and size-ordered ([1]) trees. */
+    freemap_node *root[2];
+    /** State of the priority generator. */
+    uint32_t seed;
+    /** The index is usable; cleared if it could not be kept up to date. */
+    bool valid;
+
+} freemap;
+
+/**
+ * build the free map fm from the blk bitmap bitmap with nbits blks
+ *
+ * @param fm        the free map
+ * @param bitmap    the blk bitmap
+ * @param nbits     number of blks covered by the bitmap
+ * @return          true on success; false if out of memory
+ */
+bool freemap_init(freemap *fm, const unsigned char *bitmap, uint64_t nbits);
+
+/**
+ * free all the memory used by the free map fm and mark it invalid
+ *
+ * @param fm        the free map
+ */
+void freemap_destroy(freemap *fm);
+
+/**
+ * record that the blks [start, start + count) are now in use
+ *
+ * @param fm        the free map
+ * @param start     first blk
+ * @param count     number of blks
+ * @return          true on success; false if out of memory
+ */
+bool freemap_take(freemap *fm, a1fs_blk_t start, uint32_t count);
+
+/**
+ * record that the blks [start, start + count) are now free
+ *
+ * @param fm        the free map
+ * @param start     first blk
+ * @param count     number of blks
+ * @return          true on success; false if out of memory
+ */
+bool freemap_give(freemap *fm, a1fs_blk_t start, uint32_t count);
+
+/**
+ * find the smallest free extent of at least count blks, or the largest free extent if there is none
+ *
+ * @param fm        the free map
+ * @param count     number of blks wanted
+ * @param extent    stores the free extent
+ * @return          true on success; false if there are no free blks
+ */
+bool freemap_best_fit(freemap *fm, uint32_t count, a1fs_extent *extent);
+
+/**
+ * check if the blks [start, start + count) are all free
+ *
+ * @param fm        the free map
+ * @param start     first blk
+ * @param count     number of blks
+ * @return          true if all the blks are free
+ */
+bool freemap_is_free(freemap *fm, a1fs_blk_t start, uint32_t count);
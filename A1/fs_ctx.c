@@ -16,26 +16,122 @@
  * CSC369 Assignment 1 - File system runtime context implementation.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "fs_ctx.h"
+#include "helpers.h"
+#include "map.h"
 
+/** Number of entries in the dentry cache. */
+#define DCACHE_SIZE 8192
+/** Number of inodes whose extent prefix sums are cached. */
+#define EXTCACHE_SIZE 64
 
-bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
+/** Destroy the inode and allocator locks of fs. */
+static void destroy_locks(fs_ctx *fs)
+{
+	istate_destroy(&fs->istate);
+	pthread_mutex_destroy(&fs->alloc_mutex);
+}
+
+bool fs_ctx_advise(fs_ctx *fs)
+{
+	// Superblock, bitmaps and the part of the inode table that is in use; the
+	// journal log is only accessed through the file, and the data as files are
+	size_t meta = (size_t)(fs->sb->s_first_inode_block + fs->sb->s_itable_zeroed) * fs->block_size;
+	size_t all_meta = (size_t)fs->sb->s_journal_block * fs->block_size;
+
+	// Whether or not the kernel can back it with huge pages
+	if (fs->hugepage)
+		madvise(fs->image, fs->size, MADV_HUGEPAGE);
+	if (fs->populate || fs->mlock) {
+		if (!map_populate(fs->image, meta))
+			return false;
+	} else {
+		madvise(fs->image, meta, MADV_WILLNEED);
+	}
+	// The rest of the inode table gets locked as it is faulted in
+	return !fs->mlock || map_lock(fs->image, all_meta);
+}
+
+bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, int fd, const a1fs_opts *opts)
 {
 	fs->image = image;
 	fs->size = size;
+	fs->image_fd = fd;
 
 	//TODO: check if the file system image can be mounted and initialize its
 	// runtime state
-	fs->sb = (a1fs_superblock *)(image + A1FS_BLOCK_SIZE);
-	fs->inode_bitmap = (unsigned char *)(image + A1FS_BLOCK_SIZE * fs->sb->s_inode_bitmap);
-    fs->block_bitmap = (unsigned char *)(image + A1FS_BLOCK_SIZE * fs->sb->s_block_bitmap);
-    fs->root_ino = (a1fs_inode *)(image + A1FS_BLOCK_SIZE * fs->sb->s_first_inode_block);
-    fs->data_blk = image + A1FS_BLOCK_SIZE * fs->sb->s_first_data_block;
+	fs->sb = (a1fs_superblock *)(image + A1FS_SB_OFFSET);
+	if (fs->sb->magic != A1FS_MAGIC) {
+		fprintf(stderr, "Not an a1fs image\n");
+		return false;
+	}
+	if (fs->sb->s_revision != A1FS_REVISION) {
+		fprintf(stderr, "Unsupported a1fs revision %u (expected %u), reformat the image\n",
+		        fs->sb->s_revision, A1FS_REVISION);
+		return false;
+	}
+	fs->block_size = fs->sb->s_block_size;
+	fs->blk_ops = blk_ops_for(fs->block_size);
+	if (fs->blk_ops == NULL || size % fs->block_size != 0) {
+		fprintf(stderr, "Invalid block size %u\n", fs->block_size);
+		return false;
+	}
+	// replay before anything reads the metadata
+	if (!journal_init(&fs->journal, image, size, fd, opts->commit)) {
+		return false;
+	}
+	fs->inode_bitmap = (unsigned char *)(image + fs->block_size * fs->sb->s_inode_bitmap);
+    fs->block_bitmap = (unsigned char *)(image + fs->block_size * fs->sb->s_block_bitmap);
+    fs->root_ino = (a1fs_inode *)(image + fs->block_size * fs->sb->s_first_inode_block);
+    fs->data_blk = image + fs->block_size * fs->sb->s_first_data_block;
+	fs->hugepage = opts->hugepage;
+	fs->populate = opts->populate;
+	fs->mlock = opts->mlock;
+	fs->inode_cursor = 0;
+	fs->blk_cursor = 0;
+	fs->compact_dirents = (fs->sb->s_features & A1FS_FEATURE_COMPACT_DIRENT) != 0;
+	// the state of an inode is only allocated while it is in use
+	if (!istate_init(&fs->istate)) {
+		journal_destroy(&fs->journal);
+		return false;
+	}
+	pthread_mutex_init(&fs->alloc_mutex, NULL);
+	if (!dcache_init(&fs->dcache, DCACHE_SIZE)) {
+		goto err_locks;
+	}
+	if (!extcache_init(&fs->extcache, EXTCACHE_SIZE)) {
+		dcache_destroy(&fs->dcache);
+		goto err_locks;
+	}
+	a1fs_blk_t num_data_blk = fs->sb->s_blocks_count - fs->sb->s_first_data_block + 1;
+	// on failure the free map is left invalid and the blk bitmap gets scanned instead
+	freemap_init(&fs->freemap, fs->block_bitmap, num_data_blk);
+	if (!blkio_init(&fs->bio, opts->img_path, fd, fs->block_size, (size_t)opts->cache << 20, opts->direct)) {
+		freemap_destroy(&fs->freemap);
+		extcache_destroy(&fs->extcache);
+		dcache_destroy(&fs->dcache);
+		goto err_locks;
+	}
 	return true;
+
+err_locks:
+	destroy_locks(fs);
+	journal_destroy(&fs->journal);
+	return false;
 }
 
 void fs_ctx_destroy(fs_ctx *fs)
 {
-	//TODO: cleanup any resources allocated in fs_ctx_init()
-	(void)fs;
+	journal_destroy(&fs->journal);
+	blkio_destroy(&fs->bio);
+	freemap_destroy(&fs->freemap);
+	extcache_destroy(&fs->extcache);
+	dcache_destroy(&fs->dcache);
+	destroy_locks(fs);
+	close(fs->image_fd);
 }
@@ -18,11 +18,19 @@
 
 #pragma once
 
+#include <pthread.h>
 #include <stddef.h>
 
 #include "options.h"
 #include "a1fs.h"
+#include "blkio.h"
+#include "dcache.h"
+#include "extcache.h"
+#include "freemap.h"
+#include "istate.h"
+#include "journal.h"
 
+struct blk_ops;
 
 /**
  * Mounted file system runtime state - "fs context".
@@ -32,30 +40,152 @@ typedef struct fs_ctx {
 	void *image;
 	/** Image size in bytes. */
 	size_t size;
+	/**
+	 * Image file, open for reading and writing. File data is read and
+	 * written through it rather than through the mapping, which is private
+	 * when the image has a journal.
+	 */
+	int image_fd;
 
 	//TODO: useful runtime state of the mounted file system should be cached
 	// here (NOT in global variables in a1fs.c)
 	a1fs_superblock *sb; //pointer to the superblk
+	uint32_t block_size; //blk size of the image (sb->s_block_size)
+	const struct blk_ops *blk_ops; //helpers built for block_size, see blk_ops_for()
 	unsigned char *inode_bitmap; // pointer to the first inode_bitmap.
 	unsigned char *block_bitmap;// pointer to the first block_bitmap.
 	a1fs_inode *root_ino; //pointer to root inode
 	void *data_blk; //pointer to the first data block
+	dcache dcache; //(parent, name) -> inode cache for path lookups
+	freemap freemap; //free extents of the data blks, by offset and by size
+	extcache extcache; //per-inode extent prefix sums for offset lookups
+	uint32_t inode_cursor; //next-fit cursor into the inode bitmap
+	a1fs_blk_t blk_cursor; //next-fit cursor into the blk bitmap
+	bool compact_dirents; //dirs hold a1fs_dirent records (A1FS_FEATURE_COMPACT_DIRENT)
+	journal journal; //metadata journal; every change to the mapping is marked dirty in it
+	blkio bio; //file data I/O, through the blk cache if there is one
+	bool hugepage, populate, mlock; //memory advice for the image mapping, see fs_ctx_advise()
+
+	// Locking: an operation locks the inodes it touches (a dir before the
+	// files in it), and only then alloc_mutex if it allocates or frees
+	// inodes or blks. The extents of an inode (and its extent_gen) only
+	// change under its write lock. The bitmaps, the free map and the
+	// cursors are only touched under alloc_mutex; the dcache and the
+	// extcache lock themselves.
+	istate_table istate; //locks, dirty data and extent_gen of the inodes in use
+	pthread_mutex_t alloc_mutex; //inode/blk allocator
 
 } fs_ctx;
 
+/** Lock the inode at index ino for reading. */
+static inline void inode_rdlock(fs_ctx *fs, a1fs_ino_t ino)
+{
+	pthread_rwlock_rdlock(&istate_get(&fs->istate, ino)->lock);
+}
+
+/**
+ * Lock the inode at index ino for writing. Only done by operations that
+ * change the inode, so it joins the running journal transaction here.
+ */
+static inline void inode_wrlock(fs_ctx *fs, a1fs_ino_t ino)
+{
+	pthread_rwlock_wrlock(&istate_get(&fs->istate, ino)->lock);
+	journal_dirty(&fs->journal, &fs->root_ino[ino], sizeof(a1fs_inode));
+}
+
+/**
+ * Lock the inode at index ino for writing without joining the journal, for
+ * fsync(), which only touches the in-memory dirty set of the inode.
+ */
+static inline void inode_sync_lock(fs_ctx *fs, a1fs_ino_t ino)
+{
+	pthread_rwlock_wrlock(&istate_get(&fs->istate, ino)->lock);
+}
+
+/** Unlock the inode at index ino. */
+static inline void inode_unlock(fs_ctx *fs, a1fs_ino_t ino)
+{
+	istate_put(&fs->istate, ino);
+}
+
+/** Get the runtime state of the inode at index ino, which must be locked. */
+static inline istate *inode_state(fs_ctx *fs, a1fs_ino_t ino)
+{
+	return istate_find(&fs->istate, ino);
+}
+
+/** Lock the inode and blk allocator. */
+static inline void alloc_lock(fs_ctx *fs)
+{
+	pthread_mutex_lock(&fs->alloc_mutex);
+}
+
+/** Unlock the inode and blk allocator. */
+static inline void alloc_unlock(fs_ctx *fs)
+{
+	pthread_mutex_unlock(&fs->alloc_mutex);
+}
+
+/**
+ * Read a superblock counter. The counters are updated under the allocator
+ * lock (s_dir_count under the parent dir lock) but read without it.
+ */
+static inline uint32_t sb_count(const uint32_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/** Add delta to a superblock counter. */
+static inline void sb_count_add(uint32_t *counter, int32_t delta)
+{
+	__atomic_fetch_add(counter, (uint32_t)delta, __ATOMIC_RELAXED);
+}
+
+/** Read the free blk counter, which is 64-bit; see sb_count(). */
+static inline uint64_t sb_blk_count(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/** Add delta to the free blk counter. */
+static inline void sb_blk_count_add(uint64_t *counter, int64_t delta)
+{
+	__atomic_fetch_add(counter, (uint64_t)delta, __ATOMIC_RELAXED);
+}
+
 /**
  * Initialize file system context.
  *
+ * Replays the journal of the image, if it has one, and then remaps the image
+ * privately at the same address (see journal_init()).
+ *
  * @param fs     pointer to the context to initialize.
- * @param image  pointer to the start of the image.
+ * @param image  pointer to the start of the shared mapping of the image.
  * @param size   image size in bytes.
+ * @param fd     image file, open for reading and writing; owned by the
+ *               context on success.
+ * @param opts   command line options.
  * @return       true on success; false on failure (e.g. invalid superblock).
  */
-bool fs_ctx_init(fs_ctx *fs, void *image, size_t size);
+bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, int fd, const a1fs_opts *opts);
+
+/**
+ * Advise the kernel on how the regions of the image mapping are accessed, and
+ * fault in or lock the metadata if asked to (-o hugepage, populate, mlock).
+ *
+ * Must be called from the init() callback of FUSE, which runs once FUSE has
+ * daemonized: the page tables and memory locks of the mapping are not
+ * inherited by the child of fork().
+ *
+ * @param fs  pointer to the file system context.
+ * @return    true on success; false if the metadata could not be locked.
+ */
+bool fs_ctx_advise(fs_ctx *fs);
 
 /**
  * Destroy file system context.
  *
- * Must cleanup all the resources created in fs_ctx_init().
+ * Must cleanup all the resources created in fs_ctx_init(). Commits the
+ * journal and closes image_fd.
  */
 void fs_ctx_destroy(fs_ctx *fs);
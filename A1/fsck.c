@@ -0,0 +1,1187 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - a1fs checker.
+ *
+ * The inode table is checked in three passes, each of which splits it into
+ * chunks that a pool of threads takes one at a time:
+ *
+ *   1. inodes: the mode, the flags and the extents of every inode in use;
+ *      their blks are marked in a new blk bitmap, which finds the blks that
+ *      belong to two inodes.
+ *   2. directories: the blks, the index and the entries of every directory;
+ *      each entry adds a reference to the inode it points at.
+ *   3. references: every inode must be in exactly one directory and have as
+ *      many links as it has entries; orphans left by a crash of a1fs_ll
+ *      are freed.
+ *
+ * The bitmaps and the superblock counters are then compared with the ones
+ * rebuilt by the passes. Every change a repair makes stays within the inode
+ * (or directory blk) the thread checking it owns, so the passes need no
+ * locks; the shared bitmaps and counts are updated atomically.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "bitmap.h"
+#include "journal.h"
+
+/** Command line options. */
+typedef struct fsck_opts
+{
+	/** File system image file path. */
+	const char *img_path;
+	/** Number of threads. */
+	long threads;
+
+	/** Print help and exit. */
+	bool help;
+	/** Repair the problems found. */
+	bool repair;
+
+} fsck_opts;
+
+static const char *help_str = "\
+Usage: %s options image\n\
+\n\
+Check the a1fs file system in the image file, which must not be mounted:\n\
+the extents of the inodes, the directories, the link counts, the bitmaps\n\
+and the superblock counters. A journal left by a crash is replayed first.\n\
+\n\
+Options:\n\
+    -h      print help and exit\n\
+    -y      repair the problems found (default: only report them)\n\
+    -j num  number of threads (default: number of online CPUs)\n\
+\n\
+Exit status: 0 if the file system is clean, 1 if all the problems were\n\
+repaired, 4 if some are left, 8 on an operational error.\n\
+";
+
+/** Exit statuses. */
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_LEFT 4
+#define FSCK_ERROR 8
+
+/** Number of inodes a thread takes at a time. */
+#define FSCK_CHUNK 1024
+/** Most threads. */
+#define FSCK_MAX_THREADS 256
+/** Deepest extent tree accepted; 4 levels of index nodes already hold more extents than i_extents_count counts. */
+#define FSCK_MAX_DEPTH 4
+
+/** Inode states found by the first pass. */
+#define INODE_USED 0x1 // set in the inode bitmap
+#define INODE_BAD 0x2 // corrupt; cleared by a repair
+
+/** File system being checked. */
+typedef struct fsck_ctx
+{
+	/** Start of the shared mapping of the image. */
+	unsigned char *image;
+	/** Image size in bytes. */
+	size_t size;
+	a1fs_superblock *sb;
+	uint32_t block_size;
+	unsigned char *inode_bitmap;
+	unsigned char *block_bitmap;
+	a1fs_inode *inodes;
+	/** First data blk. */
+	unsigned char *data;
+	uint32_t ninodes;
+	a1fs_blk_t ndata;
+	bool compact;
+	bool repair;
+
+	/** Per-inode INODE_* flags. */
+	unsigned char *state;
+	/** Per-inode number of directory entries pointing at it; updated atomically. */
+	uint32_t *refs;
+	/** Per-inode directory holding an entry for it. */
+	a1fs_ino_t *parent;
+	/** Blk bitmap rebuilt from the extents; updated atomically. */
+	unsigned char *used;
+	/** Blks claimed by more than one inode; updated atomically. */
+	unsigned char *dup;
+
+	/** First inode of the next chunk of the running pass; taken atomically. */
+	uint32_t next;
+	/** Problems repaired and left; counted atomically. */
+	uint32_t fixed;
+	uint32_t left;
+
+} fsck_ctx;
+
+/** Check (and maybe repair) the inode at index ino in one pass. */
+typedef void (*pass_fn)(fsck_ctx *ck, a1fs_ino_t ino);
+
+/** Callback of walk_extents(): count blks from the data blk start, which are extent tree nodes if node. */
+typedef void (*extent_fn)(fsck_ctx *ck, a1fs_blk_t start, uint32_t count, bool node, void *arg);
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+static bool parse_args(int argc, char *argv[], fsck_opts *opts)
+{
+	char o;
+	while ((o = getopt(argc, argv, "hyj:")) != -1)
+	{
+		switch (o)
+		{
+		case 'h':
+			opts->help = true;
+			return true; // skip other arguments
+		case 'y':
+			opts->repair = true;
+			break;
+		case 'j':
+			opts->threads = strtol(optarg, NULL, 10);
+			if (opts->threads < 1 || opts->threads > FSCK_MAX_THREADS) {
+				fprintf(stderr, "Invalid number of threads\n");
+				return false;
+			}
+			break;
+
+		case '?':
+			return false;
+		default:
+			assert(false);
+		}
+	}
+
+	if (optind >= argc)
+	{
+		fprintf(stderr, "Missing image path\n");
+		return false;
+	}
+	opts->img_path = argv[optind];
+	return true;
+}
+
+/**
+ * Report a problem, which a repair fixes if fixable.
+ *
+ * @param ck       the file system.
+ * @param fixable  whether the repair fixes it.
+ * @param fmt      printf() format of the message.
+ */
+__attribute__((format(printf, 3, 4)))
+static void problem(fsck_ctx *ck, bool fixable, const char *fmt, ...)
+{
+	char msg[512];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+	bool fixed = fixable && ck->repair;
+	printf("%s%s\n", msg, fixed ? " (fixed)" : "");
+	__atomic_add_fetch(fixed ? &ck->fixed : &ck->left, 1, __ATOMIC_RELAXED);
+}
+
+/** Check if the inode at index ino is in use and intact. */
+static inline bool inode_ok(const fsck_ctx *ck, a1fs_ino_t ino)
+{
+	return ck->state[ino] == INODE_USED;
+}
+
+/** Check that an extent lies within the data blks. */
+static inline bool extent_valid(const fsck_ctx *ck, const a1fs_extent *e)
+{
+	return e->count > 0 && e->start < ck->ndata && e->count <= ck->ndata - e->start;
+}
+
+/** Get the extent tree node (or flat extent blk) in the data blk blk. */
+static inline a1fs_extent_header *ext_node(const fsck_ctx *ck, a1fs_blk_t blk)
+{
+	return (a1fs_extent_header *)(ck->data + (size_t)blk * ck->block_size);
+}
+
+/**
+ * Walk the subtree of an extent tree rooted at the data blk blk, calling fn
+ * (unless NULL) on the node blks and the extents.
+ *
+ * Every node but the rightmost one on each level must be full, and the
+ * logical blks of the entries must follow each other, as the file system
+ * finds extents by their position in the tree.
+ *
+ * @param ck         the file system.
+ * @param blk        the root of the subtree.
+ * @param depth      expected depth of the root.
+ * @param rightmost  whether the subtree is the rightmost one on its level.
+ * @param left       number of extents not seen yet; decremented.
+ * @param lblk       first logical blk of the subtree; advanced past it.
+ * @return           true if the subtree is valid.
+ */
+static bool walk_tree(fsck_ctx *ck, a1fs_blk_t blk, unsigned depth, bool rightmost,
+                      uint32_t *left, uint64_t *lblk, extent_fn fn, void *arg)
+{
+	if (blk >= ck->ndata)
+		return false;
+	a1fs_extent_header *hdr = ext_node(ck, blk);
+	uint32_t max = (depth == 0) ? A1FS_EXTENT_LEAF_MAX(ck->block_size) : A1FS_EXTENT_IDX_MAX(ck->block_size);
+	if (hdr->depth != depth || hdr->count == 0 || hdr->count > max || (!rightmost && hdr->count != max))
+		return false;
+	if (fn)
+		fn(ck, blk, 1, true, arg);
+
+	if (depth == 0) {
+		a1fs_extent_leaf *leaves = (a1fs_extent_leaf *)(hdr + 1);
+		for (uint32_t i = 0; i < hdr->count; i++) {
+			if (*left == 0 || leaves[i].lblk != *lblk || !extent_valid(ck, &leaves[i].extent))
+				return false;
+			if (fn)
+				fn(ck, leaves[i].extent.start, leaves[i].extent.count, false, arg);
+			*lblk += leaves[i].extent.count;
+			*left -= 1;
+		}
+		return true;
+	}
+	a1fs_extent_idx *idxs = (a1fs_extent_idx *)(hdr + 1);
+	for (uint32_t i = 0; i < hdr->count; i++) {
+		// a root grown by a split starts at lblk 0 whatever its first child holds
+		if (i > 0 && idxs[i].lblk != *lblk)
+			return false;
+		if (!walk_tree(ck, idxs[i].child, depth - 1, rightmost && i + 1 == hdr->count, left, lblk, fn, arg))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Walk the extents of the inode at index ino in order, calling fn (unless
+ * NULL) on them and on the blks of its flat extent blk or extent tree.
+ *
+ * @return  true if the extents are valid.
+ */
+static bool walk_extents(fsck_ctx *ck, a1fs_ino_t ino, extent_fn fn, void *arg)
+{
+	a1fs_inode *inode = &ck->inodes[ino];
+	if (inode->i_flags & (A1FS_INLINE_DATA_FL | A1FS_INLINE_DIR_FL))
+		return inode->i_extents_count == 0;
+
+	uint32_t count = inode->i_extents_count;
+	uint64_t lblk = 0;
+	for (uint32_t i = 0; i < count && i < A1FS_INLINE_EXTENTS; i++) {
+		if (!extent_valid(ck, &inode->i_extents[i]))
+			return false;
+		if (fn)
+			fn(ck, inode->i_extents[i].start, inode->i_extents[i].count, false, arg);
+		lblk += inode->i_extents[i].count;
+	}
+	if (count <= A1FS_INLINE_EXTENTS)
+		return (inode->i_flags & A1FS_EXTTREE_FL) == 0;
+
+	uint32_t left = count - A1FS_INLINE_EXTENTS;
+	if (!(inode->i_flags & A1FS_EXTTREE_FL)) {
+		if (left > A1FS_EXTENT_MAX(ck->block_size) || inode->s_extent_block >= ck->ndata)
+			return false;
+		if (fn)
+			fn(ck, inode->s_extent_block, 1, true, arg);
+		a1fs_extent *flat = (a1fs_extent *)ext_node(ck, inode->s_extent_block);
+		for (uint32_t i = 0; i < left; i++) {
+			if (!extent_valid(ck, &flat[i]))
+				return false;
+			if (fn)
+				fn(ck, flat[i].start, flat[i].count, false, arg);
+		}
+		return true;
+	}
+	if (inode->s_extent_block >= ck->ndata)
+		return false;
+	unsigned depth = ext_node(ck, inode->s_extent_block)->depth;
+	if (depth > FSCK_MAX_DEPTH ||
+	    !walk_tree(ck, inode->s_extent_block, depth, true, &left, &lblk, fn, arg))
+		return false;
+	return left == 0;
+}
+
+/** Blks of an inode seen by walk_extents(). */
+typedef struct blk_list
+{
+	/** Data blks, in logical order; only collected for directories. */
+	a1fs_blk_t *blks;
+	uint32_t count;
+	uint32_t capacity;
+	/** Number of data blks (not counting extent tree nodes). */
+	uint64_t ndata;
+	/** Number of blks already claimed by another inode. */
+	uint32_t ndup;
+	/** Some of the blks (nodes included) are also claimed by another inode. */
+	bool shared;
+	/** Out of memory while collecting. */
+	bool nomem;
+
+} blk_list;
+
+/**
+ * Mark count blks from the data blk start in the rebuilt blk bitmap.
+ *
+ * @return  number of them that were already marked, i.e. that also belong
+ *          to another inode; those are marked in the dup bitmap.
+ */
+static uint32_t mark_blks(fsck_ctx *ck, a1fs_blk_t start, uint32_t count)
+{
+	uint32_t ndup = 0;
+	a1fs_blk_t end = start + count;
+	for (a1fs_blk_t i = start; i < end;) {
+		uint32_t bit = i % 8;
+		uint32_t n = (end - i < 8 - bit) ? end - i : 8 - bit;
+		unsigned char mask = ((1u << n) - 1) << bit;
+		unsigned char old = __atomic_fetch_or(&ck->used[i / 8], mask, __ATOMIC_RELAXED);
+		if (old & mask) {
+			__atomic_fetch_or(&ck->dup[i / 8], old & mask, __ATOMIC_RELAXED);
+			ndup += __builtin_popcount(old & mask);
+		}
+		i += n;
+	}
+	return ndup;
+}
+
+/** Unmark count blks from the data blk start, but the ones another inode claims too. */
+static void unmark_blks(fsck_ctx *ck, a1fs_blk_t start, uint32_t count, bool node, void *arg)
+{
+	(void)node;
+	(void)arg;
+	a1fs_blk_t end = start + count;
+	for (a1fs_blk_t i = start; i < end;) {
+		uint32_t bit = i % 8;
+		uint32_t n = (end - i < 8 - bit) ? end - i : 8 - bit;
+		unsigned char mask = ((1u << n) - 1) << bit;
+		mask &= ~__atomic_load_n(&ck->dup[i / 8], __ATOMIC_RELAXED);
+		__atomic_fetch_and(&ck->used[i / 8], (unsigned char)~mask, __ATOMIC_RELAXED);
+		i += n;
+	}
+}
+
+/** extent_fn of the first pass: mark the blks and count the data blks. */
+static void claim_blks(fsck_ctx *ck, a1fs_blk_t start, uint32_t count, bool node, void *arg)
+{
+	blk_list *list = (blk_list *)arg;
+	list->ndup += mark_blks(ck, start, count);
+	if (!node)
+		list->ndata += count;
+}
+
+/** extent_fn of the second pass: collect the data blks and note the shared ones. */
+static void collect_blks(fsck_ctx *ck, a1fs_blk_t start, uint32_t count, bool node, void *arg)
+{
+	blk_list *list = (blk_list *)arg;
+	if (!bitmap_is_clear(ck->dup, start, count))
+		list->shared = true;
+	if (node)
+		return;
+	for (uint32_t i = 0; i < count; i++) {
+		if (list->count == list->capacity) {
+			uint32_t capacity = (list->capacity == 0) ? 16 : list->capacity * 2;
+			a1fs_blk_t *blks = realloc(list->blks, capacity * sizeof(a1fs_blk_t));
+			if (blks == NULL) {
+				list->nomem = true;
+				return;
+			}
+			list->blks = blks;
+			list->capacity = capacity;
+		}
+		list->blks[list->count++] = start + i;
+	}
+}
+
+/** Free the inode at index ino in the repair: its blks and its bitmap bit. */
+static void clear_inode(fsck_ctx *ck, a1fs_ino_t ino)
+{
+	walk_extents(ck, ino, unmark_blks, NULL);
+	ck->state[ino] = 0;
+}
+
+/**
+ * Pass 1: check the fields and the extents of an inode and claim its blks.
+ */
+static void check_inode(fsck_ctx *ck, a1fs_ino_t ino)
+{
+	if (!(ck->inode_bitmap[ino / 8] & (1 << (ino % 8)))) {
+		ck->state[ino] = 0;
+		return;
+	}
+	ck->state[ino] = INODE_USED;
+	a1fs_inode *inode = &ck->inodes[ino];
+	uint32_t flags = inode->i_flags;
+	const char *bad = NULL;
+	if (ino / (ck->block_size / sizeof(a1fs_inode)) >= ck->sb->s_itable_zeroed)
+		bad = "past the initialized inode table";
+	else if (!S_ISDIR(inode->mode) && !S_ISREG(inode->mode))
+		bad = "invalid mode";
+	else if (ino == 0 && !S_ISDIR(inode->mode))
+		bad = "root is not a directory";
+	else if (flags & ~(A1FS_INDEX_FL | A1FS_EXTTREE_FL | A1FS_INLINE_DATA_FL | A1FS_INLINE_DIR_FL))
+		bad = "unknown flags";
+	else if ((flags & A1FS_INDEX_FL) && !S_ISDIR(inode->mode))
+		bad = "indexed regular file";
+	else if ((flags & A1FS_INLINE_DATA_FL) &&
+	         (!S_ISREG(inode->mode) || inode->size == 0 || inode->size > A1FS_INLINE_DATA_MAX))
+		bad = "invalid inline data";
+	else if ((flags & A1FS_INLINE_DIR_FL) && (!S_ISDIR(inode->mode) || !ck->compact || (flags & A1FS_INDEX_FL) ||
+	                                          inode->size == 0 || inode->size > A1FS_INLINE_DATA_MAX))
+		bad = "invalid inline directory";
+	else if (!walk_extents(ck, ino, NULL, NULL))
+		bad = "corrupt extents";
+	if (bad) {
+		// the root cannot be cleared
+		problem(ck, ino != 0, "inode %u: %s%s", ino, bad, (ino != 0) ? ", clearing it" : "");
+		ck->state[ino] |= INODE_BAD;
+		if (ck->repair && ino != 0)
+			ck->state[ino] = 0;
+		return;
+	}
+
+	if (inode->ino_idx != ino) {
+		problem(ck, true, "inode %u: holds index %u", ino, inode->ino_idx);
+		if (ck->repair)
+			inode->ino_idx = ino;
+	}
+	blk_list list = {0};
+	walk_extents(ck, ino, claim_blks, &list);
+	if (list.ndup > 0)
+		problem(ck, false, "inode %u: %u blks also belong to another inode", ino, list.ndup);
+	if (S_ISREG(inode->mode) && !(flags & A1FS_INLINE_DATA_FL) &&
+	    list.ndata != (inode->size + ck->block_size - 1) / ck->block_size)
+		problem(ck, false, "inode %u: size %lu does not match its %lu blks", ino,
+		        (unsigned long)inode->size, (unsigned long)list.ndata);
+	if (S_ISDIR(inode->mode) && !(flags & A1FS_INDEX_FL) && list.ndata > 1)
+		problem(ck, false, "directory %u: %lu blks but no index", ino, (unsigned long)list.ndata);
+}
+
+/** What a directory holds, found by the second pass. */
+typedef struct dir_stats
+{
+	a1fs_ino_t ino;
+	/** Number of valid entries. */
+	uint32_t entries;
+	/** Size of the valid entries in bytes. */
+	uint64_t size;
+	/** Repairs may change the blks of the directory: none is shared. */
+	bool fixable;
+	/** A blk could not be parsed. */
+	bool corrupt;
+
+} dir_stats;
+
+/**
+ * Check one entry of a directory and count the reference it makes.
+ *
+ * @param name  the name; not null-terminated.
+ * @param len   length of the name.
+ * @param ino   the inode it points at.
+ * @param type  the file type of a compact entry; NULL for a fixed one.
+ * @param lo    lowest name hash the blk may hold.
+ * @param hi    highest name hash the blk may hold, plus 1.
+ * @return      true to keep the entry; false if it must be removed.
+ */
+static bool check_entry(fsck_ctx *ck, dir_stats *st, const char *name, size_t len, a1fs_ino_t ino,
+                        uint8_t *type, uint64_t lo, uint64_t hi)
+{
+	if (memchr(name, '/', len) || memchr(name, '\0', len)) {
+		problem(ck, st->fixable, "directory %u: entry with an invalid name, removing it", st->ino);
+		return false;
+	}
+	if (ino == 0 || ino >= ck->ninodes || !inode_ok(ck, ino)) {
+		const char *what = (ino == 0) ? "the root" : (ino >= ck->ninodes) ? "a nonexistent inode"
+		                   : (ck->state[ino] & INODE_BAD) ? "a corrupt inode" : "a free inode";
+		problem(ck, st->fixable, "directory %u: entry '%.*s' points to %s (%u), removing it",
+		        st->ino, (int)len, name, what, ino);
+		return false;
+	}
+	uint32_t hash = dx_hash(name, len);
+	if (hash < lo || hash >= hi)
+		problem(ck, false, "directory %u: entry '%.*s' is in the wrong index leaf", st->ino, (int)len, name);
+	if (type) {
+		uint8_t expected = S_ISDIR(ck->inodes[ino].mode) ? A1FS_FT_DIR : A1FS_FT_REG;
+		if (*type != expected) {
+			problem(ck, st->fixable, "directory %u: entry '%.*s' has file type %u", st->ino,
+			        (int)len, name, *type);
+			if (ck->repair && st->fixable)
+				*type = expected;
+		}
+	}
+	__atomic_add_fetch(&ck->refs[ino], 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&ck->parent[ino], st->ino, __ATOMIC_RELAXED);
+	st->entries++;
+	st->size += ck->compact ? A1FS_DIRENT_LEN(len) : sizeof(a1fs_dentry);
+	return true;
+}
+
+/**
+ * Check a directory blk with fixed dentries. A slot is in use when its name
+ * is not empty; the tag header is rebuilt from the names if it differs.
+ */
+static void check_dentry_blk(fsck_ctx *ck, dir_stats *st, void *blk, uint64_t lo, uint64_t hi)
+{
+	a1fs_dentry *slots = blk;
+	uint32_t nslots = A1FS_DENTRY_SLOTS(ck->block_size);
+	uint32_t first = A1FS_DENTRY_HDR_SLOTS(ck->block_size);
+	uint8_t tags[2 * nslots]; // the tags, then the lengths, as in the header
+	memset(tags, 0, sizeof(tags));
+	memset(tags + nslots, UINT8_MAX, first); // the header itself
+	bool fix = ck->repair && st->fixable;
+	bool dropped = false;
+	for (uint32_t i = first; i < nslots; i++) {
+		if (slots[i].name[0] == '\0')
+			continue;
+		size_t len = strnlen(slots[i].name, A1FS_NAME_MAX);
+		if (len == A1FS_NAME_MAX) {
+			problem(ck, st->fixable, "directory %u: entry with an unterminated name, removing it", st->ino);
+		} else if (check_entry(ck, st, slots[i].name, len, slots[i].ino, NULL, lo, hi)) {
+			tags[i] = (uint8_t)dx_hash(slots[i].name, len);
+			tags[nslots + i] = len;
+			continue;
+		}
+		dropped = true;
+		if (fix)
+			memset(&slots[i], 0, sizeof(a1fs_dentry));
+	}
+	// lookups only compare the names whose tags match
+	if (dropped) {
+		if (fix)
+			memcpy(blk, tags, sizeof(tags));
+	} else if (memcmp(blk, tags, sizeof(tags)) != 0) {
+		problem(ck, st->fixable, "directory %u: stale name tags", st->ino);
+		if (fix)
+			memcpy(blk, tags, sizeof(tags));
+	}
+}
+
+/**
+ * Check that the compact records from offset start of base chain up to
+ * offset end; the directory is marked corrupt if they do not.
+ */
+static bool check_dirent_chain(fsck_ctx *ck, dir_stats *st, unsigned char *base, uint32_t start, uint32_t end)
+{
+	for (uint32_t off = start; off < end;) {
+		a1fs_dirent *d = (a1fs_dirent *)(base + off);
+		if (d->rec_len < sizeof(a1fs_dirent) || d->rec_len % 4 != 0 || d->rec_len > end - off ||
+		    (d->name_len > 0 && A1FS_DIRENT_LEN(d->name_len) > d->rec_len)) {
+			problem(ck, false, "directory %u: corrupt record at offset %u", st->ino, off);
+			st->corrupt = true;
+			return false;
+		}
+		off += d->rec_len;
+	}
+	return true;
+}
+
+/**
+ * Check a directory blk with compact dentries: the records must cover the
+ * blk, and every record in use must have one tag slot pointing at it.
+ */
+static void check_dirent_blk(fsck_ctx *ck, dir_stats *st, void *blk, uint64_t lo, uint64_t hi)
+{
+	unsigned char *base = blk;
+	uint32_t bs = ck->block_size;
+	uint32_t nslots = A1FS_DIRENT_SLOTS(bs);
+	uint32_t start = A1FS_DIRENT_START(bs);
+	bool fix = ck->repair && st->fixable;
+	// the records must chain to the end of the blk before anything is changed
+	if (!check_dirent_chain(ck, st, base, start, bs))
+		return;
+
+	// the tags, lengths and offsets of the slots, as in the header
+	uint16_t tags[start / 2];
+	memset(tags, 0, sizeof(tags));
+	uint8_t *tag = (uint8_t *)tags;
+	uint8_t *len = tag + nslots;
+	uint16_t *offs = tags + nslots;
+	uint32_t nused = 0;
+	uint32_t prev = 0;
+	bool dropped = false;
+	for (uint32_t off = start; off < bs;) {
+		a1fs_dirent *d = (a1fs_dirent *)(base + off);
+		uint32_t rec_len = d->rec_len;
+		if (d->name_len == 0) {
+			prev = off;
+		} else if (check_entry(ck, st, d->name, d->name_len, d->ino, &d->file_type, lo, hi)) {
+			if (nused < nslots) {
+				tag[nused] = (uint8_t)dx_hash(d->name, d->name_len);
+				len[nused] = d->name_len;
+				offs[nused] = off;
+			}
+			nused++;
+			prev = off;
+		} else {
+			dropped = true;
+			// like dirblk_remove(): the previous record absorbs this one
+			if (fix && off == start) {
+				d->ino = 0;
+				d->name_len = 0;
+				d->file_type = A1FS_FT_UNKNOWN;
+			} else if (fix) {
+				((a1fs_dirent *)(base + prev))->rec_len += rec_len;
+			}
+		}
+		off += rec_len;
+	}
+	if (nused > nslots) {
+		problem(ck, false, "directory %u: %u records but only %u tag slots", st->ino, nused, nslots);
+		return;
+	}
+	if (dropped) {
+		if (fix)
+			memcpy(blk, tags, sizeof(tags));
+		return;
+	}
+
+	// the slots may be in any order, so compare the records they point at
+	const uint8_t *hdr_tag = base;
+	const uint8_t *hdr_len = base + nslots;
+	const uint16_t *hdr_off = (const uint16_t *)(base + 2 * nslots);
+	uint32_t nfull = 0;
+	bool stale = false;
+	for (uint32_t i = 0; i < nslots && !stale; i++) {
+		if (hdr_len[i] == 0)
+			continue;
+		nfull++;
+		uint32_t off = hdr_off[i];
+		a1fs_dirent *d = (a1fs_dirent *)(base + off);
+		stale = off < start || off > bs - sizeof(a1fs_dirent) || off % 4 != 0 ||
+		        d->name_len != hdr_len[i] || A1FS_DIRENT_LEN(d->name_len) > bs - off ||
+		        hdr_tag[i] != (uint8_t)dx_hash(d->name, d->name_len);
+	}
+	if (!stale) {
+		// every slot matches a record; each record in use must have its own slot
+		for (uint32_t k = 0; k < nused && !stale; k++) {
+			uint32_t found = 0;
+			for (uint32_t i = 0; i < nslots; i++)
+				found += hdr_len[i] != 0 && hdr_off[i] == offs[k];
+			stale = found != 1;
+		}
+		stale = stale || nfull != nused;
+	}
+	if (stale) {
+		problem(ck, st->fixable, "directory %u: stale name tags", st->ino);
+		if (fix)
+			memcpy(blk, tags, sizeof(tags));
+	}
+}
+
+/**
+ * Check the records of an inline directory, which fill i_data like those of
+ * a compact blk, without the tag header.
+ */
+static void check_inline_dir(fsck_ctx *ck, dir_stats *st, a1fs_inode *dir)
+{
+	unsigned char *base = dir->i_data;
+	bool fix = ck->repair && st->fixable;
+	if (!check_dirent_chain(ck, st, base, 0, A1FS_INLINE_DATA_MAX))
+		return;
+	uint32_t prev = 0;
+	for (uint32_t off = 0; off < A1FS_INLINE_DATA_MAX;) {
+		a1fs_dirent *d = (a1fs_dirent *)(base + off);
+		uint32_t rec_len = d->rec_len;
+		if (d->name_len == 0 ||
+		    check_entry(ck, st, d->name, d->name_len, d->ino, &d->file_type, 0, (uint64_t)UINT32_MAX + 1)) {
+			prev = off;
+		} else if (fix && off == 0) {
+			d->ino = 0;
+			d->name_len = 0;
+			d->file_type = A1FS_FT_UNKNOWN;
+		} else if (fix) {
+			((a1fs_dirent *)(base + prev))->rec_len += rec_len;
+		}
+		off += rec_len;
+	}
+}
+
+/** Check a leaf (or the single blk) of a directory. */
+static void check_dir_blk(fsck_ctx *ck, dir_stats *st, a1fs_blk_t blk, uint64_t lo, uint64_t hi)
+{
+	void *ptr = ck->data + (size_t)blk * ck->block_size;
+	if (ck->compact)
+		check_dirent_blk(ck, st, ptr, lo, hi);
+	else
+		check_dentry_blk(ck, st, ptr, lo, hi);
+}
+
+/**
+ * Check the index blk at logical blk lblk of an indexed directory and
+ * everything under it.
+ *
+ * @param list     the data blks of the directory.
+ * @param seen     per logical blk, set once an index entry points at it.
+ * @param lblk     logical blk of the index blk.
+ * @param depth    number of index levels between the blk and the leaves.
+ * @param lo       lowest hash the blk covers.
+ * @param hi       highest hash the blk covers, plus 1.
+ * @return         false if the index is corrupt.
+ */
+static bool check_dx_node(fsck_ctx *ck, dir_stats *st, const blk_list *list, unsigned char *seen,
+                          uint32_t lblk, unsigned depth, uint64_t lo, uint64_t hi)
+{
+	a1fs_dx_header *hdr = (a1fs_dx_header *)(ck->data + (size_t)list->blks[lblk] * ck->block_size);
+	a1fs_dx_entry *entries = (a1fs_dx_entry *)(hdr + 1);
+	if (hdr->limit != A1FS_DX_LIMIT(ck->block_size) || hdr->count == 0 || hdr->count > hdr->limit)
+		return false;
+	for (uint32_t i = 0; i < hdr->count; i++) {
+		// entries[0] covers everything below entries[1].hash
+		uint64_t child_lo = (i == 0) ? lo : entries[i].hash;
+		uint64_t child_hi = (i + 1 < hdr->count) ? entries[i + 1].hash : hi;
+		uint32_t child = entries[i].block;
+		if (child_lo < lo || child_hi > hi || child_lo > child_hi || child == 0 || child >= list->count ||
+		    seen[child])
+			return false;
+		seen[child] = 1;
+		if (depth > 0) {
+			if (!check_dx_node(ck, st, list, seen, child, depth - 1, child_lo, child_hi))
+				return false;
+		} else {
+			check_dir_blk(ck, st, list->blks[child], child_lo, child_hi);
+		}
+	}
+	return true;
+}
+
+/**
+ * Pass 2: check the blks and entries of a directory, then its size and
+ * link count against what it holds.
+ */
+static void check_dir(fsck_ctx *ck, a1fs_ino_t ino)
+{
+	a1fs_inode *dir = &ck->inodes[ino];
+	if (!inode_ok(ck, ino) || !S_ISDIR(dir->mode))
+		return;
+	blk_list list = {0};
+	walk_extents(ck, ino, collect_blks, &list);
+	if (list.nomem) {
+		problem(ck, false, "directory %u: out of memory", ino);
+		free(list.blks);
+		return;
+	}
+	dir_stats st = {ino, 0, 0, !list.shared, false};
+	if (dir->i_flags & A1FS_INLINE_DIR_FL) {
+		check_inline_dir(ck, &st, dir);
+	} else if (!(dir->i_flags & A1FS_INDEX_FL)) {
+		if (list.count > 0)
+			check_dir_blk(ck, &st, list.blks[0], 0, (uint64_t)UINT32_MAX + 1);
+	} else {
+		unsigned char *seen = calloc(list.count, 1);
+		if (seen == NULL) {
+			problem(ck, false, "directory %u: out of memory", ino);
+			free(list.blks);
+			return;
+		}
+		unsigned levels = (list.count > 0) ? ((a1fs_dx_header *)(ck->data + (size_t)list.blks[0] * ck->block_size))->levels : 0;
+		if (list.count < 2 || levels > A1FS_DX_MAX_LEVELS ||
+		    !check_dx_node(ck, &st, &list, seen, 0, levels, 0, (uint64_t)UINT32_MAX + 1)) {
+			problem(ck, false, "directory %u: corrupt index", ino);
+			st.corrupt = true;
+		}
+		free(seen);
+	}
+	// the counts mean nothing once a blk could not be read
+	bool fix = ck->repair && st.fixable && !st.corrupt;
+	if (!st.corrupt && st.entries == 0 && list.count > 0) {
+		// a1fs frees the blks of a directory once it is empty
+		problem(ck, st.fixable, "directory %u: empty, but holds %u blks", ino, list.count);
+		if (fix) {
+			walk_extents(ck, ino, unmark_blks, NULL);
+			dir->i_extents_count = 0;
+			dir->s_extent_block = 0;
+			dir->i_flags &= ~(A1FS_INDEX_FL | A1FS_EXTTREE_FL);
+		}
+	}
+	if (!st.corrupt && st.entries == 0 && (dir->i_flags & A1FS_INLINE_DIR_FL)) {
+		problem(ck, st.fixable, "directory %u: empty, but stored inline", ino);
+		if (fix) {
+			dir->i_flags &= ~A1FS_INLINE_DIR_FL;
+			memset(dir->i_data, 0, sizeof(dir->i_data));
+		}
+	}
+	if (!st.corrupt && dir->size != st.size) {
+		problem(ck, st.fixable, "directory %u: size %lu, should be %lu", ino, (unsigned long)dir->size,
+		        (unsigned long)st.size);
+		if (fix)
+			dir->size = st.size;
+	}
+	// the entry in its parent, "." and one per entry (see update_dir_stats())
+	if (!st.corrupt && dir->links != st.entries + 2) {
+		problem(ck, true, "directory %u: %u links, should be %u", ino, dir->links, st.entries + 2);
+		if (ck->repair)
+			dir->links = st.entries + 2;
+	}
+	free(list.blks);
+}
+
+/**
+ * Pass 3: check that an inode is referenced by exactly one directory entry,
+ * and free the orphans a1fs_ll leaves behind when it crashes while the
+ * kernel still holds unlinked files (it frees them when it is unmounted).
+ */
+static void check_refs(fsck_ctx *ck, a1fs_ino_t ino)
+{
+	a1fs_inode *inode = &ck->inodes[ino];
+	if (!inode_ok(ck, ino) || ino == 0)
+		return;
+	uint32_t refs = ck->refs[ino];
+	if (refs == 0) {
+		if (inode->links == 0) {
+			problem(ck, true, "inode %u: orphan with no links, freeing it", ino);
+			if (ck->repair)
+				clear_inode(ck, ino);
+		} else {
+			problem(ck, false, "inode %u: in no directory", ino);
+		}
+		return;
+	}
+	if (S_ISDIR(inode->mode)) {
+		if (refs > 1)
+			problem(ck, false, "directory %u: in %u directories", ino, refs);
+	} else if (inode->links != refs) {
+		problem(ck, true, "inode %u: %u links, should be %u", ino, inode->links, refs);
+		if (ck->repair)
+			inode->links = refs;
+	}
+}
+
+/** Thread of a pass: take chunks of inodes until there are none left. */
+typedef struct pass_arg
+{
+	fsck_ctx *ck;
+	pass_fn fn;
+
+} pass_arg;
+
+static void *pass_thread(void *arg)
+{
+	fsck_ctx *ck = ((pass_arg *)arg)->ck;
+	pass_fn fn = ((pass_arg *)arg)->fn;
+	for (;;) {
+		uint32_t first = __atomic_fetch_add(&ck->next, FSCK_CHUNK, __ATOMIC_RELAXED);
+		if (first >= ck->ninodes)
+			return NULL;
+		uint32_t end = (ck->ninodes - first < FSCK_CHUNK) ? ck->ninodes : first + FSCK_CHUNK;
+		for (a1fs_ino_t ino = first; ino < end; ino++)
+			fn(ck, ino);
+	}
+}
+
+/**
+ * Run fn on every inode, split among nthreads threads.
+ *
+ * @return  true on success; false if no thread could be created.
+ */
+static bool run_pass(fsck_ctx *ck, pass_fn fn, long nthreads)
+{
+	pthread_t threads[FSCK_MAX_THREADS];
+	pass_arg arg = {ck, fn};
+	ck->next = 0;
+	long started = 0;
+	for (; started < nthreads; started++) {
+		if (pthread_create(&threads[started], NULL, pass_thread, &arg) != 0)
+			break;
+	}
+	if (started == 0) {
+		perror("pthread_create");
+		return false;
+	}
+	for (long i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	return true;
+}
+
+/**
+ * Find the directories that the root does not reach: their parents form a
+ * loop of their own.
+ */
+static void check_reachable(fsck_ctx *ck)
+{
+	// 0: unknown, 1: reachable, 2: on the path being followed, 3: unreachable
+	unsigned char *reach = calloc(ck->ninodes, 1);
+	if (reach == NULL) {
+		problem(ck, false, "out of memory checking directory loops");
+		return;
+	}
+	reach[0] = 1;
+	for (a1fs_ino_t ino = 1; ino < ck->ninodes; ino++) {
+		if (!inode_ok(ck, ino) || !S_ISDIR(ck->inodes[ino].mode) || ck->refs[ino] == 0 || reach[ino])
+			continue;
+		// follow the parents up to the root, a dir in no directory or a loop
+		a1fs_ino_t x = ino;
+		while (reach[x] == 0 && ck->refs[x] > 0) {
+			reach[x] = 2;
+			x = ck->parent[x];
+		}
+		unsigned char result = (reach[x] == 1) ? 1 : 3;
+		for (a1fs_ino_t y = ino; reach[y] == 2; y = ck->parent[y]) {
+			reach[y] = result;
+			if (result == 3)
+				problem(ck, false, "directory %u: not reachable from the root", y);
+		}
+	}
+	free(reach);
+}
+
+/**
+ * Compare the on-disk bitmaps and counters with the rebuilt ones.
+ */
+static void check_totals(fsck_ctx *ck)
+{
+	a1fs_superblock *sb = ck->sb;
+	uint32_t used_inodes = 0;
+	uint32_t dirs = 0;
+	uint32_t inode_diffs = 0;
+	for (a1fs_ino_t ino = 0; ino < ck->ninodes; ino++) {
+		bool used = ck->state[ino] != 0;
+		used_inodes += used;
+		dirs += used && S_ISDIR(ck->inodes[ino].mode);
+		if (used != ((ck->inode_bitmap[ino / 8] >> (ino % 8)) & 1)) {
+			inode_diffs++;
+			if (ck->repair && used)
+				bitmap_set(ck->inode_bitmap, ino, 1);
+			else if (ck->repair)
+				bitmap_clear(ck->inode_bitmap, ino, 1);
+		}
+	}
+	if (inode_diffs > 0)
+		problem(ck, true, "inode bitmap: %u inodes marked wrongly", inode_diffs);
+
+	uint64_t leaked = 0;
+	uint64_t unmarked = 0;
+	for (a1fs_blk_t i = 0; i < ck->ndata / 8; i++) {
+		unsigned char diff = ck->used[i] ^ ck->block_bitmap[i];
+		leaked += __builtin_popcount(diff & ck->block_bitmap[i]);
+		unmarked += __builtin_popcount(diff & ck->used[i]);
+	}
+	for (a1fs_blk_t blk = ck->ndata / 8 * 8; blk < ck->ndata; blk++) {
+		bool used = (ck->used[blk / 8] >> (blk % 8)) & 1;
+		bool marked = (ck->block_bitmap[blk / 8] >> (blk % 8)) & 1;
+		leaked += marked && !used;
+		unmarked += used && !marked;
+	}
+	if (leaked > 0)
+		problem(ck, true, "blk bitmap: %lu blks in use by no inode", (unsigned long)leaked);
+	if (unmarked > 0)
+		problem(ck, true, "blk bitmap: %lu blks in use but marked free", (unsigned long)unmarked);
+	if ((leaked > 0 || unmarked > 0) && ck->repair) {
+		bitmap_clear(ck->block_bitmap, 0, ck->ndata);
+		for (a1fs_blk_t blk = bitmap_next_one(ck->used, ck->ndata, 0); blk < ck->ndata;) {
+			a1fs_blk_t end = bitmap_next_zero(ck->used, ck->ndata, blk);
+			bitmap_set(ck->block_bitmap, blk, end - blk);
+			blk = bitmap_next_one(ck->used, ck->ndata, end);
+		}
+	}
+
+	uint64_t free_blocks = ck->ndata - bitmap_weight(ck->used, ck->ndata);
+	if (sb->s_free_blocks_count != free_blocks) {
+		problem(ck, true, "superblock: %lu free blks, should be %lu", (unsigned long)sb->s_free_blocks_count,
+		        (unsigned long)free_blocks);
+		if (ck->repair)
+			sb->s_free_blocks_count = free_blocks;
+	}
+	if (sb->s_free_inodes_count != ck->ninodes - used_inodes) {
+		problem(ck, true, "superblock: %u free inodes, should be %u", sb->s_free_inodes_count,
+		        ck->ninodes - used_inodes);
+		if (ck->repair)
+			sb->s_free_inodes_count = ck->ninodes - used_inodes;
+	}
+	if (sb->s_dir_count != dirs) {
+		problem(ck, true, "superblock: %u directories, should be %u", sb->s_dir_count, dirs);
+		if (ck->repair)
+			sb->s_dir_count = dirs;
+	}
+	printf("%u/%u inodes, %lu/%lu blks\n", used_inodes, ck->ninodes, (unsigned long)(ck->ndata - free_blocks),
+	       (unsigned long)ck->ndata);
+}
+
+/**
+ * Check the superblock and find the parts of the image.
+ *
+ * @return  true if the layout is sane; false if the image cannot be checked.
+ */
+static bool check_super(fsck_ctx *ck)
+{
+	a1fs_superblock *sb = (a1fs_superblock *)(ck->image + A1FS_SB_OFFSET);
+	ck->sb = sb;
+	size_t nblks = ck->size / ck->block_size;
+	a1fs_blk_t tables_end = (sb->s_features & A1FS_FEATURE_JOURNAL) ? sb->s_journal_block : sb->s_first_data_block;
+	if (sb->size != ck->size || sb->s_blocks_count != nblks - 1 || sb->s_inodes_count == 0 ||
+	    sb->s_inode_bitmap != 2 || sb->s_block_bitmap <= sb->s_inode_bitmap ||
+	    sb->s_first_inode_block <= sb->s_block_bitmap || tables_end <= sb->s_first_inode_block ||
+	    sb->s_first_data_block < tables_end || sb->s_first_data_block > sb->s_blocks_count) {
+		fprintf(stderr, "Corrupt superblock\n");
+		return false;
+	}
+	ck->ninodes = sb->s_inodes_count;
+	ck->ndata = sb->s_blocks_count - sb->s_first_data_block + 1;
+	if ((size_t)(sb->s_block_bitmap - sb->s_inode_bitmap) * ck->block_size * 8 < ck->ninodes ||
+	    (size_t)(sb->s_first_inode_block - sb->s_block_bitmap) * ck->block_size * 8 < ck->ndata ||
+	    (size_t)(tables_end - sb->s_first_inode_block) * ck->block_size < (size_t)ck->ninodes * sizeof(a1fs_inode)) {
+		fprintf(stderr, "Corrupt superblock: the bitmaps or the inode table are too small\n");
+		return false;
+	}
+	if (sb->s_itable_zeroed == 0 || sb->s_itable_zeroed > tables_end - sb->s_first_inode_block) {
+		fprintf(stderr, "Corrupt superblock: %u initialized inode table blks\n", sb->s_itable_zeroed);
+		return false;
+	}
+	ck->inode_bitmap = ck->image + (size_t)sb->s_inode_bitmap * ck->block_size;
+	ck->block_bitmap = ck->image + (size_t)sb->s_block_bitmap * ck->block_size;
+	ck->inodes = (a1fs_inode *)(ck->image + (size_t)sb->s_first_inode_block * ck->block_size);
+	ck->data = ck->image + (size_t)sb->s_first_data_block * ck->block_size;
+	ck->compact = (sb->s_features & A1FS_FEATURE_COMPACT_DIRENT) != 0;
+	// the passes read all of it, in no particular order, but for the inode
+	// table blks never initialized
+	madvise(ck->image, (size_t)(sb->s_first_inode_block + sb->s_itable_zeroed) * ck->block_size, MADV_WILLNEED);
+	return true;
+}
+
+/**
+ * Check (and repair) the file system in the image.
+ *
+ * @return  exit status.
+ */
+static int fsck(fsck_ctx *ck, long nthreads)
+{
+	if (!check_super(ck))
+		return FSCK_ERROR;
+	ck->state = calloc(ck->ninodes, 1);
+	ck->refs = calloc(ck->ninodes, sizeof(uint32_t));
+	ck->parent = calloc(ck->ninodes, sizeof(a1fs_ino_t));
+	ck->used = calloc(ck->ndata / 8 + 1, 1);
+	ck->dup = calloc(ck->ndata / 8 + 1, 1);
+	int ret = FSCK_ERROR;
+	if (!ck->state || !ck->refs || !ck->parent || !ck->used || !ck->dup) {
+		fprintf(stderr, "Out of memory\n");
+		goto end;
+	}
+
+	// each pass needs the results of the one before it
+	if (!run_pass(ck, check_inode, nthreads))
+		goto end;
+	if (!(ck->state[0] & INODE_USED))
+		problem(ck, false, "root: not in use");
+	if (!run_pass(ck, check_dir, nthreads) || !run_pass(ck, check_refs, nthreads))
+		goto end;
+	check_reachable(ck);
+	check_totals(ck);
+
+	if (ck->repair && ck->fixed > 0 && msync(ck->image, ck->size, MS_SYNC) != 0) {
+		perror("msync");
+		goto end;
+	}
+	ret = (ck->left > 0) ? FSCK_LEFT : (ck->fixed > 0) ? FSCK_FIXED : FSCK_OK;
+	if (ck->fixed > 0 || ck->left > 0)
+		printf("%u problems fixed, %u left\n", ck->fixed, ck->left);
+end:
+	free(ck->state);
+	free(ck->refs);
+	free(ck->parent);
+	free(ck->used);
+	free(ck->dup);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	fsck_opts opts = {0}; // defaults are all 0
+	if (!parse_args(argc, argv, &opts))
+	{
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return FSCK_ERROR;
+	}
+	if (opts.help)
+	{
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return FSCK_OK;
+	}
+	if (opts.threads == 0) {
+		opts.threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (opts.threads < 1)
+			opts.threads = 1;
+		if (opts.threads > FSCK_MAX_THREADS)
+			opts.threads = FSCK_MAX_THREADS;
+	}
+
+	// Only a repair opens the image for writing
+	int fd = open(opts.img_path, opts.repair ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		perror(opts.img_path);
+		return FSCK_ERROR;
+	}
+	struct stat s;
+	if (fstat(fd, &s) < 0) {
+		perror("fstat");
+		close(fd);
+		return FSCK_ERROR;
+	}
+	if (s.st_size < 2 * A1FS_MIN_BLOCK_SIZE || s.st_size % A1FS_MIN_BLOCK_SIZE != 0) {
+		fprintf(stderr, "Image file is too small or its size is not a multiple of block size\n");
+		close(fd);
+		return FSCK_ERROR;
+	}
+	fsck_ctx ck = {0};
+	ck.size = s.st_size;
+	ck.repair = opts.repair;
+	ck.image = mmap(NULL, ck.size, opts.repair ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (ck.image == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return FSCK_ERROR;
+	}
+
+	int ret = FSCK_ERROR;
+	const a1fs_superblock *sb = (const a1fs_superblock *)(ck.image + A1FS_SB_OFFSET);
+	if (sb->magic != A1FS_MAGIC) {
+		fprintf(stderr, "The image does not hold an a1fs file system\n");
+		goto end;
+	}
+	// The journal and every offset depend on both
+	if (sb->s_revision != A1FS_REVISION) {
+		fprintf(stderr, "Unsupported a1fs revision %u (expected %u)\n", sb->s_revision, A1FS_REVISION);
+		goto end;
+	}
+	if (!A1FS_VALID_BLOCK_SIZE(sb->s_block_size) || ck.size % sb->s_block_size != 0) {
+		fprintf(stderr, "Invalid block size %u\n", sb->s_block_size);
+		goto end;
+	}
+	ck.block_size = sb->s_block_size;
+	// The metadata on disk is stale until the log is replayed
+	int pending = journal_recover(ck.image, ck.size, fd, !opts.repair);
+	if (pending < 0) {
+		fprintf(stderr, "Cannot read the journal\n");
+		goto end;
+	}
+	if (pending > 0 && !opts.repair) {
+		fprintf(stderr, "The journal holds %d transactions to replay; mount the image or run with -y\n",
+		        pending);
+		ret = FSCK_LEFT;
+		goto end;
+	}
+	ret = fsck(&ck, opts.threads);
+	if (ret == FSCK_OK)
+		printf("%s: clean\n", opts.img_path);
+end:
+	munmap(ck.image, ck.size);
+	close(fd);
+	return ret;
+}
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 // Using 2.9.x FUSE API
 #define FUSE_USE_VERSION 29
@@ -14,17 +15,39 @@
 #include "options.h"
 #include "map.h"
 #include "util.h"
+#include "helpers.h"
+#include "htree.h"
+#include "bitmap.h"
+#include "dirblk.h"
+#include "extent.h"
 // Helper functions
 
+/**
+ * get the pointer to the single blk of the non-empty linear (not indexed) dir at inode index dir_i in file system fs
+ * an inline dir has no blk
+ *
+ * @param bs        block size of fs
+ * @param dir_i     inode index of the dir
+ * @param fs        a ptr to the file system
+ * @return          pointer to the blk
+ */
+static inline void *linear_dir_blk(uint32_t bs, a1fs_ino_t dir_i, fs_ctx *fs)
+{
+    return fs->data_blk + (size_t)get_extent(fs, dir_i, 0)->start * bs;
+}
+
 /**
  * a helper function for path_lookup that finds the inode from dir in file system fs and stores the result in ino_i 
  *
+ * @param bs        block size of fs, a constant in each variant (see BLK_OPS)
  * @param ino_i     ptr to the inode index in the inode table
- * @param file 	    filename
+ * @param file 	    filename (need not be null-terminated)
+ * @param len       length of the filename
  * @param fs        a ptr to the file system
  * @return          0 on success; else error
  */
-int find_inode_from_dir(a1fs_ino_t *ino_i, char *file, fs_ctx *fs)
+static inline __attribute__((always_inline)) int find_inode_from_dir_bs(const uint32_t bs, a1fs_ino_t *ino_i,
+                                                                        const char *file, size_t len, fs_ctx *fs)
 {
     a1fs_inode *inode = &(fs->root_ino[*ino_i]);
     if (!(inode->mode & S_IFDIR))
@@ -35,33 +58,128 @@ int find_inode_from_dir(a1fs_ino_t *ino_i, char *file, fs_ctx *fs)
     { //dir is empty, i.e. no extents
         return -ENOENT;
     }
-    a1fs_blk_t extent_i = inode->s_extent_block;
-    int num_dentry = inode->size / sizeof(a1fs_dentry);
-    a1fs_extent *s_extent = (a1fs_extent *)(fs->data_blk + extent_i * A1FS_BLOCK_SIZE);
-    for (uint32_t i = 0; i < inode->i_extents_count; i++)
-    { // go through each extent
-        a1fs_blk_t extent_start = s_extent[i].start;
-        int blk_count = s_extent[i].count;
-
-        for (int j = 0; j < blk_count; j++)
-        { //go through each block
-            a1fs_dentry *start_dentry = (a1fs_dentry *)(fs->data_blk + (extent_start + j) * A1FS_BLOCK_SIZE);
-            for (int dentry_i = 0; dentry_i < A1FS_BLOCK_SIZE / 256; dentry_i++)
-            { //go through each dentry
-                if (num_dentry == 0)
-                { //check if gone through all dentries
-                    return -ENOENT;
-                }
-                if (!strcmp(start_dentry[dentry_i].name, file))
-                { //if found this file
-                    *ino_i = start_dentry[dentry_i].ino;
-                    return 0;
-                }
-                num_dentry -= 1;
-            }
-        }
+    if (inode->i_flags & A1FS_INDEX_FL)
+    { //large dir, go through the hashed index
+        return dx_lookup(fs, *ino_i, file, len, ino_i);
+    }
+    a1fs_ino_t *found;
+    if (inode->i_flags & A1FS_INLINE_DIR_FL)
+    { //small dir, its dentries are in the inode
+        found = dirblk_inline_find(inode->i_data, file, len);
+    }
+    else
+    {
+        found = dirblk_find(fs, linear_dir_blk(bs, *ino_i, fs), file, len);
+    }
+    if (found == NULL)
+    {
+        return -ENOENT;
+    }
+    *ino_i = *found;
+    return 0;
+}
+
+/**
+ * look up the file/dir with name file in the dir at inode index *ino_i, going through the dentry cache of fs
+ * on success, stores the inode index of the file/dir into ino_i
+ *
+ * @param ino_i     ptr to the inode index of the dir
+ * @param file 	    filename (need not be null-terminated)
+ * @param len       length of the filename
+ * @param fs        a ptr to the file system
+ * @return          0 on success; else error
+ */
+int lookup_dentry(a1fs_ino_t *ino_i, const char *file, size_t len, fs_ctx *fs)
+{
+    if (!S_ISDIR(fs->root_ino[*ino_i].mode))
+    { //not a dir
+        return -ENOTDIR;
+    }
+    if (len >= A1FS_NAME_MAX)
+    {
+        return -ENAMETOOLONG;
+    }
+    a1fs_ino_t child_i;
+    switch (dcache_lookup(&fs->dcache, *ino_i, file, len, &child_i))
+    {
+    case DCACHE_HIT:
+        *ino_i = child_i;
+        return 0;
+    case DCACHE_NEGATIVE:
+        return -ENOENT;
+    case DCACHE_MISS:
+        break;
+    }
+    child_i = *ino_i;
+    int res = find_inode_from_dir(&child_i, file, len, fs);
+    if (res == 0)
+    {
+        dcache_add(&fs->dcache, *ino_i, file, len, child_i);
+        *ino_i = child_i;
+    }
+    else if (res == -ENOENT)
+    {
+        dcache_add_negative(&fs->dcache, *ino_i, file, len);
+    }
+    return res;
+}
+
+/**
+ * look up one component of a path: lookup_dentry() with the dir at inode index *ino_i read-locked
+ *
+ * @param ino_i     ptr to the inode index of the dir
+ * @param file 	    filename (need not be null-terminated)
+ * @param len       length of the filename
+ * @param fs        a ptr to the file system
+ * @return          0 on success; else error
+ */
+static int walk_dentry(a1fs_ino_t *ino_i, const char *file, size_t len, fs_ctx *fs)
+{
+    a1fs_ino_t dir_i = *ino_i;
+    inode_rdlock(fs, dir_i);
+    int res = lookup_dentry(ino_i, file, len, fs);
+    inode_unlock(fs, dir_i);
+    return res;
+}
+
+/**
+ * start iterating over the components of the path path
+ *
+ * @param it        the iterator
+ * @param path      the path
+ */
+void path_iter_init(path_iter *it, const char *path)
+{
+    it->next = path;
+    it->name = NULL;
+    it->len = 0;
+}
+
+/**
+ * move the iterator it to the next component of its path
+ *
+ * @param it        the iterator
+ * @return          true if it->name and it->len now describe the next component; false at the end of the path
+ */
+bool path_iter_next(path_iter *it)
+{
+    const char *p = it->next;
+    while (*p == '/')
+    {
+        p++;
+    }
+    if (*p == '\0')
+    {
+        return false;
+    }
+    it->name = p;
+    while (*p != '/' && *p != '\0')
+    {
+        p++;
     }
-    return -ENOENT;
+    it->len = p - it->name;
+    it->next = p;
+    return true;
 }
 
 /**
@@ -70,24 +188,18 @@ int find_inode_from_dir(a1fs_ino_t *ino_i, char *file, fs_ctx *fs)
  * @param path 	    the path to the file
  * @param fs        a pointer to the file system
  * @param inode_i   stores the inode index of the file
- * @return          0 on success;
+ * @return          0 on success; -errno on error
  */
 int path_lookup(const char *path, fs_ctx *fs, a1fs_ino_t *inode_i)
 {
     if (path[0] != '/')
-        return -1;
+        return -ENOENT;
     a1fs_ino_t ino_i = 0; //root inode at inode table index 0
-    if (!strcmp(path, "/"))
-    {
-
-        *inode_i = ino_i;
-        return 0;
-    }
-    char *string = strdup(&path[1]);
-    char *file;
-    while ((file = strsep(&string, "/")) != NULL)
+    path_iter it;
+    path_iter_init(&it, path);
+    while (path_iter_next(&it))
     {
-        int res = find_inode_from_dir(&ino_i, file, fs);
+        int res = walk_dentry(&ino_i, it.name, it.len, fs);
         if (res != 0)
         { //inode index correspond to this file not found
             return res;
@@ -98,38 +210,70 @@ int path_lookup(const char *path, fs_ctx *fs, a1fs_ino_t *inode_i)
 }
 
 /**
- * get the name path of the parent dir and child file/dir name from the path path
+ * look up the parent dir of the file/dir at path path in file system fs in a single walk
+ * the last component itself is not looked up
  *
- * @param parent 	stores path of the parent dir
- * @param child     stores name of the child file/dir
- * @param path      path given
- * @return          0 on success; -1 otherwise
+ * @param path 	    the path to the file/dir
+ * @param fs        a pointer to the file system
+ * @param parent_i  stores the inode index of the parent dir
+ * @param name      stores the pointer to the last component of path (not null-terminated)
+ * @param len       stores the length of the last component
+ * @return          0 on success; -errno on error
  */
-int get_parent_child_str_from_path(char **parent, char **child, const char *path)
+int path_lookup_parent(const char *path, fs_ctx *fs, a1fs_ino_t *parent_i, const char **name, size_t *len)
 {
-    char *ret = strrchr(path, '/') + 1;
-    char *filename;
-    char *p_path;
-    if ((filename = malloc(strlen(ret) + 1)) == NULL)
-    {
-        return -1;
+    if (path[0] != '/')
+        return -ENOENT;
+    a1fs_ino_t ino_i = 0; //root inode at inode table index 0
+    path_iter it;
+    path_iter_init(&it, path);
+    if (!path_iter_next(&it))
+    { //the root dir has no parent
+        return -EINVAL;
     }
-    strncpy(filename, ret, strlen(ret));
-    filename[strlen(ret)] = '\0';
-    int parent_size = strrchr(path, '/') - path;
-    if (parent_size == 0)
+    for (;;)
     {
-        parent_size += 1;
+        path_iter last = it;
+        if (!path_iter_next(&it))
+        {
+            if (!S_ISDIR(fs->root_ino[ino_i].mode))
+            {
+                return -ENOTDIR;
+            }
+            if (last.len >= A1FS_NAME_MAX)
+            {
+                return -ENAMETOOLONG;
+            }
+            *parent_i = ino_i;
+            *name = last.name;
+            *len = last.len;
+            return 0;
+        }
+        int res = walk_dentry(&ino_i, last.name, last.len, fs);
+        if (res != 0)
+        {
+            return res;
+        }
     }
-    if ((p_path = malloc(parent_size + 1)) == NULL)
+}
+
+/**
+ * zero the inode table blocks up to the one holding inode ino that mkfs left
+ * uninitialized; called under the allocator mutex
+ *
+ * @param fs        a pointer to the file system
+ * @param ino       index of the inode about to be allocated
+ */
+static void init_inode_table(fs_ctx *fs, a1fs_ino_t ino)
+{
+    uint32_t blk = ino / (fs->block_size / sizeof(a1fs_inode));
+    while (fs->sb->s_itable_zeroed <= blk)
     {
-        return -1;
+        unsigned char *table = (unsigned char *)fs->image + (size_t)(fs->sb->s_first_inode_block + fs->sb->s_itable_zeroed) * fs->block_size;
+        journal_dirty(&fs->journal, table, fs->block_size);
+        memset(table, 0, fs->block_size);
+        fs->sb->s_itable_zeroed++;
     }
-    strncpy(p_path, path, parent_size);
-    p_path[parent_size] = '\0';
-    *parent = p_path;
-    *child = filename;
-    return 0;
 }
 
 /**
@@ -139,23 +283,24 @@ int get_parent_child_str_from_path(char **parent, char **child, const char *path
  * @return          index of the empty inode
  */
 a1fs_ino_t search_inode_bitmap(fs_ctx *fs)
-
 {
-    unsigned char *bitmap = fs->inode_bitmap;
-
-    for (uint32_t byte = 0; byte < fs->sb->s_inodes_count / 8; byte++)
+    uint32_t ninodes = fs->sb->s_inodes_count;
+    a1fs_ino_t inode_i = bitmap_next_zero(fs->inode_bitmap, ninodes, fs->inode_cursor);
+    if (inode_i == ninodes)
+    { //wrap around to the inodes before the cursor
+        inode_i = bitmap_next_zero(fs->inode_bitmap, ninodes, 0);
+    }
+    if (inode_i == ninodes)
     {
-        for (int bit = 0; bit < 8; bit++)
-        {
-            if (!(bitmap[byte] & (1 << bit)))
-            {
-                bitmap[byte] |= (1 << bit);
-                fs->sb->s_free_inodes_count -= 1;
-                return byte * 8 + bit;
-            }
-        }
+        return 0; //won't get here
     }
-    return 0; //won't get here
+    init_inode_table(fs, inode_i);
+    bitmap_set(fs->inode_bitmap, inode_i, 1);
+    sb_count_add(&fs->sb->s_free_inodes_count, -1);
+    journal_dirty(&fs->journal, fs->inode_bitmap + inode_i / 8, 1);
+    journal_dirty(&fs->journal, fs->sb, sizeof(a1fs_superblock));
+    fs->inode_cursor = inode_i + 1;
+    return inode_i;
 }
 
 /**
@@ -169,6 +314,8 @@ a1fs_ino_t create_inode(fs_ctx *fs, mode_t mode)
 {
     a1fs_ino_t inode_i = search_inode_bitmap(fs);
     a1fs_inode *inode = &(fs->root_ino[inode_i]);
+    journal_dirty(&fs->journal, inode, sizeof(a1fs_inode));
+    memset(inode, 0, sizeof(a1fs_inode));
     inode->ino_idx = inode_i;
     inode->i_extents_count = 0;
     inode->links = 0;
@@ -186,7 +333,7 @@ a1fs_ino_t create_inode(fs_ctx *fs, mode_t mode)
  * @param y         denominator
  * @return          ceil(x/y)
  */
-uint32_t divide_ceil(uint32_t x, uint32_t y)
+uint64_t divide_ceil(uint64_t x, uint64_t y)
 {
     return x / y + ((x % y) != 0);
 }
@@ -206,19 +353,20 @@ void set_bitmap(unsigned char map, a1fs_blk_t index, uint32_t size, fs_ctx *fs)
     if (map == 'i') //inode bitmap
     {
         bitmap = fs->inode_bitmap;
-        fs->sb->s_free_inodes_count -= size;
+        sb_count_add(&fs->sb->s_free_inodes_count, -(int32_t)size);
     }
     else
     {
         bitmap = fs->block_bitmap; //block bitmap
-        fs->sb->s_free_blocks_count -= size;
-    }
-    for (uint32_t i = index; i < index + size; i++)
-    {
-        int byte = i / 8;
-        int bit = i % 8;
-        bitmap[byte] |= (1 << bit);
+        sb_blk_count_add(&fs->sb->s_free_blocks_count, -(int64_t)size);
+        if (fs->freemap.valid && !freemap_take(&fs->freemap, index, size))
+        { //out of memory, fall back to scanning the bitmap
+            freemap_destroy(&fs->freemap);
+        }
     }
+    bitmap_set(bitmap, index, size);
+    journal_dirty(&fs->journal, bitmap + index / 8, (index + size - 1) / 8 - index / 8 + 1);
+    journal_dirty(&fs->journal, fs->sb, sizeof(a1fs_superblock));
 }
 
 /**
@@ -230,32 +378,38 @@ void set_bitmap(unsigned char map, a1fs_blk_t index, uint32_t size, fs_ctx *fs)
  * @param size          number of bits to be flipped
  * @param fs            pointer to the file system
  */
-void unset_bitmap(unsigned char map, uint32_t index, uint32_t size, fs_ctx *fs)
+void unset_bitmap(unsigned char map, a1fs_blk_t index, uint32_t size, fs_ctx *fs)
 {
     unsigned char *bitmap;
     if (map == 'i') //inode bitmap
     {
         bitmap = fs->inode_bitmap;
-        fs->sb->s_free_inodes_count += size;
+        sb_count_add(&fs->sb->s_free_inodes_count, size);
     }
     else
     {
         bitmap = fs->block_bitmap; //block bitmap
-        fs->sb->s_free_blocks_count += size;
-    }
-    for (uint32_t i = index; i < index + size; i++)
-    {
-        int byte = i / 8;
-        int bit = i % 8;
-        bitmap[byte] &= (~(1 << bit));
+        sb_blk_count_add(&fs->sb->s_free_blocks_count, size);
+        if (fs->freemap.valid && !freemap_give(&fs->freemap, index, size))
+        { //out of memory, fall back to scanning the bitmap
+            freemap_destroy(&fs->freemap);
+        }
+        // the blks may hold file data next, which an old image of them must not overwrite
+        journal_forget(&fs->journal, fs->sb->s_first_data_block + index, size);
+        // or they may hold metadata next, which the blk cache does not see
+        blkio_forget(&fs->bio, fs->sb->s_first_data_block + index, size);
     }
+    bitmap_clear(bitmap, index, size);
+    journal_dirty(&fs->journal, bitmap + index / 8, (index + size - 1) / 8 - index / 8 + 1);
+    journal_dirty(&fs->journal, fs->sb, sizeof(a1fs_superblock));
 }
 
 /**
  * precondition: file system has enough number of free blks left
- * search from the beginning for empty contiguous blocks of size size in file system fs
+ * search for empty contiguous blocks of size size in file system fs, taking the smallest free extent that fits
  * If cannot find one, store the largest number of contiguous blocks in fs into extent
  * Flip the bits of these empty contiguous blocks and decrease the free_blk count
+ * The free map is used when valid; otherwise the bitmap is scanned from the next-fit cursor of fs
  *
  * @param size          number of contiguous blocks to look for
  * @param fs            pointer to the file system
@@ -263,51 +417,50 @@ void unset_bitmap(unsigned char map, uint32_t index, uint32_t size, fs_ctx *fs)
  */
 void search_blk_bitmap(uint32_t size, fs_ctx *fs, a1fs_extent *extent)
 {                                                                                    // 0010 0011
-    unsigned char *bitmap = fs->block_bitmap;                                        //get the blk bitmap
-    uint32_t num_data_blk = fs->sb->s_blocks_count - fs->sb->s_first_data_block + 1; //total num of datablks in the fs
-    int bit_iterated = 0;                                                            //num of bits iterated in bitmap
-    int end_bit;                                                                     // num of bit to iterate in the byte
-    extent->count = 0;                                                               //start of the largest cts blk
-    extent->start = 0;
-    uint32_t count = 0;
-    uint32_t start = 0;
-    for (uint32_t byte = 0; byte < divide_ceil(num_data_blk, 8); byte++)
+    if (fs->freemap.valid)
     {
-        if (num_data_blk - bit_iterated >= 8)
+        if (!freemap_best_fit(&fs->freemap, size, extent))
         {
-            end_bit = 8;
+            extent->start = 0;
+            extent->count = 0;
+            return;
         }
-        else
-        {
-            end_bit = num_data_blk % 8;
-        }
-        for (int bit = 0; bit < end_bit; bit++)
+        set_bitmap('d', extent->start, extent->count, fs);
+        return;
+    }
+    unsigned char *bitmap = fs->block_bitmap;                                        //get the blk bitmap
+    a1fs_blk_t num_data_blk = fs->sb->s_blocks_count - fs->sb->s_first_data_block + 1; //total num of datablks in the fs
+    extent->count = 0;                                                               //the largest cts run seen so far
+    extent->start = 0;
+    // next fit: go through the free runs from the cursor to the end, then from the beginning up to the cursor
+    a1fs_blk_t cursor = fs->blk_cursor < num_data_blk ? fs->blk_cursor : 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        a1fs_blk_t start = (pass == 0) ? cursor : 0;
+        a1fs_blk_t limit = (pass == 0) ? num_data_blk : cursor;
+        while ((start = bitmap_next_zero(bitmap, num_data_blk, start)) < limit)
         {
-            bit_iterated += 1;
-            if ((bitmap[byte] & (1 << bit)) == 0)
+            a1fs_blk_t end = bitmap_next_one(bitmap, num_data_blk, start);
+            if (end - start >= size)
             {
-                count += 1;
-                if (size == count)
-                {
-                    extent->start = start;
-                    extent->count = count;
-                    set_bitmap('d', extent->start, extent->count, fs);
-                    return;
-                }
+                extent->start = start;
+                extent->count = size;
+                break;
             }
-            else
+            if (end - start > extent->count)
             {
-                if (count > extent->count)
-                {
-                    extent->count = count;
-                    extent->start = start;
-                }
-                start = bit_iterated;
-                count = 0;
+                extent->count = end - start;
+                extent->start = start;
             }
+            start = end;
+        }
+        if (extent->count == size)
+        {
+            break;
         }
     }
-    set_bitmap('d', extent->count, extent->start, fs);
+    set_bitmap('d', extent->start, extent->count, fs);
+    fs->blk_cursor = extent->start + extent->count;
 }
 
 /**
@@ -321,28 +474,31 @@ void search_blk_bitmap(uint32_t size, fs_ctx *fs, a1fs_extent *extent)
  */
 int search_blk_bitmap_at_idx(a1fs_blk_t preferred_start_index, uint32_t size, fs_ctx *fs)
 {
-    unsigned char *bitmap = fs->block_bitmap;
-    uint32_t num_data_blk = fs->sb->s_blocks_count - fs->sb->s_first_data_block + 1;
+    a1fs_blk_t num_data_blk = fs->sb->s_blocks_count - fs->sb->s_first_data_block + 1;
     if (preferred_start_index + size > num_data_blk)
     {
         return -1;
     }
-
-    for (uint32_t idx = preferred_start_index; idx < preferred_start_index + size; idx++)
+    if (fs->freemap.valid)
     {
-        int byte = idx / 8;
-        int bit = idx % 8;
-        if ((bitmap[byte] & (1 << bit)) == 1)
+        if (!freemap_is_free(&fs->freemap, preferred_start_index, size))
         {
             return -1;
         }
+        set_bitmap('d', preferred_start_index, size, fs);
+        return 0;
+    }
+
+    if (!bitmap_is_clear(fs->block_bitmap, preferred_start_index, size))
+    {
+        return -1;
     }
     set_bitmap('d', preferred_start_index, size, fs);
     return 0;
 }
 
 /**
- * write extent extent to the extent block of the file at inode index ino_i in file system fs
+ * write extent extent to the end of the extents of the file at inode index ino_i in file system fs
  *
  * @param ino_i     inode index of the file
  * @param extent    an extent struct to be written to the extent block of the file
@@ -351,205 +507,212 @@ int search_blk_bitmap_at_idx(a1fs_blk_t preferred_start_index, uint32_t size, fs
  */
 int write_extent(a1fs_ino_t ino_i, a1fs_extent extent, fs_ctx *fs)
 {
-    a1fs_inode *ino = &(fs->root_ino[ino_i]);
-    if(ino->i_extents_count == 512){
-        return -1;
-    }
-    a1fs_blk_t extent_blk = ino->s_extent_block;
-    a1fs_extent *ptr = (a1fs_extent *)(fs->data_blk + extent_blk * A1FS_BLOCK_SIZE);
-    memcpy(&(ptr[ino->i_extents_count]), &extent, sizeof(a1fs_extent));
-    ino->i_extents_count += 1;
-    return 0;
+    extents_changed(fs, ino_i);
+    return append_extent(fs, ino_i, extent) == 0 ? 0 : -1;
 }
 
 /**
- * allocate blocks to write the dentry for dir at inode index dir_i in file system fs
+ * allocate a new blk at the end of dir at inode index dir_i in file system fs
  *
  * @param dir_i     inode index of the dir
  * @param fs        a pointer to the file system
- * @return          index of the new blk to write the dentry
+ * @param blk       stores the index of the new blk
+ * @return          0 on success; -ENOSPC if out of blks or extents
  */
-a1fs_blk_t allocate_blks_for_dir(a1fs_ino_t dir_i, fs_ctx *fs)
+int allocate_blks_for_dir(a1fs_ino_t dir_i, fs_ctx *fs, a1fs_blk_t *blk)
 {
+    extents_changed(fs, dir_i);
     a1fs_inode *parent_dir = &(fs->root_ino[dir_i]);
     if (parent_dir->size == 0)
-    { // parent is empty, need to allocate an extent blk
+    { // parent is empty, its first extent goes in the inode
+        if (fs->sb->s_free_blocks_count == 0)
+        {
+            return -ENOSPC;
+        }
         a1fs_extent extent;
-        search_blk_bitmap(1, fs, &extent);
-        a1fs_blk_t extent_blk = extent.start;    //get an extent blk
-        parent_dir->s_extent_block = extent_blk; //connect extent blk to parent_dir
         search_blk_bitmap(1, fs, &extent);       //get an extent
         write_extent(dir_i, extent, fs);         //write this extent to parent_dir
-        return extent.start;
+        *blk = extent.start;
+        return 0;
     }
     else
     { //parent directory has extents
-        a1fs_extent *first_extent = (a1fs_extent *)(fs->data_blk + parent_dir->s_extent_block * A1FS_BLOCK_SIZE);
-        a1fs_extent *last_extent = &(first_extent[parent_dir->i_extents_count - 1]); //get the last extent
+        a1fs_extent *last_extent = get_extent(fs, dir_i, parent_dir->i_extents_count - 1); //get the last extent
         a1fs_blk_t end_db = last_extent->start + last_extent->count - 1;             //get the last dlk
         if (search_blk_bitmap_at_idx(end_db + 1, 1, fs) != -1)
         { // see if can extend last extent
+            journal_dirty(&fs->journal, last_extent, sizeof(a1fs_extent));
             last_extent->count += 1;
-            return end_db + 1;
+            *blk = end_db + 1;
+            return 0;
         }
         else
         {
+            if (fs->sb->s_free_blocks_count == 0)
+            {
+                return -ENOSPC;
+            }
             a1fs_extent extent;
             search_blk_bitmap(1, fs, &extent); //get a new extent
-            write_extent(dir_i, extent, fs);   // write this extent to parent dir
-            return extent.start;
+            if (write_extent(dir_i, extent, fs) != 0)
+            { // no room to grow the extent tree
+                unset_bitmap('d', extent.start, extent.count, fs);
+                return -ENOSPC;
+            }
+            *blk = extent.start;
+            return 0;
         }
     }
 }
 
 /**
- * write a dentry struct dentry to the datablk blk of the dir at inode index dir_i in file system fs
- * increase links in dir and update mtime
+ * record that a dentry of size bytes was added to (delta > 0) or removed from (delta < 0) the dir dir
+ * updates the size, links and mtime of the dir
  *
- * @param dir_i     inode index of the dir
- * @param blk       index of the data block of the dir
- * @param index     index for the dentry to be written to
- * @param dentry    the dentry struct to be written into blk
- * @param fs        a pointer to the file system
+ * @param dir       the dir inode
+ * @param delta     +1 or -1
+ * @param size      size of the dentry in bytes (see dirblk_entry_size)
  */
-void write_dentry(a1fs_ino_t dir_i, a1fs_blk_t blk, int index, a1fs_dentry dentry, fs_ctx *fs)
+void update_dir_stats(a1fs_inode *dir, int delta, uint32_t size)
 {
-    a1fs_inode *dir = &(fs->root_ino[dir_i]);
-    a1fs_dentry *ptr = (a1fs_dentry *)(fs->data_blk + blk * A1FS_BLOCK_SIZE);
-    memcpy(&(ptr[index]), &dentry, sizeof(a1fs_dentry));
-    dir->size += sizeof(a1fs_dentry);
-    dir->links += 1;
+    if (delta > 0)
+    {
+        dir->size += size;
+    }
+    else
+    {
+        dir->size -= size;
+    }
+    dir->links += delta;
     clock_gettime(CLOCK_REALTIME, &(dir->mtime));
 }
 
+/** File system and dir blk of move_dentry_out(). */
+typedef struct dir_move
+{
+    fs_ctx *fs;
+    void *blk;
+
+} dir_move;
+
+static int move_dentry_out(const dirblk_entry *entry, void *arg)
+{
+    dir_move *move = (dir_move *)arg;
+    dirblk_add(move->fs, move->blk, entry->ino, entry->name, entry->len); // an inline dir always fits in a blk
+    return 0;
+}
+
 /**
- * get the blk_idx and the dentry index of the last dentry in dir to write to at inode index dir_i in file system fs
- * assume don't need a new blk
+ * move the records of the inline dir at inode index dir_i in file system fs out to a dir blk of its own
  *
- * @param dir_i     inode index of the dir
- * @param blk       index of the data block of the dir
- * @param index     stores the insertion point
+ * @param dir_i     inode index of the dir; must have A1FS_INLINE_DIR_FL set
  * @param fs        a pointer to the file system
+ * @return          0 on success; -ENOSPC if out of blks, in which case the records stay inline
  */
-void get_dentry_insertion_point(a1fs_ino_t dir_i, a1fs_blk_t *blk, int *index, fs_ctx *fs)
+static int move_inline_dir_out(a1fs_ino_t dir_i, fs_ctx *fs)
 {
     a1fs_inode *dir = &(fs->root_ino[dir_i]);
-    *index = (dir->size / sizeof(a1fs_dentry)) % (A1FS_BLOCK_SIZE / sizeof(a1fs_dentry));
-    a1fs_extent *first_extent = (a1fs_extent *)(fs->data_blk + dir->s_extent_block * A1FS_BLOCK_SIZE);
-    a1fs_extent last_extent = first_extent[dir->i_extents_count - 1];
-    a1fs_blk_t end_db = last_extent.start + last_extent.count - 1;
-    *blk = end_db;
+    unsigned char data[A1FS_INLINE_DATA_MAX];
+    memcpy(data, dir->i_data, sizeof(data));
+    uint64_t size = dir->size;
+    // the first extent of the dir goes where the records were
+    dir->i_flags &= ~A1FS_INLINE_DIR_FL;
+    memset(dir->i_extents, 0, sizeof(dir->i_extents));
+    dir->size = 0;
+    a1fs_blk_t blk;
+    int ret = allocate_blks_for_dir(dir_i, fs, &blk);
+    dir->size = size;
+    if (ret != 0)
+    {
+        memcpy(dir->i_data, data, sizeof(data));
+        dir->i_flags |= A1FS_INLINE_DIR_FL;
+        return ret;
+    }
+    dir_move move = { fs, fs->data_blk + (size_t)blk * fs->block_size };
+    journal_dirty(&fs->journal, move.blk, fs->block_size);
+    dirblk_init(fs, move.blk);
+    dirblk_inline_iterate(data, move_dentry_out, &move);
+    return 0;
 }
 
 /**
  * add the dentry dentry to dir at inode index dir_i in file system fs
+ * with compact dentries, a small dir keeps its dentries in the inode until they overflow it
+ * a dir that outgrows its first blk is switched to the hashed index
  *
  * @param dir_i     inode index of the dir
  * @param dentry    the dentry struct to be added
  * @param fs        a pointer to the file system
+ * @return          0 on success; -ENOSPC if out of blks or extents
  */
-void add_dentry(a1fs_ino_t dir_i, a1fs_dentry dentry, fs_ctx *fs)
+int add_dentry(a1fs_ino_t dir_i, a1fs_dentry dentry, fs_ctx *fs)
 {
     a1fs_inode *dir = &(fs->root_ino[dir_i]);
-   
-    if (dir->size % A1FS_BLOCK_SIZE == 0)
-    { //need to allocate blocks
-        a1fs_blk_t blk_to_write = allocate_blks_for_dir(dir_i, fs);
-        write_dentry(dir_i, blk_to_write, 0, dentry, fs); // at index 0 since the blk is newly allocated
-    }
-    else
-    { // add to the end of the dir
-        a1fs_blk_t blk;
-        int index;
-        get_dentry_insertion_point(dir_i, &blk, &index, fs);
-        write_dentry(dir_i, blk, index, dentry, fs);
-    }
-}
-
-/**
- * get the last dentry in dir at inode index dir_i in file system fs
- *
- * @param dir_i      inode index of the dir
- * @param fs         a pointer to the file system
- * @return           the last dentry struct in the dir
- */
-a1fs_dentry get_last_dentry(a1fs_ino_t dir_i, fs_ctx *fs)
-{
-    a1fs_blk_t blk;
-    int index;
-    get_dentry_insertion_point(dir_i, &blk, &index, fs);
-    index -= 1;
-    a1fs_dentry *first_dentry = (a1fs_dentry *)(fs->data_blk + blk * A1FS_BLOCK_SIZE);
-    return first_dentry[index];
-}
-
-/**
- * replace a dentry in dir at inode index dir_i with name name with new_dentry in file system fs
- *
- * @param dir_i         inode index of the dir
- * @param name          name of the dentry to be replaced
- * @param new_dentry    new dentry
- * @param fs            a pointer to the file system
- */
-void replace_dentry(a1fs_ino_t dir_i, char *name, a1fs_dentry new_dentry, fs_ctx *fs)
-{
-    a1fs_inode *inode = &(fs->root_ino[dir_i]);
-    a1fs_extent *s_extent = (a1fs_extent *)(fs->data_blk + inode->s_extent_block * A1FS_BLOCK_SIZE);
-    int num_dentry = inode->size / sizeof(a1fs_dentry);
-    for (a1fs_blk_t i = 0; i < inode->i_extents_count; i++)
-    { // go through each extent
-        a1fs_blk_t extent_start = s_extent[i].start;
-        int blk_count = s_extent[i].count;
-
-        for (int j = 0; j < blk_count; j++)
-        { //go through each block
-            a1fs_dentry *start_dentry = (a1fs_dentry *)(fs->data_blk + (extent_start + j) * A1FS_BLOCK_SIZE);
-            for (int dentry_i = 0; dentry_i < A1FS_BLOCK_SIZE / 256; dentry_i++)
-            { //go through each dentry
-                if (num_dentry == 0)
-                { //check if gone through all dentries
-                    return;
-                }
-
-                if (strcmp(start_dentry[dentry_i].name, name) == 0)
-                {
-                    (&(start_dentry[dentry_i]))->ino = new_dentry.ino;
-                    strncpy((&(start_dentry[dentry_i]))->name, new_dentry.name, A1FS_NAME_MAX-1);
-                    ((&(start_dentry[dentry_i]))->name)[A1FS_NAME_MAX-1] = '\0';
-                    return;
-                }
+    size_t len = strlen(dentry.name);
+    int ret = 0;
 
-                num_dentry -= 1;
-            }
+    if (dir->i_flags & A1FS_INLINE_DIR_FL)
+    {
+        journal_dirty(&fs->journal, dir, sizeof(a1fs_inode));
+        if (dirblk_inline_add(fs, dir->i_data, dentry.ino, dentry.name, len))
+        {
+            update_dir_stats(dir, 1, dirblk_entry_size(fs, len));
+            dcache_add(&fs->dcache, dir_i, dentry.name, len, dentry.ino);
+            return 0;
+        }
+        if ((ret = move_inline_dir_out(dir_i, fs)) != 0)
+        { //the inode is full and there is no blk to move to
+            return ret;
         }
     }
-}
 
-/**
- * remove the last dentry in dir at inode index dir_i in file system fs
- *
- * @param dir_i         inode index of the dir
- * @param fs            a pointer to the file system
- */
-void rm_last_dentry(a1fs_ino_t dir_i, fs_ctx *fs)
-{
-    a1fs_inode *dir = &(fs->root_ino[dir_i]);
-    int last_dentry_i = (dir->size / sizeof(a1fs_dentry)) % (A1FS_BLOCK_SIZE / sizeof(a1fs_dentry)) - 1;
-    a1fs_extent *first_extent = (a1fs_extent *)(fs->data_blk + dir->s_extent_block * A1FS_BLOCK_SIZE);
-    a1fs_extent last_extent = first_extent[dir->i_extents_count - 1];
-    a1fs_blk_t end_db = last_extent.start + last_extent.count - 1;
-    if (last_dentry_i == 0)
+    if (dir->i_flags & A1FS_INDEX_FL)
     {
-        unset_bitmap('d', end_db, 1, fs);
-        (&last_extent)->count -= 1;
+        ret = dx_add_entry(fs, dir_i, &dentry);
     }
-    if ((&last_extent)->count == 0)
+    else if (dir->size == 0 && fs->compact_dirents && A1FS_DIRENT_LEN(len) <= A1FS_INLINE_DATA_MAX)
+    { //the first dentry goes in the inode
+        journal_dirty(&fs->journal, dir, sizeof(a1fs_inode));
+        dirblk_inline_init(dir->i_data);
+        dirblk_inline_add(fs, dir->i_data, dentry.ino, dentry.name, len);
+        dir->i_flags |= A1FS_INLINE_DIR_FL;
+        update_dir_stats(dir, 1, dirblk_entry_size(fs, len));
+    }
+    else if (dir->size == 0)
+    { //need to allocate the blk
+        a1fs_blk_t blk;
+        ret = allocate_blks_for_dir(dir_i, fs, &blk);
+        if (ret == 0)
+        {
+            void *ptr = fs->data_blk + (size_t)blk * fs->block_size;
+            journal_dirty(&fs->journal, ptr, fs->block_size);
+            dirblk_init(fs, ptr);
+            dirblk_add(fs, ptr, dentry.ino, dentry.name, len);
+            update_dir_stats(dir, 1, dirblk_entry_size(fs, len));
+        }
+    }
+    else
+    {
+        void *ptr = linear_dir_blk(fs->block_size, dir_i, fs);
+        journal_dirty(&fs->journal, ptr, fs->block_size);
+        if (dirblk_add(fs, ptr, dentry.ino, dentry.name, len))
+        {
+            update_dir_stats(dir, 1, dirblk_entry_size(fs, len));
+        }
+        else
+        { //the blk is full, switch to the hashed index
+            ret = dx_convert(fs, dir_i);
+            if (ret == 0)
+            {
+                ret = dx_add_entry(fs, dir_i, &dentry);
+            }
+        }
+    }
+    if (ret == 0)
     {
-        dir->i_extents_count -= 1;
+        dcache_add(&fs->dcache, dir_i, dentry.name, len, dentry.ino);
     }
-    dir->size -= sizeof(a1fs_dentry); //delete the dentry
-    dir->links -= 1;
-    clock_gettime(CLOCK_REALTIME, &(dir->mtime));
+    return ret;
 }
 
 /**
@@ -561,31 +724,56 @@ void rm_last_dentry(a1fs_ino_t dir_i, fs_ctx *fs)
  */
 void rm_dentry(a1fs_ino_t dir_i, a1fs_dentry dentry, fs_ctx *fs)
 {   a1fs_inode *dir = &(fs->root_ino[dir_i]);
-    a1fs_dentry last_dentry = get_last_dentry(dir_i, fs);
-    if ((strcmp(dentry.name, last_dentry.name)) != 0)
+    size_t len = strlen(dentry.name);
+    dcache_add_negative(&fs->dcache, dir_i, dentry.name, len);
+    if (dir->i_flags & A1FS_INDEX_FL)
+    {
+        dx_remove_entry(fs, dir_i, dentry.name);
+        return;
+    }
+    if (dir->i_flags & A1FS_INLINE_DIR_FL)
+    {
+        journal_dirty(&fs->journal, dir, sizeof(a1fs_inode));
+        if (dirblk_inline_remove(dir->i_data, dentry.name, len))
+        {
+            update_dir_stats(dir, -1, dirblk_entry_size(fs, len));
+            if (dir->size == 0)
+            { //no blk to deallocate
+                dir->i_flags &= ~A1FS_INLINE_DIR_FL;
+                memset(dir->i_data, 0, sizeof(dir->i_data));
+            }
+        }
+        return;
+    }
+    void *ptr = linear_dir_blk(fs->block_size, dir_i, fs);
+    journal_dirty(&fs->journal, ptr, fs->block_size);
+    if (!dirblk_remove(fs, ptr, dentry.name, len))
     {
-        replace_dentry(dir_i, dentry.name, last_dentry, fs);
+        return;
     }
-    rm_last_dentry(dir_i, fs);
-    if(dir->size == 0){ //deallocate extent blk
-        unset_bitmap('d', dir->s_extent_block, 1, fs);
+    update_dir_stats(dir, -1, dirblk_entry_size(fs, len));
+    if(dir->size == 0){ //deallocate the blk
+        delete_file_data(dir_i, fs);
     }
-
 }
 
 /**
  * create a dentry struct specified by inode index ino and name name
  *
  * @param ino               inode index of the file/dir
- * @param name              name of the file/dir
+ * @param name              name of the file/dir (need not be null-terminated)
+ * @param len               length of the name
  * @return                  a dentry struct specified by ino and name
  */
-a1fs_dentry create_dentry(a1fs_ino_t ino, char *name)
+a1fs_dentry create_dentry(a1fs_ino_t ino, const char *name, size_t len)
 {
     a1fs_dentry dentry = {0};
     dentry.ino = ino;
-    strncpy(dentry.name, name, A1FS_NAME_MAX - 1);
-    dentry.name[A1FS_NAME_MAX - 1] = '\0';
+    if (len > A1FS_NAME_MAX - 1)
+    {
+        len = A1FS_NAME_MAX - 1;
+    }
+    memcpy(dentry.name, name, len);
     return dentry;
 }
 
@@ -606,75 +794,289 @@ a1fs_extent create_extent(a1fs_blk_t start, uint32_t count)
 }
 
 /**
- * find the pointer to the byte specified by offset of the file with inode index ino in file system fs
+ * call fn on each contiguous piece of the size bytes at offset offset of the file with inode index ino in file
+ * system fs, in order: the inline data, or the part of each extent the range touches
+ * precondition: offset + size <= size of the file
  *
+ * @param bs                block size of fs, a constant in each variant (see BLK_OPS)
  * @param ino               inode index of the file
  * @param fs                a pointer to the file system
  * @param offset            offset of the file
- * @return                  pointer to the byte
+ * @param size              number of bytes
+ * @param cur               extent cursor to start from and move past the data; NULL to search from scratch
+ * @param fn                callback
+ * @param arg               argument passed to fn
  */
-unsigned char *find_offset(a1fs_ino_t ino, fs_ctx *fs, uint32_t offset)
+static inline __attribute__((always_inline)) void walk_file_data_bs(const uint32_t bs, a1fs_ino_t ino, fs_ctx *fs,
+                                                                   uint64_t offset, size_t size, extent_cursor *cur,
+                                                                   file_data_fn fn, void *arg)
 {
-    a1fs_inode *inode = &(fs->root_ino[ino]);   // get the inode
-    a1fs_blk_t extent_blk = inode->s_extent_block;  // get the extent block
-    a1fs_extent *curr_extent = (a1fs_extent *)(fs->data_blk + extent_blk * A1FS_BLOCK_SIZE);
-    int block_offset = offset / A1FS_BLOCK_SIZE;
-    int remaining_data = offset % A1FS_BLOCK_SIZE;
-    int num_extent = 0;
-    int num_block_in_extent = curr_extent->count;
-
-    while (block_offset - num_block_in_extent > 0) {
-        block_offset -= num_block_in_extent;
-        num_extent ++;
-        curr_extent = (a1fs_extent *)(curr_extent + num_extent * sizeof(a1fs_extent));
-        num_block_in_extent = curr_extent->count;
-    }   // when the loop terminates, curr_extent is the correct extent containing block_offset
-
-    return (fs->data_blk + curr_extent->start * A1FS_BLOCK_SIZE + remaining_data);
-
+    if (size == 0)
+    {
+        return;
+    }
+    a1fs_inode *inode = &(fs->root_ino[ino]);
+    if (inode->i_flags & A1FS_INLINE_DATA_FL)
+    { // the data is in the inode
+        fn(inode->i_data + offset, size, arg);
+        return;
+    }
+    a1fs_lblk_t lblk; // logical blk of offset within its extent
+    uint32_t extent_idx = (cur != NULL) ? find_extent_at(fs, ino, offset / bs, &lblk, cur)
+                                        : find_extent(fs, ino, offset / bs, &lblk);
+    a1fs_lblk_t first = offset / bs - lblk; // first logical blk of the current extent
+    size_t pos = (size_t)lblk * bs + offset % bs; // byte offset in the current extent
+    while (true)
+    {
+        a1fs_extent *curr_extent = get_extent(fs, ino, extent_idx);
+        unsigned char *data = fs->data_blk + (size_t)curr_extent->start * bs + pos;
+        size_t n = (size_t)curr_extent->count * bs - pos; // bytes left in this extent
+        if (n > size)
+        {
+            n = size;
+        }
+        fn(data, n, arg);
+        size -= n;
+        if (size == 0)
+        {
+            break;
+        }
+        first += curr_extent->count;
+        pos = 0;
+        extent_idx++;
+    }
+    if (cur != NULL)
+    { // the next sequential access starts in this extent or the next one
+        cur->idx = extent_idx;
+        cur->lblk = first;
+    }
 }
 
 /**
- * delete all the data of the file with inode index ino in file system fs
- * assuming bytes_to_delete > 0
+ * check whether data, a piece of a file handed out by walk_file_data(), is inline data kept in the inode table
+ * rather than in a data blk
  *
- * @param ino               inode index of the file
  * @param fs                a pointer to the file system
+ * @param data              the piece
+ * @return                  true if the data is inline
  */
-void delete_file_data(a1fs_ino_t ino, fs_ctx *fs)
+static bool is_inline(fs_ctx *fs, const unsigned char *data)
 {
-    a1fs_inode *inode = &(fs->root_ino[ino]);   // get the inode
-    a1fs_extent *first_extent = (a1fs_extent *)(fs->data_blk + inode->s_extent_block * A1FS_BLOCK_SIZE);
-    for (int extent_idx = 0; (uint32_t)extent_idx < inode->i_extents_count; extent_idx++)
-    {
-        a1fs_extent *curr_extent = &(first_extent[extent_idx]); //get the next extent
-        unset_bitmap('d', curr_extent->start, curr_extent->count, fs);
-    }
-    unset_bitmap('d', inode->s_extent_block, 1, fs); // unset the bit for extent blk
-    inode->size = 0;
+    return data < (unsigned char *)fs->data_blk;
 }
 
 /**
- * truncate the file with inode index ino in the file system fs by bytes_to_delete bytes
- * assuming bytes_to_delete > 0
+ * read the size bytes at data, in a data blk of the mapped image, from the image file into buf
+ * file data never goes through the mapping, which is private while the image has a journal
  *
- * @param ino               inode index of the file
  * @param fs                a pointer to the file system
- * @param bytes_to_delete   bytes to truncate
+ * @param data              start of the bytes in the mapped image
+ * @param buf               the buffer that receives the data
+ * @param size              number of bytes
+ * @return                  0 on success; -ENOMEM or -EIO on error
  */
-void truncate_file(a1fs_ino_t ino, fs_ctx *fs, int bytes_to_delete)
+static int image_read(fs_ctx *fs, const unsigned char *data, void *buf, size_t size)
 {
-    a1fs_inode *inode = &(fs->root_ino[ino]);   // get the inode
-    a1fs_extent *first_extent = (a1fs_extent *)(fs->data_blk + inode->s_extent_block * A1FS_BLOCK_SIZE);
-    a1fs_extent *last_extent = first_extent + (inode->i_extents_count - 1) * sizeof(a1fs_extent); //get the last extent
-    a1fs_blk_t last_data_block = last_extent->start + last_extent->count - 1;
+    return blkio_read(&fs->bio, data - (unsigned char *)fs->image, buf, size);
+}
 
-    int remainder = inode->size % A1FS_BLOCK_SIZE;
+/**
+ * write the size bytes of buf to the image file at data, in a data blk of the mapped image
+ *
+ * @param fs                a pointer to the file system
+ * @param data              start of the bytes in the mapped image
+ * @param buf               the data; NULL to write zeros
+ * @param size              number of bytes
+ * @return                  0 on success; -ENOMEM or -EIO on error
+ */
+static int image_write(fs_ctx *fs, const unsigned char *data, const void *buf, size_t size)
+{
+    return blkio_write(&fs->bio, data - (unsigned char *)fs->image, buf, size);
+}
 
-    // if file size is not multiple of A1FS_BLOCK_SIZE, truncate the last blk accordingly
-    if (remainder != 0)
-    {
-        // if bytes_to_delete is within the last data block, nothing changes to the extent
+/**
+ * record that the size bytes at data in the mapped image were written for the file with inode index ino in
+ * file system fs, so that its next fsync() writes them back
+ *
+ * @param fs                a pointer to the file system
+ * @param ino               inode index of the file; write-locked
+ * @param data              start of the bytes in the mapped image
+ * @param size              number of bytes
+ */
+static void data_written(fs_ctx *fs, a1fs_ino_t ino, const unsigned char *data, size_t size)
+{
+    if (is_inline(fs, data))
+    { // inline data is metadata
+        inode_state(fs, ino)->dirty.metadata = true;
+        return;
+    }
+    uint64_t pos = data - (unsigned char *)fs->image;
+    dirty_add(&inode_state(fs, ino)->dirty, pos, pos + size);
+}
+
+/** File system, file, position in the buffer and first error of copy_to_buf() and copy_from_buf(). */
+typedef struct copy_ctx
+{
+    fs_ctx *fs;
+    a1fs_ino_t ino;
+    unsigned char *buf;
+    int error;
+
+} copy_ctx;
+
+static void copy_to_buf(unsigned char *data, size_t size, void *arg)
+{
+    copy_ctx *ctx = (copy_ctx *)arg;
+    if (is_inline(ctx->fs, data))
+    {
+        memcpy(ctx->buf, data, size);
+    }
+    else if (ctx->error == 0)
+    {
+        ctx->error = image_read(ctx->fs, data, ctx->buf, size);
+    }
+    ctx->buf += size;
+}
+
+static void copy_from_buf(unsigned char *data, size_t size, void *arg)
+{
+    copy_ctx *ctx = (copy_ctx *)arg;
+    data_written(ctx->fs, ctx->ino, data, size);
+    if (is_inline(ctx->fs, data))
+    {
+        memcpy(data, ctx->buf, size);
+    }
+    else if (ctx->error == 0)
+    {
+        ctx->error = image_write(ctx->fs, data, ctx->buf, size);
+    }
+    ctx->buf += size;
+}
+
+/**
+ * read size bytes at offset offset of the file with inode index ino in file system fs into buf
+ * precondition: offset + size <= size of the file
+ *
+ * @param ino               inode index of the file
+ * @param fs                a pointer to the file system
+ * @param offset            offset of the file
+ * @param buf               the buffer that receives the data
+ * @param size              number of bytes to read
+ * @param cur               extent cursor to start from and move past the data; NULL to search from scratch
+ * @return                  0 on success; -EIO on error
+ */
+int read_file_data(a1fs_ino_t ino, fs_ctx *fs, uint64_t offset, void *buf, size_t size, extent_cursor *cur)
+{
+    copy_ctx ctx = { fs, ino, buf, 0 };
+    walk_file_data(ino, fs, offset, size, cur, copy_to_buf, &ctx);
+    return ctx.error;
+}
+
+/**
+ * write size bytes from buf at offset offset of the file with inode index ino in file system fs
+ * precondition: offset + size <= size of the file
+ *
+ * @param ino               inode index of the file
+ * @param fs                a pointer to the file system
+ * @param offset            offset of the file
+ * @param buf               the buffer containing the data
+ * @param size              number of bytes to write
+ * @param cur               extent cursor to start from and move past the data; NULL to search from scratch
+ * @return                  0 on success; -EIO on error
+ */
+int write_file_data(a1fs_ino_t ino, fs_ctx *fs, uint64_t offset, const void *buf, size_t size, extent_cursor *cur)
+{
+    copy_ctx ctx = { fs, ino, (unsigned char *)buf, 0 };
+    walk_file_data(ino, fs, offset, size, cur, copy_from_buf, &ctx);
+    return ctx.error;
+}
+
+/**
+ * find the data blk that holds the logical blk lblk of the file with inode index ino in file system fs
+ *
+ * @param ino               inode index of the file
+ * @param fs                a pointer to the file system
+ * @param lblk              logical blk number within the file
+ * @return                  index of the data blk
+ */
+a1fs_blk_t find_blk(a1fs_ino_t ino, fs_ctx *fs, a1fs_lblk_t lblk)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino]);   // get the inode
+    a1fs_lblk_t blk_offset;
+    uint32_t i = find_extent(fs, ino, lblk, &blk_offset);
+    assert(i < inode->i_extents_count);
+    return get_extent(fs, ino, i)->start + blk_offset;
+}
+
+/**
+ * get the number of data blks of the file with inode index ino in file system fs
+ *
+ * @param ino               inode index of the file
+ * @param fs                a pointer to the file system
+ * @return                  number of data blks
+ */
+a1fs_lblk_t get_blk_count(a1fs_ino_t ino, fs_ctx *fs)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino]);   // get the inode
+    if (inode->size == 0)
+    {
+        return 0;
+    }
+    return extent_end(fs, ino);
+}
+
+/**
+ * delete all the data of the file with inode index ino in file system fs
+ * assuming bytes_to_delete > 0
+ *
+ * @param ino               inode index of the file
+ * @param fs                a pointer to the file system
+ */
+void delete_file_data(a1fs_ino_t ino, fs_ctx *fs)
+{
+    extents_changed(fs, ino);
+    a1fs_inode *inode = &(fs->root_ino[ino]);   // get the inode
+    for (uint32_t extent_idx = 0; extent_idx < inode->i_extents_count; extent_idx++)
+    {
+        a1fs_extent *curr_extent = get_extent(fs, ino, extent_idx); //get the next extent
+        unset_bitmap('d', curr_extent->start, curr_extent->count, fs);
+    }
+    free_extents(fs, ino); // unset the bits for the extent blk(s)
+    inode->i_flags &= ~(A1FS_INLINE_DATA_FL | A1FS_INLINE_DIR_FL);
+    inode->size = 0;
+}
+
+/**
+ * truncate the file with inode index ino in the file system fs by bytes_to_delete bytes
+ * assuming bytes_to_delete > 0
+ *
+ * @param ino               inode index of the file
+ * @param fs                a pointer to the file system
+ * @param bytes_to_delete   bytes to truncate
+ */
+void truncate_file(a1fs_ino_t ino, fs_ctx *fs, uint64_t bytes_to_delete)
+{
+    extents_changed(fs, ino);
+    a1fs_inode *inode = &(fs->root_ino[ino]);   // get the inode
+    journal_dirty(&fs->journal, inode, sizeof(a1fs_inode));
+    if (inode->i_flags & A1FS_INLINE_DATA_FL)
+    { // the bytes past the end are zeroed again when the file grows
+        inode->size -= bytes_to_delete;
+        if (inode->size == 0)
+        {
+            inode->i_flags &= ~A1FS_INLINE_DATA_FL;
+        }
+        return;
+    }
+    a1fs_extent *last_extent = get_extent(fs, ino, inode->i_extents_count - 1); //get the last extent
+    a1fs_blk_t last_data_block = last_extent->start + last_extent->count - 1;
+
+    uint32_t remainder = inode->size % fs->block_size;
+
+    // if file size is not multiple of the blk size, truncate the last blk accordingly
+    if (remainder != 0)
+    {
+        // if bytes_to_delete is within the last data block, nothing changes to the extent
         if (bytes_to_delete < remainder) {
             inode->size -= bytes_to_delete;
             return ;
@@ -685,21 +1087,23 @@ void truncate_file(a1fs_ino_t ino, fs_ctx *fs, int bytes_to_delete)
 
         inode->size -= remainder;
         bytes_to_delete -= remainder;
+        journal_dirty(&fs->journal, last_extent, sizeof(a1fs_extent));
         last_extent->count--;
         // if this last extent only has one data block, remove this extent, update last_data_block
-        if (last_extent->count == 0) {inode->i_extents_count--;}
+        if (last_extent->count == 0) {pop_extent(fs, ino);}
     }
 
     // from now on, the remainder at the end has been truncated
 
-    while (bytes_to_delete >= A1FS_BLOCK_SIZE) {
-        last_extent = first_extent + (inode->i_extents_count - 1) * sizeof(a1fs_extent); //get the current last extent
+    while (bytes_to_delete >= fs->block_size) {
+        last_extent = get_extent(fs, ino, inode->i_extents_count - 1); //get the current last extent
         last_data_block = last_extent->start + last_extent->count - 1;  // get the current last data blk
         unset_bitmap('d', last_data_block, 1, fs);
-        inode->size -= A1FS_BLOCK_SIZE;
-        bytes_to_delete -= A1FS_BLOCK_SIZE;
+        inode->size -= fs->block_size;
+        bytes_to_delete -= fs->block_size;
+        journal_dirty(&fs->journal, last_extent, sizeof(a1fs_extent));
         last_extent->count--;
-        if (last_extent->count == 0) {inode->i_extents_count--;}
+        if (last_extent->count == 0) {pop_extent(fs, ino);}
     }
 
     // we have reached the last data blk to delete, nothing changes to the extent
@@ -716,10 +1120,9 @@ void truncate_file(a1fs_ino_t ino, fs_ctx *fs, int bytes_to_delete)
  */
 unsigned char *find_last_blk(a1fs_ino_t ino, fs_ctx *fs) {
     a1fs_inode *inode = &(fs->root_ino[ino]);   // get the inode
-    a1fs_extent *first_extent = (a1fs_extent *) (fs->data_blk + inode->s_extent_block * A1FS_BLOCK_SIZE);
-    a1fs_extent *last_extent = &(first_extent[inode->i_extents_count - 1]); //get the last extent
-    unsigned char *first_blk = fs->data_blk + last_extent->start * A1FS_BLOCK_SIZE; // first blk of the last extent
-    unsigned char *last_blk = first_blk + last_extent->count * A1FS_BLOCK_SIZE; // last blk of the last extent
+    a1fs_extent *last_extent = get_extent(fs, ino, inode->i_extents_count - 1); //get the last extent
+    unsigned char *first_blk = fs->data_blk + last_extent->start * fs->block_size; // first blk of the last extent
+    unsigned char *last_blk = first_blk + last_extent->count * fs->block_size; // last blk of the last extent
 
     return last_blk;
 }
@@ -732,11 +1135,17 @@ unsigned char *find_last_blk(a1fs_ino_t ino, fs_ctx *fs) {
  * @param start             start of writing
  * @param length            length of writing
  * @param fs                a pointer to the file system
+ * @return                  0 on success; -EIO on error.
  */
-void write_zero_to_blk(a1fs_ino_t ino_i, a1fs_blk_t blk, int start, int length, fs_ctx *fs){
+int write_zero_to_blk(a1fs_ino_t ino_i, a1fs_blk_t blk, uint32_t start, uint64_t length, fs_ctx *fs){
     a1fs_inode* inode = &(fs->root_ino[ino_i]);
-    inode -> size += length;
-    memset(fs->data_blk+ blk*A1FS_BLOCK_SIZE + start, 0, length);
+    unsigned char *data = fs->data_blk + (size_t)blk*fs->block_size + start;
+    int error = image_write(fs, data, NULL, length);
+    if(error == 0){
+        data_written(fs, ino_i, data, length);
+        inode -> size += length;
+    }
+    return error;
 }
 
 /**
@@ -747,22 +1156,28 @@ void write_zero_to_blk(a1fs_ino_t ino_i, a1fs_blk_t blk, int start, int length,
  * @param fs                a pointer to the file system
  * @return                  0 on success; -errno on error.
  */
-int populate_extent_blk(a1fs_ino_t ino_i, uint32_t size, fs_ctx *fs){
-    uint32_t num_db_needed = divide_ceil(size, A1FS_BLOCK_SIZE);
-    uint32_t size_remain = size;
+int populate_extent_blk(a1fs_ino_t ino_i, uint64_t size, fs_ctx *fs){
+    a1fs_lblk_t num_db_needed = divide_ceil(size, fs->block_size);
+    uint64_t size_remain = size;
     while (num_db_needed != 0){
-        a1fs_extent extent;
-        search_blk_bitmap(num_db_needed, fs, &extent);
+        a1fs_extent extent; // an extent holds at most UINT32_MAX blks
+        search_blk_bitmap(num_db_needed < UINT32_MAX ? num_db_needed : UINT32_MAX, fs, &extent);
+        if(extent.count == 0){ // the extent tree used up the last free blks
+            return -ENOSPC;
+        }
         if(write_extent(ino_i, extent, fs) == -1){
+            unset_bitmap('d', extent.start, extent.count, fs);
             return -ENOSPC;
         }
         num_db_needed -= extent.count;
-        if(size_remain > extent.count * A1FS_BLOCK_SIZE){
-            write_zero_to_blk(ino_i, extent.start,0, extent.count * A1FS_BLOCK_SIZE, fs );
-            size_remain -= extent.count * A1FS_BLOCK_SIZE;
+        if(size_remain > (uint64_t)extent.count * fs->block_size){
+            int error = write_zero_to_blk(ino_i, extent.start,0, (uint64_t)extent.count * fs->block_size, fs );
+            if(error != 0){
+                return error;
+            }
+            size_remain -= (uint64_t)extent.count * fs->block_size;
         }else{
-            write_zero_to_blk(ino_i, extent.start,0, size_remain, fs );
-            return 0;
+            return write_zero_to_blk(ino_i, extent.start,0, size_remain, fs );
         }
     }
     return 0;
@@ -778,60 +1193,862 @@ int populate_extent_blk(a1fs_ino_t ino_i, uint32_t size, fs_ctx *fs){
  */
 a1fs_blk_t get_last_blk(a1fs_ino_t ino, fs_ctx *fs) {
     a1fs_inode *inode = &(fs->root_ino[ino]);   // get the inode
-    a1fs_extent *first_extent = (a1fs_extent *) (fs->data_blk + inode->s_extent_block * A1FS_BLOCK_SIZE);
-    a1fs_extent last_extent = first_extent[inode->i_extents_count - 1]; //get the last extent
-    return last_extent.start + last_extent.count - 1;
+    a1fs_extent *last_extent = get_extent(fs, ino, inode->i_extents_count - 1); //get the last extent
+    return last_extent->start + last_extent->count - 1;
+}
+
+/**
+ * move the inline data of the file with inode index ino_i in file system fs out to a data blk of its own
+ * precondition: there is a free blk
+ *
+ * @param ino_i             inode index of the file; must have A1FS_INLINE_DATA_FL set
+ * @param fs                a pointer to the file system
+ * @return                  0 on success; -EIO on error, in which case the data stays inline
+ */
+static int move_inline_data_out(a1fs_ino_t ino_i, fs_ctx *fs)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino_i]);
+    a1fs_extent extent;
+    search_blk_bitmap(1, fs, &extent);
+    unsigned char *data = fs->data_blk + (size_t)extent.start * fs->block_size;
+    int error = image_write(fs, data, inode->i_data, inode->size);
+    if (error != 0)
+    {
+        unset_bitmap('d', extent.start, 1, fs);
+        return error;
+    }
+    data_written(fs, ino_i, data, inode->size);
+    inode->i_flags &= ~A1FS_INLINE_DATA_FL;
+    memset(inode->i_extents, 0, sizeof(inode->i_extents));
+    inode->i_extents_count = 0;
+    write_extent(ino_i, extent, fs); // goes in the inode, cannot fail
+    return 0;
 }
 
 /**
  * extend the file by filling extend_size 0s at the end of the file with inode index ino_i in file system fs
+ * a regular file that stays within A1FS_INLINE_DATA_MAX bytes keeps its data in the inode
  *
+ * @param bs                block size of fs, a constant in each variant (see BLK_OPS)
  * @param extend_size 	    bytes to extend
  * @param ino_i             inode index of the file
  * @param fs                a pointer to the file system
  * @return                  0 on success; -errno on error.
  */
-int extend_file(uint32_t extend_size, a1fs_ino_t ino_i, fs_ctx *fs){
-    uint32_t offset_remain = extend_size;
+static inline __attribute__((always_inline)) int extend_file_bs(const uint32_t bs, uint64_t extend_size, a1fs_ino_t ino_i,
+                                                             fs_ctx *fs){
+    extents_changed(fs, ino_i);
+    uint64_t offset_remain = extend_size;
     a1fs_inode* inode = &(fs->root_ino[ino_i]);
-    if(inode->size == 0){ // if file is empty
-        a1fs_extent extent;
-        search_blk_bitmap(1, fs, &extent);
-        inode->s_extent_block = extent.start;
-        if(populate_extent_blk(ino_i, offset_remain, fs)== -ENOSPC){
-                return -ENOSPC;
+    if(extend_size == 0){
+        return 0;
+    }
+    journal_dirty(&fs->journal, inode, sizeof(a1fs_inode));
+    if(inode->size + extend_size <= A1FS_INLINE_DATA_MAX && S_ISREG(inode->mode) &&
+       (inode->size == 0 || (inode->i_flags & A1FS_INLINE_DATA_FL))){ // still fits in the inode
+        if(inode->size == 0){
+            inode->i_flags |= A1FS_INLINE_DATA_FL;
         }
+        memset(inode->i_data + inode->size, 0, extend_size);
+        inode->size += extend_size;
         return 0;
+    }
+    // blks needed: the new data blks (the first extents of a file live in its inode)
+    a1fs_lblk_t blks_needed = divide_ceil(inode->size + extend_size, bs) - divide_ceil(inode->size, bs);
+    if(inode->i_flags & A1FS_INLINE_DATA_FL){ // the inline data moves to a blk of its own
+        blks_needed += 1;
+    }
+    if(fs->sb->s_free_blocks_count < blks_needed){
+        return -ENOSPC;
+    }
+    if(inode->i_flags & A1FS_INLINE_DATA_FL){
+        int error = move_inline_data_out(ino_i, fs);
+        if(error != 0){
+            return error;
+        }
+    }
+    if(inode->size == 0){ // if file is empty
+        return populate_extent_blk(ino_i, offset_remain, fs);
     }else{ // if file is not empty 
         a1fs_blk_t last_blk = get_last_blk(ino_i, fs);
         // fill the remaining block
-        if(inode->size % A1FS_BLOCK_SIZE != 0){ // if the last datablk is not fully filled
+        if(inode->size % bs != 0){ // if the last datablk is not fully filled
             
-            int last_fill = (inode->size)%A1FS_BLOCK_SIZE;
-            if(last_fill + extend_size <= A1FS_BLOCK_SIZE){ // data doesn't extend last data blk
-                write_zero_to_blk(ino_i, last_blk,last_fill, extend_size, fs );
-                return 0;
+            uint32_t last_fill = (inode->size)%bs;
+            if(last_fill + extend_size <= bs){ // data doesn't extend last data blk
+                return write_zero_to_blk(ino_i, last_blk,last_fill, extend_size, fs );
 
             }else{ //data exceeds last data blk
-                write_zero_to_blk(ino_i, last_blk,last_fill, A1FS_BLOCK_SIZE - last_fill, fs );
-                offset_remain -= A1FS_BLOCK_SIZE - last_fill;
+                int error = write_zero_to_blk(ino_i, last_blk,last_fill, bs - last_fill, fs );
+                if(error != 0){
+                    return error;
+                }
+                offset_remain -= bs - last_fill;
             }
         }
         // write the remaining blks
-        uint32_t num_db_needed = divide_ceil(offset_remain, A1FS_BLOCK_SIZE);
-        if(search_blk_bitmap_at_idx(last_blk, offset_remain, fs)==0){ // can extend the previous extent
-            write_zero_to_blk(ino_i, last_blk + 1, 0, offset_remain, fs );
-            a1fs_extent *first_extent = (a1fs_extent *) (fs->data_blk + inode->s_extent_block * A1FS_BLOCK_SIZE);
-            a1fs_extent *last_extent = &(first_extent[inode->i_extents_count - 1]);
+        a1fs_lblk_t num_db_needed = divide_ceil(offset_remain, bs);
+        a1fs_extent *last_extent = get_extent(fs, ino_i, inode->i_extents_count - 1);
+        if(num_db_needed <= UINT32_MAX - last_extent->count &&
+           search_blk_bitmap_at_idx(last_blk + 1, num_db_needed, fs)==0){ // can extend the previous extent
+            int error = write_zero_to_blk(ino_i, last_blk + 1, 0, offset_remain, fs );
+            if(error != 0){
+                unset_bitmap('d', last_blk + 1, num_db_needed, fs);
+                return error;
+            }
+            journal_dirty(&fs->journal, last_extent, sizeof(a1fs_extent));
             last_extent->count += num_db_needed;
             return 0;
 
         }else{
-            if(populate_extent_blk(ino_i, offset_remain, fs)== -ENOSPC){
-                return -ENOSPC;
+            return populate_extent_blk(ino_i, offset_remain, fs);
+        }
+    }
+    return 0;
+}
+    
+/*
+ * Variants of find_inode_from_dir(), walk_file_data() and extend_file() for the block size bs, with
+ * bs a constant so that the divisions and remainders by it compile to shifts and masks.
+ */
+#define BLK_OPS(bs)                                                                                                   \
+    static int find_inode_from_dir_##bs(a1fs_ino_t *ino_i, const char *file, size_t len, fs_ctx *fs)                 \
+    {                                                                                                                 \
+        return find_inode_from_dir_bs(bs, ino_i, file, len, fs);                                                      \
+    }                                                                                                                 \
+    static void walk_file_data_##bs(a1fs_ino_t ino, fs_ctx *fs, uint64_t offset, size_t size, extent_cursor *cur,    \
+                                    file_data_fn fn, void *arg)                                                       \
+    {                                                                                                                 \
+        walk_file_data_bs(bs, ino, fs, offset, size, cur, fn, arg);                                                   \
+    }                                                                                                                 \
+    static int extend_file_##bs(uint64_t extend_size, a1fs_ino_t ino_i, fs_ctx *fs)                                  \
+    {                                                                                                                 \
+        return extend_file_bs(bs, extend_size, ino_i, fs);                                                            \
+    }                                                                                                                 \
+    static const blk_ops blk_ops_##bs = {find_inode_from_dir_##bs, walk_file_data_##bs, extend_file_##bs};
+
+A1FS_FOR_EACH_BLOCK_SIZE(BLK_OPS)
+
+#define BLK_OPS_CASE(bs)                                                                                              \
+    case bs:                                                                                                          \
+        return &blk_ops_##bs;
+
+const blk_ops *blk_ops_for(uint32_t block_size)
+{
+    switch (block_size)
+    {
+        A1FS_FOR_EACH_BLOCK_SIZE(BLK_OPS_CASE)
+    default:
+        return NULL;
+    }
+}
+
+int find_inode_from_dir(a1fs_ino_t *ino_i, const char *file, size_t len, fs_ctx *fs)
+{
+    return fs->blk_ops->find_inode_from_dir(ino_i, file, len, fs);
+}
+
+void walk_file_data(a1fs_ino_t ino, fs_ctx *fs, uint64_t offset, size_t size, extent_cursor *cur,
+                    file_data_fn fn, void *arg)
+{
+    fs->blk_ops->walk_file_data(ino, fs, offset, size, cur, fn, arg);
+}
+
+int extend_file(uint64_t extend_size, a1fs_ino_t ino_i, fs_ctx *fs)
+{
+    return fs->blk_ops->extend_file(extend_size, ino_i, fs);
+}
+
+/**
+ * fill the fields of st that a1fs keeps from the inode at index ino in file system fs
+ * st_ino is left to the caller
+ *
+ * @param ino       inode index of the file/dir
+ * @param fs        a pointer to the file system
+ * @param st        the stat struct to fill
+ */
+void stat_inode(a1fs_ino_t ino, fs_ctx *fs, struct stat *st)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino]);
+    st->st_mode = inode->mode;
+    st->st_nlink = inode->links;
+    st->st_size = inode->size;
+    // inline data and inline dirs take no data blk; st_blocks is in 512-byte units
+    st->st_blocks = 0;
+    if (!(inode->i_flags & (A1FS_INLINE_DATA_FL | A1FS_INLINE_DIR_FL)))
+    {
+        st->st_blocks = (get_blk_count(ino, fs) + extent_blk_count(fs, ino)) * (fs->block_size / 512);
+    }
+    st->st_mtim = inode->mtime;
+}
+
+/**
+ * fill st with the statistics of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param st        the statvfs struct to fill
+ */
+void stat_fs(fs_ctx *fs, struct statvfs *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = fs->block_size;
+    st->f_frsize = fs->block_size;
+    st->f_blocks = fs->sb->size / fs->block_size;
+    st->f_bfree = sb_blk_count(&fs->sb->s_free_blocks_count);
+    st->f_bavail = st->f_bfree;
+    st->f_files = fs->sb->s_inodes_count;
+    st->f_ffree = sb_count(&fs->sb->s_free_inodes_count);
+    st->f_favail = st->f_ffree;
+    st->f_namemax = A1FS_NAME_MAX;
+}
+
+/**
+ * call fn on every dentry of the dir at inode index dir_i in file system fs, inline, linear or indexed
+ *
+ * @param dir_i     inode index of the dir
+ * @param fs        a pointer to the file system
+ * @param fn        callback; a non-zero return value stops the iteration
+ * @param arg       argument passed to fn
+ * @return          0 if all dentries were visited; otherwise the value returned by fn
+ */
+int iterate_dir(a1fs_ino_t dir_i, fs_ctx *fs, dirblk_fn fn, void *arg)
+{
+    a1fs_inode *dir = &(fs->root_ino[dir_i]);
+    if (dir->i_flags & A1FS_INDEX_FL)
+    {
+        return dx_iterate(fs, dir_i, fn, arg);
+    }
+    if (dir->size == 0)
+    {
+        return 0;
+    }
+    if (dir->i_flags & A1FS_INLINE_DIR_FL)
+    {
+        return dirblk_inline_iterate(dir->i_data, fn, arg);
+    }
+    return dirblk_iterate(fs, linear_dir_blk(fs->block_size, dir_i, fs), fn, arg);
+}
+
+/**
+ * create a file/dir with mode mode named name in the dir at inode index parent_i in file system fs
+ *
+ * @param parent_i  inode index of the parent dir
+ * @param name      name of the file/dir (need not be null-terminated)
+ * @param len       length of the name
+ * @param mode      mode of the file/dir; S_IFDIR or S_IFREG must be set
+ * @param fs        a pointer to the file system
+ * @param ino       stores the inode index of the new file/dir
+ * @return          0 on success; -ENOSPC if out of inodes, blks or extents
+ */
+int make_file(a1fs_ino_t parent_i, const char *name, size_t len, mode_t mode, fs_ctx *fs, a1fs_ino_t *ino)
+{
+    // all inodes occupied; running out of blocks is reported by add_dentry()
+    if (fs->sb->s_free_inodes_count == 0)
+    {
+        return -ENOSPC;
+    }
+    a1fs_ino_t child_i = create_inode(fs, mode);
+    fs->root_ino[child_i].links = S_ISDIR(mode) ? 2 : 1;
+    int ret = add_dentry(parent_i, create_dentry(child_i, name, len), fs);
+    if (ret != 0)
+    {
+        unset_bitmap('i', child_i, 1, fs);
+        return ret;
+    }
+    if (S_ISDIR(mode))
+    {
+        sb_count_add(&fs->sb->s_dir_count, 1);
+    }
+    *ino = child_i;
+    return 0;
+}
+
+/**
+ * free the data and the inode of the file/dir at inode index ino in file system fs
+ * its dentry must already be gone
+ *
+ * @param ino       inode index of the file/dir
+ * @param fs        a pointer to the file system
+ */
+void free_inode(a1fs_ino_t ino, fs_ctx *fs)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino]);
+    if (S_ISDIR(inode->mode))
+    {
+        sb_count_add(&fs->sb->s_dir_count, -1);
+    }
+    if (inode->size != 0)
+    {
+        delete_file_data(ino, fs);
+    }
+    dirty_clear(&inode_state(fs, ino)->dirty);
+    unset_bitmap('i', ino, 1, fs);
+}
+
+/**
+ * set the size of the file at inode index ino_i in file system fs to size bytes
+ * a failed extension leaves the file as it was
+ *
+ * @param ino_i     inode index of the file
+ * @param fs        a pointer to the file system
+ * @param size      new size in bytes
+ * @return          0 on success; -ENOSPC or -EFBIG on error
+ */
+int resize_file(a1fs_ino_t ino_i, fs_ctx *fs, uint64_t size)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino_i]);
+    uint64_t orig_ino_size = inode->size;
+
+    if (size > INT64_MAX)
+    { // past the largest off_t
+        return -EFBIG;
+    }
+    if (size != inode->size)
+    { // fdatasync() needs the new size and extents
+        inode_state(fs, ino_i)->dirty.metadata = true;
+    }
+    // if the input size is larger than the original size of the file, extend the file
+    if (size > inode->size)
+    {
+        int error = extend_file(size - inode->size, ino_i, fs);
+        if (error != 0)
+        { // revert back to the original size
+            if (orig_ino_size == 0)
+            {
+                delete_file_data(ino_i, fs);
             }
+            else if (inode->size > orig_ino_size)
+            {
+                truncate_file(ino_i, fs, inode->size - orig_ino_size);
+            }
+            return error;
         }
     }
+    // if the input size is smaller than the original size of the file, truncate the file
+    else if (size < inode->size)
+    {
+        if (size == 0)
+        {
+            delete_file_data(ino_i, fs);
+        }
+        else
+        {
+            truncate_file(ino_i, fs, inode->size - size);
+        }
+    }
+    clock_gettime(CLOCK_REALTIME, &(inode->mtime));
     return 0;
 }
-    
\ No newline at end of file
+
+/**
+ * create a handle for the file/dir at inode index ino
+ *
+ * @param ino       inode index of the file/dir
+ * @return          the handle; NULL if out of memory
+ */
+file_handle *create_handle(a1fs_ino_t ino)
+{
+    file_handle *fh = calloc(1, sizeof(file_handle));
+    if (fh == NULL)
+    {
+        return NULL;
+    }
+    fh->ino = ino;
+    pthread_mutex_init(&fh->lock, NULL);
+    return fh;
+}
+
+/**
+ * free the handle fh
+ *
+ * @param fh        the handle
+ */
+void free_handle(file_handle *fh)
+{
+    pthread_mutex_destroy(&fh->lock);
+    free(fh);
+}
+
+/**
+ * get the cursor of the handle fh to work on without holding its lock
+ *
+ * @param fh        the handle; may be NULL
+ * @param cur       stores the cursor
+ * @return          cur; NULL if fh is NULL
+ */
+static extent_cursor *get_handle_cursor(file_handle *fh, extent_cursor *cur)
+{
+    if (fh == NULL)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&fh->lock);
+    *cur = fh->cur;
+    pthread_mutex_unlock(&fh->lock);
+    return cur;
+}
+
+/**
+ * store the cursor cur back in the handle fh
+ *
+ * @param fh        the handle; may be NULL
+ * @param cur       the cursor
+ */
+static void put_handle_cursor(file_handle *fh, const extent_cursor *cur)
+{
+    if (fh == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&fh->lock);
+    fh->cur = *cur;
+    pthread_mutex_unlock(&fh->lock);
+}
+
+/** Smallest and largest readahead windows, in bytes; reads come in FUSE requests of up to 128K. */
+#define READAHEAD_MIN (128 * 1024)
+#define READAHEAD_MAX (4 * 1024 * 1024)
+
+static void readahead_piece(unsigned char *data, size_t size, void *arg)
+{
+    fs_ctx *fs = (fs_ctx *)arg;
+    if (!is_inline(fs, data))
+    {
+        blkio_readahead(&fs->bio, data - (unsigned char *)fs->image, size);
+    }
+}
+
+/**
+ * note a read of size bytes at offset offset of the file at inode index ino_i through the handle fh, and while the
+ * reads through fh are sequential, keep a window of the data after them being read ahead, extent by extent
+ * FUSE may serve the requests of one stream out of order, so a read near the end of the last one still counts
+ * the caller holds the read lock of the inode
+ *
+ * @param ino_i     inode index of the file
+ * @param fs        a pointer to the file system
+ * @param fh        the handle the file is read through; NULL if there is none
+ * @param offset    offset within the file
+ * @param size      number of bytes read
+ */
+static void read_ahead(a1fs_ino_t ino_i, fs_ctx *fs, file_handle *fh, uint64_t offset, size_t size)
+{
+    if (fh == NULL || size == 0)
+    {
+        return;
+    }
+    uint64_t end = offset + size;
+    uint64_t start = 0, stop = 0;
+    pthread_mutex_lock(&fh->lock);
+    readahead_state *ra = &fh->ra;
+    uint64_t slack = (ra->window > READAHEAD_MIN) ? ra->window : READAHEAD_MIN;
+    if (offset + slack < ra->next || offset > ra->next + slack)
+    { // a seek: no readahead until the reads are sequential again
+        ra->window = 0;
+        ra->ahead = end;
+        ra->next = end;
+        pthread_mutex_unlock(&fh->lock);
+        return;
+    }
+    if (ra->window == 0)
+    {
+        ra->window = (2 * size > READAHEAD_MIN) ? 2 * size : READAHEAD_MIN;
+    }
+    if (ra->next < end)
+    {
+        ra->next = end;
+    }
+    if (ra->ahead < ra->next)
+    {
+        ra->ahead = ra->next;
+    }
+    // top the window up once the reader is through half of it
+    if (ra->ahead - ra->next < ra->window / 2)
+    {
+        start = ra->ahead;
+        stop = ra->next + ra->window;
+        ra->ahead = stop;
+        ra->window = (2 * ra->window < READAHEAD_MAX) ? 2 * ra->window : READAHEAD_MAX;
+    }
+    pthread_mutex_unlock(&fh->lock);
+    uint64_t file_size = fs->root_ino[ino_i].size;
+    if (stop > file_size)
+    {
+        stop = file_size;
+    }
+    if (start < stop)
+    {
+        walk_file_data(ino_i, fs, start, stop - start, NULL, readahead_piece, fs);
+    }
+}
+
+/**
+ * read up to size bytes at offset offset of the file at inode index ino_i in file system fs into buf
+ *
+ * @param ino_i     inode index of the file
+ * @param fs        a pointer to the file system
+ * @param buf       the buffer that receives the data
+ * @param size      number of bytes requested
+ * @param offset    offset within the file
+ * @param fh        the handle the file is read through, whose cursor makes sequential reads skip the extent
+ *                  search, and which reads ahead while they are sequential; NULL if there is none
+ * @return          number of bytes read, less than size only at EOF; -EIO on error
+ */
+ssize_t read_file(a1fs_ino_t ino_i, fs_ctx *fs, void *buf, size_t size, uint64_t offset, file_handle *fh)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino_i]);
+    if (offset >= inode->size)
+    {
+        return 0;
+    }
+    size_t to_read = size;
+    if (offset + size > inode->size)
+    {
+        to_read = inode->size - offset;
+    }
+    // the range may span any number of blks and extents
+    extent_cursor cur;
+    int error = read_file_data(ino_i, fs, offset, buf, to_read, get_handle_cursor(fh, &cur));
+    put_handle_cursor(fh, &cur);
+    if (error != 0)
+    {
+        return error;
+    }
+    read_ahead(ino_i, fs, fh, offset, to_read);
+    return (ssize_t)to_read;
+}
+
+/**
+ * make room for a write of size bytes at offset offset of the file at inode index ino_i in file system fs,
+ * extending the file (zero-filling any hole) if the range ends past EOF
+ * the allocator is locked here, and only if the file grows
+ *
+ * @param ino_i     inode index of the file
+ * @param fs        a pointer to the file system
+ * @param size      number of bytes to write
+ * @param offset    offset within the file
+ * @return          0 on success; -ENOSPC, -EFBIG or -EIO on error
+ */
+static int prepare_write(a1fs_ino_t ino_i, fs_ctx *fs, size_t size, uint64_t offset)
+{
+    uint64_t end = offset + size;
+    if (offset > INT64_MAX || end > INT64_MAX)
+    {
+        return -EFBIG;
+    }
+    // write to after EOF == need to extend the file first (zero-filling any hole);
+    // overwrites skip this and never touch the allocator
+    if (end <= fs->root_ino[ino_i].size)
+    {
+        return 0;
+    }
+    alloc_lock(fs);
+    int error = resize_file(ino_i, fs, end);
+    alloc_unlock(fs);
+    return error;
+}
+
+/**
+ * write size bytes from buf at offset offset of the file at inode index ino_i in file system fs
+ * the file is extended first (zero-filling any hole) if the range ends past EOF
+ * the caller holds the write lock of the inode; the allocator is locked here, and only if the file grows
+ *
+ * @param ino_i     inode index of the file
+ * @param fs        a pointer to the file system
+ * @param buf       the data
+ * @param size      number of bytes to write
+ * @param offset    offset within the file
+ * @param fh        the handle the file is written through, whose cursor makes sequential writes skip the extent
+ *                  search; NULL if there is none
+ * @return          0 on success; -ENOSPC, -EFBIG or -EIO on error
+ */
+int write_file(a1fs_ino_t ino_i, fs_ctx *fs, const void *buf, size_t size, uint64_t offset, file_handle *fh)
+{
+    int error = prepare_write(ino_i, fs, size, offset);
+    if (error != 0)
+    {
+        return error;
+    }
+    // the range may span any number of blks and extents
+    journal_dirty(&fs->journal, &(fs->root_ino[ino_i]), sizeof(a1fs_inode));
+    extent_cursor cur;
+    error = write_file_data(ino_i, fs, offset, buf, size, get_handle_cursor(fh, &cur));
+    put_handle_cursor(fh, &cur);
+    clock_gettime(CLOCK_REALTIME, &(fs->root_ino[ino_i].mtime));
+    return error;
+}
+
+/**
+ * allocate a bufvec with room for n bufs
+ *
+ * @param n         number of bufs; at least 1
+ * @return          the bufvec, holding one empty buf; NULL if out of memory
+ */
+static struct fuse_bufvec *alloc_bufvec(size_t n)
+{
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + (n - 1) * sizeof(struct fuse_buf));
+    if (bufv != NULL)
+    {
+        *bufv = FUSE_BUFVEC_INIT(0);
+    }
+    return bufv;
+}
+
+/**
+ * get the most bufs a range of size bytes of a file can need: one per extent it touches, which is at most one
+ * per blk
+ *
+ * @param fs        a pointer to the file system
+ * @param size      number of bytes
+ * @return          number of bufs
+ */
+static size_t max_bufs(const fs_ctx *fs, size_t size)
+{
+    return size / fs->block_size + 2;
+}
+
+/** File system, file, bufvec and first error of add_read_buf() and add_write_buf(). */
+typedef struct file_bufs
+{
+    fs_ctx *fs;
+    a1fs_ino_t ino;
+    struct fuse_bufvec *bufv;
+    int error;
+
+} file_bufs;
+
+/**
+ * append to the bufvec of ctx a buf for the size bytes at data in the mapped image: a range of the image file
+ * for a data blk, or the bytes themselves for inline data
+ *
+ * @param ctx       the bufvec
+ * @param data      start of the bytes in the mapped image
+ * @param size      number of bytes
+ * @param mem       memory to point an inline buf at
+ */
+static void add_buf(file_bufs *ctx, unsigned char *data, size_t size, void *mem)
+{
+    struct fuse_buf *b = &(ctx->bufv->buf[ctx->bufv->count++]);
+    b->size = size;
+    if (is_inline(ctx->fs, data))
+    {
+        b->flags = 0;
+        b->mem = mem;
+        b->fd = -1;
+        b->pos = 0;
+    }
+    else
+    {
+        b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        b->mem = NULL;
+        b->fd = ctx->fs->image_fd;
+        b->pos = data - (unsigned char *)ctx->fs->image;
+    }
+}
+
+static void add_read_buf(unsigned char *data, size_t size, void *arg)
+{
+    file_bufs *ctx = (file_bufs *)arg;
+    void *copy = NULL;
+    if (ctx->error != 0)
+    {
+        return;
+    }
+    if (is_inline(ctx->fs, data))
+    { // the inode may change once it is unlocked, before FUSE sends the reply
+        copy = malloc(size);
+        if (copy == NULL)
+        {
+            ctx->error = -ENOMEM;
+            return;
+        }
+        memcpy(copy, data, size);
+    }
+    add_buf(ctx, data, size, copy);
+}
+
+static void add_write_buf(unsigned char *data, size_t size, void *arg)
+{
+    file_bufs *ctx = (file_bufs *)arg;
+    data_written(ctx->fs, ctx->ino, data, size);
+    add_buf(ctx, data, size, data);
+}
+
+/**
+ * describe up to size bytes at offset offset of the file at inode index ino_i in file system fs as ranges of the
+ * image file (fs->image_fd), one per extent, which FUSE can splice to the kernel without copying them
+ * the bufvec only holds offsets, so the data is read when FUSE sends the reply, and the inode must stay locked
+ * until then; a freed blk may already hold the data of another file; inline data is copied, and so is all of the
+ * data when it goes through the blk cache of fs
+ *
+ * @param ino_i     inode index of the file
+ * @param fs        a pointer to the file system
+ * @param size      number of bytes requested
+ * @param offset    offset within the file
+ * @param fh        the handle the file is read through, which reads ahead while the reads are sequential; NULL
+ *                  if there is none
+ * @param bufp      stores the bufvec, to be freed with free_file_buf(); holds less than size bytes only at EOF
+ * @return          0 on success; -ENOMEM if out of memory; -EIO if the data cannot be read into the blk cache
+ */
+int read_file_buf(a1fs_ino_t ino_i, fs_ctx *fs, size_t size, uint64_t offset, file_handle *fh,
+                  struct fuse_bufvec **bufp)
+{
+    a1fs_inode *inode = &(fs->root_ino[ino_i]);
+    size_t to_read = 0;
+    if (offset < inode->size)
+    {
+        to_read = (offset + size > inode->size) ? inode->size - offset : size;
+    }
+    struct fuse_bufvec *bufv = alloc_bufvec(max_bufs(fs, to_read));
+    if (bufv == NULL)
+    {
+        return -ENOMEM;
+    }
+    if (to_read > 0 && blkio_cached(&fs->bio))
+    { // the image file may be older than the blk cache, so the data is copied instead
+        void *mem = malloc(to_read);
+        if (mem == NULL)
+        {
+            free(bufv);
+            return -ENOMEM;
+        }
+        bufv->buf[0].mem = mem;
+        bufv->buf[0].size = to_read;
+        ssize_t n = read_file(ino_i, fs, mem, to_read, offset, fh);
+        if (n < 0)
+        {
+            free_file_buf(bufv);
+            return n;
+        }
+    }
+    else if (to_read > 0)
+    {
+        bufv->count = 0;
+        file_bufs ctx = { fs, ino_i, bufv, 0 };
+        extent_cursor cur;
+        walk_file_data(ino_i, fs, offset, to_read, get_handle_cursor(fh, &cur), add_read_buf, &ctx);
+        put_handle_cursor(fh, &cur);
+        if (ctx.error != 0)
+        {
+            free_file_buf(bufv);
+            return ctx.error;
+        }
+        read_ahead(ino_i, fs, fh, offset, to_read);
+    }
+    *bufp = bufv;
+    return 0;
+}
+
+/**
+ * free the bufvec bufv made by read_file_buf()
+ *
+ * @param bufv      the bufvec
+ */
+void free_file_buf(struct fuse_bufvec *bufv)
+{
+    for (size_t i = 0; i < bufv->count; i++)
+    {
+        if (!(bufv->buf[i].flags & FUSE_BUF_IS_FD))
+        {
+            free(bufv->buf[i].mem);
+        }
+    }
+    free(bufv);
+}
+
+/**
+ * write the data of buf at offset offset of the file at inode index ino_i in file system fs like write_file(),
+ * copying it with fuse_buf_copy() straight into the image file: from memory, or by splicing the pipe FUSE spliced
+ * the request into; through a copy in memory when the data goes through the blk cache of fs
+ * after a short or failed copy, a file extended for the write ends where the data copied ends
+ *
+ * @param ino_i     inode index of the file
+ * @param fs        a pointer to the file system
+ * @param buf       the data
+ * @param offset    offset within the file
+ * @param fh        the handle the file is written through; NULL if there is none
+ * @return          number of bytes written on success; -ENOMEM, -ENOSPC, -EFBIG, -EIO or the error of
+ *                  fuse_buf_copy() on error
+ */
+ssize_t write_file_buf(a1fs_ino_t ino_i, fs_ctx *fs, struct fuse_bufvec *buf, uint64_t offset, file_handle *fh)
+{
+    size_t size = fuse_buf_size(buf);
+    if (size > 0 && blkio_cached(&fs->bio))
+    { // the data goes through the blk cache, so it is copied out of the request first
+        struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+        mem.buf[0].mem = malloc(size);
+        if (mem.buf[0].mem == NULL)
+        {
+            return -ENOMEM;
+        }
+        ssize_t res = fuse_buf_copy(&mem, buf, 0);
+        if (res > 0)
+        {
+            int error = write_file(ino_i, fs, mem.buf[0].mem, res, offset, fh);
+            res = (error != 0) ? error : res;
+        }
+        free(mem.buf[0].mem);
+        return res;
+    }
+    struct fuse_bufvec *dst = alloc_bufvec(max_bufs(fs, size));
+    if (dst == NULL)
+    {
+        return -ENOMEM;
+    }
+    uint64_t orig_size = fs->root_ino[ino_i].size;
+    int error = prepare_write(ino_i, fs, size, offset);
+    if (error != 0)
+    {
+        free(dst);
+        return error;
+    }
+    journal_dirty(&fs->journal, &(fs->root_ino[ino_i]), sizeof(a1fs_inode));
+    dst->count = 0;
+    file_bufs ctx = { fs, ino_i, dst, 0 };
+    extent_cursor cur;
+    walk_file_data(ino_i, fs, offset, size, get_handle_cursor(fh, &cur), add_write_buf, &ctx);
+    put_handle_cursor(fh, &cur);
+    ssize_t res = (size > 0) ? fuse_buf_copy(dst, buf, 0) : 0;
+    free(dst);
+    // the file was extended for all of the data; after a short copy shrink it back to the end of what was copied,
+    // if that is past the original EOF, and after a failed one to the original size
+    uint64_t end = (res > 0) ? offset + res : orig_size;
+    if (end < orig_size)
+    {
+        end = orig_size;
+    }
+    if (end < fs->root_ino[ino_i].size)
+    {
+        alloc_lock(fs);
+        resize_file(ino_i, fs, end);
+        alloc_unlock(fs);
+    }
+    clock_gettime(CLOCK_REALTIME, &(fs->root_ino[ino_i].mtime));
+    return res;
+}
+
+/**
+ * make the data written to the file/dir at inode index ino_i in file system fs durable, along with the
+ * metadata unless datasync is set and none of the metadata needed to read the data back changed
+ * the caller holds no locks and no journal handle; the inode is locked here only to take its dirty ranges
+ *
+ * @param ino_i     inode index of the file/dir
+ * @param fs        a pointer to the file system
+ * @param datasync  fdatasync(): skip the metadata if only timestamps changed
+ * @return          0 on success; -ENOMEM or -EIO on error
+ */
+int sync_file(a1fs_ino_t ino_i, fs_ctx *fs, bool datasync)
+{
+    dirty_set data;
+    inode_sync_lock(fs, ino_i);
+    dirty_take(&(inode_state(fs, ino_i)->dirty), &data);
+    inode_unlock(fs, ino_i);
+    int ret = journal_sync(&fs->journal, &data, !datasync || data.metadata);
+    if (ret != 0)
+    { // the next fsync() tries again
+        inode_sync_lock(fs, ino_i);
+        dirty_restore(&(inode_state(fs, ino_i)->dirty), &data);
+        inode_unlock(fs, ino_i);
+    }
+    dirty_clear(&data);
+    return ret;
+}
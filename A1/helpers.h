@@ -1,3 +1,5 @@
+#pragma once
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,30 +12,115 @@
 #include <fuse.h>
 
 #include "a1fs.h"
+#include "dirblk.h"
+#include "extent.h"
 #include "fs_ctx.h"
 #include "options.h"
 #include "map.h"
 #include "util.h"
 
+/*
+ * Locking (see fs_ctx): the functions below expect the caller to hold the locks
+ * of the inodes they are given - a read lock to look at a file or dir, a write
+ * lock to change it - plus the allocator lock for the ones that can allocate or
+ * free inodes or blks (create_inode, make_file, free_inode, add_dentry,
+ * rm_dentry, extend_file, truncate_file, resize_file, delete_file_data and the
+ * bitmap functions); write_file() and write_file_buf() take the allocator lock
+ * themselves, only when the file grows. path_lookup() and path_lookup_parent() read-lock each dir
+ * they walk through themselves and return with nothing locked.
+ *
+ * Journaling (see journal.h): the functions that change metadata mark what they change with
+ * journal_dirty() and must run between journal_start() and journal_stop(). File data is read and
+ * written through fs->image_fd, never through the mapping; only inline data lives in the mapping.
+ */
+
+/** Iterator over the components of a path; the path is not modified or copied. */
+typedef struct path_iter
+{
+    /** Rest of the path after the current component. */
+    const char *next;
+    /** Current component (not null-terminated). */
+    const char *name;
+    /** Length of the current component. */
+    size_t len;
+
+} path_iter;
+
+/**
+ * start iterating over the components of the path path
+ *
+ * @param it        the iterator
+ * @param path      the path
+ */
+void path_iter_init(path_iter *it, const char *path);
+
+/**
+ * move the iterator it to the next component of its path
+ *
+ * @param it        the iterator
+ * @return          true if it->name and it->len now describe the next component; false at the end of the path
+ */
+bool path_iter_next(path_iter *it);
+
+/**
+ * check if the name of the dentry dentry is name
+ *
+ * @param dentry    the dentry
+ * @param name      the name to compare with (need not be null-terminated)
+ * @param len       length of the name
+ * @return          true if the names are equal
+ */
+static inline bool dentry_name_eq(const a1fs_dentry *dentry, const char *name, size_t len)
+{
+    return len < A1FS_NAME_MAX && dentry->name[len] == '\0' && memcmp(dentry->name, name, len) == 0;
+}
+
+/**
+ * find the file/dir with name file in the dir at inode index *ino_i of file system fs, without the dentry cache
+ * on success, stores the inode index of the file/dir into ino_i
+ *
+ * @param ino_i     ptr to the inode index of the dir
+ * @param file 	    filename (need not be null-terminated)
+ * @param len       length of the filename
+ * @param fs        a ptr to the file system
+ * @return          0 on success; else error
+ */
+int find_inode_from_dir(a1fs_ino_t *ino_i, const char *file, size_t len, fs_ctx *fs);
+
+/**
+ * look up the file/dir with name file in the dir at inode index *ino_i, going through the dentry cache of fs
+ * on success, stores the inode index of the file/dir into ino_i
+ *
+ * @param ino_i     ptr to the inode index of the dir
+ * @param file 	    filename (need not be null-terminated)
+ * @param len       length of the filename
+ * @param fs        a ptr to the file system
+ * @return          0 on success; else error
+ */
+int lookup_dentry(a1fs_ino_t *ino_i, const char *file, size_t len, fs_ctx *fs);
+
 /**
  * look up the file/dir from path path in file system fs, once found, stores the inode index of the file into inode_i
  *
  * @param path 	    the path to the file
  * @param fs        a pointer to the file system
  * @param inode_i   stores the inode index of the file
- * @return          0 on success;
+ * @return          0 on success; -errno on error
  */
 int path_lookup(const char *path, fs_ctx *fs, a1fs_ino_t *inode_i);
 
 /**
- * get the name path of the parent dir and child file/dir name from the path path
+ * look up the parent dir of the file/dir at path path in file system fs in a single walk
+ * the last component itself is not looked up
  *
- * @param parent 	stores path of the parent dir
- * @param child     stores name of the child file/dir
- * @param path      path given
- * @return          0 on success; -1 otherwise
+ * @param path 	    the path to the file/dir
+ * @param fs        a pointer to the file system
+ * @param parent_i  stores the inode index of the parent dir
+ * @param name      stores the pointer to the last component of path (not null-terminated)
+ * @param len       stores the length of the last component
+ * @return          0 on success; -errno on error
  */
-int get_parent_child_str_from_path(char **parent, char **child, const char *path);
+int path_lookup_parent(const char *path, fs_ctx *fs, a1fs_ino_t *parent_i, const char **name, size_t *len);
 
 /**
  * create an inode with mode mode in file system fs
@@ -44,23 +131,46 @@ int get_parent_child_str_from_path(char **parent, char **child, const char *path
  */
 a1fs_ino_t create_inode(fs_ctx *fs, mode_t mode);
 
+/**
+ * record that a dentry of size bytes was added to (delta > 0) or removed from (delta < 0) the dir dir
+ * updates the size, links and mtime of the dir
+ *
+ * @param dir       the dir inode
+ * @param delta     +1 or -1
+ * @param size      size of the dentry in bytes (see dirblk_entry_size)
+ */
+void update_dir_stats(a1fs_inode *dir, int delta, uint32_t size);
+
 /**
  * add the dentry dentry to dir at inode index dir_i in file system fs
+ * a dir that outgrows its first blk is switched to the hashed index
  *
  * @param dir_i     inode index of the dir
  * @param dentry    the dentry struct to be added
  * @param fs        a pointer to the file system
+ * @return          0 on success; -ENOSPC if out of blks or extents
  */
-void add_dentry(a1fs_ino_t dir_i, a1fs_dentry dentry, fs_ctx *fs);
+int add_dentry(a1fs_ino_t dir_i, a1fs_dentry dentry, fs_ctx *fs);
+
+/**
+ * allocate a new blk at the end of dir at inode index dir_i in file system fs
+ *
+ * @param dir_i     inode index of the dir
+ * @param fs        a pointer to the file system
+ * @param blk       stores the index of the new blk
+ * @return          0 on success; -ENOSPC if out of blks or extents
+ */
+int allocate_blks_for_dir(a1fs_ino_t dir_i, fs_ctx *fs, a1fs_blk_t *blk);
 
 /**
  * create a dentry struct specified by inode index ino and name name
  *
  * @param ino               inode index of the file/dir
- * @param name              name of the file/dir
+ * @param name              name of the file/dir (need not be null-terminated)
+ * @param len               length of the name
  * @return                  a dentry struct specified by ino and name
  */
-a1fs_dentry create_dentry(a1fs_ino_t ino, char *name);
+a1fs_dentry create_dentry(a1fs_ino_t ino, const char *name, size_t len);
 
 /**
  * a ceiling function for x/y
@@ -69,7 +179,7 @@ a1fs_dentry create_dentry(a1fs_ino_t ino, char *name);
  * @param y         denominator
  * @return          ceil(x/y)
  */
-uint32_t divide_ceil(uint32_t x, uint32_t y);
+uint64_t divide_ceil(uint64_t x, uint64_t y);
 
 /**
  * remove a dentry struct dentry in dir at inode index dir_i in file system fs
@@ -80,15 +190,71 @@ uint32_t divide_ceil(uint32_t x, uint32_t y);
  */
 void rm_dentry(a1fs_ino_t dir_i, a1fs_dentry dentry, fs_ctx *fs);
 
+/** Callback of walk_file_data(); gets the next piece of the range, in the mapped image. */
+typedef void (*file_data_fn)(unsigned char *data, size_t size, void *arg);
+
 /**
- * find the pointer to the byte specified by offset of the file with inode index ino in file system fs
+ * call fn on each contiguous piece of the size bytes at offset offset of the file with inode index ino in file
+ * system fs, in order: the inline data, or the part of each extent the range touches
+ * precondition: offset + size <= size of the file
  *
  * @param ino               inode index of the file
  * @param fs                a pointer to the file system
  * @param offset            offset of the file
- * @return                  pointer to the byte
+ * @param size              number of bytes
+ * @param cur               extent cursor to start from and move past the data; NULL to search from scratch
+ * @param fn                callback
+ * @param arg               argument passed to fn
  */
-unsigned char *find_offset(a1fs_ino_t ino, fs_ctx *fs, uint32_t offset);
+void walk_file_data(a1fs_ino_t ino, fs_ctx *fs, uint64_t offset, size_t size, extent_cursor *cur,
+                    file_data_fn fn, void *arg);
+
+/**
+ * read size bytes at offset offset of the file with inode index ino in file system fs into buf
+ * precondition: offset + size <= size of the file
+ *
+ * @param ino               inode index of the file
+ * @param fs                a pointer to the file system
+ * @param offset            offset of the file
+ * @param buf               the buffer that receives the data
+ * @param size              number of bytes to read
+ * @param cur               extent cursor to start from and move past the data; NULL to search from scratch
+ * @return                  0 on success; -EIO on error
+ */
+int read_file_data(a1fs_ino_t ino, fs_ctx *fs, uint64_t offset, void *buf, size_t size, extent_cursor *cur);
+
+/**
+ * write size bytes from buf at offset offset of the file with inode index ino in file system fs
+ * precondition: offset + size <= size of the file
+ *
+ * @param ino               inode index of the file
+ * @param fs                a pointer to the file system
+ * @param offset            offset of the file
+ * @param buf               the buffer containing the data
+ * @param size              number of bytes to write
+ * @param cur               extent cursor to start from and move past the data; NULL to search from scratch
+ * @return                  0 on success; -EIO on error
+ */
+int write_file_data(a1fs_ino_t ino, fs_ctx *fs, uint64_t offset, const void *buf, size_t size, extent_cursor *cur);
+
+/**
+ * find the data blk that holds the logical blk lblk of the file with inode index ino in file system fs
+ *
+ * @param ino               inode index of the file
+ * @param fs                a pointer to the file system
+ * @param lblk              logical blk number within the file
+ * @return                  index of the data blk
+ */
+a1fs_blk_t find_blk(a1fs_ino_t ino, fs_ctx *fs, a1fs_lblk_t lblk);
+
+/**
+ * get the number of data blks of the file with inode index ino in file system fs
+ *
+ * @param ino               inode index of the file
+ * @param fs                a pointer to the file system
+ * @return                  number of data blks
+ */
+a1fs_lblk_t get_blk_count(a1fs_ino_t ino, fs_ctx *fs);
 
 /**
  * get the pointer to the last blk of the file with inode index ino in file system fs
@@ -107,7 +273,28 @@ unsigned char *find_last_blk(a1fs_ino_t ino, fs_ctx *fs);
  * @param fs                a pointer to the file system
  * @return                  0 on success; -errno on error.
  */
-int extend_file(uint32_t extend_size, a1fs_ino_t ino_i, fs_ctx *fs);
+int extend_file(uint64_t extend_size, a1fs_ino_t ino_i, fs_ctx *fs);
+
+/**
+ * find_inode_from_dir(), walk_file_data() and extend_file() are built once for each supported
+ * block size, with the size as a constant, and call the variant that fs_ctx_init() picked for the image
+ */
+typedef struct blk_ops
+{
+    int (*find_inode_from_dir)(a1fs_ino_t *ino_i, const char *file, size_t len, fs_ctx *fs);
+    void (*walk_file_data)(a1fs_ino_t ino, fs_ctx *fs, uint64_t offset, size_t size, extent_cursor *cur,
+                           file_data_fn fn, void *arg);
+    int (*extend_file)(uint64_t extend_size, a1fs_ino_t ino_i, fs_ctx *fs);
+
+} blk_ops;
+
+/**
+ * get the variants of the helpers above built for the block size block_size
+ *
+ * @param block_size        block size in bytes
+ * @return                  the variants; NULL if block_size is not supported
+ */
+const blk_ops *blk_ops_for(uint32_t block_size);
 
 /**
  * delete all the data of the file with inode index ino in file system fs
@@ -126,7 +313,7 @@ void delete_file_data(a1fs_ino_t ino, fs_ctx *fs);
  * @param fs                a pointer to the file system
  * @param bytes_to_delete   bytes to truncate
  */
-void truncate_file(a1fs_ino_t ino, fs_ctx *fs, int bytes_to_delete);
+void truncate_file(a1fs_ino_t ino, fs_ctx *fs, uint64_t bytes_to_delete);
 
 /**
  * flip the bitmap to 0 at index index and of size size
@@ -137,4 +324,208 @@ void truncate_file(a1fs_ino_t ino, fs_ctx *fs, int bytes_to_delete);
  * @param size          number of bits to be flipped
  * @param fs            pointer to the file system
  */
-void unset_bitmap(unsigned char map, uint32_t index, uint32_t size, fs_ctx *fs);
\ No newline at end of file
+void unset_bitmap(unsigned char map, a1fs_blk_t index, uint32_t size, fs_ctx *fs);
+
+/**
+ * precondition: file system has enough number of free blks left
+ * search for empty contiguous blocks of size size in file system fs, taking the smallest free extent that fits
+ * If cannot find one, store the largest number of contiguous blocks in fs into extent
+ * Flip the bits of these empty contiguous blocks and decrease the free_blk count
+ * The free map is used when valid; otherwise the bitmap is scanned from the next-fit cursor of fs
+ *
+ * @param size          number of contiguous blocks to look for
+ * @param fs            pointer to the file system
+ * @param extent        pointer to an extent that stores the resulting extent.start and extent.count
+ */
+void search_blk_bitmap(uint32_t size, fs_ctx *fs, a1fs_extent *extent);
+
+/**
+ * fill the fields of st that a1fs keeps from the inode at index ino in file system fs
+ * st_ino is left to the caller
+ *
+ * @param ino       inode index of the file/dir
+ * @param fs        a pointer to the file system
+ * @param st        the stat struct to fill
+ */
+void stat_inode(a1fs_ino_t ino, fs_ctx *fs, struct stat *st);
+
+/**
+ * fill st with the statistics of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param st        the statvfs struct to fill
+ */
+void stat_fs(fs_ctx *fs, struct statvfs *st);
+
+/**
+ * call fn on every dentry of the dir at inode index dir_i in file system fs, linear or indexed
+ *
+ * @param dir_i     inode index of the dir
+ * @param fs        a pointer to the file system
+ * @param fn        callback; a non-zero return value stops the iteration
+ * @param arg       argument passed to fn
+ * @return          0 if all dentries were visited; otherwise the value returned by fn
+ */
+int iterate_dir(a1fs_ino_t dir_i, fs_ctx *fs, dirblk_fn fn, void *arg);
+
+/**
+ * create a file/dir with mode mode named name in the dir at inode index parent_i in file system fs
+ *
+ * @param parent_i  inode index of the parent dir
+ * @param name      name of the file/dir (need not be null-terminated)
+ * @param len       length of the name
+ * @param mode      mode of the file/dir; S_IFDIR or S_IFREG must be set
+ * @param fs        a pointer to the file system
+ * @param ino       stores the inode index of the new file/dir
+ * @return          0 on success; -ENOSPC if out of inodes, blks or extents
+ */
+int make_file(a1fs_ino_t parent_i, const char *name, size_t len, mode_t mode, fs_ctx *fs, a1fs_ino_t *ino);
+
+/**
+ * free the data and the inode of the file/dir at inode index ino in file system fs
+ * its dentry must already be gone
+ *
+ * @param ino       inode index of the file/dir
+ * @param fs        a pointer to the file system
+ */
+void free_inode(a1fs_ino_t ino, fs_ctx *fs);
+
+/**
+ * set the size of the file at inode index ino_i in file system fs to size bytes
+ * a failed extension leaves the file as it was
+ *
+ * @param ino_i     inode index of the file
+ * @param fs        a pointer to the file system
+ * @param size      new size in bytes
+ * @return          0 on success; -ENOSPC or -EFBIG on error
+ */
+int resize_file(a1fs_ino_t ino_i, fs_ctx *fs, uint64_t size);
+
+/**
+ * sequential read detection of an open file, like the readahead state the kernel keeps for each one: while reads
+ * follow each other, the extents ahead of the reader are read into the page cache a window at a time, and the
+ * window doubles up to a limit; the kernel's own readahead of the image file only reads the blks that follow on
+ * disk, which belong to other files once the file is fragmented
+ */
+typedef struct readahead_state
+{
+    /** Offset where a read continues the stream. */
+    uint64_t next;
+    /** Offset up to which the data has been read ahead. */
+    uint64_t ahead;
+    /** Size of the next window in bytes; 0 until the reads are sequential. */
+    uint64_t window;
+
+} readahead_state;
+
+/** An open file or dir, kept in fi->fh from open() or opendir() until release(). */
+typedef struct file_handle
+{
+    /** Inode index of the file/dir. */
+    a1fs_ino_t ino;
+    /** Where the last read or write through the handle ended. */
+    extent_cursor cur;
+    /** Sequential read detection. */
+    readahead_state ra;
+    /** Protects cur and ra; reads through one handle may run in parallel. */
+    pthread_mutex_t lock;
+
+} file_handle;
+
+/**
+ * create a handle for the file/dir at inode index ino
+ *
+ * @param ino       inode index of the file/dir
+ * @return          the handle; NULL if out of memory
+ */
+file_handle *create_handle(a1fs_ino_t ino);
+
+/**
+ * free the handle fh
+ *
+ * @param fh        the handle
+ */
+void free_handle(file_handle *fh);
+
+/**
+ * read up to size bytes at offset offset of the file at inode index ino_i in file system fs into buf
+ *
+ * @param ino_i     inode index of the file
+ * @param fs        a pointer to the file system
+ * @param buf       the buffer that receives the data
+ * @param size      number of bytes requested
+ * @param offset    offset within the file
+ * @param fh        the handle the file is read through, whose cursor makes sequential reads skip the extent
+ *                  search, and which reads ahead while they are sequential; NULL if there is none
+ * @return          number of bytes read, less than size only at EOF; -EIO on error
+ */
+ssize_t read_file(a1fs_ino_t ino_i, fs_ctx *fs, void *buf, size_t size, uint64_t offset, file_handle *fh);
+
+/**
+ * write size bytes from buf at offset offset of the file at inode index ino_i in file system fs
+ * the file is extended first (zero-filling any hole) if the range ends past EOF
+ * the caller holds the write lock of the inode; the allocator is locked here, and only if the file grows
+ *
+ * @param ino_i     inode index of the file
+ * @param fs        a pointer to the file system
+ * @param buf       the data
+ * @param size      number of bytes to write
+ * @param offset    offset within the file
+ * @param fh        the handle the file is written through, whose cursor makes sequential writes skip the extent
+ *                  search; NULL if there is none
+ * @return          0 on success; -ENOSPC, -EFBIG or -EIO on error
+ */
+int write_file(a1fs_ino_t ino_i, fs_ctx *fs, const void *buf, size_t size, uint64_t offset, file_handle *fh);
+
+/**
+ * describe up to size bytes at offset offset of the file at inode index ino_i in file system fs as ranges of the
+ * image file (fs->image_fd), one per extent, which FUSE can splice to the kernel without copying them
+ * the bufvec only holds offsets, so the data is read when FUSE sends the reply, and the inode must stay locked
+ * until then; a freed blk may already hold the data of another file; inline data is copied, and so is all of the
+ * data when it goes through the blk cache of fs
+ *
+ * @param ino_i     inode index of the file
+ * @param fs        a pointer to the file system
+ * @param size      number of bytes requested
+ * @param offset    offset within the file
+ * @param fh        the handle the file is read through, which reads ahead while the reads are sequential; NULL
+ *                  if there is none
+ * @param bufp      stores the bufvec, to be freed with free_file_buf(); holds less than size bytes only at EOF
+ * @return          0 on success; -ENOMEM if out of memory; -EIO if the data cannot be read into the blk cache
+ */
+int read_file_buf(a1fs_ino_t ino_i, fs_ctx *fs, size_t size, uint64_t offset, file_handle *fh,
+                  struct fuse_bufvec **bufp);
+
+/**
+ * free the bufvec bufv made by read_file_buf()
+ *
+ * @param bufv      the bufvec
+ */
+void free_file_buf(struct fuse_bufvec *bufv);
+
+/**
+ * write the data of buf at offset offset of the file at inode index ino_i in file system fs like write_file(),
+ * copying it with fuse_buf_copy() straight into the image file: from memory, or by splicing the pipe FUSE spliced
+ * the request into; through a copy in memory when the data goes through the blk cache of fs
+ *
+ * @param ino_i     inode index of the file
+ * @param fs        a pointer to the file system
+ * @param buf       the data
+ * @param offset    offset within the file
+ * @param fh        the handle the file is written through; NULL if there is none
+ * @return          number of bytes written on success; -ENOMEM, -ENOSPC, -EFBIG, -EIO or the error of
+ *                  fuse_buf_copy() on error
+ */
+ssize_t write_file_buf(a1fs_ino_t ino_i, fs_ctx *fs, struct fuse_bufvec *buf, uint64_t offset, file_handle *fh);
+
+/**
+ * make the data written to the file/dir at inode index ino_i in file system fs durable, along with the
+ * metadata unless datasync is set and none of the metadata needed to read the data back changed
+ * the caller holds no locks and no journal handle; the inode is locked here only to take its dirty ranges
+ *
+ * @param ino_i     inode index of the file/dir
+ * @param fs        a pointer to the file system
+ * @param datasync  fdatasync(): skip the metadata if only timestamps changed
+ * @return          0 on success; -ENOMEM or -EIO on error
+ */
+int sync_file(a1fs_ino_t ino_i, fs_ctx *fs, bool datasync);
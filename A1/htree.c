@@ -0,0 +1,476 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "htree.h"
+#include "helpers.h"
+
+// Hashed directory index, see a1fs_dx_header in a1fs.h for the layout; the leaves are dir blks (see dirblk.h)
+
+/** Most dentries a leaf of bs bytes can hold, one per tag slot. */
+#define DX_LEAF_MAX(bs) A1FS_DIRENT_SLOTS(bs)
+
+/** One step on the path from the index root down to a leaf. */
+typedef struct dx_frame
+{
+    /** Index block. */
+    a1fs_dx_header *hdr;
+    /** Entry in the index block that covers the hash. */
+    a1fs_dx_entry *at;
+
+} dx_frame;
+
+/** Hash of a dentry in a leaf being split, and the dentry itself. */
+typedef struct dx_map
+{
+    uint32_t hash;
+    dirblk_entry entry;
+
+} dx_map;
+
+/** The dentries collected from a leaf being split. */
+typedef struct dx_map_list
+{
+    uint32_t count;
+    /** Room for DX_LEAF_MAX dentries. */
+    uint32_t max;
+    dx_map map[];
+
+} dx_map_list;
+
+/**
+ * get the entries of the index block hdr
+ *
+ * @param hdr       header of the index block
+ * @return          pointer to the first entry
+ */
+static inline a1fs_dx_entry *dx_entries(a1fs_dx_header *hdr)
+{
+    return (a1fs_dx_entry *)(hdr + 1);
+}
+
+/**
+ * get the pointer to the logical block lblk of the dir at inode index dir_i in file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param dir_i     inode index of the dir
+ * @param lblk      logical block number within the dir
+ * @return          pointer to the block
+ */
+static void *dx_blk(fs_ctx *fs, a1fs_ino_t dir_i, uint32_t lblk)
+{
+    return fs->data_blk + find_blk(dir_i, fs, lblk) * fs->block_size;
+}
+
+/**
+ * find the entry in the index block hdr that covers hash, i.e. the last entry whose hash is <= hash
+ *
+ * @param hdr       header of the index block
+ * @param hash      hash to look for
+ * @return          pointer to the entry
+ */
+static a1fs_dx_entry *dx_search(a1fs_dx_header *hdr, uint32_t hash)
+{
+    a1fs_dx_entry *entries = dx_entries(hdr);
+    // entries[0] covers everything below entries[1].hash
+    uint32_t lo = 1;
+    uint32_t hi = hdr->count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].hash <= hash)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return &entries[lo - 1];
+}
+
+/**
+ * walk the index of the dir at inode index dir_i from the root down to the leaf that covers hash
+ *
+ * @param fs        a pointer to the file system
+ * @param dir_i     inode index of the indexed dir
+ * @param hash      hash to look for
+ * @param frames    stores the path; must have room for A1FS_DX_MAX_LEVELS + 1 frames
+ * @return          number of frames; the last one points at the leaf
+ */
+static int dx_probe(fs_ctx *fs, a1fs_ino_t dir_i, uint32_t hash, dx_frame *frames)
+{
+    a1fs_dx_header *hdr = dx_blk(fs, dir_i, 0);
+    int levels = hdr->levels;
+    assert(levels <= A1FS_DX_MAX_LEVELS);
+    frames[0].hdr = hdr;
+    frames[0].at = dx_search(hdr, hash);
+    for (int i = 1; i <= levels; i++)
+    {
+        hdr = dx_blk(fs, dir_i, frames[i - 1].at->block);
+        frames[i].hdr = hdr;
+        frames[i].at = dx_search(hdr, hash);
+    }
+    return levels + 1;
+}
+
+/**
+ * insert an entry for the child block block covering hash right after at in the index block hdr
+ * assuming the index block is not full
+ *
+ * @param hdr       header of the index block
+ * @param at        entry to insert after
+ * @param hash      lowest hash covered by the child block
+ * @param block     logical block number of the child block
+ */
+static void dx_insert(a1fs_dx_header *hdr, a1fs_dx_entry *at, uint32_t hash, uint32_t block)
+{
+    a1fs_dx_entry *end = dx_entries(hdr) + hdr->count;
+    assert(hdr->count < hdr->limit);
+    memmove(at + 2, at + 1, (end - (at + 1)) * sizeof(a1fs_dx_entry));
+    at[1].hash = hash;
+    at[1].block = block;
+    hdr->count += 1;
+}
+
+/**
+ * initialize an empty index block of file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param hdr       header of the index block
+ */
+static void dx_init(fs_ctx *fs, a1fs_dx_header *hdr)
+{
+    memset(hdr, 0, fs->block_size);
+    hdr->limit = A1FS_DX_LIMIT(fs->block_size);
+}
+
+/**
+ * append a zeroed block to the dir at inode index dir_i in file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param dir_i     inode index of the dir
+ * @param lblk      stores the logical block number of the new block
+ * @param ptr       stores the pointer to the new block
+ * @return          0 on success; -ENOSPC if no blocks are left
+ */
+static int dx_new_blk(fs_ctx *fs, a1fs_ino_t dir_i, uint32_t *lblk, void **ptr)
+{
+    uint32_t count = get_blk_count(dir_i, fs);
+    a1fs_blk_t blk;
+    int ret = allocate_blks_for_dir(dir_i, fs, &blk);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    *lblk = count;
+    *ptr = fs->data_blk + blk * fs->block_size;
+    journal_dirty(&fs->journal, *ptr, fs->block_size);
+    memset(*ptr, 0, fs->block_size);
+    return 0;
+}
+
+int dx_lookup(fs_ctx *fs, a1fs_ino_t dir_i, const char *name, size_t len, a1fs_ino_t *ino)
+{
+    dx_frame frames[A1FS_DX_MAX_LEVELS + 1];
+    int n = dx_probe(fs, dir_i, dx_hash(name, len), frames);
+    a1fs_ino_t *found = dirblk_find(fs, dx_blk(fs, dir_i, frames[n - 1].at->block), name, len);
+    if (found == NULL)
+    {
+        return -ENOENT;
+    }
+    *ino = *found;
+    return 0;
+}
+
+static int dx_map_cmp(const void *a, const void *b)
+{
+    uint32_t ha = ((const dx_map *)a)->hash;
+    uint32_t hb = ((const dx_map *)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+/**
+ * add the dentry entry with its hash to the list of dentries of the leaf being split
+ *
+ * @param entry     the dentry
+ * @param arg       the dx_map_list
+ * @return          0
+ */
+static int dx_map_add(const dirblk_entry *entry, void *arg)
+{
+    dx_map_list *list = arg;
+    assert(list->count < list->max);
+    list->map[list->count].hash = dx_hash(entry->name, entry->len);
+    list->map[list->count].entry = *entry;
+    list->count += 1;
+    return 0;
+}
+
+/**
+ * split the full leaf that frame points at into two leaves, moving the upper half of the hashes to a new block
+ * the halves hold about the same number of bytes; dentries with equal hashes are never separated
+ *
+ * @param fs        a pointer to the file system
+ * @param dir_i     inode index of the indexed dir
+ * @param frame     the index block entry pointing at the leaf; the index block must not be full
+ * @return          0 on success; -ENOSPC if no blocks are left or the leaf cannot be split
+ */
+static int dx_split_leaf(fs_ctx *fs, a1fs_ino_t dir_i, dx_frame *frame)
+{
+    void *leaf = dx_blk(fs, dir_i, frame->at->block);
+    unsigned char old[fs->block_size]; // the names in the map point into this copy
+    memcpy(old, leaf, fs->block_size);
+    dx_map_list *list = malloc(sizeof(dx_map_list) + DX_LEAF_MAX(fs->block_size) * sizeof(dx_map));
+    if (list == NULL)
+    {
+        return -ENOMEM;
+    }
+    list->count = 0;
+    list->max = DX_LEAF_MAX(fs->block_size);
+    dirblk_iterate(fs, old, dx_map_add, list);
+    dx_map *map = list->map;
+    int count = list->count;
+    qsort(map, count, sizeof(dx_map), dx_map_cmp);
+
+    // find the dentry that crosses the middle of the leaf, then the closest hash boundary to it
+    uint32_t total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        total += dirblk_entry_size(fs, map[i].entry.len);
+    }
+    int half = 0;
+    for (uint32_t bytes = 0; half < count - 1 && bytes + dirblk_entry_size(fs, map[half].entry.len) <= total / 2; half++)
+    {
+        bytes += dirblk_entry_size(fs, map[half].entry.len);
+    }
+    if (half == 0)
+    {
+        half = 1;
+    }
+    int split = -1;
+    for (int d = 0; d < count && split < 0; d++)
+    {
+        if (half + d < count && map[half + d - 1].hash != map[half + d].hash)
+        {
+            split = half + d;
+        }
+        else if (half - d > 0 && map[half - d - 1].hash != map[half - d].hash)
+        {
+            split = half - d;
+        }
+    }
+    if (split < 0)
+    { // every dentry has the same hash
+        free(list);
+        return -ENOSPC;
+    }
+
+    uint32_t new_lblk;
+    void *new_leaf;
+    int ret = dx_new_blk(fs, dir_i, &new_lblk, &new_leaf);
+    if (ret != 0)
+    {
+        free(list);
+        return ret;
+    }
+    journal_dirty(&fs->journal, leaf, fs->block_size);
+    journal_dirty(&fs->journal, frame->hdr, fs->block_size);
+    dirblk_init(fs, leaf);
+    dirblk_init(fs, new_leaf);
+    for (int i = 0; i < count; i++)
+    {
+        bool added = dirblk_add(fs, (i < split) ? leaf : new_leaf, map[i].entry.ino, map[i].entry.name,
+                                map[i].entry.len);
+        assert(added);
+        (void)added;
+    }
+    dx_insert(frame->hdr, frame->at, map[split].hash, new_lblk);
+    free(list);
+    return 0;
+}
+
+/**
+ * move the entries of the full index root of the dir at inode index dir_i into a new interior index block
+ * the root is left with a single entry pointing at the new block
+ *
+ * @param fs        a pointer to the file system
+ * @param dir_i     inode index of the indexed dir
+ * @return          0 on success; -ENOSPC if no blocks are left
+ */
+static int dx_grow_root(fs_ctx *fs, a1fs_ino_t dir_i)
+{
+    uint32_t lblk;
+    a1fs_dx_header *node;
+    int ret = dx_new_blk(fs, dir_i, &lblk, (void **)&node);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    a1fs_dx_header *root = dx_blk(fs, dir_i, 0);
+    journal_dirty(&fs->journal, root, fs->block_size);
+    memcpy(node, root, fs->block_size);
+    node->levels = 0;
+    root->count = 1;
+    root->levels += 1;
+    dx_entries(root)[0].hash = 0;
+    dx_entries(root)[0].block = lblk;
+    return 0;
+}
+
+/**
+ * split the full interior index block that frame points at, moving its upper half to a new block
+ *
+ * @param fs        a pointer to the file system
+ * @param dir_i     inode index of the indexed dir
+ * @param parent    the entry in the parent index block pointing at the full block; must not be full
+ * @param frame     the full index block
+ * @return          0 on success; -ENOSPC if no blocks are left
+ */
+static int dx_split_node(fs_ctx *fs, a1fs_ino_t dir_i, dx_frame *parent, dx_frame *frame)
+{
+    uint32_t lblk;
+    a1fs_dx_header *node;
+    int ret = dx_new_blk(fs, dir_i, &lblk, (void **)&node);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    journal_dirty(&fs->journal, frame->hdr, fs->block_size);
+    journal_dirty(&fs->journal, parent->hdr, fs->block_size);
+    dx_init(fs, node);
+    uint32_t half = frame->hdr->count / 2;
+    a1fs_dx_entry *entries = dx_entries(frame->hdr);
+    memcpy(dx_entries(node), entries + half, (frame->hdr->count - half) * sizeof(a1fs_dx_entry));
+    node->count = frame->hdr->count - half;
+    frame->hdr->count = half;
+    dx_insert(parent->hdr, parent->at, entries[half].hash, lblk);
+    return 0;
+}
+
+int dx_add_entry(fs_ctx *fs, a1fs_ino_t dir_i, const a1fs_dentry *dentry)
+{
+    size_t len = strlen(dentry->name);
+    uint32_t hash = dx_hash(dentry->name, len);
+    for (;;)
+    {
+        dx_frame frames[A1FS_DX_MAX_LEVELS + 1];
+        int n = dx_probe(fs, dir_i, hash, frames);
+        void *leaf = dx_blk(fs, dir_i, frames[n - 1].at->block);
+        journal_dirty(&fs->journal, leaf, fs->block_size);
+        if (dirblk_add(fs, leaf, dentry->ino, dentry->name, len))
+        {
+            update_dir_stats(&(fs->root_ino[dir_i]), 1, dirblk_entry_size(fs, len));
+            return 0;
+        }
+
+        // leaf is full; make sure its index block has room for one more leaf first
+        dx_frame *parent = &frames[n - 1];
+        int ret;
+        if (parent->hdr->count < parent->hdr->limit)
+        {
+            ret = dx_split_leaf(fs, dir_i, parent);
+        }
+        else if (n == 1)
+        { //root is full and has no levels below it
+            ret = dx_grow_root(fs, dir_i);
+        }
+        else if (frames[n - 2].hdr->count < frames[n - 2].hdr->limit)
+        {
+            ret = dx_split_node(fs, dir_i, &frames[n - 2], parent);
+        }
+        else
+        { //whole index is full
+            ret = -ENOSPC;
+        }
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+}
+
+int dx_remove_entry(fs_ctx *fs, a1fs_ino_t dir_i, const char *name)
+{
+    size_t len = strlen(name);
+    dx_frame frames[A1FS_DX_MAX_LEVELS + 1];
+    int n = dx_probe(fs, dir_i, dx_hash(name, len), frames);
+    void *leaf = dx_blk(fs, dir_i, frames[n - 1].at->block);
+    journal_dirty(&fs->journal, leaf, fs->block_size);
+    if (!dirblk_remove(fs, leaf, name, len))
+    {
+        return -ENOENT;
+    }
+
+    a1fs_inode *dir = &(fs->root_ino[dir_i]);
+    update_dir_stats(dir, -1, dirblk_entry_size(fs, len));
+    if (dir->size == 0)
+    { //last dentry is gone, free the index and the leaves
+        delete_file_data(dir_i, fs);
+        dir->i_flags &= ~A1FS_INDEX_FL;
+    }
+    return 0;
+}
+
+int dx_convert(fs_ctx *fs, a1fs_ino_t dir_i)
+{
+    a1fs_inode *dir = &(fs->root_ino[dir_i]);
+    assert(!(dir->i_flags & A1FS_INDEX_FL));
+    uint32_t lblk;
+    void *leaf;
+    int ret = dx_new_blk(fs, dir_i, &lblk, &leaf);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    a1fs_dx_header *root = dx_blk(fs, dir_i, 0);
+    journal_dirty(&fs->journal, root, fs->block_size);
+    memcpy(leaf, root, fs->block_size);
+    dx_init(fs, root);
+    root->count = 1;
+    dx_entries(root)[0].hash = 0;
+    dx_entries(root)[0].block = lblk;
+    dir->i_flags |= A1FS_INDEX_FL;
+    return 0;
+}
+
+/**
+ * call fn on every dentry under the index block hdr, which is depth levels above the leaves
+ *
+ * @param fs        a pointer to the file system
+ * @param dir_i     inode index of the indexed dir
+ * @param hdr       header of the index block
+ * @param depth     number of index levels between hdr and the leaves
+ * @param fn        callback; a non-zero return value stops the iteration
+ * @param arg       argument passed to fn
+ * @return          0 if all dentries were visited; otherwise the value returned by fn
+ */
+static int dx_iterate_node(fs_ctx *fs, a1fs_ino_t dir_i, a1fs_dx_header *hdr, int depth, dirblk_fn fn, void *arg)
+{
+    a1fs_dx_entry *entries = dx_entries(hdr);
+    for (uint32_t i = 0; i < hdr->count; i++)
+    {
+        void *child = dx_blk(fs, dir_i, entries[i].block);
+        int ret = 0;
+        if (depth > 0)
+        {
+            ret = dx_iterate_node(fs, dir_i, child, depth - 1, fn, arg);
+        }
+        else
+        {
+            ret = dirblk_iterate(fs, child, fn, arg);
+        }
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int dx_iterate(fs_ctx *fs, a1fs_ino_t dir_i, dirblk_fn fn, void *arg)
+{
+    a1fs_dx_header *root = dx_blk(fs, dir_i, 0);
+    return dx_iterate_node(fs, dir_i, root, root->levels, fn, arg);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "dirblk.h"
+#include "fs_ctx.h"
+
+/**
+ * look up the name name in the indexed dir at inode index dir_i in file system fs
+ *
+ * @param fs        a pointer to the file system
+ * @param dir_i     inode index of the indexed dir
+ * @param name      name of the file/dir to look for (need not be null-terminated)
+ * @param len       length of the name
+ * @param ino       stores the inode index of the file/dir
+ * @return          0 on success; -ENOENT if not found
+ */
+int dx_lookup(fs_ctx *fs, a1fs_ino_t dir_i, const char *name, size_t len, a1fs_ino_t *ino);
+
+/**
+ * add the dentry dentry to the indexed dir at inode index dir_i in file system fs
+ * splits the leaf (and the index blocks above it) when it is full
+ *
+ * @param fs        a pointer to the file system
+ * @param dir_i     inode index of the indexed dir
+ * @param dentry    the dentry struct to be added
+ * @return          0 on success; -ENOSPC if no blocks are left
+ */
+int dx_add_entry(fs_ctx *fs, a1fs_ino_t dir_i, const a1fs_dentry *dentry);
+
+/**
+ * remove the dentry with name name from the indexed dir at inode index dir_i in file system fs
+ * once the dir becomes empty, its blocks are freed and it goes back to the linear format
+ *
+ * @param fs        a pointer to the file system
+ * @param dir_i     inode index of the indexed dir
+ * @param name      name of the dentry to be removed
+ * @return          0 on success; -ENOENT if not found
+ */
+int dx_remove_entry(fs_ctx *fs, a1fs_ino_t dir_i, const char *name);
+
+/**
+ * convert the linear dir at inode index dir_i, whose single block is full, to the indexed format
+ * the old block becomes the index root and its dentries move to a new leaf block
+ *
+ * @param fs        a pointer to the file system
+ * @param dir_i     inode index of the dir
+ * @return          0 on success; -ENOSPC if no blocks are left
+ */
+int dx_convert(fs_ctx *fs, a1fs_ino_t dir_i);
+
+/**
+ * call fn on every dentry of the indexed dir at inode index dir_i in file system fs, in hash order
+ *
+ * @param fs        a pointer to the file system
+ * @param dir_i     inode index of the indexed dir
+ * @param fn        callback; a non-zero return value stops the iteration
+ * @param arg       argument passed to fn
+ * @return          0 if all dentries were visited; otherwise the value returned by fn
+ */
+int dx_iterate(fs_ctx *fs, a1fs_ino_t dir_i, dirblk_fn fn, void *arg);
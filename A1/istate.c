@@ -0,0 +1,242 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "istate.h"
+
+/** Number of hash buckets a shard starts with; a power of 2. */
+#define ISTATE_MIN_BUCKETS 16
+/** Most released entries a shard keeps for reuse. */
+#define ISTATE_MAX_FREE 16
+
+/**
+ * get the shard of the table t that holds the inode ino
+ *
+ * @param t         pointer to the table
+ * @param ino       inode index
+ * @return          the shard
+ */
+static inline istate_shard *shard_of(istate_table *t, a1fs_ino_t ino)
+{
+    return &(t->shards[ino & (ISTATE_SHARDS - 1)]);
+}
+
+/**
+ * get the hash bucket of the shard sh for the inode ino; consecutive inodes of a shard get consecutive buckets
+ *
+ * @param sh        the shard
+ * @param ino       inode index
+ * @return          pointer to the head of the chain
+ */
+static inline istate **bucket_of(istate_shard *sh, a1fs_ino_t ino)
+{
+    return &(sh->buckets[(ino / ISTATE_SHARDS) & (sh->nbuckets - 1)]);
+}
+
+/**
+ * find the entry of the inode ino in the shard sh; the shard is locked
+ *
+ * @param sh        the shard
+ * @param ino       inode index
+ * @return          pointer to the link to the entry; points at NULL if there is none
+ */
+static istate **shard_lookup(istate_shard *sh, a1fs_ino_t ino)
+{
+    istate **link = bucket_of(sh, ino);
+    while (*link != NULL && (*link)->ino != ino)
+    {
+        link = &((*link)->next);
+    }
+    return link;
+}
+
+/**
+ * double the number of buckets of the shard sh, keeping the old ones if there is no memory; the shard is locked
+ *
+ * @param sh        the shard
+ */
+static void shard_grow(istate_shard *sh)
+{
+    istate **buckets = calloc((size_t)sh->nbuckets * 2, sizeof(istate *));
+    if (buckets == NULL)
+    { // longer chains, but still correct
+        return;
+    }
+    istate **old = sh->buckets;
+    uint32_t nold = sh->nbuckets;
+    sh->buckets = buckets;
+    sh->nbuckets *= 2;
+    for (uint32_t b = 0; b < nold; b++)
+    {
+        while (old[b] != NULL)
+        {
+            istate *s = old[b];
+            old[b] = s->next;
+            istate **head = bucket_of(sh, s->ino);
+            s->next = *head;
+            *head = s;
+        }
+    }
+    free(old);
+}
+
+/**
+ * free the memory of the entry s
+ *
+ * @param s         the entry
+ */
+static void istate_free(istate *s)
+{
+    dirty_clear(&s->dirty);
+    pthread_rwlock_destroy(&s->lock);
+    free(s);
+}
+
+bool istate_init(istate_table *t)
+{
+    memset(t, 0, sizeof(istate_table));
+    for (size_t i = 0; i < ISTATE_SHARDS; i++)
+    {
+        istate_shard *sh = &(t->shards[i]);
+        sh->buckets = calloc(ISTATE_MIN_BUCKETS, sizeof(istate *));
+        if (sh->buckets == NULL)
+        {
+            while (i > 0)
+            {
+                free(t->shards[--i].buckets);
+            }
+            return false;
+        }
+        sh->nbuckets = ISTATE_MIN_BUCKETS;
+    }
+    for (size_t i = 0; i < ISTATE_SHARDS; i++)
+    {
+        pthread_mutex_init(&(t->shards[i].lock), NULL);
+    }
+    return true;
+}
+
+void istate_destroy(istate_table *t)
+{
+    for (size_t i = 0; i < ISTATE_SHARDS; i++)
+    {
+        istate_shard *sh = &(t->shards[i]);
+        for (uint32_t b = 0; b < sh->nbuckets; b++)
+        {
+            while (sh->buckets[b] != NULL)
+            {
+                istate *s = sh->buckets[b];
+                sh->buckets[b] = s->next;
+                istate_free(s);
+            }
+        }
+        while (sh->free != NULL)
+        {
+            istate *s = sh->free;
+            sh->free = s->next;
+            free(s);
+        }
+        free(sh->buckets);
+        pthread_mutex_destroy(&(sh->lock));
+    }
+}
+
+void istate_iterate(istate_table *t, void (*fn)(istate *s, void *arg), void *arg)
+{
+    for (size_t i = 0; i < ISTATE_SHARDS; i++)
+    {
+        istate_shard *sh = &(t->shards[i]);
+        for (uint32_t b = 0; b < sh->nbuckets; b++)
+        {
+            for (istate *s = sh->buckets[b]; s != NULL; s = s->next)
+            {
+                fn(s, arg);
+            }
+        }
+    }
+}
+
+istate *istate_get(istate_table *t, a1fs_ino_t ino)
+{
+    istate_shard *sh = shard_of(t, ino);
+    pthread_mutex_lock(&(sh->lock));
+    istate **link = shard_lookup(sh, ino);
+    istate *s = *link;
+    if (s == NULL)
+    {
+        s = sh->free;
+        if (s != NULL)
+        {
+            sh->free = s->next;
+            sh->nfree--;
+        }
+        else
+        {
+            s = malloc(sizeof(istate));
+            if (s == NULL)
+            {
+                fprintf(stderr, "Out of memory for the state of inode %u\n", ino);
+                abort();
+            }
+        }
+        pthread_rwlock_init(&s->lock, NULL);
+        s->ino = ino;
+        s->refs = 0;
+        s->nlookup = 0;
+        s->extent_gen = istate_next_gen(t);
+        memset(&s->dirty, 0, sizeof(dirty_set));
+        s->next = NULL;
+        *link = s;
+        if (++sh->count > 2 * sh->nbuckets)
+        {
+            shard_grow(sh);
+        }
+    }
+    s->refs++;
+    pthread_mutex_unlock(&(sh->lock));
+    return s;
+}
+
+void istate_put(istate_table *t, a1fs_ino_t ino)
+{
+    istate_shard *sh = shard_of(t, ino);
+    pthread_mutex_lock(&(sh->lock));
+    istate **link = shard_lookup(sh, ino);
+    istate *s = *link;
+    pthread_rwlock_unlock(&s->lock);
+    // with no references left nobody else can touch the dirty set
+    istate *release = NULL;
+    if (--s->refs == 0 && s->nlookup == 0 && s->dirty.count == 0 && !s->dirty.metadata && !s->dirty.overflow)
+    {
+        *link = s->next;
+        sh->count--;
+        if (sh->nfree < ISTATE_MAX_FREE)
+        { // the lock is set up again for the next inode that gets the entry
+            dirty_clear(&s->dirty);
+            pthread_rwlock_destroy(&s->lock);
+            s->next = sh->free;
+            sh->free = s;
+            sh->nfree++;
+        }
+        else
+        {
+            release = s;
+        }
+    }
+    pthread_mutex_unlock(&(sh->lock));
+    if (release != NULL)
+    {
+        istate_free(release);
+    }
+}
+
+istate *istate_find(istate_table *t, a1fs_ino_t ino)
+{
+    istate_shard *sh = shard_of(t, ino);
+    pthread_mutex_lock(&(sh->lock));
+    istate *s = *shard_lookup(sh, ino);
+    pthread_mutex_unlock(&(sh->lock));
+    assert(s != NULL);
+    return s;
+}
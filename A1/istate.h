@@ -0,0 +1,130 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "dirty.h"
+
+/** Number of inode state table shards; a power of 2. */
+#define ISTATE_SHARDS 64
+
+/** Runtime state of one inode, which only exists while the inode is locked, has unsynced data or is looked up. */
+typedef struct istate
+{
+    /** Next entry in the same hash bucket, or in the free list. */
+    struct istate *next;
+    /** Inode index. */
+    a1fs_ino_t ino;
+    /** Number of threads that hold the lock or wait for it. */
+    uint32_t refs;
+    /** Number of lookups of the inode the kernel holds (a1fs_ll only); only changes under the write lock, or
+     *  atomically under a read lock. */
+    uint64_t nlookup;
+    /** Changes whenever the extents of the inode change; see istate_next_gen(). */
+    uint64_t extent_gen;
+    /** Data written since the last fsync(); only touched under the lock. */
+    dirty_set dirty;
+    /** Reader-writer lock of the inode. */
+    pthread_rwlock_t lock;
+
+} istate;
+
+/** One shard of the inode state table, holding the inodes whose index is its index modulo the number of shards. */
+typedef struct istate_shard
+{
+    /** Hash buckets; the number of buckets is a power of 2. */
+    istate **buckets;
+    uint32_t nbuckets;
+    /** Number of entries in the buckets. */
+    uint32_t count;
+    /** Released entries kept for reuse, and their number. */
+    istate *free;
+    uint32_t nfree;
+    /** Protects all of the above and the refs of the entries. */
+    pthread_mutex_t lock;
+
+} istate_shard;
+
+/**
+ * Inode state table: the locks, dirty sets and extent generations of the inodes in use, in a sharded hash table.
+ *
+ * An entry is created when its inode is locked, is kept while any thread holds or waits for the lock, and after
+ * that only while the inode has data that is not synced yet or the kernel holds lookups of it. The memory used
+ * thus follows the number of inodes being accessed and written, not the size of the inode table. Every inode has
+ * a lock of its own, so an operation can lock several inodes (e.g. a dir and a file in it) without deadlocking on
+ * a lock shared with another one.
+ */
+typedef struct istate_table
+{
+    istate_shard shards[ISTATE_SHARDS];
+    /** Last extent generation handed out. */
+    uint64_t gen;
+
+} istate_table;
+
+/**
+ * initialize the empty inode state table t
+ *
+ * @param t         pointer to the table
+ * @return          true on success; false if out of memory
+ */
+bool istate_init(istate_table *t);
+
+/**
+ * free all the entries of the inode state table t, dropping the dirty sets of inodes that were never synced
+ *
+ * @param t         pointer to the table
+ */
+void istate_destroy(istate_table *t);
+
+/**
+ * call fn on every entry of the table t
+ * no other thread may use the table meanwhile, and fn may look entries up but must not lock or release any
+ *
+ * @param t         pointer to the table
+ * @param fn        callback
+ * @param arg       argument passed to fn
+ */
+void istate_iterate(istate_table *t, void (*fn)(istate *s, void *arg), void *arg);
+
+/**
+ * get the entry of the inode at index ino in the table t, creating it if there is none, and take a reference to it
+ * aborts if there is no memory for a new entry, since inode locks cannot fail
+ *
+ * @param t         pointer to the table
+ * @param ino       inode index
+ * @return          the entry, which stays valid until istate_put()
+ */
+istate *istate_get(istate_table *t, a1fs_ino_t ino);
+
+/**
+ * unlock the entry of the inode at index ino in the table t and drop the reference taken by istate_get(); the entry
+ * is released once it has no references and no unsynced data
+ *
+ * @param t         pointer to the table
+ * @param ino       inode index; the caller holds its lock
+ */
+void istate_put(istate_table *t, a1fs_ino_t ino);
+
+/**
+ * find the entry of the inode at index ino in the table t, which the caller holds a reference to
+ *
+ * @param t         pointer to the table
+ * @param ino       inode index; the caller holds its lock
+ * @return          the entry
+ */
+istate *istate_find(istate_table *t, a1fs_ino_t ino);
+
+/**
+ * get a new extent generation from the table t, never handed out before, so that a cursor set from an entry that
+ * was released since never matches the next entry of the same inode
+ *
+ * @param t         pointer to the table
+ * @return          the generation; never 0, so zeroed cursors are stale
+ */
+static inline uint64_t istate_next_gen(istate_table *t)
+{
+    return __atomic_add_fetch(&t->gen, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,947 @@
+#define _GNU_SOURCE // sync_file_range()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "bitmap.h"
+
+// Metadata journal, see a1fs_journal_header in a1fs.h for the log format
+
+/** The commit thread is woken when the running transaction fills this fraction of the log... */
+#define JOURNAL_WAKE_DIV 4
+/** ...and new operations wait for it when it fills this fraction. */
+#define JOURNAL_WAIT_DIV 2
+
+/**
+ * get the number of log blks a transaction of count metadata blks takes in the journal j
+ *
+ * @param j         pointer to the journal
+ * @param count     number of metadata blks
+ * @return          number of descriptor blks, images and the commit blk
+ */
+static size_t txn_blks(const journal *j, size_t count)
+{
+    return (count + A1FS_JOURNAL_TAGS(j->block_size) - 1) / A1FS_JOURNAL_TAGS(j->block_size) + count + 1;
+}
+
+/**
+ * get the number of metadata blks at which the running transaction of the journal j fills the fraction 1 / div of
+ * the log; at least 1, so that a small log does not keep the commit thread busy and new operations waiting
+ *
+ * @param j         pointer to the journal
+ * @param div       JOURNAL_WAKE_DIV or JOURNAL_WAIT_DIV
+ * @return          number of metadata blks
+ */
+static uint32_t txn_limit(const journal *j, uint32_t div)
+{
+    return (j->max_count + div - 1) / div;
+}
+
+/**
+ * get the home block number of the metadata blk number i of a transaction of the journal j
+ *
+ * @param j         pointer to the journal
+ * @param txn       the transaction, starting with the first descriptor blk
+ * @param i         index of the metadata blk in the transaction
+ * @return          pointer to the home block number in the descriptor blks
+ */
+static inline a1fs_blk_t *txn_tag(const journal *j, const unsigned char *txn, size_t i)
+{
+    size_t tags = A1FS_JOURNAL_TAGS(j->block_size);
+    return &(((a1fs_journal_desc *)(txn + (i / tags) * j->block_size))->blocks[i % tags]);
+}
+
+/**
+ * compute the checksum of the len bytes at buf (FNV-1a over 64-bit words)
+ *
+ * @param buf       the data; len must be a multiple of 8
+ * @param len       number of bytes
+ * @return          the checksum
+ */
+static uint64_t journal_checksum(const unsigned char *buf, size_t len)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, buf + i, sizeof(word));
+        hash ^= word;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * read count blks of the image file of the journal j from the blk blk into buf
+ *
+ * @param j         pointer to the journal
+ * @param buf       the buffer
+ * @param blk       first image blk
+ * @param count     number of blks
+ * @return          true on success; false on an I/O error
+ */
+static bool read_blks(journal *j, void *buf, size_t blk, size_t count)
+{
+    size_t done = 0;
+    size_t size = count * j->block_size;
+    while (done < size)
+    {
+        ssize_t n = pread(j->fd, (unsigned char *)buf + done, size - done, blk * j->block_size + done);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            perror("journal: pread");
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+/**
+ * write count blks from buf to the image file of the journal j at the blk blk
+ *
+ * @param j         pointer to the journal
+ * @param buf       the data
+ * @param blk       first image blk
+ * @param count     number of blks
+ * @return          true on success; false on an I/O error
+ */
+static bool write_blks(journal *j, const void *buf, size_t blk, size_t count)
+{
+    size_t done = 0;
+    size_t size = count * j->block_size;
+    while (done < size)
+    {
+        ssize_t n = pwrite(j->fd, (const unsigned char *)buf + done, size - done, blk * j->block_size + done);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            perror("journal: pwrite");
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+/**
+ * wait for the image file of the journal j to reach the disk
+ *
+ * @param j         pointer to the journal
+ * @return          true on success; false on an I/O error
+ */
+static bool sync_image(journal *j)
+{
+    if (fdatasync(j->fd) != 0)
+    {
+        perror("journal: fdatasync");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * write the journal superblock of the journal j, making start the first log blk to replay from seq on
+ *
+ * @param j         pointer to the journal
+ * @param seq       sequence number of the first transaction to replay
+ * @param start     log blk of the first transaction to replay
+ * @return          true on success; false on an I/O error
+ */
+static bool write_super(journal *j, uint64_t seq, uint32_t start)
+{
+    unsigned char blk[j->block_size];
+    memset(blk, 0, j->block_size);
+    a1fs_journal_super jsb = {{A1FS_JOURNAL_MAGIC, A1FS_JOURNAL_SUPER, seq}, start, 0};
+    memcpy(blk, &jsb, sizeof(jsb));
+    return write_blks(j, blk, j->start, 1);
+}
+
+/**
+ * check that the count blks at txn are a complete transaction with sequence number seq
+ *
+ * @param j         pointer to the journal
+ * @param txn       the blks, starting with the first descriptor blk
+ * @param seq       expected sequence number
+ * @param count     number of metadata blks, from the first descriptor blk
+ * @return          true if every descriptor and the commit blk match and the checksum is right
+ */
+static bool txn_valid(journal *j, const unsigned char *txn, uint64_t seq, uint32_t count)
+{
+    size_t ndesc = txn_blks(j, count) - count - 1;
+    for (size_t i = 0; i < ndesc; i++)
+    {
+        const a1fs_journal_desc *desc = (const a1fs_journal_desc *)(txn + i * j->block_size);
+        if (desc->h.magic != A1FS_JOURNAL_MAGIC || desc->h.type != A1FS_JOURNAL_DESC || desc->h.seq != seq ||
+            desc->count != count)
+        {
+            return false;
+        }
+        size_t tags = A1FS_JOURNAL_TAGS(j->block_size);
+        for (size_t t = 0; t < tags && i * tags + t < count; t++)
+        {
+            if (desc->blocks[t] >= j->nimage_blks)
+            {
+                return false;
+            }
+        }
+    }
+    const a1fs_journal_commit *commit = (const a1fs_journal_commit *)(txn + (ndesc + count) * j->block_size);
+    return commit->h.magic == A1FS_JOURNAL_MAGIC && commit->h.type == A1FS_JOURNAL_COMMIT &&
+           commit->h.seq == seq && commit->count == count &&
+           commit->checksum == journal_checksum(txn, (ndesc + count) * j->block_size);
+}
+
+/**
+ * read the transaction with sequence number seq at the log blk pos of the journal j into txn
+ *
+ * @param j         pointer to the journal
+ * @param txn       buffer with room for the whole log
+ * @param pos       log blk of the first descriptor blk
+ * @param seq       expected sequence number
+ * @return          number of metadata blks in the transaction; 0 if there is no valid transaction there
+ */
+static uint32_t read_txn(journal *j, unsigned char *txn, uint32_t pos, uint64_t seq)
+{
+    if (pos >= j->nblks || !read_blks(j, txn, j->start + pos, 1))
+    {
+        return 0;
+    }
+    const a1fs_journal_desc *desc = (const a1fs_journal_desc *)txn;
+    if (desc->h.magic != A1FS_JOURNAL_MAGIC || desc->h.type != A1FS_JOURNAL_DESC || desc->h.seq != seq)
+    {
+        return 0;
+    }
+    uint32_t count = desc->count;
+    if (count == 0 || count > j->max_count || pos + txn_blks(j, count) > j->nblks ||
+        !read_blks(j, txn, j->start + pos, txn_blks(j, count)) || !txn_valid(j, txn, seq, count))
+    {
+        return 0;
+    }
+    return count;
+}
+
+/**
+ * write the images of the count metadata blks of the transaction txn home
+ *
+ * @param j         pointer to the journal
+ * @param txn       the transaction, starting with the first descriptor blk
+ * @param count     number of metadata blks
+ * @return          true on success; false on an I/O error
+ */
+static bool write_home(journal *j, const unsigned char *txn, uint32_t count)
+{
+    size_t ndesc = txn_blks(j, count) - count - 1;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!write_blks(j, txn + (ndesc + i) * j->block_size, *txn_tag(j, txn, i), 1))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * replay the committed transactions in the log of the journal j and empty the log
+ * with check_only, the log is only scanned and nothing is written
+ *
+ * @param j             pointer to the journal
+ * @param check_only    only count the transactions
+ * @param count         stores the number of transactions in the log
+ * @return              true on success; false if the journal superblock is corrupt or on an I/O error
+ */
+static bool journal_replay(journal *j, bool check_only, uint32_t *count)
+{
+    a1fs_journal_super jsb;
+    unsigned char blk[j->block_size];
+    if (!read_blks(j, blk, j->start, 1))
+    {
+        return false;
+    }
+    memcpy(&jsb, blk, sizeof(jsb));
+    if (jsb.h.magic != A1FS_JOURNAL_MAGIC || jsb.h.type != A1FS_JOURNAL_SUPER || jsb.start == 0 ||
+        jsb.start >= j->nblks)
+    {
+        fprintf(stderr, "Invalid journal superblock\n");
+        return false;
+    }
+    unsigned char *txn = malloc((size_t)(j->nblks - 1) * j->block_size);
+    if (txn == NULL)
+    {
+        return false;
+    }
+    uint64_t seq = jsb.h.seq;
+    uint32_t pos = jsb.start;
+    uint32_t replayed = 0;
+    for (;;)
+    {
+        uint32_t count = read_txn(j, txn, pos, seq);
+        if (count == 0 && pos != 1)
+        { // the next transaction did not fit at the end of the log
+            pos = 1;
+            count = read_txn(j, txn, pos, seq);
+        }
+        if (count == 0)
+        {
+            break;
+        }
+        if (!check_only && !write_home(j, txn, count))
+        {
+            free(txn);
+            return false;
+        }
+        replayed++;
+        seq++;
+        pos += txn_blks(j, count);
+    }
+    free(txn);
+    *count = replayed;
+    if (check_only)
+    {
+        return true;
+    }
+    // the blks must be home before the log forgets them
+    if ((replayed > 0 && !sync_image(j)) || !write_super(j, seq, 1) || !sync_image(j))
+    {
+        return false;
+    }
+    if (replayed > 0)
+    {
+        fprintf(stderr, "Replayed %u journal transactions\n", replayed);
+    }
+    j->seq = seq;
+    j->head = 1;
+    return true;
+}
+
+/**
+ * find the journal of the image in the superblock sb and check that it fits in the image
+ *
+ * @param j         pointer to the journal; fd, image and nimage_blks must be set
+ * @param sb        the superblock
+ * @return          true on success; false if the journal location is invalid
+ */
+static bool journal_locate(journal *j, const a1fs_superblock *sb)
+{
+    j->start = sb->s_journal_block;
+    j->nblks = sb->s_journal_blocks;
+    if (j->nblks < 4 || (size_t)j->start + j->nblks > j->nimage_blks)
+    {
+        fprintf(stderr, "Invalid journal location\n");
+        return false;
+    }
+    j->max_count = j->nblks - 3;
+    while (txn_blks(j, j->max_count) > j->nblks - 1)
+    {
+        j->max_count--;
+    }
+    return true;
+}
+
+bool journal_init(journal *j, void *image, size_t size, int fd, unsigned int interval)
+{
+    memset(j, 0, sizeof(journal));
+    const a1fs_superblock *sb = (const a1fs_superblock *)((unsigned char *)image + A1FS_SB_OFFSET);
+    j->enabled = (sb->s_features & A1FS_FEATURE_JOURNAL) != 0;
+    j->fd = fd;
+    j->image = image;
+    j->block_size = sb->s_block_size;
+    j->blk_shift = __builtin_ctz(sb->s_block_size);
+    j->nimage_blks = size / j->block_size;
+    if (!j->enabled)
+    { // the dirty blks are only tracked for fsync()
+        j->dirty = calloc((j->nimage_blks + 7) / 8, 1);
+        return j->dirty != NULL;
+    }
+    j->interval = interval;
+    if (!journal_locate(j, sb))
+    {
+        return false;
+    }
+    // a transaction that does not fit in the log is rare, and its commit scans the dirty bits instead
+    j->list_max = j->max_count;
+    j->dirty = calloc((j->nimage_blks + 7) / 8, 1);
+    j->committing = calloc((j->nimage_blks + 7) / 8, 1);
+    j->listed = malloc(j->list_max * sizeof(a1fs_blk_t));
+    // replay through the shared mapping, then keep further changes private until they are committed
+    uint32_t replayed;
+    if (j->dirty == NULL || j->committing == NULL || j->listed == NULL || !journal_replay(j, false, &replayed))
+    {
+        free(j->dirty);
+        free(j->committing);
+        free(j->listed);
+        return false;
+    }
+    // only metadata blks are ever copied, so do not reserve swap for the whole image, which would keep images
+    // larger than memory from mounting
+    if (mmap(image, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, fd, 0) == MAP_FAILED)
+    {
+        perror("journal: mmap");
+        free(j->dirty);
+        free(j->committing);
+        free(j->listed);
+        return false;
+    }
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_mutex_init(&j->commit_lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+    pthread_cond_init(&j->wake, NULL);
+    return true;
+}
+
+int journal_recover(void *image, size_t size, int fd, bool check_only)
+{
+    const a1fs_superblock *sb = (const a1fs_superblock *)((unsigned char *)image + A1FS_SB_OFFSET);
+    if (!(sb->s_features & A1FS_FEATURE_JOURNAL))
+    {
+        return 0;
+    }
+    journal j = {0};
+    j.fd = fd;
+    j.image = image;
+    j.block_size = sb->s_block_size;
+    j.blk_shift = __builtin_ctz(sb->s_block_size);
+    j.nimage_blks = size / j.block_size;
+    uint32_t count;
+    if (!journal_locate(&j, sb) || !journal_replay(&j, check_only, &count))
+    {
+        return -1;
+    }
+    return count;
+}
+
+/**
+ * set the dirty bits of the count blks listed in the descriptor blks at txn again, after a failed commit
+ *
+ * @param j         pointer to the journal
+ * @param txn       the transaction, starting with the first descriptor blk
+ * @param count     number of metadata blks
+ */
+static void redirty(journal *j, const unsigned char *txn, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        journal_dirty(j, j->image + (size_t)*txn_tag(j, txn, i) * j->block_size, 1);
+    }
+}
+
+/**
+ * drop the private copies of the blks the last commit wrote home that have not changed since, so that the
+ * mapping reads them from the page cache again; must be called with no operation running
+ *
+ * @param j         pointer to the journal
+ */
+static void drop_written(journal *j)
+{
+    for (uint32_t i = 0; i < j->nwritten;)
+    {
+        a1fs_blk_t blk = j->written[i];
+        uint32_t run = 0; // consecutive clean blks
+        while (i + run < j->nwritten && j->written[i + run] == blk + run &&
+               !(j->dirty[(blk + run) / 8] & (1 << ((blk + run) % 8))))
+        {
+            run++;
+        }
+        if (run > 0)
+        {
+            madvise(j->image + (size_t)blk * j->block_size, (size_t)run * j->block_size, MADV_DONTNEED);
+        }
+        i += (run > 0) ? run : 1;
+    }
+    j->nwritten = 0;
+}
+
+static int blk_cmp(const void *a, const void *b)
+{
+    a1fs_blk_t ba = *(const a1fs_blk_t *)a;
+    a1fs_blk_t bb = *(const a1fs_blk_t *)b;
+    return (ba > bb) - (ba < bb);
+}
+
+/**
+ * move the blk blk from the running transaction of the journal j to the transaction txn, unless it is not dirty
+ * (it was forgotten, or listed twice and already moved); must be called with no operation running
+ *
+ * @param j         pointer to the journal
+ * @param txn       the transaction, starting with the first descriptor blk
+ * @param ndesc     number of descriptor blks of txn
+ * @param blk       image blk
+ * @param i         index of the next metadata blk in txn; incremented if blk is moved
+ */
+static void take_blk(journal *j, unsigned char *txn, size_t ndesc, a1fs_blk_t blk, uint32_t *i)
+{
+    unsigned char bit = 1 << (blk % 8);
+    if (!(j->dirty[blk / 8] & bit))
+    {
+        return;
+    }
+    j->dirty[blk / 8] &= ~bit;
+    j->committing[blk / 8] |= bit;
+    *txn_tag(j, txn, *i) = blk;
+    memcpy(txn + (ndesc + *i) * j->block_size, j->image + (size_t)blk * j->block_size, j->block_size);
+    (*i)++;
+}
+
+/**
+ * take a copy of the running transaction of the journal j once the running operations are done
+ * its blks move from the dirty bits to the committing ones and the next transaction starts; only the listed
+ * blks are visited, so this takes time in the size of the transaction, not of the image
+ *
+ * @param j         pointer to the journal; commit_lock must be held
+ * @param count     stores the number of metadata blks
+ * @return          the transaction blks, to be freed with free(); NULL if it is empty or out of memory
+ */
+static unsigned char *take_txn(journal *j, uint32_t *count)
+{
+    pthread_mutex_lock(&j->lock);
+    if (__atomic_load_n(&j->ndirty, __ATOMIC_RELAXED) == 0)
+    {
+        pthread_mutex_unlock(&j->lock);
+        return NULL;
+    }
+    j->locked = true;
+    while (j->handles > 0)
+    {
+        pthread_cond_wait(&j->cond, &j->lock);
+    }
+    // nothing changes the image until locked is cleared
+    *count = __atomic_load_n(&j->ndirty, __ATOMIC_RELAXED);
+    size_t ndesc = txn_blks(j, *count) - *count - 1;
+    unsigned char *txn = malloc(txn_blks(j, *count) * j->block_size);
+    if (txn != NULL)
+    {
+        memset(txn, 0, ndesc * j->block_size);
+        drop_written(j);
+        uint32_t nlisted = __atomic_load_n(&j->nlisted, __ATOMIC_RELAXED);
+        uint32_t i = 0;
+        if (nlisted <= j->list_max)
+        { // in blk order, so that runs of blks are written home together
+            qsort(j->listed, nlisted, sizeof(a1fs_blk_t), blk_cmp);
+            for (uint32_t k = 0; k < nlisted; k++)
+            {
+                take_blk(j, txn, ndesc, j->listed[k], &i);
+            }
+        }
+        else
+        {
+            for (a1fs_blk_t blk = bitmap_next_one(j->dirty, j->nimage_blks, 0); blk < j->nimage_blks;
+                 blk = bitmap_next_one(j->dirty, j->nimage_blks, blk + 1))
+            {
+                take_blk(j, txn, ndesc, blk, &i);
+            }
+        }
+        assert(i == *count);
+        __atomic_store_n(&j->ndirty, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&j->nlisted, 0, __ATOMIC_RELAXED);
+        j->writing_home = true;
+    }
+    j->locked = false;
+    pthread_cond_broadcast(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+    return txn;
+}
+
+/**
+ * write the transaction txn of count metadata blks to the log of the journal j, then home
+ *
+ * @param j         pointer to the journal; commit_lock must be held
+ * @param txn       the transaction; its descriptor blks list the home blks
+ * @param count     number of metadata blks
+ * @return          true on success; false on an I/O error
+ */
+static bool write_txn(journal *j, unsigned char *txn, uint32_t count)
+{
+    size_t ndesc = txn_blks(j, count) - count - 1;
+    for (size_t i = 0; i < ndesc; i++)
+    {
+        a1fs_journal_desc *desc = (a1fs_journal_desc *)(txn + i * j->block_size);
+        desc->h = (a1fs_journal_header){A1FS_JOURNAL_MAGIC, A1FS_JOURNAL_DESC, j->seq};
+        desc->count = count;
+    }
+    a1fs_journal_commit *commit = (a1fs_journal_commit *)(txn + (ndesc + count) * j->block_size);
+    memset(commit, 0, j->block_size);
+    commit->h = (a1fs_journal_header){A1FS_JOURNAL_MAGIC, A1FS_JOURNAL_COMMIT, j->seq};
+    commit->count = count;
+    commit->checksum = journal_checksum(txn, (ndesc + count) * j->block_size);
+
+    if (count > j->max_count)
+    { // too large for the log: empty it so no older image is replayed over these, then write them in place
+        fprintf(stderr, "Journal transaction of %u blocks does not fit in the log, writing it in place\n", count);
+        return write_super(j, j->seq, j->head) && sync_image(j) && write_home(j, txn, count) && sync_image(j);
+    }
+    if (j->head + txn_blks(j, count) > j->nblks)
+    { // wrap around; whatever the log held before is home already
+        j->head = 1;
+    }
+    // the previous transactions are home, replay would start from this one; the transaction is committed once
+    // the sync returns, then it goes home
+    if (!write_super(j, j->seq, j->head) || !write_blks(j, txn, j->start + j->head, txn_blks(j, count)) ||
+        !sync_image(j) || !write_home(j, txn, count) || !sync_image(j))
+    {
+        return false;
+    }
+    j->head += txn_blks(j, count);
+    if (j->head == j->nblks)
+    { // the log is full to its end; the journal superblock must point into it
+        j->head = 1;
+    }
+    j->seq++;
+    return true;
+}
+
+int journal_commit(journal *j)
+{
+    if (!j->enabled)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&j->commit_lock);
+    uint32_t count = 0;
+    unsigned char *txn = take_txn(j, &count);
+    if (txn == NULL)
+    {
+        pthread_mutex_unlock(&j->commit_lock);
+        return (count == 0) ? 0 : -ENOMEM;
+    }
+    int ret = 0;
+    if (!write_txn(j, txn, count))
+    { // keep the blks for the next commit
+        redirty(j, txn, count);
+        ret = -EIO;
+    }
+    else
+    { // remember the blks so their private copies can go once they are clean
+        a1fs_blk_t *written = realloc(j->written, count * sizeof(a1fs_blk_t));
+        if (written != NULL)
+        {
+            j->written = written;
+            for (uint32_t i = 0; i < count; i++)
+            {
+                j->written[i] = *txn_tag(j, txn, i);
+            }
+            j->nwritten = count;
+        }
+    }
+    for (uint32_t i = 0; i < count; i++)
+    { // home, or dirty again after a failure
+        a1fs_blk_t blk = *txn_tag(j, txn, i);
+        __atomic_fetch_and(&j->committing[blk / 8], (unsigned char)~(1 << (blk % 8)), __ATOMIC_RELAXED);
+    }
+    free(txn);
+    pthread_mutex_lock(&j->lock);
+    j->writing_home = false;
+    pthread_cond_broadcast(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+    pthread_mutex_unlock(&j->commit_lock);
+    return ret;
+}
+
+/**
+ * commit the running transaction of the journal arg every interval seconds, or sooner when it grows large
+ *
+ * @param arg       pointer to the journal
+ * @return          NULL
+ */
+static void *journal_thread(void *arg)
+{
+    journal *j = (journal *)arg;
+    pthread_mutex_lock(&j->lock);
+    while (!j->stop)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += j->interval;
+        while (!j->stop && __atomic_load_n(&j->ndirty, __ATOMIC_RELAXED) < txn_limit(j, JOURNAL_WAKE_DIV))
+        {
+            if (pthread_cond_timedwait(&j->wake, &j->lock, &deadline) == ETIMEDOUT)
+            {
+                break;
+            }
+        }
+        if (j->stop)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&j->lock);
+        journal_commit(j);
+        pthread_mutex_lock(&j->lock);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+void journal_destroy(journal *j)
+{
+    if (!j->enabled)
+    { // the shared mapping is written back when it is unmapped
+        free(j->dirty);
+        return;
+    }
+    pthread_mutex_lock(&j->lock);
+    j->stop = true;
+    pthread_cond_signal(&j->wake);
+    pthread_mutex_unlock(&j->lock);
+    if (j->thread_started)
+    {
+        pthread_join(j->thread, NULL);
+    }
+    // everything is home after the last commit, nothing to replay on the next mount
+    if (journal_commit(j) == 0 && write_super(j, j->seq, j->head))
+    {
+        sync_image(j);
+    }
+    free(j->dirty);
+    free(j->committing);
+    free(j->listed);
+    free(j->written);
+    pthread_cond_destroy(&j->wake);
+    pthread_cond_destroy(&j->cond);
+    pthread_mutex_destroy(&j->commit_lock);
+    pthread_mutex_destroy(&j->lock);
+}
+
+void journal_start(journal *j)
+{
+    if (!j->enabled)
+    {
+        return;
+    }
+    pthread_mutex_lock(&j->lock);
+    if (!j->thread_started && !j->stop)
+    {
+        j->thread_started = pthread_create(&j->thread, NULL, journal_thread, j) == 0;
+    }
+    // leave the rest of the log to the operations that are already running
+    while (j->locked ||
+           (j->thread_started && __atomic_load_n(&j->ndirty, __ATOMIC_RELAXED) >= txn_limit(j, JOURNAL_WAIT_DIV)))
+    {
+        pthread_cond_signal(&j->wake);
+        pthread_cond_wait(&j->cond, &j->lock);
+    }
+    j->handles++;
+    pthread_mutex_unlock(&j->lock);
+}
+
+void journal_stop(journal *j)
+{
+    if (!j->enabled)
+    {
+        return;
+    }
+    pthread_mutex_lock(&j->lock);
+    j->handles--;
+    if (j->handles == 0)
+    {
+        pthread_cond_broadcast(&j->cond);
+    }
+    bool full = __atomic_load_n(&j->ndirty, __ATOMIC_RELAXED) >= txn_limit(j, JOURNAL_WAKE_DIV);
+    if (full && j->thread_started)
+    {
+        pthread_cond_signal(&j->wake);
+    }
+    pthread_mutex_unlock(&j->lock);
+    if (full && !j->thread_started)
+    { // no commit thread, commit here
+        journal_commit(j);
+    }
+}
+
+void journal_dirty(journal *j, const void *ptr, size_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    size_t first = ((const unsigned char *)ptr - j->image) >> j->blk_shift;
+    size_t last = ((const unsigned char *)ptr - j->image + len - 1) >> j->blk_shift;
+    for (size_t blk = first; blk <= last; blk++)
+    {
+        unsigned char bit = 1 << (blk % 8);
+        if (__atomic_load_n(&j->dirty[blk / 8], __ATOMIC_RELAXED) & bit)
+        {
+            continue;
+        }
+        if (!(__atomic_fetch_or(&j->dirty[blk / 8], bit, __ATOMIC_RELAXED) & bit))
+        {
+            __atomic_fetch_add(&j->ndirty, 1, __ATOMIC_RELAXED);
+            uint32_t i = __atomic_fetch_add(&j->nlisted, 1, __ATOMIC_RELAXED);
+            if (i < j->list_max)
+            {
+                j->listed[i] = blk;
+            }
+        }
+    }
+}
+
+void journal_forget(journal *j, size_t blk, size_t count)
+{
+    if (!j->enabled)
+    {
+        return;
+    }
+    bool committing = false;
+    for (size_t b = blk; b < blk + count; b++)
+    {
+        unsigned char bit = 1 << (b % 8);
+        unsigned char committing_bits = __atomic_load_n(&j->committing[b / 8], __ATOMIC_RELAXED);
+        committing = committing || (committing_bits & bit);
+        if (b % 8 == 0 && b + 8 <= blk + count && __atomic_load_n(&j->dirty[b / 8], __ATOMIC_RELAXED) == 0 &&
+            committing_bits == 0)
+        { // skip a whole clean byte
+            b += 7;
+            continue;
+        }
+        if (__atomic_fetch_and(&j->dirty[b / 8], (unsigned char)~bit, __ATOMIC_RELAXED) & bit)
+        {
+            __atomic_fetch_sub(&j->ndirty, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (committing)
+    { // the commit thread may still write an old image of the blks home
+        pthread_mutex_lock(&j->lock);
+        while (j->writing_home)
+        {
+            pthread_cond_wait(&j->cond, &j->lock);
+        }
+        pthread_mutex_unlock(&j->lock);
+    }
+}
+
+/**
+ * write the bytes [start, end) of the shared mapping of the journal j back to the image and wait for the disk
+ *
+ * @param j         pointer to the journal; must not be enabled
+ * @param start     first byte
+ * @param end       byte after the last one
+ * @return          true on success; false on an I/O error
+ */
+static bool msync_range(journal *j, uint64_t start, uint64_t end)
+{
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    start -= start % page;
+    if (msync(j->image + start, end - start, MS_SYNC) != 0)
+    {
+        perror("msync");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * write the run of nrun metadata blks from the blk run of the shared mapping of the journal j back to the image
+ *
+ * @param j         pointer to the journal; must not be enabled
+ * @param run       first blk of the run
+ * @param nrun      number of blks in the run; nothing is written if 0
+ * @return          true on success; false on an I/O error, in which case the blks are dirty again
+ */
+static bool msync_run(journal *j, size_t run, size_t nrun)
+{
+    if (nrun == 0 || msync_range(j, (uint64_t)run * j->block_size, (uint64_t)(run + nrun) * j->block_size))
+    {
+        return true;
+    }
+    journal_dirty(j, j->image + run * j->block_size, nrun * j->block_size);
+    return false;
+}
+
+/**
+ * write the metadata blks changed through the shared mapping of the journal j back to the image, a run of
+ * consecutive blks at a time, and clear their dirty bits
+ *
+ * @param j         pointer to the journal; must not be enabled
+ * @return          true on success; false on an I/O error, in which case the blks stay dirty
+ */
+static bool msync_dirty(journal *j)
+{
+    if (__atomic_load_n(&j->ndirty, __ATOMIC_RELAXED) == 0)
+    {
+        return true;
+    }
+    bool ok = true;
+    size_t run = 0;  // first blk of the current run
+    size_t nrun = 0; // number of blks in it
+    for (size_t blk = bitmap_next_one(j->dirty, j->nimage_blks, 0); blk < j->nimage_blks;
+         blk = bitmap_next_one(j->dirty, j->nimage_blks, (blk / 8 + 1) * 8))
+    { // a blk changed from now on is written by the next fsync()
+        unsigned char bits = __atomic_exchange_n(&j->dirty[blk / 8], 0, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&j->ndirty, __builtin_popcount(bits), __ATOMIC_RELAXED);
+        for (size_t b = 0; b < 8; b++)
+        {
+            size_t cur = blk / 8 * 8 + b;
+            if (!(bits & (1 << b)))
+            {
+                continue;
+            }
+            if (nrun > 0 && run + nrun == cur)
+            {
+                nrun++;
+                continue;
+            }
+            ok = msync_run(j, run, nrun) && ok;
+            run = cur;
+            nrun = 1;
+        }
+    }
+    return msync_run(j, run, nrun) && ok;
+}
+
+int journal_sync(journal *j, const dirty_set *data, bool metadata)
+{
+    bool ok = true;
+    if (!j->enabled)
+    { // the data and the metadata are in the shared mapping, msync() writes them and waits for the disk
+        if (data->overflow)
+        {
+            return msync(j->image, j->nimage_blks * j->block_size, MS_SYNC) == 0 ? 0 : -EIO;
+        }
+        for (uint32_t i = 0; i < data->count; i++)
+        {
+            ok = msync_range(j, data->ranges[i].start, data->ranges[i].end) && ok;
+        }
+        if (metadata)
+        {
+            ok = msync_dirty(j) && ok;
+        }
+        return ok ? 0 : -EIO;
+    }
+    // start writing all the ranges before waiting for any of them
+    int flags[2] = {SYNC_FILE_RANGE_WRITE, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WAIT_AFTER};
+    for (int pass = 0; pass < 2 && !data->overflow; pass++)
+    {
+        for (uint32_t i = 0; i < data->count; i++)
+        {
+            const dirty_range *r = &data->ranges[i];
+            if (sync_file_range(j->fd, r->start, r->end - r->start, flags[pass]) != 0)
+            {
+                perror("sync_file_range");
+                return -EIO;
+            }
+        }
+    }
+    // the fdatasync() of a commit also makes the data written above durable
+    if (metadata && __atomic_load_n(&j->ndirty, __ATOMIC_RELAXED) > 0)
+    {
+        return journal_commit(j);
+    }
+    if (data->count > 0 || data->overflow)
+    {
+        return sync_image(j) ? 0 : -EIO;
+    }
+    return 0;
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "dirty.h"
+
+/**
+ * Metadata journal of a mounted file system (see a1fs_journal_header in a1fs.h for the log format).
+ *
+ * The image is mapped privately, so changes to the metadata stay in memory until they are committed. Every
+ * operation that changes metadata runs between journal_start() and journal_stop() and marks the blks it changes
+ * with journal_dirty(). A commit waits for the running operations to finish, copies the dirty blks into one
+ * transaction, writes it to the log and then writes the blks home, so many operations share the same two
+ * fdatasync() calls (group commit). Commits run every few seconds, when the running transaction grows large,
+ * on fsync() and on unmount.
+ *
+ * Without a journal the image is mapped shared and only the dirty bits are kept, so that fsync() can write
+ * back just the metadata blks that changed.
+ */
+typedef struct journal
+{
+    /** The image has a journal; otherwise only journal_dirty() and journal_sync() do anything. */
+    bool enabled;
+    /** Image file, written with pwrite() by commits. */
+    int fd;
+    /** Start of the private mapping of the image. */
+    unsigned char *image;
+    /** Blk size of the image, and its log2. */
+    uint32_t block_size;
+    unsigned int blk_shift;
+    /** Number of blks in the image. */
+    size_t nimage_blks;
+    /** Blk num of the journal superblock. */
+    a1fs_blk_t start;
+    /** Number of journal blks, the journal superblock included. */
+    uint32_t nblks;
+    /** Most metadata blks a transaction can hold. */
+    uint32_t max_count;
+    /** Log blk (relative to start) that the next transaction goes to. */
+    uint32_t head;
+    /** Sequence number of the next transaction. */
+    uint64_t seq;
+
+    /** One bit per image blk changed by the running transaction (or since the last fsync() without a journal);
+     *  set and cleared atomically. */
+    unsigned char *dirty;
+    /** Number of bits set in dirty; updated atomically. */
+    uint32_t ndirty;
+    /** The blks whose dirty bits the running transaction set, in the order it set them, so that a commit finds
+     *  them without scanning dirty; a forgotten blk stays listed, and is listed again if it is dirtied again. */
+    a1fs_blk_t *listed;
+    /** Number of blks set, which may be more than list_max, past which a commit scans dirty; updated atomically. */
+    uint32_t nlisted;
+    uint32_t list_max;
+    /** The bits of the transaction being committed; set when a commit takes its copy, cleared once it is home. */
+    unsigned char *committing;
+    /** The blks of committing are being written home; a freed one must not be reused for file data till then. */
+    bool writing_home;
+    /** Blks written home by the last commit, in order; their private copies are dropped once clean. */
+    a1fs_blk_t *written;
+    uint32_t nwritten;
+
+    /** Number of operations between journal_start() and journal_stop(). */
+    uint32_t handles;
+    /** A commit is waiting for the running operations to finish; new ones wait for the commit. */
+    bool locked;
+    /** Protects handles, locked and the commit thread state. */
+    pthread_mutex_t lock;
+    /** Broadcast when handles drops to 0 and when a commit has taken its copy of the dirty blks. */
+    pthread_cond_t cond;
+    /** Held for a whole commit, so commits reach the log in order. */
+    pthread_mutex_t commit_lock;
+
+    /** Commit thread, started by the first operation (after FUSE has daemonized). */
+    pthread_t thread;
+    bool thread_started;
+    /** Tells the commit thread to exit. */
+    bool stop;
+    /** Wakes the commit thread before its interval is up. */
+    pthread_cond_t wake;
+    /** Seconds between group commits. */
+    unsigned int interval;
+
+} journal;
+
+/**
+ * set up the journal j of the image of size bytes at image, replaying the transactions left in the log
+ * if the image has a journal, the mapping is then replaced by a private one at the same address
+ *
+ * @param j         pointer to the journal
+ * @param image     start of the shared mapping of the image
+ * @param size      image size in bytes
+ * @param fd        image file, open for reading and writing
+ * @param interval  seconds between group commits
+ * @return          true on success; false if the journal is corrupt or on an I/O error
+ */
+bool journal_init(journal *j, void *image, size_t size, int fd, unsigned int interval);
+
+/**
+ * find the transactions a crash left in the log of the image of size bytes at image and replay them, without
+ * mounting the image; used by fsck.a1fs, which works on a shared mapping
+ *
+ * @param image         start of the shared mapping of the image
+ * @param size          image size in bytes
+ * @param fd            image file; only read with check_only
+ * @param check_only    only count the transactions, leaving the log as it is
+ * @return              number of transactions found (0 without a journal); -1 if the journal is corrupt or on an
+ *                      I/O error
+ */
+int journal_recover(void *image, size_t size, int fd, bool check_only);
+
+/**
+ * commit the running transaction and stop the commit thread of the journal j
+ * the log is left empty
+ *
+ * @param j         pointer to the journal
+ */
+void journal_destroy(journal *j);
+
+/**
+ * begin an operation that changes metadata; must come before the operation takes any inode or allocator lock
+ * waits while a commit is taking its copy of the dirty blks, or while the running transaction is too large
+ *
+ * @param j         pointer to the journal
+ */
+void journal_start(journal *j);
+
+/**
+ * end an operation begun with journal_start(); must come after the operation has dropped all of its locks
+ *
+ * @param j         pointer to the journal
+ */
+void journal_stop(journal *j);
+
+/**
+ * add the blks holding the len bytes at ptr in the mapped image to the running transaction
+ * must be called between journal_start() and journal_stop()
+ *
+ * @param j         pointer to the journal
+ * @param ptr       start of the changed bytes
+ * @param len       number of changed bytes
+ */
+void journal_dirty(journal *j, const void *ptr, size_t len);
+
+/**
+ * drop the count image blks from blk from the running transaction, because they were freed
+ * a freed blk may be reused for file data, which must never be overwritten by an old metadata image, so this
+ * also waits for the commit in progress if it is writing any of them home
+ *
+ * @param j         pointer to the journal
+ * @param blk       first image blk
+ * @param count     number of blks
+ */
+void journal_forget(journal *j, size_t blk, size_t count);
+
+/**
+ * commit the running transaction of the journal j and write its blks home
+ *
+ * @param j         pointer to the journal
+ * @return          0 on success; -ENOMEM or -EIO on error, in which case the blks stay in the next transaction
+ */
+int journal_commit(journal *j);
+
+/**
+ * make the data of a file and, if metadata, the metadata changed so far durable
+ * with a journal, the data ranges are written back and the running transaction is committed (or the image
+ * is synced if there is nothing to commit); without one, the ranges and the dirty metadata blks are written
+ * back with msync()
+ *
+ * @param j         pointer to the journal
+ * @param data      ranges of the image file the file wrote since its last fsync()
+ * @param metadata  also write the metadata; false for an fdatasync() that needs no metadata to read the data
+ * @return          0 on success; -ENOMEM or -EIO on error
+ */
+int journal_sync(journal *j, const dirty_set *data, bool metadata);
@@ -16,6 +16,9 @@
  * CSC369 Assignment 1 - File mapping helper implementation.
  */
 
+#define _GNU_SOURCE // mlock2()
+
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <sys/mman.h>
@@ -53,13 +56,36 @@ void *map_file(const char *path, size_t block_size, size_t *size)
 		goto end;
 	}
 
+	// Reserve room to place the mapping on a boundary of the largest power of
+	// 2 that divides the file size, and so on a block boundary whatever the
+	// block size of the image, which can be larger than a page; and on a huge
+	// page boundary, so that MADV_HUGEPAGE can back it with huge pages where
+	// the file supports them
+	size_t slack = (size_t)s.st_size & -(size_t)s.st_size;
+	if ((size_t)s.st_size >= HUGE_PAGE_SIZE)
+		slack = HUGE_PAGE_SIZE;
+	void *area = mmap(NULL, s.st_size + slack, PROT_NONE,
+	                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (area == MAP_FAILED) {
+		perror("mmap");
+		goto end;
+	}
+	void *start = (void *)align_up((size_t)area, slack);
+
 	// Map file contents into memory
-	addr = mmap(NULL, s.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	addr = mmap(start, s.st_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
 	if (addr == MAP_FAILED) {
 		perror("mmap");
+		munmap(area, s.st_size + slack);
 		addr = NULL;
 		goto end;
 	}
+	// Give back the rest of the reservation
+	size_t head = start - area;
+	if (head != 0)
+		munmap(area, head);
+	if (slack - head != 0)
+		munmap(start + s.st_size, slack - head);
 	assert(is_aligned((size_t)addr, block_size));
 	*size = s.st_size;
 
@@ -69,3 +95,31 @@ end:
 	close(fd);
 	return addr;
 }
+
+bool map_populate(void *addr, size_t len)
+{
+	// Read faults map the cached pages instead of copying them into a private
+	// mapping, which is what prefaulting a writable one for write would do
+	if (madvise(addr, len, MADV_POPULATE_READ) == 0)
+		return true;
+	if (errno != EINVAL) {
+		perror("madvise");
+		return false;
+	}
+	// Kernel older than 5.14: touch every page
+	long page = sysconf(_SC_PAGESIZE);
+	for (size_t off = 0; off < len; off += page)
+		(void)((volatile const char *)addr)[off];
+	return true;
+}
+
+bool map_lock(void *addr, size_t len)
+{
+	// Lock the pages that are present now and any faulted in later, without
+	// faulting them in for write
+	if (mlock2(addr, len, MLOCK_ONFAULT) != 0) {
+		perror("mlock (see ulimit -l)");
+		return false;
+	}
+	return true;
+}
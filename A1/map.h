@@ -18,18 +18,46 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 
 
+/** Largest huge page size that mappings are aligned to. */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+
 /**
  * Map the whole file into memory for reading and writing.
  *
- * File size must be a non-zero multiple of the block_size.
+ * File size must be a non-zero multiple of the block_size, a power of 2. The
+ * mapping is aligned to the largest power of 2 that divides the file size (so
+ * to the block size of the image, even if the caller only knows a smaller
+ * one), and HUGE_PAGE_SIZE aligned for files of at least HUGE_PAGE_SIZE.
  *
  * @param path        image file path.
- * @param block_size  file system block size.
+ * @param block_size  file system block size, or a smaller power of 2.
  * @param size        pointer to the variable that will be set to file size.
  * @return            pointer to the file mapping in memory on success;
  *                    NULL on failure.
  */
 void *map_file(const char *path, size_t block_size, size_t *size);
+
+/**
+ * Fault in a range of a mapping for reading, so that accessing it later does
+ * not wait for I/O. A private mapping keeps sharing the pages with the file.
+ *
+ * @param addr  page aligned start of the range.
+ * @param len   length of the range in bytes.
+ * @return      true on success; false on failure.
+ */
+bool map_populate(void *addr, size_t len);
+
+/**
+ * Lock the pages of a range of a mapping that are present in memory, and any
+ * that are faulted in later; see map_populate() to fault them in first.
+ *
+ * @param addr  page aligned start of the range.
+ * @param len   length of the range in bytes.
+ * @return      true on success; false on failure, e.g. over RLIMIT_MEMLOCK.
+ */
+bool map_lock(void *addr, size_t len);
@@ -16,6 +16,8 @@
  * CSC369 Assignment 1 - a1fs formatting tool.
  */
 
+#define _GNU_SOURCE // fallocate()
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -42,6 +44,14 @@ typedef struct mkfs_opts
 	bool force;
 	/** Zero out image contents. */
 	bool zero;
+	/** Image file descriptor, for punching holes into it; -1 if it cannot be opened. */
+	int fd;
+	/** Use compact variable-length directory entries. */
+	bool compact;
+	/** Number of journal blocks; 0 for no journal, -1 for the default size. */
+	long journal_blocks;
+	/** Block size in bytes. */
+	size_t block_size;
 
 } mkfs_opts;
 
@@ -49,24 +59,38 @@ static const char *help_str = "\
 Usage: %s options image\n\
 \n\
 Format the image file into a1fs file system. The file must exist and\n\
-its size must be a multiple of a1fs block size - %zu bytes.\n\
+its size must be a multiple of the block size.\n\
 \n\
 Options:\n\
     -i num  number of inodes; required argument\n\
+    -b num  block size in bytes, a power of 2 between %d and %d (default:\n\
+            %d)\n\
     -h      print help and exit\n\
     -f      force format - overwrite existing a1fs file system\n\
-    -z      zero out image contents\n\
+    -z      zero out image contents; fast on file systems that can punch\n\
+            holes into files, such as ext4, xfs and tmpfs\n\
+    -c      compact directory entries - variable length, many more per block;\n\
+            small directories are stored in their inode\n\
+    -J num  number of metadata journal blocks; 0 for no journal (default:\n\
+            1/64 of the image, between %d and %d blocks)\n\
 ";
 
+/** Bounds of the default journal size, in blocks. */
+#define JOURNAL_MIN_BLOCKS 64
+#define JOURNAL_MAX_BLOCKS 8192
+/** Smallest journal: its superblock and a descriptor, an image and a commit block. */
+#define JOURNAL_MIN_LOG 4
+
 static void print_help(FILE *f, const char *progname)
 {
-	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE);
+	fprintf(f, help_str, progname, A1FS_MIN_BLOCK_SIZE, A1FS_MAX_BLOCK_SIZE, A1FS_DEFAULT_BLOCK_SIZE,
+	        JOURNAL_MIN_BLOCKS, JOURNAL_MAX_BLOCKS);
 }
 
 static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 {
 	char o;
-	while ((o = getopt(argc, argv, "i:hfvz")) != -1)
+	while ((o = getopt(argc, argv, "i:hfvzcJ:b:")) != -1)
 	{
 		switch (o)
 		{
@@ -83,6 +107,23 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 		case 'z':
 			opts->zero = true;
 			break;
+		case 'c':
+			opts->compact = true;
+			break;
+		case 'J':
+			opts->journal_blocks = strtol(optarg, NULL, 10);
+			if (opts->journal_blocks < 0) {
+				fprintf(stderr, "Invalid number of journal blocks\n");
+				return false;
+			}
+			break;
+		case 'b':
+			opts->block_size = strtoul(optarg, NULL, 10);
+			if (!A1FS_VALID_BLOCK_SIZE(opts->block_size)) {
+				fprintf(stderr, "Invalid block size\n");
+				return false;
+			}
+			break;
 
 		case '?':
 			return false;
@@ -110,7 +151,24 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 static bool a1fs_is_present(void *image)
 {
 	//TODO: check if the image already contains a valid a1fs superblock
-	return ((a1fs_superblock *)(image + A1FS_BLOCK_SIZE))->magic == A1FS_MAGIC;
+	return ((a1fs_superblock *)(image + A1FS_SB_OFFSET))->magic == A1FS_MAGIC;
+}
+
+/**
+ * Zero a range of the image by punching a hole into the file, which frees its
+ * blks instead of writing them; the mapping reads zeroes there afterwards.
+ *
+ * @param opts   command line options.
+ * @param first  first blk of the range.
+ * @param count  number of blks.
+ * @return       true on success; false if the file system cannot punch holes.
+ */
+static bool punch_blocks(const mkfs_opts *opts, size_t first, size_t count)
+{
+	if (opts->fd < 0)
+		return false;
+	return fallocate(opts->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	                 (off_t)(first * opts->block_size), (off_t)(count * opts->block_size)) == 0;
 }
 
 /**
@@ -130,37 +188,64 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	//NOTE: the mode of the root directory inode should be set to S_IFDIR | 0777
 	if (opts->n_inodes < 1) return false; // n_inode should be at least 1
 	
-	int num_blk_inode_bitmap = pos_ceil(opts->n_inodes, 8 * A1FS_BLOCK_SIZE);
+	if (opts->n_inodes > UINT32_MAX) return false; // inode numbers are 32-bit
+	size_t bs = opts->block_size;
+
+	a1fs_blk_t num_blk_inode_bitmap = pos_ceil(opts->n_inodes, 8 * bs);
 	//num of blocks needed for inode bitmap
-	int num_blk_inode_table = pos_ceil(opts->n_inodes * sizeof(a1fs_inode), A1FS_BLOCK_SIZE);
+	a1fs_blk_t num_blk_inode_table = pos_ceil(opts->n_inodes * sizeof(a1fs_inode), bs);
 	//num of blocks needed for inode table
-	int min_num_blks = 2 + num_blk_inode_bitmap + num_blk_inode_table;
-	if (size < (size_t)min_num_blks) return false;
+	long num_blk_journal = opts->journal_blocks;
+	if (num_blk_journal < 0) {
+		num_blk_journal = size / bs / 64;
+		if (num_blk_journal < JOURNAL_MIN_BLOCKS) num_blk_journal = JOURNAL_MIN_BLOCKS;
+		if (num_blk_journal > JOURNAL_MAX_BLOCKS) num_blk_journal = JOURNAL_MAX_BLOCKS;
+	}
+	if (num_blk_journal > 0 && num_blk_journal < JOURNAL_MIN_LOG) return false;
+	a1fs_blk_t min_num_blks = 2 + num_blk_inode_bitmap + num_blk_inode_table + num_blk_journal;
+	if (size / bs <= min_num_blks) return false;
 
-	a1fs_superblock sb;
+	a1fs_superblock sb = {0};
 	sb.magic = A1FS_MAGIC;
+	sb.s_revision = A1FS_REVISION;
+	if (opts->compact) sb.s_features |= A1FS_FEATURE_COMPACT_DIRENT;
+	if (num_blk_journal > 0) sb.s_features |= A1FS_FEATURE_JOURNAL;
 	sb.size = size;
 	sb.s_inodes_count = opts->n_inodes;
-	sb.s_blocks_count = size / A1FS_BLOCK_SIZE - 1;
+	sb.s_blocks_count = size / bs - 1;
+	sb.s_block_size = bs;
 	sb.s_dir_count = 1;
 
 	sb.s_free_inodes_count = opts->n_inodes - 1; //minus root inode
 	sb.s_inode_bitmap = 2;
 	//bitmap start at block 2
-	int num_data_block = sb.s_blocks_count - 1 - num_blk_inode_bitmap - num_blk_inode_table;
+	a1fs_blk_t num_data_block = sb.s_blocks_count - 1 - num_blk_inode_bitmap - num_blk_inode_table - num_blk_journal;
 	// num of blks included in free block bitmap
-	int num_blk_bitmap = pos_ceil(num_data_block, 8 * A1FS_BLOCK_SIZE);
+	a1fs_blk_t num_blk_bitmap = pos_ceil(num_data_block, 8 * bs);
 	//num of blks needed for free block bitmap
-	sb.s_block_bitmap = 2 + num_blk_bitmap;
+	sb.s_block_bitmap = 2 + num_blk_inode_bitmap;
 	sb.s_first_inode_block = sb.s_block_bitmap + num_blk_bitmap;
-	sb.s_first_data_block = sb.s_first_inode_block + num_blk_inode_table;
+	// the journal sits between the inode table and the data blks
+	sb.s_journal_block = sb.s_first_inode_block + num_blk_inode_table;
+	sb.s_journal_blocks = num_blk_journal;
+	sb.s_first_data_block = sb.s_journal_block + num_blk_journal;
 	sb.s_free_blocks_count = sb.s_blocks_count - sb.s_first_data_block + 1;
-	memcpy(image + A1FS_BLOCK_SIZE, &sb, sizeof(a1fs_superblock));
-	unsigned char *inode_bitmap = image + sb.s_inode_bitmap * A1FS_BLOCK_SIZE;
-	unsigned char *data_bitmap = image + sb.s_block_bitmap * A1FS_BLOCK_SIZE;
 
-	memset(inode_bitmap, 0, num_blk_inode_bitmap * A1FS_BLOCK_SIZE);
-	memset(data_bitmap, 0, num_blk_bitmap * A1FS_BLOCK_SIZE);
+	// Zero the metadata all at once if the file system can punch holes (-z
+	// already did); otherwise write only the bitmaps and the first inode
+	// table block, and leave the rest of the table for the file system to
+	// zero as it allocates inodes there
+	bool zeroed = opts->zero || punch_blocks(opts, sb.s_inode_bitmap, sb.s_first_data_block - sb.s_inode_bitmap);
+	sb.s_itable_zeroed = zeroed ? num_blk_inode_table : 1;
+	memcpy(image + A1FS_SB_OFFSET, &sb, sizeof(a1fs_superblock));
+	unsigned char *inode_bitmap = image + sb.s_inode_bitmap * bs;
+	unsigned char *data_bitmap = image + sb.s_block_bitmap * bs;
+
+	if (!zeroed) {
+		memset(inode_bitmap, 0, num_blk_inode_bitmap * bs);
+		memset(data_bitmap, 0, num_blk_bitmap * bs);
+		memset(image + (size_t)sb.s_first_inode_block * bs, 0, bs);
+	}
 	inode_bitmap[0] = 1;		   // = 0000 0001
 	data_bitmap[0] = 0; // = 0000 0000
 	a1fs_inode root = {0};
@@ -171,7 +256,17 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	root.s_extent_block = 0;
 	root.i_extents_count = 0;
 	root.ino_idx = 0;
-	memcpy(image + sb.s_first_inode_block * A1FS_BLOCK_SIZE, &root, sizeof(a1fs_inode));
+	memcpy(image + sb.s_first_inode_block * bs, &root, sizeof(a1fs_inode));
+
+	if (num_blk_journal > 0) {
+		// empty log: the first log block must not look like a transaction
+		// left over from an earlier format
+		unsigned char *journal = image + (size_t)sb.s_journal_block * bs;
+		if (!zeroed)
+			memset(journal, 0, 2 * bs);
+		a1fs_journal_super jsb = {{A1FS_JOURNAL_MAGIC, A1FS_JOURNAL_SUPER, 1}, 1, 0};
+		memcpy(journal, &jsb, sizeof(jsb));
+	}
 
 	return true;
 }
@@ -179,6 +274,8 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 int main(int argc, char *argv[])
 {
 	mkfs_opts opts = {0}; // defaults are all 0
+	opts.journal_blocks = -1; // but the journal size
+	opts.block_size = A1FS_DEFAULT_BLOCK_SIZE; // and the block size
 	if (!parse_args(argc, argv, &opts))
 	{
 		// Invalid arguments, print help to stderr
@@ -194,7 +291,7 @@ int main(int argc, char *argv[])
 
 	// Map image file into memory
 	size_t size;
-	void *image = map_file(opts.img_path, A1FS_BLOCK_SIZE, &size);
+	void *image = map_file(opts.img_path, opts.block_size, &size);
 	if (image == NULL)
 		return 1;
 
@@ -206,7 +303,10 @@ int main(int argc, char *argv[])
 		goto end;
 	}
 
-	if (opts.zero)
+	// The mapping keeps its own reference to the file; this descriptor is
+	// only for fallocate()
+	opts.fd = open(opts.img_path, O_RDWR);
+	if (opts.zero && !punch_blocks(&opts, 0, size / opts.block_size))
 		memset(image, 0, size);
 	if (!mkfs(image, size, &opts))
 	{
@@ -217,5 +317,7 @@ int main(int argc, char *argv[])
 	ret = 0;
 end:
 	munmap(image, size);
+	if (opts.fd >= 0)
+		close(opts.fd);
 	return ret;
 }
@@ -31,6 +31,12 @@
 static const struct fuse_opt opt_spec[] = {
 	A1FS_OPT("-h"    , help),
 	A1FS_OPT("--help", help),
+	{ "commit=%u", offsetof(a1fs_opts, commit), 0 },
+	A1FS_OPT("populate", populate),
+	A1FS_OPT("mlock"   , mlock),
+	A1FS_OPT("hugepage", hugepage),
+	{ "cache=%u", offsetof(a1fs_opts, cache), 0 },
+	A1FS_OPT("direct"  , direct),
 	FUSE_OPT_END
 };
 
@@ -38,14 +44,35 @@ static const char *help_str = "\
 Usage: %s image mountpoint [options]\n\
 \n\
 Mount a1fs image file under mount point directory. Use fusermount(1) to \n\
-unmount. Only single-threaded mount is supported; -s FUSE option is implied.\n\
+unmount. Requests are served by multiple threads; pass -s to serve them\n\
+one at a time.\n\
 \n\
 general options:\n\
     -o opt,[opt...]        mount options\n\
     -h   --help            print help\n\
 \n\
+a1fs options:\n\
+    -o commit=N            commit the metadata journal every N seconds\n\
+                           (default: %u)\n\
+    -o populate            read the superblock, bitmaps and inode table into\n\
+                           memory when mounting\n\
+    -o mlock               same, and keep them in memory (see ulimit -l)\n\
+    -o hugepage            map the image with huge pages where the file\n\
+                           system holding it supports them, e.g. tmpfs\n\
+                           mounted with huge=advise\n\
+    -o cache=N             cache N MB of file data in the file system\n\
+                           instead of splicing it from the page cache\n\
+    -o direct              bypass the page cache for file data (O_DIRECT),\n\
+                           leaving it to the metadata; implies cache=%u\n\
+                           unless a cache size is given\n\
+\n\
 ";
 
+/** Default seconds between journal commits. */
+#define COMMIT_INTERVAL 5
+/** Default size of the blk cache with -o direct, in MB. */
+#define DIRECT_CACHE_SIZE 64
+
 // Callback for fuse_opt_parse()
 static int opt_proc(void *data, const char *arg, int key, struct fuse_args *out)
 {
@@ -62,25 +89,41 @@ static int opt_proc(void *data, const char *arg, int key, struct fuse_args *out)
 
 bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 {
+	opts->commit = COMMIT_INTERVAL;
 	if (fuse_opt_parse(args, opts, opt_spec, opt_proc) != 0) return false;
 
 	//NOTE: printing to stderr to keep it consistent with FUSE
 	if (opts->help) {
-		fprintf(stderr, help_str, args->argv[0]);
+		fprintf(stderr, help_str, args->argv[0], COMMIT_INTERVAL, DIRECT_CACHE_SIZE);
 		fuse_opt_add_arg(args, "-ho");
 	}
 	if (!opts->help && !opts->img_path) {
 		fprintf(stderr, "Missing image path\n");
 		return false;
 	}
+	if (opts->commit == 0) {
+		fprintf(stderr, "Invalid commit interval\n");
+		return false;
+	}
+	if (opts->direct && opts->cache == 0) {
+		opts->cache = DIRECT_CACHE_SIZE;
+	}
 
-	// Only single-threaded mount is supported
-	fuse_opt_add_arg(args, "-s");
-	// Limit the size of reads and writes to 4K
+	// Let the kernel send reads and writes of up to 128K (the most FUSE 2.9
+	// negotiates) in one request; read() and write() handle multi-block ranges
+	fuse_opt_add_arg(args, "-o");
+	fuse_opt_add_arg(args, "big_writes");
+	fuse_opt_add_arg(args, "-o");
+	fuse_opt_add_arg(args, "max_read=131072");
+	fuse_opt_add_arg(args, "-o");
+	fuse_opt_add_arg(args, "max_write=131072");
+	// Let FUSE splice a1fs_ll read replies from the image file and hand
+	// write_buf() the pipe the request was spliced into, instead of copying
+	// the data through its own buffers
 	fuse_opt_add_arg(args, "-o");
-	fuse_opt_add_arg(args, "max_read=4096");
+	fuse_opt_add_arg(args, "splice_read");
 	fuse_opt_add_arg(args, "-o");
-	fuse_opt_add_arg(args, "max_write=4096");
+	fuse_opt_add_arg(args, "splice_write");
 
 	return true;
 }
@@ -29,6 +29,18 @@ typedef struct a1fs_opts {
 	const char *img_path;
 	/** Print help and exit. FUSE option. */
 	int help;
+	/** Seconds between journal commits (-o commit=N). */
+	unsigned int commit;
+	/** Fault in the metadata when mounting (-o populate). */
+	int populate;
+	/** Fault in the metadata and keep it in memory (-o mlock). */
+	int mlock;
+	/** Back the image mapping with huge pages where possible (-o hugepage). */
+	int hugepage;
+	/** Size of the file data blk cache in MB; 0 for none (-o cache=N). */
+	unsigned int cache;
+	/** Read and write file data with O_DIRECT, through the blk cache (-o direct). */
+	int direct;
 
 } a1fs_opts;
 
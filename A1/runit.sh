@@ -81,3 +81,6 @@ echo " "
 
 echo "Unmount the file system"
 fusermount -u ${root}
+
+echo "Check the image offline"
+./fsck.a1fs ${image}
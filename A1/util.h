@@ -21,6 +21,7 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 
 /** Check if x is a power of 2. */
@@ -44,7 +45,7 @@ static inline size_t align_up(size_t x, size_t alignment)
 }
 
 /**Ceiling function to positive number*/
-static inline int pos_ceil(int dividend, int divisor)
+static inline uint64_t pos_ceil(uint64_t dividend, uint64_t divisor)
 {
     if (dividend/divisor == 0){
 		return 1;